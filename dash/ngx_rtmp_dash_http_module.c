@@ -0,0 +1,427 @@
+
+/*
+ * Copyright (C) Roman Arutyunyan
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+static char * ngx_rtmp_dash_http_chunked(ngx_conf_t *cf, ngx_command_t *cmd,
+       void *conf);
+static void * ngx_rtmp_dash_http_create_loc_conf(ngx_conf_t *cf);
+static char * ngx_rtmp_dash_http_merge_loc_conf(ngx_conf_t *cf,
+       void *parent, void *child);
+
+
+typedef struct {
+    ngx_str_t                           root;
+} ngx_rtmp_dash_http_loc_conf_t;
+
+
+/* growing fragment is polled for new chunks */
+#define NGX_RTMP_DASH_HTTP_POLL         20
+
+/* fragment which has not grown for that long is abandoned */
+#define NGX_RTMP_DASH_HTTP_HOLD         10000
+
+#define NGX_RTMP_DASH_HTTP_BUFSIZE      65536
+
+
+typedef struct {
+    ngx_file_t                          file;
+    ngx_str_t                           raw;
+    off_t                               offset;
+    ngx_msec_t                          deadline;
+    ngx_buf_t                          *buf;
+    ngx_chain_t                         out;
+    ngx_event_t                         timer;
+} ngx_rtmp_dash_http_ctx_t;
+
+
+static ngx_command_t  ngx_rtmp_dash_http_commands[] = {
+
+    { ngx_string("rtmp_dash_chunked"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_rtmp_dash_http_chunked,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_rtmp_dash_http_module_ctx = {
+    NULL,                               /* preconfiguration */
+    NULL,                               /* postconfiguration */
+
+    NULL,                               /* create main configuration */
+    NULL,                               /* init main configuration */
+
+    NULL,                               /* create server configuration */
+    NULL,                               /* merge server configuration */
+
+    ngx_rtmp_dash_http_create_loc_conf, /* create location configuration */
+    ngx_rtmp_dash_http_merge_loc_conf,  /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_rtmp_dash_http_module = {
+    NGX_MODULE_V1,
+    &ngx_rtmp_dash_http_module_ctx,     /* module context */
+    ngx_rtmp_dash_http_commands,        /* module directives */
+    NGX_HTTP_MODULE,                    /* module type */
+    NULL,                               /* init master */
+    NULL,                               /* init module */
+    NULL,                               /* init process */
+    NULL,                               /* init thread */
+    NULL,                               /* exit thread */
+    NULL,                               /* exit process */
+    NULL,                               /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static void
+ngx_rtmp_dash_http_timer_cleanup(void *data)
+{
+    ngx_rtmp_dash_http_ctx_t  *ctx = data;
+
+    if (ctx->timer.timer_set) {
+        ngx_del_timer(&ctx->timer);
+    }
+}
+
+
+/*
+ * Sends whatever has been appended to the fragment since the last call;
+ * the fragment is complete once its .raw name is gone. Returns NGX_AGAIN
+ * while more is expected.
+ */
+
+static ngx_int_t
+ngx_rtmp_dash_http_send(ngx_http_request_t *r)
+{
+    off_t                       size;
+    ssize_t                     n;
+    ngx_int_t                   rc;
+    ngx_uint_t                  done;
+    ngx_buf_t                  *b;
+    ngx_file_info_t             fi;
+    ngx_connection_t           *c;
+    ngx_rtmp_dash_http_ctx_t   *ctx;
+
+    c = r->connection;
+    ctx = ngx_http_get_module_ctx(r, ngx_rtmp_dash_http_module);
+
+    /* previous chunk is still on its way */
+
+    if (r->buffered || c->buffered) {
+        rc = ngx_http_output_filter(r, NULL);
+        return rc == NGX_ERROR ? NGX_ERROR : NGX_AGAIN;
+    }
+
+    /* check completion first, the size is final after rename */
+
+    done = (ngx_file_info(ctx->raw.data, &fi) == NGX_FILE_ERROR);
+
+    if (ngx_fd_info(ctx->file.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, c->log, ngx_errno,
+                      ngx_fd_info_n " \"%V\" failed", &ctx->file.name);
+        return NGX_ERROR;
+    }
+
+    size = ngx_file_size(&fi);
+
+    if (size == ctx->offset && !done) {
+        return (ngx_msec_int_t) (ngx_current_msec - ctx->deadline) < 0
+               ? NGX_AGAIN : NGX_ERROR;
+    }
+
+    ctx->deadline = ngx_current_msec + NGX_RTMP_DASH_HTTP_HOLD;
+
+    b = ctx->buf;
+    b->pos = b->start;
+    b->last = b->start;
+    b->last_buf = 0;
+    b->last_in_chain = 0;
+
+    if (size > ctx->offset) {
+        n = ngx_read_file(&ctx->file, b->start,
+                          (size_t) ngx_min(size - ctx->offset,
+                                           (off_t) (b->end - b->start)),
+                          ctx->offset);
+
+        if (n == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        b->last += n;
+        ctx->offset += n;
+    }
+
+    if (done && ctx->offset == size) {
+        b->last_buf = (r == r->main) ? 1 : 0;
+        b->last_in_chain = 1;
+    }
+
+    b->flush = 1;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "dash chunked: send %uz bytes, offset=%O, last=%ui",
+                   (size_t) (b->last - b->pos), ctx->offset,
+                   (ngx_uint_t) b->last_buf);
+
+    rc = ngx_http_output_filter(r, &ctx->out);
+
+    if (rc == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    /* the rest of the last chunk is up to the request finalizer */
+
+    return b->last_in_chain ? NGX_OK : NGX_AGAIN;
+}
+
+
+static void
+ngx_rtmp_dash_http_wait_handler(ngx_event_t *ev)
+{
+    ngx_int_t                   rc;
+    ngx_connection_t           *c;
+    ngx_http_request_t         *r;
+    ngx_rtmp_dash_http_ctx_t   *ctx;
+
+    r = ev->data;
+    c = r->connection;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_rtmp_dash_http_module);
+
+    rc = ngx_rtmp_dash_http_send(r);
+
+    if (rc == NGX_AGAIN) {
+        ngx_add_timer(ev, NGX_RTMP_DASH_HTTP_POLL);
+        return;
+    }
+
+    if (rc == NGX_ERROR) {
+        ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                      "dash chunked: \"%V\" abandoned", &ctx->file.name);
+    }
+
+    ngx_http_finalize_request(r, rc);
+    ngx_http_run_posted_requests(c);
+}
+
+
+static ngx_int_t
+ngx_rtmp_dash_http_handler(ngx_http_request_t *r)
+{
+    u_char                         *p;
+    size_t                          skip;
+    ngx_int_t                       rc;
+    ngx_str_t                       name;
+    ngx_pool_cleanup_t             *cln;
+    ngx_pool_cleanup_file_t        *clnf;
+    ngx_http_core_loc_conf_t       *clcf;
+    ngx_rtmp_dash_http_ctx_t       *ctx;
+    ngx_rtmp_dash_http_loc_conf_t  *dlcf;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    /* only fragments grow, the rest is left to the static handler */
+
+    if (r->uri.len < 4 ||
+        ngx_strncmp(r->uri.data + r->uri.len - 4, ".m4", 3) != 0 ||
+        (r->uri.data[r->uri.len - 1] != 'v' &&
+         r->uri.data[r->uri.len - 1] != 'a'))
+    {
+        return NGX_DECLINED;
+    }
+
+    dlcf = ngx_http_get_module_loc_conf(r, ngx_rtmp_dash_http_module);
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    /* location prefix is replaced with dash_path, like alias does */
+
+    skip = 0;
+
+    if (r->uri.len >= clcf->name.len &&
+        ngx_strncmp(r->uri.data, clcf->name.data, clcf->name.len) == 0)
+    {
+        skip = clcf->name.len;
+    }
+
+    while (skip < r->uri.len && r->uri.data[skip] == '/') {
+        skip++;
+    }
+
+    name.len = dlcf->root.len + 1 + r->uri.len - skip;
+    name.data = ngx_pnalloc(r->pool, name.len + sizeof(".raw"));
+    if (name.data == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    p = ngx_cpymem(name.data, dlcf->root.data, dlcf->root.len);
+    *p++ = '/';
+    p = ngx_cpymem(p, r->uri.data + skip, r->uri.len - skip);
+    ngx_memcpy(p, ".raw", sizeof(".raw"));
+
+    ctx = ngx_pcalloc(r->pool, sizeof(ngx_rtmp_dash_http_ctx_t));
+    if (ctx == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ctx->raw.data = name.data;
+    ctx->raw.len = name.len + sizeof(".raw") - 1;
+
+    ctx->file.fd = ngx_open_file(ctx->raw.data, NGX_FILE_RDONLY,
+                                 NGX_FILE_OPEN, 0);
+
+    if (ctx->file.fd == NGX_INVALID_FILE) {
+
+        /* complete or unknown fragment */
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "dash chunked: \"%V\" is not growing", &ctx->raw);
+
+        return NGX_DECLINED;
+    }
+
+    ctx->file.name = ctx->raw;
+    ctx->file.log = r->connection->log;
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_pool_cleanup_file_t));
+    if (cln == NULL) {
+        ngx_close_file(ctx->file.fd);
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    cln->handler = ngx_pool_cleanup_file;
+    clnf = cln->data;
+
+    clnf->fd = ctx->file.fd;
+    clnf->name = ctx->raw.data;
+    clnf->log = r->connection->log;
+
+    ngx_http_set_ctx(r, ctx, ngx_rtmp_dash_http_module);
+
+    rc = ngx_http_discard_request_body(r);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "dash chunked: stream \"%V\"", &ctx->raw);
+
+    /* no content length, HTTP/1.1 clients get chunked transfer */
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = -1;
+
+    if (ngx_http_set_content_type(r) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (r->method == NGX_HTTP_HEAD) {
+        r->header_only = 1;
+    }
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    ctx->buf = ngx_create_temp_buf(r->pool, NGX_RTMP_DASH_HTTP_BUFSIZE);
+    if (ctx->buf == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ctx->out.buf = ctx->buf;
+    ctx->out.next = NULL;
+    ctx->deadline = ngx_current_msec + NGX_RTMP_DASH_HTTP_HOLD;
+
+    rc = ngx_rtmp_dash_http_send(r);
+
+    if (rc != NGX_AGAIN) {
+        return rc;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    cln->handler = ngx_rtmp_dash_http_timer_cleanup;
+    cln->data = ctx;
+
+    ctx->timer.handler = ngx_rtmp_dash_http_wait_handler;
+    ctx->timer.data = r;
+    ctx->timer.log = r->connection->log;
+
+    ngx_add_timer(&ctx->timer, NGX_RTMP_DASH_HTTP_POLL);
+
+    r->read_event_handler = ngx_http_test_reading;
+    r->main->count++;
+
+    return NGX_DONE;
+}
+
+
+static char *
+ngx_rtmp_dash_http_chunked(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_rtmp_dash_http_loc_conf_t  *dlcf = conf;
+
+    ngx_str_t                      *value;
+    ngx_http_core_loc_conf_t       *clcf;
+
+    if (dlcf->root.data) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    dlcf->root = value[1];
+
+    if (dlcf->root.len && dlcf->root.data[dlcf->root.len - 1] == '/') {
+        dlcf->root.len--;
+    }
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_rtmp_dash_http_handler;
+
+    return NGX_CONF_OK;
+}
+
+
+static void *
+ngx_rtmp_dash_http_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_rtmp_dash_http_loc_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_rtmp_dash_http_loc_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    return conf;
+}
+
+
+static char *
+ngx_rtmp_dash_http_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_rtmp_dash_http_loc_conf_t  *prev = parent;
+    ngx_rtmp_dash_http_loc_conf_t  *conf = child;
+
+    ngx_conf_merge_str_value(conf->root, prev->root, "");
+
+    return NGX_CONF_OK;
+}
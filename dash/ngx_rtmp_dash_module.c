@@ -5,7 +5,9 @@
 #include <ngx_rtmp.h>
 #include <ngx_rtmp_codec_module.h>
 #include "ngx_rtmp_live_module.h"
+#include "ngx_rtmp_dash_module.h"
 #include "ngx_rtmp_mp4.h"
+#include "hls/ngx_rtmp_hls_store.h"
 
 
 static ngx_rtmp_publish_pt              next_publish;
@@ -14,7 +16,12 @@ static ngx_rtmp_stream_begin_pt         next_stream_begin;
 static ngx_rtmp_stream_eof_pt           next_stream_eof;
 
 
+ngx_rtmp_dash_fragment_pt               ngx_rtmp_dash_fragment;
+
+
+static ngx_int_t ngx_rtmp_dash_preconfiguration(ngx_conf_t *cf);
 static ngx_int_t ngx_rtmp_dash_postconfiguration(ngx_conf_t *cf);
+static void * ngx_rtmp_dash_create_main_conf(ngx_conf_t *cf);
 static void * ngx_rtmp_dash_create_app_conf(ngx_conf_t *cf);
 static char * ngx_rtmp_dash_merge_app_conf(ngx_conf_t *cf,
        void *parent, void *child);
@@ -23,10 +30,35 @@ static ngx_int_t ngx_rtmp_dash_write_init_segments(ngx_rtmp_session_t *s);
 
 #define NGX_RTMP_DASH_BUFSIZE           (1024*1024)
 #define NGX_RTMP_DASH_MAX_MDAT          (10*1024*1024)
-#define NGX_RTMP_DASH_MAX_SAMPLES       1024
+#define NGX_RTMP_DASH_MAX_SAMPLES       16384
+#define NGX_RTMP_DASH_MIN_SAMPLES       32
 #define NGX_RTMP_DASH_DIR_ACCESS        0744
 
 
+/* files are deleted as they expire, a slow scan catches orphans */
+#define NGX_RTMP_DASH_CLEANUP_SCAN      600
+
+
+#define NGX_RTMP_DASH_MANIFEST_TIME                                            \
+    "             <S t=\"%uD\" d=\"%uD\"/>\n"
+
+
+#define NGX_RTMP_DASH_MANIFEST_REPEAT                                          \
+    "             <S t=\"%uD\" d=\"%uD\" r=\"%ui\"/>\n"
+
+
+#define NGX_RTMP_DASH_MANIFEST_CHUNKED                                         \
+    "\n"                                                                       \
+    "            availabilityTimeOffset=\"%ui.%03ui\"\n"                       \
+    "            availabilityTimeComplete=\"false\""
+
+
+/* longest timeline entry */
+#define NGX_RTMP_DASH_TIME_LEN                                                 \
+    (sizeof("             <S t=\"\" d=\"\" r=\"\"/>\n") - 1                    \
+     + 2 * NGX_INT32_LEN + NGX_INT_T_LEN)
+
+
 typedef struct {
     uint32_t                            timestamp;
     uint32_t                            duration;
@@ -39,11 +71,26 @@ typedef struct {
     ngx_uint_t                          mdat_size;
     ngx_uint_t                          sample_count;
     ngx_uint_t                          sample_mask;
-    ngx_fd_t                            fd;
     char                                type;
     uint32_t                            earliest_pres_time;
     uint32_t                            latest_pres_time;
-    ngx_rtmp_mp4_sample_t               samples[NGX_RTMP_DASH_MAX_SAMPLES];
+
+    /* grows as needed, sized from the frame rate at first */
+    ngx_rtmp_mp4_sample_t              *samples;
+    ngx_uint_t                          samples_alloc;
+
+    /* sample data of the open fragment, written out once on close */
+    u_char                             *mdat;
+    size_t                              mdat_alloc;
+
+    /*
+     * dash_chunk: samples from chunk_first (data from chunk_pos)
+     * are not yet written to the growing fragment file
+     */
+    ngx_fd_t                            fd;
+    ngx_uint_t                          chunk_first;
+    ngx_uint_t                          chunk_pos;
+    uint32_t                            chunk_seq;
 } ngx_rtmp_dash_track_t;
 
 
@@ -58,6 +105,16 @@ typedef struct {
     ngx_uint_t                          frag;
     ngx_rtmp_dash_frag_t               *frags; /* circular 2 * winfrags + 1 */
 
+    /*
+     * timeline of fragments time_first..time_last-1 (and the chunked
+     * one being written if time_opened) as runs of equal durations,
+     * the manifest is rewritten only when this changes
+     */
+    ngx_buf_t                           timeline;
+    ngx_uint_t                          time_first;
+    ngx_uint_t                          time_last;
+    unsigned                            time_opened:1;
+
     unsigned                            opened:1;
     unsigned                            has_video:1;
     unsigned                            has_audio:1;
@@ -78,16 +135,24 @@ typedef struct {
 } ngx_rtmp_dash_cleanup_t;
 
 
+/*
+ * file to delete once expired unless it was rewritten, or nested
+ * stream directory to remove if it is empty by then
+ */
 typedef struct {
-    ngx_flag_t                          dash;
-    ngx_msec_t                          fraglen;
-    ngx_msec_t                          playlen;
-    ngx_flag_t                          nested;
-    ngx_str_t                           path;
-    ngx_uint_t                          winfrags;
-    ngx_flag_t                          cleanup;
-    ngx_path_t                         *slot;
-} ngx_rtmp_dash_app_conf_t;
+    ngx_queue_t                         queue;
+    time_t                              expire;
+    time_t                              mtime;
+    unsigned                            dir:1;
+    u_char                              path[1];
+} ngx_rtmp_dash_expire_t;
+
+
+typedef struct {
+    ngx_queue_t                         expire;
+    ngx_event_t                         expire_evt;
+    ngx_shm_zone_t                     *store_zone;
+} ngx_rtmp_dash_main_conf_t;
 
 
 static ngx_command_t ngx_rtmp_dash_commands[] = {
@@ -113,6 +178,13 @@ static ngx_command_t ngx_rtmp_dash_commands[] = {
       offsetof(ngx_rtmp_dash_app_conf_t, path),
       NULL },
 
+    { ngx_string("dash_chunk"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_dash_app_conf_t, chunk),
+      NULL },
+
     { ngx_string("dash_playlist_length"),
       NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_msec_slot,
@@ -134,15 +206,22 @@ static ngx_command_t ngx_rtmp_dash_commands[] = {
       offsetof(ngx_rtmp_dash_app_conf_t, nested),
       NULL },
 
+    { ngx_string("dash_store"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_flag_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_dash_app_conf_t, store),
+      NULL },
+
     ngx_null_command
 };
 
 
 static ngx_rtmp_module_t  ngx_rtmp_dash_module_ctx = {
-    NULL,                               /* preconfiguration */
+    ngx_rtmp_dash_preconfiguration,     /* preconfiguration */
     ngx_rtmp_dash_postconfiguration,    /* postconfiguration */
 
-    NULL,                               /* create main configuration */
+    ngx_rtmp_dash_create_main_conf,     /* create main configuration */
     NULL,                               /* init main configuration */
 
     NULL,                               /* create server configuration */
@@ -182,6 +261,166 @@ ngx_rtmp_dash_get_frag(ngx_rtmp_session_t *s, ngx_int_t n)
 }
 
 
+static ngx_int_t
+ngx_rtmp_dash_expire_modified(u_char *name, time_t mtime)
+{
+    ngx_file_info_t            fi;
+
+    if (ngx_file_info(name, &fi) == NGX_FILE_ERROR) {
+        return 0;
+    }
+
+    return ngx_file_mtime(&fi) > mtime;
+}
+
+
+static void
+ngx_rtmp_dash_expire_handler(ngx_event_t *ev)
+{
+    ngx_queue_t                *q;
+    ngx_rtmp_dash_expire_t     *e;
+    ngx_rtmp_dash_main_conf_t  *dmcf;
+
+    dmcf = ev->data;
+
+    while (!ngx_queue_empty(&dmcf->expire)) {
+
+        q = ngx_queue_head(&dmcf->expire);
+        e = ngx_queue_data(q, ngx_rtmp_dash_expire_t, queue);
+
+        if (e->expire > ngx_time()) {
+            ngx_add_timer(ev, (ngx_msec_t) (e->expire - ngx_time()) * 1000);
+            return;
+        }
+
+        ngx_queue_remove(q);
+
+        /* republished stream has put files into it */
+
+        if (e->dir) {
+            ngx_log_debug1(NGX_LOG_DEBUG_RTMP, ev->log, 0,
+                           "dash: expire dir '%s'", e->path);
+
+            if (ngx_delete_dir(e->path) == NGX_FILE_ERROR
+                && ngx_errno != NGX_ENOENT && ngx_errno != NGX_ENOTEMPTY
+                && ngx_errno != NGX_EEXIST)
+            {
+                ngx_log_error(NGX_LOG_ERR, ev->log, ngx_errno,
+                              "dash: expire " ngx_delete_dir_n
+                              " failed on '%s'", e->path);
+            }
+
+            ngx_free(e);
+            continue;
+        }
+
+        /* republished stream has rewritten it */
+
+        if (ngx_rtmp_dash_expire_modified(e->path, e->mtime)) {
+            ngx_log_debug1(NGX_LOG_DEBUG_RTMP, ev->log, 0,
+                           "dash: expire skip '%s'", e->path);
+
+            ngx_free(e);
+            continue;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_RTMP, ev->log, 0,
+                       "dash: expire '%s'", e->path);
+
+        if (ngx_delete_file(e->path) == NGX_FILE_ERROR
+            && ngx_errno != NGX_ENOENT)
+        {
+            ngx_log_error(NGX_LOG_ERR, ev->log, ngx_errno,
+                          "dash: expire " ngx_delete_file_n " failed on '%s'",
+                          e->path);
+        }
+
+        ngx_free(e);
+    }
+}
+
+
+/*
+ * Same as in hls: files are queued for deletion as they leave
+ * the manifest, what an exiting worker leaves is for the scan.
+ */
+
+static ngx_rtmp_dash_expire_t *
+ngx_rtmp_dash_expire(ngx_rtmp_session_t *s, u_char *path, size_t len,
+    ngx_msec_t delay)
+{
+    ngx_queue_t                *q;
+    ngx_rtmp_dash_expire_t     *e, *prev;
+    ngx_rtmp_dash_app_conf_t   *dacf;
+    ngx_rtmp_dash_main_conf_t  *dmcf;
+
+    dacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_dash_module);
+
+    if (!dacf->cleanup) {
+        return NULL;
+    }
+
+    dmcf = ngx_rtmp_get_module_main_conf(s, ngx_rtmp_dash_module);
+
+    e = ngx_alloc(sizeof(ngx_rtmp_dash_expire_t) + len, s->connection->log);
+    if (e == NULL) {
+        return NULL;
+    }
+
+    e->mtime = ngx_time();
+    e->expire = e->mtime + (time_t) (delay / 1000);
+    e->dir = 0;
+
+    *ngx_cpymem(e->path, path, len) = 0;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                   "dash: expire '%s' in %M", e->path, delay);
+
+    for (q = ngx_queue_last(&dmcf->expire);
+         q != ngx_queue_sentinel(&dmcf->expire);
+         q = ngx_queue_prev(q))
+    {
+        prev = ngx_queue_data(q, ngx_rtmp_dash_expire_t, queue);
+
+        if (prev->expire <= e->expire) {
+            break;
+        }
+    }
+
+    ngx_queue_insert_after(q, &e->queue);
+
+    if (ngx_queue_head(&dmcf->expire) == &e->queue) {
+        ngx_add_timer(&dmcf->expire_evt, delay);
+    }
+
+    return e;
+}
+
+
+static void
+ngx_rtmp_dash_expire_frag(ngx_rtmp_session_t *s, ngx_rtmp_dash_frag_t *f,
+    ngx_msec_t delay)
+{
+    u_char                    *p;
+    ngx_rtmp_dash_ctx_t       *ctx;
+    u_char                     path[NGX_MAX_PATH + 1];
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_dash_module);
+
+    if (ctx->has_video) {
+        p = ngx_snprintf(path, sizeof(path) - 1, "%*s%uD.m4v",
+                         ctx->stream.len, ctx->stream.data, f->timestamp);
+        ngx_rtmp_dash_expire(s, path, p - path, delay);
+    }
+
+    if (ctx->has_audio) {
+        p = ngx_snprintf(path, sizeof(path) - 1, "%*s%uD.m4a",
+                         ctx->stream.len, ctx->stream.data, f->timestamp);
+        ngx_rtmp_dash_expire(s, path, p - path, delay);
+    }
+}
+
+
 static void
 ngx_rtmp_dash_next_frag(ngx_rtmp_session_t *s)
 {
@@ -193,6 +432,12 @@ ngx_rtmp_dash_next_frag(ngx_rtmp_session_t *s)
 
     if (ctx->nfrags == dacf->winfrags) {
         ctx->frag++;
+
+        /* left the manifest, keep it for players which have just read it */
+
+        ngx_rtmp_dash_expire_frag(s, ngx_rtmp_dash_get_frag(s, -1),
+                                  dacf->playlen);
+
     } else {
         ctx->nfrags++;
     }
@@ -212,22 +457,180 @@ ngx_rtmp_dash_rename_file(u_char *src, u_char *dst)
 }
 
 
+static u_char *
+ngx_rtmp_dash_write_run(u_char *p, uint32_t t, uint32_t d, ngx_uint_t r)
+{
+    if (r == 0) {
+        return ngx_sprintf(p, NGX_RTMP_DASH_MANIFEST_TIME, t, d);
+    }
+
+    return ngx_sprintf(p, NGX_RTMP_DASH_MANIFEST_REPEAT, t, d, r);
+}
+
+
+static ngx_int_t
+ngx_rtmp_dash_update_timeline(ngx_rtmp_session_t *s)
+{
+    u_char                    *p;
+    uint32_t                   t, d, duration;
+    ngx_uint_t                 i, n, r, opened;
+    ngx_rtmp_dash_ctx_t       *ctx;
+    ngx_rtmp_dash_frag_t      *f;
+    ngx_rtmp_dash_app_conf_t  *dacf;
+
+    dacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_dash_module);
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_dash_module);
+
+    /* chunked: the fragment being written is listed with nominal duration */
+
+    opened = (dacf->chunk && ctx->opened);
+
+    if (ctx->time_first == ctx->frag &&
+        ctx->time_last == ctx->frag + ctx->nfrags &&
+        ctx->time_opened == opened)
+    {
+        return 0;
+    }
+
+    ctx->time_first = ctx->frag;
+    ctx->time_last = ctx->frag + ctx->nfrags;
+    ctx->time_opened = opened;
+
+    /*
+     * a fragment joins the previous run if it has the same duration
+     * and starts where the run ends, so that its start is implied
+     */
+
+    p = ctx->timeline.start;
+
+    t = 0;
+    d = 0;
+    r = 0;
+
+    n = ctx->nfrags + opened;
+
+    for (i = 0; i < n; i++) {
+        f = ngx_rtmp_dash_get_frag(s, i);
+
+        duration = (i == ctx->nfrags ? (uint32_t) dacf->fraglen
+                                     : f->duration);
+
+        if (i > 0 && duration == d &&
+            f->timestamp == (uint32_t) (t + d * (r + 1)))
+        {
+            r++;
+            continue;
+        }
+
+        if (i > 0) {
+            p = ngx_rtmp_dash_write_run(p, t, d, r);
+        }
+
+        t = f->timestamp;
+        d = duration;
+        r = 0;
+    }
+
+    if (n) {
+        p = ngx_rtmp_dash_write_run(p, t, d, r);
+    }
+
+    ctx->timeline.pos = ctx->timeline.start;
+    ctx->timeline.last = p;
+
+    return 1;
+}
+
+
+static ngx_int_t
+ngx_rtmp_dash_write_data(ngx_rtmp_session_t *s, u_char *data, size_t len)
+{
+    ssize_t                     n;
+    ngx_fd_t                    fd;
+    ngx_rtmp_dash_ctx_t        *ctx;
+    ngx_rtmp_dash_app_conf_t   *dacf;
+    ngx_rtmp_dash_main_conf_t  *dmcf;
+    ngx_rtmp_hls_store_entry_t *e;
+
+    dacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_dash_module);
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_dash_module);
+
+    if (dacf->store) {
+        dmcf = ngx_rtmp_get_module_main_conf(s, ngx_rtmp_dash_module);
+
+        e = ngx_rtmp_hls_store_open(dmcf->store_zone, &ctx->playlist,
+                                    s->connection->log);
+        if (e == NULL) {
+            return NGX_ERROR;
+        }
+
+        if (ngx_rtmp_hls_store_write(dmcf->store_zone, e, data, len,
+                                     s->connection->log)
+            != NGX_OK)
+        {
+            ngx_rtmp_hls_store_abort(dmcf->store_zone, e);
+            return NGX_ERROR;
+        }
+
+        /* outlives the stream as long as the file would */
+
+        ngx_rtmp_hls_store_close(dmcf->store_zone, e,
+                                 (time_t) (dacf->playlen / 1000));
+
+        return NGX_OK;
+    }
+
+    fd = ngx_open_file(ctx->playlist_bak.data, NGX_FILE_WRONLY,
+                       NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
+
+    if (fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
+                      "dash: open failed: '%V'", &ctx->playlist_bak);
+        return NGX_ERROR;
+    }
+
+    /* the whole manifest goes out in one write */
+
+    n = ngx_write_fd(fd, data, len);
+
+    if (n != (ssize_t) len) {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
+                      "dash: write failed: '%V'", &ctx->playlist_bak);
+        ngx_close_file(fd);
+        return NGX_ERROR;
+    }
+
+    ngx_close_file(fd);
+
+    if (ngx_rtmp_dash_rename_file(ctx->playlist_bak.data, ctx->playlist.data)
+        == NGX_FILE_ERROR)
+    {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
+                      "dash: rename failed: '%V'->'%V'",
+                      &ctx->playlist_bak, &ctx->playlist);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_rtmp_dash_write_playlist(ngx_rtmp_session_t *s)
 {
     char                      *sep;
     u_char                    *p, *last;
-    ssize_t                    n;
-    ngx_fd_t                   fd;
     struct tm                  tm;
+    ngx_msec_t                 ato;
     ngx_str_t                  noname, *name;
-    ngx_uint_t                 i;
+    ngx_buf_t                 *b;
     ngx_rtmp_dash_ctx_t       *ctx;
     ngx_rtmp_codec_ctx_t      *codec_ctx;
-    ngx_rtmp_dash_frag_t      *f;
     ngx_rtmp_dash_app_conf_t  *dacf;
 
     static u_char              buffer[NGX_RTMP_DASH_BUFSIZE];
+    static u_char              chunked[sizeof(NGX_RTMP_DASH_MANIFEST_CHUNKED)
+                                       + NGX_INT_T_LEN];
     static u_char              start_time[sizeof("1970-09-28T12:00:00Z")];
     static u_char              pub_time[sizeof("1970-09-28T12:00:00Z")];
 
@@ -239,17 +642,12 @@ ngx_rtmp_dash_write_playlist(ngx_rtmp_session_t *s)
         return NGX_ERROR;
     }
 
-    if (ctx->id == 0) {
-        ngx_rtmp_dash_write_init_segments(s);
+    if (!ngx_rtmp_dash_update_timeline(s)) {
+        return NGX_OK;
     }
 
-    fd = ngx_open_file(ctx->playlist_bak.data, NGX_FILE_WRONLY,
-                       NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
-
-    if (fd == NGX_INVALID_FILE) {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                      "dash: open failed: '%V'", &ctx->playlist_bak);
-        return NGX_ERROR;
+    if (ctx->id == 0) {
+        ngx_rtmp_dash_write_init_segments(s);
     }
 
 #define NGX_RTMP_DASH_MANIFEST_HEADER                                          \
@@ -279,7 +677,7 @@ ngx_rtmp_dash_write_playlist(ngx_rtmp_session_t *s)
     "      <Representation\n"                                                  \
     "          id=\"%V_H264\"\n"                                               \
     "          mimeType=\"video/mp4\"\n"                                       \
-    "          codecs=\"avc1.%02uxi%02uxi%02uxi\"\n"                           \
+    "          codecs=\"%s\"\n"                                              \
     "          width=\"%ui\"\n"                                                \
     "          height=\"%ui\"\n"                                               \
     "          frameRate=\"%ui\"\n"                                            \
@@ -288,7 +686,7 @@ ngx_rtmp_dash_write_playlist(ngx_rtmp_session_t *s)
     "        <SegmentTemplate\n"                                               \
     "            timescale=\"1000\"\n"                                         \
     "            media=\"%V%s$Time$.m4v\"\n"                                   \
-    "            initialization=\"%V%sinit.m4v\">\n"                           \
+    "            initialization=\"%V%sinit.m4v\"%s>\n"                         \
     "          <SegmentTimeline>\n"
 
 
@@ -299,10 +697,6 @@ ngx_rtmp_dash_write_playlist(ngx_rtmp_session_t *s)
     "    </AdaptationSet>\n"
 
 
-#define NGX_RTMP_DASH_MANIFEST_TIME                                            \
-    "             <S t=\"%uD\" d=\"%uD\"/>\n"
-
-
 #define NGX_RTMP_DASH_MANIFEST_AUDIO                                           \
     "    <AdaptationSet\n"                                                     \
     "        id=\"2\"\n"                                                       \
@@ -321,7 +715,7 @@ ngx_rtmp_dash_write_playlist(ngx_rtmp_session_t *s)
     "        <SegmentTemplate\n"                                               \
     "            timescale=\"1000\"\n"                                         \
     "            media=\"%V%s$Time$.m4a\"\n"                                   \
-    "            initialization=\"%V%sinit.m4a\">\n"                           \
+    "            initialization=\"%V%sinit.m4a\"%s>\n"                         \
     "          <SegmentTimeline>\n"
 
 
@@ -364,83 +758,64 @@ ngx_rtmp_dash_write_playlist(ngx_rtmp_session_t *s)
      *     2 * minBufferTime + max_fragment_length + 1
      */
 
-    n = ngx_write_fd(fd, buffer, p - buffer);
+    b = &ctx->timeline;
 
     ngx_str_null(&noname);
 
     name = (dacf->nested ? &noname : &ctx->name);
     sep = (dacf->nested ? "" : "-");
 
+    /*
+     * chunked: the fragment being written may be requested
+     * once its first chunk is out
+     */
+
+    chunked[0] = '\0';
+
+    if (dacf->chunk) {
+        ato = dacf->fraglen - dacf->chunk;
+
+        ngx_sprintf(chunked, NGX_RTMP_DASH_MANIFEST_CHUNKED "%Z",
+                    (ngx_uint_t) (ato / 1000), (ngx_uint_t) (ato % 1000));
+    }
+
     if (ctx->has_video) {
-        p = ngx_slprintf(buffer, last, NGX_RTMP_DASH_MANIFEST_VIDEO,
+        p = ngx_slprintf(p, last, NGX_RTMP_DASH_MANIFEST_VIDEO,
                          codec_ctx->width,
                          codec_ctx->height,
                          codec_ctx->frame_rate,
                          &ctx->name,
-                         codec_ctx->avc_profile,
-                         codec_ctx->avc_compat,
-                         codec_ctx->avc_level,
+                         codec_ctx->video_codecs,
                          codec_ctx->width,
                          codec_ctx->height,
                          codec_ctx->frame_rate,
                          (ngx_uint_t) (codec_ctx->video_data_rate * 1000),
                          name, sep,
-                         name, sep);
+                         name, sep, chunked);
 
-        for (i = 0; i < ctx->nfrags; i++) {
-            f = ngx_rtmp_dash_get_frag(s, i);
-            p = ngx_slprintf(p, last, NGX_RTMP_DASH_MANIFEST_TIME,
-                             f->timestamp, f->duration);
-        }
+        p = ngx_cpymem(p, b->pos, ngx_min(b->last - b->pos, last - p));
 
         p = ngx_slprintf(p, last, NGX_RTMP_DASH_MANIFEST_VIDEO_FOOTER);
-
-        n = ngx_write_fd(fd, buffer, p - buffer);
     }
 
     if (ctx->has_audio) {
-        p = ngx_slprintf(buffer, last, NGX_RTMP_DASH_MANIFEST_AUDIO,
+        p = ngx_slprintf(p, last, NGX_RTMP_DASH_MANIFEST_AUDIO,
                          &ctx->name,
                          codec_ctx->audio_codec_id == NGX_RTMP_AUDIO_AAC ?
                          (codec_ctx->aac_sbr ? "40.5" : "40.2") : "6b",
                          codec_ctx->sample_rate,
                          (ngx_uint_t) (codec_ctx->audio_data_rate * 1000),
                          name, sep,
-                         name, sep);
+                         name, sep, chunked);
 
-        for (i = 0; i < ctx->nfrags; i++) {
-            f = ngx_rtmp_dash_get_frag(s, i);
-            p = ngx_slprintf(p, last, NGX_RTMP_DASH_MANIFEST_TIME,
-                             f->timestamp, f->duration);
-        }
+        p = ngx_cpymem(p, b->pos, ngx_min(b->last - b->pos, last - p));
 
         p = ngx_slprintf(p, last, NGX_RTMP_DASH_MANIFEST_AUDIO_FOOTER);
-
-        n = ngx_write_fd(fd, buffer, p - buffer);
-    }
-
-    p = ngx_slprintf(buffer, last, NGX_RTMP_DASH_MANIFEST_FOOTER);
-    n = ngx_write_fd(fd, buffer, p - buffer);
-
-    if (n < 0) {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                      "dash: write failed: '%V'", &ctx->playlist_bak);
-        ngx_close_file(fd);
-        return NGX_ERROR;
     }
 
-    ngx_close_file(fd);
+    p = ngx_slprintf(p, last, NGX_RTMP_DASH_MANIFEST_FOOTER);
 
-    if (ngx_rtmp_dash_rename_file(ctx->playlist_bak.data, ctx->playlist.data)
-        == NGX_FILE_ERROR)
-    {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                      "dash: rename failed: '%V'->'%V'",
-                      &ctx->playlist_bak, &ctx->playlist);
-        return NGX_ERROR;
-    }
-
-    return NGX_OK;
+    return ngx_rtmp_dash_write_data(s, buffer, p - buffer);
 }
 
 
@@ -514,22 +889,135 @@ ngx_rtmp_dash_write_init_segments(ngx_rtmp_session_t *s)
                       "dash: writing audio init failed");
     }
 
-    ngx_close_file(fd);
+    ngx_close_file(fd);
+
+    return NGX_OK;
+}
+
+
+static u_char *
+ngx_rtmp_dash_fragment_name(ngx_rtmp_session_t *s, ngx_rtmp_dash_track_t *t,
+    ngx_uint_t raw)
+{
+    ngx_rtmp_dash_ctx_t       *ctx;
+    ngx_rtmp_dash_frag_t      *f;
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_dash_module);
+
+    f = ngx_rtmp_dash_get_frag(s, ctx->nfrags);
+
+    *ngx_sprintf(ctx->stream.data + ctx->stream.len, "%uD.m4%c%s",
+                 f->timestamp, t->type, raw ? ".raw" : "") = 0;
+
+    return ctx->stream.data;
+}
+
+
+/*
+ * Chunked CMAF: samples collected since the previous chunk go out as
+ * a moof+mdat pair appended to <fragment>.raw, the first chunk is
+ * preceded by styp; no sidx as the fragment size is not known yet.
+ */
+
+static ngx_int_t
+ngx_rtmp_dash_write_chunk(ngx_rtmp_session_t *s, ngx_rtmp_dash_track_t *t,
+    ngx_uint_t last)
+{
+    u_char                    *name;
+    size_t                     size;
+    ngx_buf_t                  b;
+    ngx_uint_t                 n;
+
+    static u_char              buffer[NGX_RTMP_DASH_BUFSIZE];
+
+    n = last - t->chunk_first;
+
+    if (n == 0) {
+        return NGX_OK;
+    }
+
+    b.start = buffer;
+    b.end = buffer + sizeof(buffer);
+    b.pos = b.last = b.start;
+
+    if (t->fd == NGX_INVALID_FILE) {
+        name = ngx_rtmp_dash_fragment_name(s, t, 1);
+
+        t->fd = ngx_open_file(name, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE,
+                              NGX_FILE_DEFAULT_ACCESS);
+
+        if (t->fd == NGX_INVALID_FILE) {
+            ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
+                          "dash: error creating fragment file '%s'", name);
+            return NGX_ERROR;
+        }
+
+        ngx_rtmp_mp4_write_styp(&b);
+    }
+
+    size = t->mdat_size - t->chunk_pos;
+
+    ngx_rtmp_mp4_write_moof(&b, t->samples[t->chunk_first].timestamp, n,
+                            &t->samples[t->chunk_first], t->sample_mask,
+                            ++t->chunk_seq);
+    ngx_rtmp_mp4_write_mdat(&b, size + 8);
+
+    ngx_log_debug4(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                   "dash: write chunk type=%c, seq=%uD, samples=%ui, "
+                   "size=%uz", t->type, t->chunk_seq, n, size);
+
+    if (ngx_write_fd(t->fd, b.pos, (size_t) (b.last - b.pos)) == NGX_ERROR ||
+        (size &&
+         ngx_write_fd(t->fd, t->mdat + t->chunk_pos, size) == NGX_ERROR))
+    {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
+                      "dash: " ngx_write_fd_n " failed");
+        return NGX_ERROR;
+    }
+
+    t->chunk_first = last;
+    t->chunk_pos = t->mdat_size;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_rtmp_dash_close_chunks(ngx_rtmp_session_t *s, ngx_rtmp_dash_track_t *t)
+{
+    u_char                    *name;
+    u_char                     raw[NGX_MAX_PATH + 1];
+
+    ngx_rtmp_dash_write_chunk(s, t, t->sample_count);
+
+    if (t->fd == NGX_INVALID_FILE) {
+        return;
+    }
+
+    ngx_close_file(t->fd);
+    t->fd = NGX_INVALID_FILE;
+
+    /* fragment is complete, chunked readers see .raw disappear */
+
+    name = ngx_rtmp_dash_fragment_name(s, t, 1);
+    ngx_cpystrn(raw, name, sizeof(raw));
 
-    return NGX_OK;
+    name = ngx_rtmp_dash_fragment_name(s, t, 0);
+
+    if (ngx_rtmp_dash_rename_file(raw, name) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
+                      "dash: rename failed: '%s'->'%s'", raw, name);
+    }
 }
 
 
 static void
 ngx_rtmp_dash_close_fragment(ngx_rtmp_session_t *s, ngx_rtmp_dash_track_t *t)
 {
-    u_char                    *pos, *pos1;
-    size_t                     left;
-    ssize_t                    n;
+    u_char                    *pos, *pos1, *name;
     ngx_fd_t                   fd;
     ngx_buf_t                  b;
-    ngx_rtmp_dash_ctx_t       *ctx;
-    ngx_rtmp_dash_frag_t      *f;
+    ngx_rtmp_dash_app_conf_t  *dacf;
 
     static u_char              buffer[NGX_RTMP_DASH_BUFSIZE];
 
@@ -541,7 +1029,14 @@ ngx_rtmp_dash_close_fragment(ngx_rtmp_session_t *s, ngx_rtmp_dash_track_t *t)
                    "dash: close fragment id=%ui, type=%c, pts=%uD",
                    t->id, t->type, t->earliest_pres_time);
 
-    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_dash_module);
+    dacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_dash_module);
+
+    t->opened = 0;
+
+    if (dacf->chunk) {
+        ngx_rtmp_dash_close_chunks(s, t);
+        return;
+    }
 
     b.start = buffer;
     b.end = buffer + sizeof(buffer);
@@ -562,75 +1057,65 @@ ngx_rtmp_dash_close_fragment(ngx_rtmp_session_t *s, ngx_rtmp_dash_track_t *t)
     b.last = pos1;
     ngx_rtmp_mp4_write_mdat(&b, t->mdat_size + 8);
 
-    /* move the data down to make room for the headers */
-
-    f = ngx_rtmp_dash_get_frag(s, ctx->nfrags);
+    /* headers and sample data held in memory go out in one pass */
 
-    *ngx_sprintf(ctx->stream.data + ctx->stream.len, "%uD.m4%c",
-                 f->timestamp, t->type) = 0;
+    name = ngx_rtmp_dash_fragment_name(s, t, 0);
 
-    fd = ngx_open_file(ctx->stream.data, NGX_FILE_RDWR,
+    fd = ngx_open_file(name, NGX_FILE_WRONLY,
                        NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
 
     if (fd == NGX_INVALID_FILE) {
         ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                      "dash: error creating dash temp video file");
-        goto done;
-    }
-
-    if (ngx_write_fd(fd, b.pos, (size_t) (b.last - b.pos)) == NGX_ERROR) {
-        goto done;
+                      "dash: error creating fragment file");
+        return;
     }
 
-    left = (size_t) t->mdat_size;
-
-#if (NGX_WIN32)
-    if (SetFilePointer(t->fd, 0, 0, FILE_BEGIN) == INVALID_SET_FILE_POINTER) {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
-                      "dash: SetFilePointer error");
-        goto done;
-    }
-#else
-    if (lseek(t->fd, 0, SEEK_SET) == -1) {
+    if (ngx_write_fd(fd, b.pos, (size_t) (b.last - b.pos)) == NGX_ERROR ||
+        (t->mdat_size &&
+         ngx_write_fd(fd, t->mdat, t->mdat_size) == NGX_ERROR))
+    {
         ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                      "dash: lseek error");
-        goto done;
+                      "dash: " ngx_write_fd_n " failed");
     }
-#endif
 
-    while (left > 0) {
-
-        n = ngx_read_fd(t->fd, buffer, ngx_min(sizeof(buffer), left));
-        if (n == NGX_ERROR) {
-            break;
-        }
+    ngx_close_file(fd);
+}
 
-        n = ngx_write_fd(fd, buffer, (size_t) n);
-        if (n == NGX_ERROR) {
-            break;
-        }
 
-        left -= n;
+static void
+ngx_rtmp_dash_free_track(ngx_rtmp_session_t *s, ngx_rtmp_dash_track_t *t)
+{
+    if (t->mdat) {
+        ngx_free(t->mdat);
+        t->mdat = NULL;
+        t->mdat_alloc = 0;
     }
 
-done:
-
-    if (fd != NGX_INVALID_FILE) {
-        ngx_close_file(fd);
+    if (t->samples) {
+        ngx_free(t->samples);
+        t->samples = NULL;
+        t->samples_alloc = 0;
     }
+}
 
-    ngx_close_file(t->fd);
 
-    t->fd = NGX_INVALID_FILE;
-    t->opened = 0;
+static void
+ngx_rtmp_dash_free_tracks(ngx_rtmp_session_t *s, ngx_rtmp_dash_ctx_t *ctx)
+{
+    ngx_rtmp_dash_free_track(s, &ctx->video);
+    ngx_rtmp_dash_free_track(s, &ctx->audio);
 }
 
 
 static ngx_int_t
 ngx_rtmp_dash_close_fragments(ngx_rtmp_session_t *s)
 {
-    ngx_rtmp_dash_ctx_t  *ctx;
+    ngx_rtmp_dash_ctx_t       *ctx;
+    ngx_rtmp_dash_frag_t      *f;
+    ngx_rtmp_dash_fragment_t   v;
+    ngx_rtmp_dash_app_conf_t  *dacf;
 
+    dacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_dash_module);
     ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_dash_module);
     if (ctx == NULL || !ctx->opened) {
         return NGX_OK;
@@ -642,14 +1127,31 @@ ngx_rtmp_dash_close_fragments(ngx_rtmp_session_t *s)
     ngx_rtmp_dash_close_fragment(s, &ctx->video);
     ngx_rtmp_dash_close_fragment(s, &ctx->audio);
 
+    f = ngx_rtmp_dash_get_frag(s, ctx->nfrags);
+
     ngx_rtmp_dash_next_frag(s);
 
-    ngx_rtmp_dash_write_playlist(s);
+    ctx->opened = 0;
+
+    /* chunked manifest is written once the next fragment is open */
+
+    if (!dacf->chunk) {
+        ngx_rtmp_dash_write_playlist(s);
+    }
 
     ctx->id++;
-    ctx->opened = 0;
 
-    return NGX_OK;
+    /* fragments are complete, let other packagers list them */
+
+    ngx_memzero(&v, sizeof(v));
+
+    v.stream = ctx->stream;
+    v.timestamp = f->timestamp;
+    v.duration = f->duration;
+    v.video = ctx->has_video;
+    v.audio = ctx->has_audio;
+
+    return ngx_rtmp_dash_fragment(s, &v);
 }
 
 
@@ -657,8 +1159,6 @@ static ngx_int_t
 ngx_rtmp_dash_open_fragment(ngx_rtmp_session_t *s, ngx_rtmp_dash_track_t *t,
     ngx_uint_t id, char type)
 {
-    ngx_rtmp_dash_ctx_t   *ctx;
-
     if (t->opened) {
         return NGX_OK;
     }
@@ -666,25 +1166,15 @@ ngx_rtmp_dash_open_fragment(ngx_rtmp_session_t *s, ngx_rtmp_dash_track_t *t,
     ngx_log_debug2(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
                    "dash: open fragment id=%ui, type='%c'", id, type);
 
-    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_dash_module);
-
-    *ngx_sprintf(ctx->stream.data + ctx->stream.len, "raw.m4%c", type) = 0;
-
-    t->fd = ngx_open_file(ctx->stream.data, NGX_FILE_RDWR,
-                          NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
-
-    if (t->fd == NGX_INVALID_FILE) {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                      "dash: error creating fragment file");
-        return NGX_ERROR;
-    }
-
     t->id = id;
     t->type = type;
     t->sample_count = 0;
     t->earliest_pres_time = 0;
     t->latest_pres_time = 0;
     t->mdat_size = 0;
+    t->fd = NGX_INVALID_FILE;
+    t->chunk_first = 0;
+    t->chunk_pos = 0;
     t->opened = 1;
 
     if (type == 'v') {
@@ -827,6 +1317,7 @@ ngx_rtmp_dash_publish(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
 {
     u_char                    *p;
     size_t                     len;
+    ngx_buf_t                  b;
     ngx_rtmp_dash_ctx_t       *ctx;
     ngx_rtmp_dash_frag_t      *f;
     ngx_rtmp_dash_app_conf_t  *dacf;
@@ -857,9 +1348,15 @@ ngx_rtmp_dash_publish(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
             goto next;
         }
 
+        ngx_rtmp_dash_free_tracks(s, ctx);
+
         f = ctx->frags;
+        b = ctx->timeline;
         ngx_memzero(ctx, sizeof(ngx_rtmp_dash_ctx_t));
         ctx->frags = f;
+        ctx->timeline = b;
+        ctx->timeline.pos = b.start;
+        ctx->timeline.last = b.start;
     }
 
     if (ctx->frags == NULL) {
@@ -871,6 +1368,19 @@ ngx_rtmp_dash_publish(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
         }
     }
 
+    if (ctx->timeline.start == NULL) {
+        len = NGX_RTMP_DASH_TIME_LEN * (dacf->winfrags + 1);
+
+        ctx->timeline.start = ngx_palloc(s->connection->pool, len);
+        if (ctx->timeline.start == NULL) {
+            return NGX_ERROR;
+        }
+
+        ctx->timeline.end = ctx->timeline.start + len;
+        ctx->timeline.pos = ctx->timeline.start;
+        ctx->timeline.last = ctx->timeline.start;
+    }
+
     ctx->id = 0;
 
     if (ngx_strstr(v->name, "..")) {
@@ -953,6 +1463,55 @@ next:
 }
 
 
+static void
+ngx_rtmp_dash_expire_stream(ngx_rtmp_session_t *s)
+{
+    u_char                    *p;
+    ngx_uint_t                 i;
+    ngx_rtmp_dash_ctx_t       *ctx;
+    ngx_rtmp_dash_expire_t    *e;
+    ngx_rtmp_dash_app_conf_t  *dacf;
+    u_char                     path[NGX_MAX_PATH + 1];
+
+    dacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_dash_module);
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_dash_module);
+
+    if (ctx->playlist.data == NULL) {
+        return;
+    }
+
+    /* stored manifest expires by itself */
+
+    if (!dacf->store) {
+        ngx_rtmp_dash_expire(s, ctx->playlist.data, ctx->playlist.len,
+                             dacf->playlen);
+    }
+
+    p = ngx_snprintf(path, sizeof(path) - 1, "%*sinit.m4v",
+                     ctx->stream.len, ctx->stream.data);
+    ngx_rtmp_dash_expire(s, path, p - path, dacf->playlen * 2);
+
+    p = ngx_snprintf(path, sizeof(path) - 1, "%*sinit.m4a",
+                     ctx->stream.len, ctx->stream.data);
+    ngx_rtmp_dash_expire(s, path, p - path, dacf->playlen * 2);
+
+    for (i = 0; i < ctx->nfrags; i++) {
+        ngx_rtmp_dash_expire_frag(s, ngx_rtmp_dash_get_frag(s, i),
+                                  dacf->playlen * 2);
+    }
+
+    /* nested directory goes after the last files queued in it */
+
+    if (dacf->nested) {
+        e = ngx_rtmp_dash_expire(s, ctx->stream.data, ctx->stream.len - 1,
+                                 dacf->playlen * 2);
+        if (e) {
+            e->dir = 1;
+        }
+    }
+}
+
+
 static ngx_int_t
 ngx_rtmp_dash_close_stream(ngx_rtmp_session_t *s, ngx_rtmp_close_stream_t *v)
 {
@@ -972,6 +1531,14 @@ ngx_rtmp_dash_close_stream(ngx_rtmp_session_t *s, ngx_rtmp_close_stream_t *v)
 
     ngx_rtmp_dash_close_fragments(s);
 
+    /* nothing is in progress any more */
+
+    ngx_rtmp_dash_write_playlist(s);
+
+    ngx_rtmp_dash_free_tracks(s, ctx);
+
+    ngx_rtmp_dash_expire_stream(s);
+
 next:
     return next_close_stream(s, v);
 }
@@ -1026,6 +1593,14 @@ ngx_rtmp_dash_update_fragments(ngx_rtmp_session_t *s, ngx_int_t boundary,
         boundary = 1;
     }
 
+    /* split rather than drop samples, moof size is bounded as well */
+
+    if (ctx->audio.sample_count >= NGX_RTMP_DASH_MAX_SAMPLES ||
+        ctx->video.sample_count >= NGX_RTMP_DASH_MAX_SAMPLES)
+    {
+        boundary = 1;
+    }
+
     if (!ctx->opened) {
         boundary = 1;
     }
@@ -1036,67 +1611,177 @@ ngx_rtmp_dash_update_fragments(ngx_rtmp_session_t *s, ngx_int_t boundary,
 
         f = ngx_rtmp_dash_get_frag(s, ctx->nfrags);
         f->timestamp = timestamp;
+
+        /* chunked fragment is listed while it is being written */
+
+        if (dacf->chunk) {
+            ngx_rtmp_dash_write_playlist(s);
+        }
     }
 }
 
 
 static ngx_int_t
-ngx_rtmp_dash_append(ngx_rtmp_session_t *s, ngx_chain_t *in,
-    ngx_rtmp_dash_track_t *t, ngx_int_t key, uint32_t timestamp, uint32_t delay)
+ngx_rtmp_dash_reserve(ngx_rtmp_session_t *s, ngx_rtmp_dash_track_t *t,
+    size_t size)
 {
-    u_char                 *p;
-    size_t                  size, bsize;
-    ngx_rtmp_mp4_sample_t  *smpl;
+    u_char  *p;
+    size_t   n;
 
-    static u_char           buffer[NGX_RTMP_DASH_BUFSIZE];
+    if (t->mdat_size + size <= t->mdat_alloc) {
+        return NGX_OK;
+    }
 
-    p = buffer;
-    size = 0;
+    n = ngx_max(t->mdat_alloc * 2, NGX_RTMP_DASH_BUFSIZE);
+
+    while (n < t->mdat_size + size) {
+        n *= 2;
+    }
+
+    p = ngx_alloc(n, s->connection->log);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (t->mdat) {
+        ngx_memcpy(p, t->mdat, t->mdat_size);
+        ngx_free(t->mdat);
+    }
+
+    t->mdat = p;
+    t->mdat_alloc = n;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_rtmp_dash_grow_samples(ngx_rtmp_session_t *s, ngx_rtmp_dash_track_t *t)
+{
+    ngx_uint_t                 n, rate;
+    ngx_rtmp_mp4_sample_t     *samples;
+    ngx_rtmp_codec_ctx_t      *codec_ctx;
+    ngx_rtmp_dash_app_conf_t  *dacf;
 
-    for (; in && size < sizeof(buffer); in = in->next) {
+    n = t->samples_alloc * 2;
 
-        bsize = (size_t) (in->buf->last - in->buf->pos);
-        if (size + bsize > sizeof(buffer)) {
-            bsize = (size_t) (sizeof(buffer) - size);
+    if (n == 0) {
+
+        /* enough for a fragment at twice dash_fragment, the longest one */
+
+        dacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_dash_module);
+        codec_ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_codec_module);
+
+        rate = 0;
+
+        if (codec_ctx) {
+            rate = (t->type == 'v') ? codec_ctx->frame_rate
+                                    : codec_ctx->sample_rate / 1024 + 1;
         }
 
-        p = ngx_cpymem(p, in->buf->pos, bsize);
-        size += bsize;
+        n = ngx_max(rate * dacf->fraglen * 2 / 1000,
+                    NGX_RTMP_DASH_MIN_SAMPLES);
+    }
+
+    n = ngx_min(n, NGX_RTMP_DASH_MAX_SAMPLES);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                   "dash: sample table type=%c, size=%ui", t->type, n);
+
+    /* like mdat, outside of the pool which cannot free small blocks */
+
+    samples = ngx_alloc(n * sizeof(ngx_rtmp_mp4_sample_t),
+                        s->connection->log);
+    if (samples == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (t->samples) {
+        ngx_memcpy(samples, t->samples,
+                   t->sample_count * sizeof(ngx_rtmp_mp4_sample_t));
+        ngx_free(t->samples);
     }
 
+    t->samples = samples;
+    t->samples_alloc = n;
+
+    return NGX_OK;
+}
+
+
+/*
+ * sample data starts at pos in the first buffer, input buffers are
+ * shared with the modules which handle the message after dash
+ */
+
+static ngx_int_t
+ngx_rtmp_dash_append(ngx_rtmp_session_t *s, ngx_chain_t *in, u_char *pos,
+    ngx_rtmp_dash_track_t *t, ngx_int_t key, uint32_t timestamp, uint32_t delay)
+{
+    u_char                    *p, *start;
+    size_t                     size;
+    ngx_chain_t               *cl;
+    ngx_rtmp_mp4_sample_t     *smpl;
+    ngx_rtmp_dash_app_conf_t  *dacf;
+
+    dacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_dash_module);
+
     ngx_rtmp_dash_update_fragments(s, key, timestamp);
 
+    if (t->sample_count == t->samples_alloc &&
+        ngx_rtmp_dash_grow_samples(s, t) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
     if (t->sample_count == 0) {
         t->earliest_pres_time = timestamp;
     }
 
     t->latest_pres_time = timestamp;
 
-    if (t->sample_count < NGX_RTMP_DASH_MAX_SAMPLES) {
+    if (t->sample_count > 0) {
+        smpl = &t->samples[t->sample_count - 1];
+        smpl->duration = timestamp - smpl->timestamp;
+    }
 
-        if (ngx_write_fd(t->fd, buffer, size) == NGX_ERROR) {
-            ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                          "dash: " ngx_write_fd_n " failed");
-            return NGX_ERROR;
-        }
+    /* samples before this one have durations, the chunk is complete */
+
+    if (dacf->chunk && t->sample_count > t->chunk_first &&
+        timestamp - t->samples[t->chunk_first].timestamp >= dacf->chunk)
+    {
+        ngx_rtmp_dash_write_chunk(s, t, t->sample_count);
+    }
 
-        smpl = &t->samples[t->sample_count];
+    size = 0;
 
-        smpl->delay = delay;
-        smpl->size = (uint32_t) size;
-        smpl->duration = 0;
-        smpl->timestamp = timestamp;
-        smpl->key = (key ? 1 : 0);
+    for (cl = in; cl; cl = cl->next) {
+        start = (cl == in ? pos : cl->buf->pos);
+        size += (size_t) (cl->buf->last - start);
+    }
 
-        if (t->sample_count > 0) {
-            smpl = &t->samples[t->sample_count - 1];
-            smpl->duration = timestamp - smpl->timestamp;
-        }
+    if (ngx_rtmp_dash_reserve(s, t, size) != NGX_OK) {
+        return NGX_ERROR;
+    }
 
-        t->sample_count++;
-        t->mdat_size += (ngx_uint_t) size;
+    p = t->mdat + t->mdat_size;
+
+    for (cl = in; cl; cl = cl->next) {
+        start = (cl == in ? pos : cl->buf->pos);
+        p = ngx_cpymem(p, start, cl->buf->last - start);
     }
 
+    smpl = &t->samples[t->sample_count];
+
+    smpl->delay = delay;
+    smpl->size = (uint32_t) size;
+    smpl->duration = 0;
+    smpl->timestamp = timestamp;
+    smpl->key = (key ? 1 : 0);
+
+    t->sample_count++;
+    t->mdat_size += (ngx_uint_t) size;
+
     return NGX_OK;
 }
 
@@ -1143,9 +1828,8 @@ ngx_rtmp_dash_audio(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
 
     /* skip RTMP & AAC headers */
 
-    in->buf->pos += 2;
-
-    return ngx_rtmp_dash_append(s, in, &ctx->audio, 0, h->timestamp, 0);
+    return ngx_rtmp_dash_append(s, in, in->buf->pos + 2, &ctx->audio, 0,
+                                h->timestamp, 0);
 }
 
 
@@ -1153,7 +1837,7 @@ static ngx_int_t
 ngx_rtmp_dash_video(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
     ngx_chain_t *in)
 {
-    u_char                    *p;
+    u_char                    *p, *pos;
     uint8_t                    ftype, htype;
     uint32_t                   delay;
     ngx_rtmp_dash_ctx_t       *ctx;
@@ -1170,40 +1854,70 @@ ngx_rtmp_dash_video(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
         return NGX_OK;
     }
 
-    /* Only H264 is supported */
+    /* Only H264 and HEVC are supported */
 
-    if (codec_ctx->video_codec_id != NGX_RTMP_VIDEO_H264) {
+    if (!ngx_rtmp_is_avc_like(codec_ctx->video_codec_id)) {
         return NGX_OK;
     }
 
-    if (in->buf->last - in->buf->pos < 5) {
+    pos = in->buf->pos;
+
+    if (in->buf->last - pos < 5) {
         return NGX_ERROR;
     }
 
-    ftype = (in->buf->pos[0] & 0xf0) >> 4;
+    ftype = ngx_rtmp_get_video_frame_type(in);
 
-    /* skip AVC config */
+    delay = 0;
 
-    htype = in->buf->pos[1];
-    if (htype != 1) {
-        return NGX_OK;
+    if (pos[0] & NGX_RTMP_VIDEO_EX_HEADER) {
+
+        /* enhanced RTMP: composition time only in CodedFrames */
+
+        htype = pos[0] & 0x0f;
+
+        if (htype == NGX_RTMP_VIDEO_PACKET_CODED_FRAMES_X) {
+            pos += 5;
+            goto append;
+        }
+
+        if (htype != NGX_RTMP_VIDEO_PACKET_CODED_FRAMES) {
+            return NGX_OK;
+        }
+
+        if (in->buf->last - pos < 8) {
+            return NGX_ERROR;
+        }
+
+        pos += 4;
+
+    } else {
+
+        /* skip AVC config */
+
+        htype = pos[1];
+        if (htype != 1) {
+            return NGX_OK;
+        }
     }
 
     p = (u_char *) &delay;
 
-    p[0] = in->buf->pos[4];
-    p[1] = in->buf->pos[3];
-    p[2] = in->buf->pos[2];
+    p[0] = pos[4];
+    p[1] = pos[3];
+    p[2] = pos[2];
     p[3] = 0;
 
-    ctx->has_video = 1;
+    /* skip RTMP & H264/HEVC headers */
 
-    /* skip RTMP & H264 headers */
+    pos += 5;
 
-    in->buf->pos += 5;
+append:
+
+    ctx->has_video = 1;
 
-    return ngx_rtmp_dash_append(s, in, &ctx->video, ftype == 1, h->timestamp,
-                                delay);
+    return ngx_rtmp_dash_append(s, in, pos, &ctx->video, ftype == 1,
+                                h->timestamp, delay);
 }
 
 
@@ -1223,6 +1937,13 @@ ngx_rtmp_dash_stream_eof(ngx_rtmp_session_t *s, ngx_rtmp_stream_eof_t *v)
 }
 
 
+static ngx_int_t
+ngx_rtmp_dash_fragment_init(ngx_rtmp_session_t *s, ngx_rtmp_dash_fragment_t *v)
+{
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_rtmp_dash_cleanup_dir(ngx_str_t *ppath, ngx_msec_t playlen)
 {
@@ -1417,16 +2138,43 @@ ngx_rtmp_dash_cleanup(void *data)
 {
     ngx_rtmp_dash_cleanup_t *cleanup = data;
 
+    /*
+     * workers expire what they create, the scan is left with files of
+     * previous runs, of crashed workers and of workers which exited
+     * before their files expired
+     */
+
     ngx_rtmp_dash_cleanup_dir(&cleanup->path, cleanup->playlen);
 
 #if (nginx_version >= 1011005)
-    return cleanup->playlen * 2;
+    return NGX_RTMP_DASH_CLEANUP_SCAN * 1000;
 #else
-    return cleanup->playlen / 500;
+    return NGX_RTMP_DASH_CLEANUP_SCAN;
 #endif
 }
 
 
+static void *
+ngx_rtmp_dash_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_rtmp_dash_main_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_rtmp_dash_main_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    ngx_queue_init(&conf->expire);
+
+    conf->expire_evt.handler = ngx_rtmp_dash_expire_handler;
+    conf->expire_evt.data = conf;
+    conf->expire_evt.log = &cf->cycle->new_log;
+    conf->expire_evt.cancelable = 1;
+
+    return conf;
+}
+
+
 static void *
 ngx_rtmp_dash_create_app_conf(ngx_conf_t *cf)
 {
@@ -1440,8 +2188,10 @@ ngx_rtmp_dash_create_app_conf(ngx_conf_t *cf)
     conf->dash = NGX_CONF_UNSET;
     conf->fraglen = NGX_CONF_UNSET_MSEC;
     conf->playlen = NGX_CONF_UNSET_MSEC;
+    conf->chunk = NGX_CONF_UNSET_MSEC;
     conf->cleanup = NGX_CONF_UNSET;
     conf->nested = NGX_CONF_UNSET;
+    conf->store = NGX_CONF_UNSET;
 
     return conf;
 }
@@ -1453,17 +2203,37 @@ ngx_rtmp_dash_merge_app_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_rtmp_dash_app_conf_t    *prev = parent;
     ngx_rtmp_dash_app_conf_t    *conf = child;
     ngx_rtmp_dash_cleanup_t     *cleanup;
+    ngx_rtmp_dash_main_conf_t   *dmcf;
 
     ngx_conf_merge_value(conf->dash, prev->dash, 0);
     ngx_conf_merge_msec_value(conf->fraglen, prev->fraglen, 5000);
     ngx_conf_merge_msec_value(conf->playlen, prev->playlen, 30000);
+    ngx_conf_merge_msec_value(conf->chunk, prev->chunk, 0);
     ngx_conf_merge_value(conf->cleanup, prev->cleanup, 1);
     ngx_conf_merge_value(conf->nested, prev->nested, 0);
+    ngx_conf_merge_value(conf->store, prev->store, 0);
 
     if (conf->fraglen) {
         conf->winfrags = conf->playlen / conf->fraglen;
     }
 
+    if (conf->chunk >= conf->fraglen) {
+        conf->chunk = 0;
+    }
+
+    /* manifest goes to the hls_store_size zone, fragments stay on disk */
+
+    if (conf->dash && conf->store) {
+        dmcf = ngx_rtmp_conf_get_module_main_conf(cf, ngx_rtmp_dash_module);
+
+        if (dmcf->store_zone == NULL) {
+            dmcf->store_zone = ngx_rtmp_hls_store_get_zone(cf);
+            if (dmcf->store_zone == NULL) {
+                return NGX_CONF_ERROR;
+            }
+        }
+    }
+
     /* schedule cleanup */
 
     if (conf->dash && conf->path.len && conf->cleanup) {
@@ -1501,6 +2271,20 @@ ngx_rtmp_dash_merge_app_conf(ngx_conf_t *cf, void *parent, void *child)
 }
 
 
+static ngx_int_t
+ngx_rtmp_dash_preconfiguration(ngx_conf_t *cf)
+{
+    /*
+     * reset before any postconfiguration chains to it,
+     * hls comes before dash in the module list
+     */
+
+    ngx_rtmp_dash_fragment = ngx_rtmp_dash_fragment_init;
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_rtmp_dash_postconfiguration(ngx_conf_t *cf)
 {
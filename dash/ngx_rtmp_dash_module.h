@@ -0,0 +1,52 @@
+
+
+#ifndef _NGX_RTMP_DASH_H_INCLUDED_
+#define _NGX_RTMP_DASH_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_rtmp.h>
+
+
+typedef struct {
+    ngx_flag_t                          dash;
+    ngx_msec_t                          fraglen;
+    ngx_msec_t                          playlen;
+    ngx_msec_t                          chunk;
+    ngx_flag_t                          nested;
+    ngx_str_t                           path;
+    ngx_uint_t                          winfrags;
+    ngx_flag_t                          cleanup;
+    ngx_flag_t                          store;
+    ngx_path_t                         *slot;
+} ngx_rtmp_dash_app_conf_t;
+
+
+/*
+ * Fragment pair written to <stream><timestamp>.m4v and .m4a,
+ * initialization segments are <stream>init.m4v and <stream>init.m4a;
+ * with dash_chunk fragments grow as <stream><timestamp>.m4v.raw
+ * and are renamed when complete
+ */
+
+typedef struct {
+    ngx_str_t                           stream;
+    uint32_t                            timestamp;
+    uint32_t                            duration;
+    unsigned                            video:1;
+    unsigned                            audio:1;
+} ngx_rtmp_dash_fragment_t;
+
+
+typedef ngx_int_t (*ngx_rtmp_dash_fragment_pt)(ngx_rtmp_session_t *s,
+        ngx_rtmp_dash_fragment_t *v);
+
+
+extern ngx_rtmp_dash_fragment_pt        ngx_rtmp_dash_fragment;
+
+
+extern ngx_module_t                     ngx_rtmp_dash_module;
+
+
+#endif /* _NGX_RTMP_DASH_H_INCLUDED_ */
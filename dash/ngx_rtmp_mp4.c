@@ -507,7 +507,8 @@ ngx_rtmp_mp4_write_avcc(ngx_rtmp_session_t *s, ngx_buf_t *b)
         return NGX_ERROR;
     }
 
-    pos = ngx_rtmp_mp4_start_box(b, "avcC");
+    pos = ngx_rtmp_mp4_start_box(b, codec_ctx->video_codec_id ==
+                                    NGX_RTMP_VIDEO_HEVC ? "hvcC" : "avcC");
 
     /* assume config fits one chunk (highly probable) */
 
@@ -518,6 +519,8 @@ ngx_rtmp_mp4_write_avcc(ngx_rtmp_session_t *s, ngx_buf_t *b)
      * - 0
      * - 0
      * - 0
+     *
+     * or enhanced header & FourCC
      */
 
     p = in->buf->pos + 5;
@@ -543,7 +546,8 @@ ngx_rtmp_mp4_write_video(ngx_rtmp_session_t *s, ngx_buf_t *b)
 
     codec_ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_codec_module);
 
-    pos = ngx_rtmp_mp4_start_box(b, "avc1");
+    pos = ngx_rtmp_mp4_start_box(b, codec_ctx->video_codec_id ==
+                                    NGX_RTMP_VIDEO_HEVC ? "hvc1" : "avc1");
 
     /* reserved */
     ngx_rtmp_mp4_field_32(b, 0);
@@ -0,0 +1,486 @@
+
+/*
+ * Copyright (C) Roman Arutyunyan
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include "ngx_rtmp_hls_store.h"
+
+
+static char * ngx_rtmp_hls_http_store(ngx_conf_t *cf, ngx_command_t *cmd,
+       void *conf);
+static void * ngx_rtmp_hls_http_create_loc_conf(ngx_conf_t *cf);
+static char * ngx_rtmp_hls_http_merge_loc_conf(ngx_conf_t *cf,
+       void *parent, void *child);
+
+
+typedef struct {
+    ngx_str_t                           root;
+    ngx_shm_zone_t                     *zone;
+} ngx_rtmp_hls_http_loc_conf_t;
+
+
+typedef struct {
+    ngx_shm_zone_t                     *zone;
+    ngx_rtmp_hls_store_entry_t         *entry;
+} ngx_rtmp_hls_http_cleanup_t;
+
+
+/*
+ * store is polled while a blocking request waits, less often the longer
+ * it waits; the mutex is only taken if something was published since
+ */
+#define NGX_RTMP_HLS_HTTP_POLL          20
+#define NGX_RTMP_HLS_HTTP_POLL_MAX      160
+
+
+typedef struct {
+    ngx_str_t                           name;
+
+    /* blocking playlist reload: _HLS_msn and _HLS_part */
+    uint64_t                            msn;
+    ngx_uint_t                          part;
+    unsigned                            blocking:1;
+    unsigned                            has_part:1;
+
+    ngx_msec_t                          deadline;
+    ngx_msec_t                          poll;
+    ngx_atomic_uint_t                   generation;
+    ngx_event_t                         timer;
+} ngx_rtmp_hls_http_ctx_t;
+
+
+static ngx_command_t  ngx_rtmp_hls_http_commands[] = {
+
+    { ngx_string("rtmp_hls_store"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_rtmp_hls_http_store,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_rtmp_hls_http_module_ctx = {
+    NULL,                               /* preconfiguration */
+    NULL,                               /* postconfiguration */
+
+    NULL,                               /* create main configuration */
+    NULL,                               /* init main configuration */
+
+    NULL,                               /* create server configuration */
+    NULL,                               /* merge server configuration */
+
+    ngx_rtmp_hls_http_create_loc_conf,  /* create location configuration */
+    ngx_rtmp_hls_http_merge_loc_conf,   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_rtmp_hls_http_module = {
+    NGX_MODULE_V1,
+    &ngx_rtmp_hls_http_module_ctx,      /* module context */
+    ngx_rtmp_hls_http_commands,         /* module directives */
+    NGX_HTTP_MODULE,                    /* module type */
+    NULL,                               /* init master */
+    NULL,                               /* init module */
+    NULL,                               /* init process */
+    NULL,                               /* init thread */
+    NULL,                               /* exit thread */
+    NULL,                               /* exit process */
+    NULL,                               /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static void
+ngx_rtmp_hls_http_cleanup(void *data)
+{
+    ngx_rtmp_hls_http_cleanup_t  *hc = data;
+
+    ngx_rtmp_hls_store_release(hc->zone, hc->entry);
+}
+
+
+static void
+ngx_rtmp_hls_http_timer_cleanup(void *data)
+{
+    ngx_rtmp_hls_http_ctx_t  *ctx = data;
+
+    if (ctx->timer.timer_set) {
+        ngx_del_timer(&ctx->timer);
+    }
+}
+
+
+/*
+ * Pending entries are parts announced by EXT-X-PRELOAD-HINT and not yet
+ * written; playlists requested with _HLS_msn/_HLS_part are held back
+ * until they list the part asked for.
+ */
+
+static ngx_int_t
+ngx_rtmp_hls_http_ready(ngx_http_request_t *r, ngx_rtmp_hls_http_ctx_t *ctx,
+    ngx_rtmp_hls_store_entry_t *e)
+{
+    if (e->pending) {
+        return NGX_AGAIN;
+    }
+
+    if (!ctx->blocking) {
+        return NGX_OK;
+    }
+
+    if (ctx->msn > e->msn + 1) {
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                      "hls store: _HLS_msn=%uL is too far ahead of %uL",
+                      ctx->msn, e->msn);
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    if (e->msn > ctx->msn) {
+        return NGX_OK;
+    }
+
+    if (ctx->has_part && e->msn == ctx->msn && e->part > ctx->part) {
+        return NGX_OK;
+    }
+
+    return NGX_AGAIN;
+}
+
+
+static ngx_int_t
+ngx_rtmp_hls_http_send(ngx_http_request_t *r)
+{
+    ngx_int_t                       rc;
+    ngx_buf_t                      *b;
+    ngx_chain_t                    *out, **ll;
+    ngx_pool_cleanup_t             *cln;
+    ngx_rtmp_hls_store_block_t     *sb;
+    ngx_rtmp_hls_store_entry_t     *e;
+    ngx_rtmp_hls_http_ctx_t        *ctx;
+    ngx_rtmp_hls_http_cleanup_t    *hc;
+    ngx_rtmp_hls_http_loc_conf_t   *hlcf;
+
+    hlcf = ngx_http_get_module_loc_conf(r, ngx_rtmp_hls_http_module);
+    ctx = ngx_http_get_module_ctx(r, ngx_rtmp_hls_http_module);
+
+    e = ngx_rtmp_hls_store_acquire(hlcf->zone, &ctx->name);
+    if (e == NULL) {
+        return NGX_HTTP_NOT_FOUND;
+    }
+
+    rc = ngx_rtmp_hls_http_ready(r, ctx, e);
+
+    if (rc == NGX_AGAIN && ctx->deadline == 0) {
+        ctx->deadline = ngx_current_msec + e->hold;
+    }
+
+    if (rc != NGX_OK) {
+        ngx_rtmp_hls_store_release(hlcf->zone, e);
+        return rc;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_rtmp_hls_http_cleanup_t));
+    if (cln == NULL) {
+        ngx_rtmp_hls_store_release(hlcf->zone, e);
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    /* entry stays in place until the response is sent */
+
+    hc = cln->data;
+    hc->zone = hlcf->zone;
+    hc->entry = e;
+
+    cln->handler = ngx_rtmp_hls_http_cleanup;
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = e->size;
+    r->headers_out.last_modified_time = e->mtime;
+
+    if (ngx_http_set_content_type(r) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (e->size == 0) {
+        r->header_only = 1;
+    }
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    out = NULL;
+    ll = &out;
+    b = NULL;
+
+    for (sb = e->head; sb; sb = sb->next) {
+        b = ngx_calloc_buf(r->pool);
+        if (b == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        b->pos = sb->pos;
+        b->last = sb->last;
+        b->memory = 1;
+
+        *ll = ngx_alloc_chain_link(r->pool);
+        if (*ll == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        (*ll)->buf = b;
+        (*ll)->next = NULL;
+
+        ll = &(*ll)->next;
+    }
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    return ngx_http_output_filter(r, out);
+}
+
+
+static void
+ngx_rtmp_hls_http_wait_handler(ngx_event_t *ev)
+{
+    ngx_int_t                       rc;
+    ngx_atomic_uint_t               generation;
+    ngx_connection_t               *c;
+    ngx_http_request_t             *r;
+    ngx_rtmp_hls_http_ctx_t        *ctx;
+    ngx_rtmp_hls_http_loc_conf_t   *hlcf;
+
+    r = ev->data;
+    c = r->connection;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_rtmp_hls_http_module);
+    hlcf = ngx_http_get_module_loc_conf(r, ngx_rtmp_hls_http_module);
+
+    generation = ngx_rtmp_hls_store_generation(hlcf->zone);
+
+    if (generation != ctx->generation) {
+        ctx->generation = generation;
+        rc = ngx_rtmp_hls_http_send(r);
+
+    } else {
+        rc = NGX_AGAIN;
+    }
+
+    if (rc == NGX_AGAIN) {
+        if ((ngx_msec_int_t) (ngx_current_msec - ctx->deadline) < 0) {
+            ctx->poll = ngx_min(ctx->poll * 2, NGX_RTMP_HLS_HTTP_POLL_MAX);
+            ngx_add_timer(ev, ctx->poll);
+            return;
+        }
+
+        ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                      "hls store: '%V' timed out", &ctx->name);
+
+        rc = NGX_HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    ngx_http_finalize_request(r, rc);
+    ngx_http_run_posted_requests(c);
+}
+
+
+static ngx_int_t
+ngx_rtmp_hls_http_handler(ngx_http_request_t *r)
+{
+    u_char                         *p;
+    size_t                          skip;
+    off_t                           msn;
+    ngx_int_t                       rc, part;
+    ngx_str_t                       name, value;
+    ngx_pool_cleanup_t             *cln;
+    ngx_http_core_loc_conf_t       *clcf;
+    ngx_rtmp_hls_http_ctx_t        *ctx;
+    ngx_rtmp_hls_http_loc_conf_t   *hlcf;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    if (r->uri.data[r->uri.len - 1] == '/') {
+        return NGX_DECLINED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    hlcf = ngx_http_get_module_loc_conf(r, ngx_rtmp_hls_http_module);
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    ctx = ngx_pcalloc(r->pool, sizeof(ngx_rtmp_hls_http_ctx_t));
+    if (ctx == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ngx_http_set_ctx(r, ctx, ngx_rtmp_hls_http_module);
+
+    /* location prefix is replaced with hls_path, like alias does */
+
+    skip = 0;
+
+    if (r->uri.len >= clcf->name.len &&
+        ngx_strncmp(r->uri.data, clcf->name.data, clcf->name.len) == 0)
+    {
+        skip = clcf->name.len;
+    }
+
+    while (skip < r->uri.len && r->uri.data[skip] == '/') {
+        skip++;
+    }
+
+    name.len = hlcf->root.len + 1 + r->uri.len - skip;
+    name.data = ngx_pnalloc(r->pool, name.len);
+    if (name.data == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    p = ngx_cpymem(name.data, hlcf->root.data, hlcf->root.len);
+    *p++ = '/';
+    ngx_memcpy(p, r->uri.data + skip, r->uri.len - skip);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "hls store: lookup '%V'", &name);
+
+    ctx->name = name;
+
+    if (ngx_http_arg(r, (u_char *) "_HLS_msn", sizeof("_HLS_msn") - 1,
+                     &value)
+        == NGX_OK)
+    {
+        msn = ngx_atoof(value.data, value.len);
+        if (msn == NGX_ERROR) {
+            return NGX_HTTP_BAD_REQUEST;
+        }
+
+        ctx->msn = msn;
+        ctx->blocking = 1;
+
+        if (ngx_http_arg(r, (u_char *) "_HLS_part", sizeof("_HLS_part") - 1,
+                         &value)
+            == NGX_OK)
+        {
+            part = ngx_atoi(value.data, value.len);
+            if (part == NGX_ERROR) {
+                return NGX_HTTP_BAD_REQUEST;
+            }
+
+            ctx->part = part;
+            ctx->has_part = 1;
+        }
+    }
+
+    /* read before the store is looked at, so no update is missed */
+
+    ctx->generation = ngx_rtmp_hls_store_generation(hlcf->zone);
+
+    rc = ngx_rtmp_hls_http_send(r);
+
+    if (rc != NGX_AGAIN) {
+        return rc;
+    }
+
+    /* wait for the playlist or part to catch up */
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "hls store: wait for '%V'", &name);
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    cln->handler = ngx_rtmp_hls_http_timer_cleanup;
+    cln->data = ctx;
+
+    ctx->timer.handler = ngx_rtmp_hls_http_wait_handler;
+    ctx->timer.data = r;
+    ctx->timer.log = r->connection->log;
+
+    ctx->poll = NGX_RTMP_HLS_HTTP_POLL;
+
+    ngx_add_timer(&ctx->timer, ctx->poll);
+
+    r->read_event_handler = ngx_http_test_reading;
+    r->main->count++;
+
+    return NGX_DONE;
+}
+
+
+static char *
+ngx_rtmp_hls_http_store(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_rtmp_hls_http_loc_conf_t  *hlcf = conf;
+
+    ngx_str_t                     *value;
+    ngx_http_core_loc_conf_t      *clcf;
+
+    if (hlcf->zone) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    hlcf->root = value[1];
+
+    if (hlcf->root.len && hlcf->root.data[hlcf->root.len - 1] == '/') {
+        hlcf->root.len--;
+    }
+
+    /* the zone is sized by hls_store_size in rtmp{} */
+
+    hlcf->zone = ngx_rtmp_hls_store_add_zone(cf, 0);
+    if (hlcf->zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_rtmp_hls_http_handler;
+
+    return NGX_CONF_OK;
+}
+
+
+static void *
+ngx_rtmp_hls_http_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_rtmp_hls_http_loc_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_rtmp_hls_http_loc_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    return conf;
+}
+
+
+static char *
+ngx_rtmp_hls_http_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_rtmp_hls_http_loc_conf_t  *prev = parent;
+    ngx_rtmp_hls_http_loc_conf_t  *conf = child;
+
+    if (conf->zone == NULL) {
+        conf->zone = prev->zone;
+        conf->root = prev->root;
+    }
+
+    return NGX_CONF_OK;
+}
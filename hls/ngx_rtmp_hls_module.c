@@ -10,44 +10,109 @@
 #include <ngx_rtmp_cmd_module.h>
 #include <ngx_rtmp_codec_module.h>
 #include "ngx_rtmp_mpegts.h"
+#include "dash/ngx_rtmp_dash_module.h"
 
 
 static ngx_rtmp_publish_pt              next_publish;
 static ngx_rtmp_close_stream_pt         next_close_stream;
 static ngx_rtmp_stream_begin_pt         next_stream_begin;
 static ngx_rtmp_stream_eof_pt           next_stream_eof;
+static ngx_rtmp_dash_fragment_pt        next_dash_fragment;
 
 
 static char * ngx_rtmp_hls_variant(ngx_conf_t *cf, ngx_command_t *cmd,
        void *conf);
 static ngx_int_t ngx_rtmp_hls_postconfiguration(ngx_conf_t *cf);
+static void * ngx_rtmp_hls_create_main_conf(ngx_conf_t *cf);
+static char * ngx_rtmp_hls_init_main_conf(ngx_conf_t *cf, void *conf);
 static void * ngx_rtmp_hls_create_app_conf(ngx_conf_t *cf);
 static char * ngx_rtmp_hls_merge_app_conf(ngx_conf_t *cf,
        void *parent, void *child);
 static ngx_int_t ngx_rtmp_hls_flush_audio(ngx_rtmp_session_t *s);
+static ngx_int_t ngx_rtmp_hls_write_playlist(ngx_rtmp_session_t *s);
 static ngx_int_t ngx_rtmp_hls_ensure_directory(ngx_rtmp_session_t *s,
        ngx_str_t *path);
 
 
 #define NGX_RTMP_HLS_BUFSIZE            (1024*1024)
 #define NGX_RTMP_HLS_DIR_ACCESS         0744
+#define NGX_RTMP_HLS_STORE_SIZE         (64*1024*1024)
+
+/* entries of event playlists are never expired */
+#define NGX_RTMP_HLS_STORE_FOREVER      (86400*365)
+
+/* complete fragments still listed with their parts */
+#define NGX_RTMP_HLS_PART_FRAGS         2
+
+
+/* NAL unit classes, values of H264 types */
+#define NGX_RTMP_HLS_NAL_SLICE          1
+#define NGX_RTMP_HLS_NAL_IDR            5
+#define NGX_RTMP_HLS_NAL_SEI            6
+#define NGX_RTMP_HLS_NAL_PARAMS         7
+#define NGX_RTMP_HLS_NAL_AUD            9
+
+
+/* playlist buffer: header is put in front of the listed fragments */
+#define NGX_RTMP_HLS_PLAYLIST_HEAD      2048
+#define NGX_RTMP_HLS_PLAYLIST_SIZE      16384
+
+/* headroom for the header, its EXT-X-KEY line has a key URL of any size */
+#define ngx_rtmp_hls_playlist_head(hacf)                                      \
+    (NGX_RTMP_HLS_PLAYLIST_HEAD + (hacf)->key_url.len)
+
+
+/* files are deleted as they expire, a slow scan catches orphans */
+#define NGX_RTMP_HLS_CLEANUP_SCAN       600
 
 
 typedef struct {
     uint64_t                            id;
     uint64_t                            key_id;
     double                              duration;
+    ngx_uint_t                          nparts;
+    size_t                              entry_len;
     unsigned                            active:1;
     unsigned                            discont:1; /* before */
+    unsigned                            key_tag:1; /* entry has EXT-X-KEY */
 } ngx_rtmp_hls_frag_t;
 
 
+typedef struct {
+    double                              duration;
+    unsigned                            independent:1;
+} ngx_rtmp_hls_part_t;
+
+
 typedef struct {
     ngx_str_t                           suffix;
     ngx_array_t                         args;
 } ngx_rtmp_hls_variant_t;
 
 
+/*
+ * Renditions of one stream listed with hls_variant and published to
+ * this worker. The first hls_variant is the top rendition: the others
+ * replicate its fragment boundaries at their next key frame.
+ */
+
+typedef struct ngx_rtmp_hls_group_s ngx_rtmp_hls_group_t;
+
+struct ngx_rtmp_hls_group_s {
+    ngx_rtmp_hls_group_t               *next;
+    void                               *conf;
+    u_char                              name[NGX_RTMP_MAX_NAME];
+    size_t                              len;
+    ngx_uint_t                          nmembers;
+    ngx_rtmp_session_t                 *top;
+
+    /* fragment the top rendition is writing */
+    uint64_t                            frag;
+
+    time_t                              updated;
+};
+
+
 typedef struct {
     unsigned                            opened:1;
 
@@ -78,7 +143,38 @@ typedef struct {
     ngx_buf_t                          *aframe;
     uint64_t                            aframe_pts;
 
+    /* free links referencing pieces of video frames */
+    ngx_chain_t                        *free;
+
+    /*
+     * playlist entries of closed fragments pl_first..pl_last-1,
+     * appended once and trimmed as fragments leave the window
+     */
+    ngx_buf_t                           pl;
+    uint64_t                            pl_first;
+    uint64_t                            pl_last;
+    uint64_t                            pl_key_id;
+
     ngx_rtmp_hls_variant_t             *var;
+    ngx_rtmp_hls_group_t               *group;
+    uint64_t                            group_frag;
+
+    /* low latency parts */
+    unsigned                            part_opened:1;
+    ngx_rtmp_mpegts_file_t              part_file;
+    ngx_str_t                           partfile;
+    uint64_t                            part_ts;
+    uint64_t                            last_ts;
+    ngx_rtmp_hls_part_t                *parts; /* maxparts per frag */
+
+    /* store entries linked before this publish are left from earlier ones */
+    ngx_atomic_uint_t                   generation;
+
+    /* fmp4: per track playlists of dash fragments */
+    ngx_str_t                           track_playlist;
+    ngx_str_t                           track_playlist_bak;
+    unsigned                            has_video:1;
+    unsigned                            has_audio:1;
 } ngx_rtmp_hls_ctx_t;
 
 
@@ -89,6 +185,40 @@ typedef struct {
 } ngx_rtmp_hls_cleanup_t;
 
 
+/*
+ * file to delete once expired unless it or its guard was rewritten,
+ * or nested stream directory to remove if it is empty by then
+ */
+typedef struct {
+    ngx_queue_t                         queue;
+    time_t                              expire;
+    time_t                              mtime;
+    u_char                             *guard;
+    unsigned                            dir:1;
+    u_char                              path[1];
+} ngx_rtmp_hls_expire_t;
+
+
+typedef struct {
+    size_t                              store_size;
+    ngx_shm_zone_t                     *store_zone;
+    ngx_rtmp_hls_group_t               *groups;
+    ngx_rtmp_hls_group_t               *free_groups;
+    ngx_pool_t                         *pool;
+    ngx_queue_t                         expire;
+    ngx_event_t                         expire_evt;
+} ngx_rtmp_hls_main_conf_t;
+
+
+/* playlist or key file being written, to disk or to the store */
+typedef struct {
+    ngx_fd_t                            fd;
+    ngx_str_t                          *name;
+    ngx_str_t                          *bak;
+    ngx_rtmp_hls_store_entry_t         *entry;
+} ngx_rtmp_hls_output_t;
+
+
 typedef struct {
     ngx_flag_t                          hls;
     ngx_msec_t                          fraglen;
@@ -114,6 +244,10 @@ typedef struct {
     ngx_str_t                           key_path;
     ngx_str_t                           key_url;
     ngx_uint_t                          frags_per_key;
+    ngx_flag_t                          store;
+    ngx_msec_t                          partlen;
+    ngx_uint_t                          maxparts;
+    ngx_uint_t                          format;
 } ngx_rtmp_hls_app_conf_t;
 
 
@@ -130,6 +264,10 @@ typedef struct {
 #define NGX_RTMP_HLS_TYPE_EVENT         2
 
 
+#define NGX_RTMP_HLS_FORMAT_MPEGTS      1
+#define NGX_RTMP_HLS_FORMAT_FMP4        2
+
+
 static ngx_conf_enum_t                  ngx_rtmp_hls_naming_slots[] = {
     { ngx_string("sequential"),         NGX_RTMP_HLS_NAMING_SEQUENTIAL },
     { ngx_string("timestamp"),          NGX_RTMP_HLS_NAMING_TIMESTAMP  },
@@ -152,6 +290,13 @@ static ngx_conf_enum_t                  ngx_rtmp_hls_type_slots[] = {
 };
 
 
+static ngx_conf_enum_t                  ngx_rtmp_hls_format_slots[] = {
+    { ngx_string("mpegts"),             NGX_RTMP_HLS_FORMAT_MPEGTS },
+    { ngx_string("fmp4"),               NGX_RTMP_HLS_FORMAT_FMP4   },
+    { ngx_null_string,                  0 }
+};
+
+
 static ngx_command_t ngx_rtmp_hls_commands[] = {
 
     { ngx_string("hls"),
@@ -308,6 +453,34 @@ static ngx_command_t ngx_rtmp_hls_commands[] = {
       offsetof(ngx_rtmp_hls_app_conf_t, frags_per_key),
       NULL },
 
+    { ngx_string("hls_partial_fragment"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_hls_app_conf_t, partlen),
+      NULL },
+
+    { ngx_string("hls_fragment_format"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_hls_app_conf_t, format),
+      &ngx_rtmp_hls_format_slots },
+
+    { ngx_string("hls_store"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_flag_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_hls_app_conf_t, store),
+      NULL },
+
+    { ngx_string("hls_store_size"),
+      NGX_RTMP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_RTMP_MAIN_CONF_OFFSET,
+      offsetof(ngx_rtmp_hls_main_conf_t, store_size),
+      NULL },
+
     ngx_null_command
 };
 
@@ -316,8 +489,8 @@ static ngx_rtmp_module_t  ngx_rtmp_hls_module_ctx = {
     NULL,                               /* preconfiguration */
     ngx_rtmp_hls_postconfiguration,     /* postconfiguration */
 
-    NULL,                               /* create main configuration */
-    NULL,                               /* init main configuration */
+    ngx_rtmp_hls_create_main_conf,      /* create main configuration */
+    ngx_rtmp_hls_init_main_conf,        /* init main configuration */
 
     NULL,                               /* create server configuration */
     NULL,                               /* merge server configuration */
@@ -356,10 +529,30 @@ ngx_rtmp_hls_get_frag(ngx_rtmp_session_t *s, ngx_int_t n)
 }
 
 
+static ngx_rtmp_hls_part_t *
+ngx_rtmp_hls_get_parts(ngx_rtmp_session_t *s, ngx_int_t n)
+{
+    ngx_rtmp_hls_ctx_t         *ctx;
+    ngx_rtmp_hls_app_conf_t    *hacf;
+
+    hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
+
+    return &ctx->parts[(ctx->frag + n) % (hacf->winfrags * 2 + 1)
+                       * hacf->maxparts];
+}
+
+
+static void ngx_rtmp_hls_expire_frag(ngx_rtmp_session_t *s,
+    ngx_rtmp_hls_frag_t *f, ngx_uint_t key, ngx_str_t *guard,
+    ngx_msec_t delay);
+
+
 static void
 ngx_rtmp_hls_next_frag(ngx_rtmp_session_t *s)
 {
     ngx_rtmp_hls_ctx_t         *ctx;
+    ngx_rtmp_hls_frag_t        *f;
     ngx_rtmp_hls_app_conf_t    *hacf;
 
     hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
@@ -367,6 +560,15 @@ ngx_rtmp_hls_next_frag(ngx_rtmp_session_t *s)
 
     if (ctx->nfrags == hacf->winfrags) {
         ctx->frag++;
+
+        /* left the playlist, keep it for players which have just read it */
+
+        f = ngx_rtmp_hls_get_frag(s, -1);
+
+        ngx_rtmp_hls_expire_frag(s, f,
+                                 f->key_id != ngx_rtmp_hls_get_frag(s, 0)->key_id,
+                                 NULL, hacf->playlen);
+
     } else {
         ctx->nfrags++;
     }
@@ -386,253 +588,1115 @@ ngx_rtmp_hls_rename_file(u_char *src, u_char *dst)
 }
 
 
-static ngx_int_t
-ngx_rtmp_hls_write_variant_playlist(ngx_rtmp_session_t *s)
+static time_t
+ngx_rtmp_hls_store_ttl(ngx_rtmp_session_t *s, ngx_msec_t unit)
 {
-    static u_char             buffer[1024];
-
-    u_char                   *p, *last;
-    ssize_t                   rc;
-    ngx_fd_t                  fd;
-    ngx_str_t                *arg;
-    ngx_uint_t                n, k;
-    ngx_rtmp_hls_ctx_t       *ctx;
-    ngx_rtmp_hls_variant_t   *var;
-    ngx_rtmp_hls_app_conf_t  *hacf;
+    ngx_rtmp_hls_app_conf_t    *hacf;
 
     hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
-    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
-
-    fd = ngx_open_file(ctx->var_playlist_bak.data, NGX_FILE_WRONLY,
-                       NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
 
-    if (fd == NGX_INVALID_FILE) {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                      "hls: " ngx_open_file_n " failed: '%V'",
-                      &ctx->var_playlist_bak);
+    /* same age ngx_rtmp_hls_cleanup_dir() deletes files at */
 
-        return NGX_ERROR;
+    if (!hacf->cleanup || hacf->type == NGX_RTMP_HLS_TYPE_EVENT) {
+        return NGX_RTMP_HLS_STORE_FOREVER;
     }
 
-#define NGX_RTMP_HLS_VAR_HEADER "#EXTM3U\n#EXT-X-VERSION:3\n"
+    return (time_t) (hacf->playlen / unit);
+}
 
-    rc = ngx_write_fd(fd, NGX_RTMP_HLS_VAR_HEADER,
-                      sizeof(NGX_RTMP_HLS_VAR_HEADER) - 1);
-    if (rc < 0) {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                      "hls: " ngx_write_fd_n " failed: '%V'",
-                      &ctx->var_playlist_bak);
-        ngx_close_file(fd);
-        return NGX_ERROR;
+
+static ngx_int_t
+ngx_rtmp_hls_expire_modified(u_char *name, time_t mtime)
+{
+    ngx_file_info_t             fi;
+
+    if (ngx_file_info(name, &fi) == NGX_FILE_ERROR) {
+        return 0;
     }
 
-    var = hacf->variant->elts;
-    for (n = 0; n < hacf->variant->nelts; n++, var++)
-    {
-        p = buffer;
-        last = buffer + sizeof(buffer);
+    return ngx_file_mtime(&fi) > mtime;
+}
 
-        p = ngx_slprintf(p, last, "#EXT-X-STREAM-INF:PROGRAM-ID=1");
 
-        arg = var->args.elts;
-        for (k = 0; k < var->args.nelts; k++, arg++) {
-            p = ngx_slprintf(p, last, ",%V", arg);
+static void
+ngx_rtmp_hls_expire_handler(ngx_event_t *ev)
+{
+    ngx_queue_t                *q;
+    ngx_rtmp_hls_expire_t      *e;
+    ngx_rtmp_hls_main_conf_t   *hmcf;
+
+    hmcf = ev->data;
+
+    while (!ngx_queue_empty(&hmcf->expire)) {
+
+        q = ngx_queue_head(&hmcf->expire);
+        e = ngx_queue_data(q, ngx_rtmp_hls_expire_t, queue);
+
+        if (e->expire > ngx_time()) {
+            ngx_add_timer(ev, (ngx_msec_t) (e->expire - ngx_time()) * 1000);
+            return;
         }
 
-        if (p < last) {
-            *p++ = '\n';
+        ngx_queue_remove(q);
+
+        /* stream which is back has put files into it */
+
+        if (e->dir) {
+            ngx_log_debug1(NGX_LOG_DEBUG_RTMP, ev->log, 0,
+                           "hls: expire dir '%s'", e->path);
+
+            if (ngx_delete_dir(e->path) == NGX_FILE_ERROR
+                && ngx_errno != NGX_ENOENT && ngx_errno != NGX_ENOTEMPTY
+                && ngx_errno != NGX_EEXIST)
+            {
+                ngx_log_error(NGX_LOG_ERR, ev->log, ngx_errno,
+                              "hls: expire " ngx_delete_dir_n
+                              " failed on '%s'", e->path);
+            }
+
+            ngx_free(e);
+            continue;
         }
 
-        p = ngx_slprintf(p, last, "%V%*s%V",
-                         &hacf->base_url,
-                         ctx->name.len - ctx->var->suffix.len, ctx->name.data,
-                         &var->suffix);
-        if (hacf->nested) {
-            p = ngx_slprintf(p, last, "%s", "/index");
+        /* stream is back or file was reused */
+
+        if ((e->guard && ngx_rtmp_hls_expire_modified(e->guard, e->mtime))
+            || ngx_rtmp_hls_expire_modified(e->path, e->mtime))
+        {
+            ngx_log_debug1(NGX_LOG_DEBUG_RTMP, ev->log, 0,
+                           "hls: expire skip '%s'", e->path);
+
+            ngx_free(e);
+            continue;
         }
 
-        p = ngx_slprintf(p, last, "%s", ".m3u8\n");
+        ngx_log_debug1(NGX_LOG_DEBUG_RTMP, ev->log, 0,
+                       "hls: expire '%s'", e->path);
 
-        rc = ngx_write_fd(fd, buffer, p - buffer);
-        if (rc < 0) {
-            ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                          "hls: " ngx_write_fd_n " failed '%V'",
-                          &ctx->var_playlist_bak);
-            ngx_close_file(fd);
-            return NGX_ERROR;
+        if (ngx_delete_file(e->path) == NGX_FILE_ERROR
+            && ngx_errno != NGX_ENOENT)
+        {
+            ngx_log_error(NGX_LOG_ERR, ev->log, ngx_errno,
+                          "hls: expire " ngx_delete_file_n " failed on '%s'",
+                          e->path);
         }
+
+        ngx_free(e);
     }
+}
 
-    ngx_close_file(fd);
 
-    if (ngx_rtmp_hls_rename_file(ctx->var_playlist_bak.data,
-                                 ctx->var_playlist.data)
-        == NGX_FILE_ERROR)
+/*
+ * Files the stream has created are queued for deletion when they
+ * leave the playlist instead of being found by directory scans.
+ * The timer is cancelable, an exiting worker leaves the rest of its
+ * queue to the cleanup scan.
+ */
+
+static ngx_rtmp_hls_expire_t *
+ngx_rtmp_hls_expire(ngx_rtmp_session_t *s, u_char *path, size_t len,
+    ngx_str_t *guard, ngx_msec_t delay)
+{
+    size_t                      size;
+    ngx_queue_t                *q;
+    ngx_rtmp_hls_expire_t      *e, *prev;
+    ngx_rtmp_hls_app_conf_t    *hacf;
+    ngx_rtmp_hls_main_conf_t   *hmcf;
+
+    hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
+
+    if (!hacf->cleanup || hacf->store ||
+        hacf->type == NGX_RTMP_HLS_TYPE_EVENT)
     {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                      "hls: rename failed: '%V'->'%V'",
-                      &ctx->var_playlist_bak, &ctx->var_playlist);
-        return NGX_ERROR;
+        return NULL;
     }
 
-    return NGX_OK;
-}
+    hmcf = ngx_rtmp_get_module_main_conf(s, ngx_rtmp_hls_module);
 
+    size = sizeof(ngx_rtmp_hls_expire_t) + len;
 
-static ngx_int_t
-ngx_rtmp_hls_write_playlist(ngx_rtmp_session_t *s)
-{
-    static u_char                   buffer[1024];
-    ngx_fd_t                        fd;
-    u_char                         *p, *end;
-    ngx_rtmp_hls_ctx_t             *ctx;
-    ssize_t                         n;
-    ngx_rtmp_hls_app_conf_t        *hacf;
-    ngx_rtmp_hls_frag_t            *f;
-    ngx_uint_t                      i, max_frag;
-    ngx_str_t                       name_part, key_name_part;
-    uint64_t                        prev_key_id;
-    const char                     *sep, *key_sep;
+    if (guard) {
+        size += guard->len + 1;
+    }
 
+    e = ngx_alloc(size, s->connection->log);
+    if (e == NULL) {
+        return NULL;
+    }
 
-    hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
-    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
+    e->mtime = ngx_time();
+    e->expire = e->mtime + (time_t) (delay / 1000);
 
-    fd = ngx_open_file(ctx->playlist_bak.data, NGX_FILE_WRONLY,
-                       NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
+    *ngx_cpymem(e->path, path, len) = 0;
 
-    if (fd == NGX_INVALID_FILE) {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                      "hls: " ngx_open_file_n " failed: '%V'",
-                      &ctx->playlist_bak);
-        return NGX_ERROR;
+    e->guard = NULL;
+    e->dir = 0;
+
+    if (guard) {
+        e->guard = e->path + len + 1;
+        *ngx_cpymem(e->guard, guard->data, guard->len) = 0;
     }
 
-    max_frag = hacf->fraglen / 1000;
+    ngx_log_debug2(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                   "hls: expire '%s' in %M", e->path, delay);
 
-    for (i = 0; i < ctx->nfrags; i++) {
-        f = ngx_rtmp_hls_get_frag(s, i);
-        if (f->duration > max_frag) {
-            max_frag = (ngx_uint_t) (f->duration + .5);
+    /* delays are few per app, the entry mostly goes last */
+
+    for (q = ngx_queue_last(&hmcf->expire);
+         q != ngx_queue_sentinel(&hmcf->expire);
+         q = ngx_queue_prev(q))
+    {
+        prev = ngx_queue_data(q, ngx_rtmp_hls_expire_t, queue);
+
+        if (prev->expire <= e->expire) {
+            break;
         }
     }
 
-    p = buffer;
-    end = p + sizeof(buffer);
-
-    p = ngx_slprintf(p, end,
-                     "#EXTM3U\n"
-                     "#EXT-X-VERSION:3\n"
-                     "#EXT-X-MEDIA-SEQUENCE:%uL\n"
-                     "#EXT-X-TARGETDURATION:%ui\n",
-                     ctx->frag, max_frag);
+    ngx_queue_insert_after(q, &e->queue);
 
-    if (hacf->type == NGX_RTMP_HLS_TYPE_EVENT) {
-        p = ngx_slprintf(p, end, "#EXT-X-PLAYLIST-TYPE: EVENT\n");
+    if (ngx_queue_head(&hmcf->expire) == &e->queue) {
+        ngx_add_timer(&hmcf->expire_evt, delay);
     }
 
-    n = ngx_write_fd(fd, buffer, p - buffer);
-    if (n < 0) {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                      "hls: " ngx_write_fd_n " failed: '%V'",
-                      &ctx->playlist_bak);
-        ngx_close_file(fd);
-        return NGX_ERROR;
-    }
+    return e;
+}
 
-    sep = hacf->nested ? (hacf->base_url.len ? "/" : "") : "-";
-    key_sep = hacf->nested ? (hacf->key_url.len ? "/" : "") : "-";
 
-    name_part.len = 0;
-    if (!hacf->nested || hacf->base_url.len) {
-        name_part = ctx->name;
-    }
+static void
+ngx_rtmp_hls_expire_frag(ngx_rtmp_session_t *s, ngx_rtmp_hls_frag_t *f,
+    ngx_uint_t key, ngx_str_t *guard, ngx_msec_t delay)
+{
+    u_char                     *p;
+    ngx_uint_t                  k;
+    ngx_rtmp_hls_ctx_t         *ctx;
+    ngx_rtmp_hls_app_conf_t    *hacf;
+    u_char                      path[NGX_MAX_PATH + 1];
 
-    key_name_part.len = 0;
-    if (!hacf->nested || hacf->key_url.len) {
-        key_name_part = ctx->name;
+    hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
+
+    /* fmp4 fragments belong to dash */
+
+    if (hacf->format != NGX_RTMP_HLS_FORMAT_FMP4) {
+        p = ngx_snprintf(path, sizeof(path) - 1, "%*s%uL.ts",
+                         ctx->stream.len, ctx->stream.data, f->id);
+        ngx_rtmp_hls_expire(s, path, p - path, guard, delay);
+
+        for (k = 0; k < f->nparts; k++) {
+            p = ngx_snprintf(path, sizeof(path) - 1, "%*s%uL.%ui.ts",
+                             ctx->stream.len, ctx->stream.data, f->id, k);
+            ngx_rtmp_hls_expire(s, path, p - path, guard, delay);
+        }
     }
 
-    prev_key_id = 0;
+    if (key && hacf->keys) {
+        p = ngx_snprintf(path, sizeof(path) - 1, "%*s%uL.key",
+                         ctx->keyfile.len, ctx->keyfile.data, f->key_id);
+        ngx_rtmp_hls_expire(s, path, p - path, guard, delay);
+    }
+}
 
-    for (i = 0; i < ctx->nfrags; i++) {
-        f = ngx_rtmp_hls_get_frag(s, i);
 
-        p = buffer;
-        end = p + sizeof(buffer);
+static ngx_int_t
+ngx_rtmp_hls_output_open(ngx_rtmp_session_t *s, ngx_rtmp_hls_output_t *out,
+    ngx_str_t *name, ngx_str_t *bak)
+{
+    ngx_rtmp_hls_app_conf_t    *hacf;
+    ngx_rtmp_hls_main_conf_t   *hmcf;
 
-        if (f->discont) {
-            p = ngx_slprintf(p, end, "#EXT-X-DISCONTINUITY\n");
-        }
+    hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
 
-        if (hacf->keys && (i == 0 || f->key_id != prev_key_id)) {
-            p = ngx_slprintf(p, end, "#EXT-X-KEY:METHOD=AES-128,"
-                             "URI=\"%V%V%s%uL.key\",IV=0x%032XL\n",
-                             &hacf->key_url, &key_name_part,
-                             key_sep, f->key_id, f->key_id);
-        }
+    out->name = name;
+    out->bak = bak;
+    out->entry = NULL;
+    out->fd = NGX_INVALID_FILE;
 
-        prev_key_id = f->key_id;
+    if (hacf->store) {
+        hmcf = ngx_rtmp_get_module_main_conf(s, ngx_rtmp_hls_module);
 
-        p = ngx_slprintf(p, end,
-                         "#EXTINF:%.3f,\n"
-                         "%V%V%s%uL.ts\n",
-                         f->duration, &hacf->base_url, &name_part, sep, f->id);
+        out->entry = ngx_rtmp_hls_store_open(hmcf->store_zone, name,
+                                             s->connection->log);
 
-        ngx_log_debug5(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
-                       "hls: fragment frag=%uL, n=%ui/%ui, duration=%.3f, "
-                       "discont=%i",
-                       ctx->frag, i + 1, ctx->nfrags, f->duration, f->discont);
+        return out->entry ? NGX_OK : NGX_ERROR;
+    }
 
-        n = ngx_write_fd(fd, buffer, p - buffer);
-        if (n < 0) {
-            ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                          "hls: " ngx_write_fd_n " failed '%V'",
-                          &ctx->playlist_bak);
-            ngx_close_file(fd);
-            return NGX_ERROR;
-        }
+    if (bak) {
+        name = bak;
     }
 
-    ngx_close_file(fd);
+    out->fd = ngx_open_file(name->data, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE,
+                            NGX_FILE_DEFAULT_ACCESS);
 
-    if (ngx_rtmp_hls_rename_file(ctx->playlist_bak.data, ctx->playlist.data)
-        == NGX_FILE_ERROR)
-    {
+    if (out->fd == NGX_INVALID_FILE) {
         ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                      "hls: rename failed: '%V'->'%V'",
-                      &ctx->playlist_bak, &ctx->playlist);
+                      "hls: " ngx_open_file_n " failed: '%V'", name);
         return NGX_ERROR;
     }
 
-    if (ctx->var) {
-        return ngx_rtmp_hls_write_variant_playlist(s);
-    }
-
     return NGX_OK;
 }
 
 
 static ngx_int_t
-ngx_rtmp_hls_copy(ngx_rtmp_session_t *s, void *dst, u_char **src, size_t n,
-    ngx_chain_t **in)
+ngx_rtmp_hls_output_write(ngx_rtmp_session_t *s, ngx_rtmp_hls_output_t *out,
+    u_char *data, size_t len)
 {
-    u_char  *last;
-    size_t   pn;
+    ngx_rtmp_hls_main_conf_t   *hmcf;
 
-    if (*in == NULL) {
+    if (out->entry) {
+        hmcf = ngx_rtmp_get_module_main_conf(s, ngx_rtmp_hls_module);
+
+        return ngx_rtmp_hls_store_write(hmcf->store_zone, out->entry, data,
+                                        len, s->connection->log);
+    }
+
+    if (ngx_write_fd(out->fd, data, len) != (ssize_t) len) {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
+                      "hls: " ngx_write_fd_n " failed: '%V'",
+                      out->bak ? out->bak : out->name);
         return NGX_ERROR;
     }
 
-    for ( ;; ) {
-        last = (*in)->buf->last;
+    return NGX_OK;
+}
 
-        if ((size_t)(last - *src) >= n) {
-            if (dst) {
-                ngx_memcpy(dst, *src, n);
-            }
 
-            *src += n;
+static void
+ngx_rtmp_hls_output_abort(ngx_rtmp_session_t *s, ngx_rtmp_hls_output_t *out)
+{
+    ngx_rtmp_hls_main_conf_t   *hmcf;
+
+    if (out->entry) {
+        hmcf = ngx_rtmp_get_module_main_conf(s, ngx_rtmp_hls_module);
+
+        ngx_rtmp_hls_store_abort(hmcf->store_zone, out->entry);
+        out->entry = NULL;
+        return;
+    }
+
+    ngx_close_file(out->fd);
+}
+
+
+static ngx_int_t
+ngx_rtmp_hls_output_close(ngx_rtmp_session_t *s, ngx_rtmp_hls_output_t *out,
+    time_t ttl)
+{
+    ngx_rtmp_hls_main_conf_t   *hmcf;
+
+    if (out->entry) {
+        hmcf = ngx_rtmp_get_module_main_conf(s, ngx_rtmp_hls_module);
+
+        /* replaces the previous version at once, no need for .bak */
+
+        ngx_rtmp_hls_store_close(hmcf->store_zone, out->entry, ttl);
+        out->entry = NULL;
+        return NGX_OK;
+    }
+
+    ngx_close_file(out->fd);
+
+    if (out->bak == NULL) {
+        return NGX_OK;
+    }
+
+    if (ngx_rtmp_hls_rename_file(out->bak->data, out->name->data)
+        == NGX_FILE_ERROR)
+    {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
+                      "hls: rename failed: '%V'->'%V'",
+                      out->bak, out->name);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_rtmp_hls_write_buffer(ngx_rtmp_session_t *s, u_char *buf, size_t size,
+    ngx_str_t *name, ngx_str_t *bak)
+{
+    ngx_rtmp_hls_output_t           out;
+
+    if (ngx_rtmp_hls_output_open(s, &out, name, bak) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_rtmp_hls_output_write(s, &out, buf, size) != NGX_OK) {
+        ngx_rtmp_hls_output_abort(s, &out);
+        return NGX_ERROR;
+    }
+
+    return ngx_rtmp_hls_output_close(s, &out,
+                                     ngx_rtmp_hls_store_ttl(s, 1000));
+}
+
+
+static ngx_int_t
+ngx_rtmp_hls_write_variant_playlist(ngx_rtmp_session_t *s)
+{
+    u_char                   *buffer, *p, *last;
+    size_t                    size;
+    ngx_int_t                 rc;
+    ngx_str_t                *arg;
+    time_t                    refresh;
+    ngx_uint_t                n, k;
+    ngx_rtmp_hls_ctx_t       *ctx;
+    ngx_rtmp_hls_group_t     *g;
+    ngx_rtmp_hls_variant_t   *var;
+    ngx_rtmp_hls_app_conf_t  *hacf;
+
+    hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
+
+    /*
+     * variant playlist only depends on configuration; it's written
+     * once per group and refreshed before cleanup or store expire it
+     */
+
+    g = ctx->group;
+
+    refresh = ngx_max(hacf->playlen / 2000, 1);
+
+    if (g->updated && ngx_cached_time->sec < g->updated + refresh) {
+        return NGX_OK;
+    }
+
+    g->updated = ngx_cached_time->sec;
+
+#define NGX_RTMP_HLS_VAR_HEADER "#EXTM3U\n#EXT-X-VERSION:3\n"
+
+    /* any number of variants with arguments of any length */
+
+    size = sizeof(NGX_RTMP_HLS_VAR_HEADER) - 1;
+
+    var = hacf->variant->elts;
+    for (n = 0; n < hacf->variant->nelts; n++, var++) {
+        size += sizeof("#EXT-X-STREAM-INF:PROGRAM-ID=1\n") - 1
+                + hacf->base_url.len + ctx->name.len + var->suffix.len
+                + sizeof("/index.m3u8\n") - 1;
+
+        arg = var->args.elts;
+        for (k = 0; k < var->args.nelts; k++, arg++) {
+            size += 1 + arg->len;
+        }
+    }
+
+    buffer = ngx_alloc(size, s->connection->log);
+    if (buffer == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = ngx_cpymem(buffer, NGX_RTMP_HLS_VAR_HEADER,
+                   sizeof(NGX_RTMP_HLS_VAR_HEADER) - 1);
+    last = buffer + size;
+
+    var = hacf->variant->elts;
+    for (n = 0; n < hacf->variant->nelts; n++, var++)
+    {
+        p = ngx_slprintf(p, last, "#EXT-X-STREAM-INF:PROGRAM-ID=1");
+
+        arg = var->args.elts;
+        for (k = 0; k < var->args.nelts; k++, arg++) {
+            p = ngx_slprintf(p, last, ",%V", arg);
+        }
+
+        p = ngx_slprintf(p, last, "\n%V%*s%V",
+                         &hacf->base_url,
+                         ctx->name.len - ctx->var->suffix.len, ctx->name.data,
+                         &var->suffix);
+        if (hacf->nested) {
+            p = ngx_slprintf(p, last, "%s", "/index");
+        }
+
+        p = ngx_slprintf(p, last, "%s", ".m3u8\n");
+    }
+
+    rc = ngx_rtmp_hls_write_buffer(s, buffer, p - buffer,
+                                   &ctx->var_playlist,
+                                   &ctx->var_playlist_bak);
+
+    ngx_free(buffer);
+
+    return rc;
+}
+
+
+static void
+ngx_rtmp_hls_playlist_cleanup(void *data)
+{
+    ngx_rtmp_hls_ctx_t  *ctx = data;
+
+    if (ctx->pl.start) {
+        ngx_free(ctx->pl.start);
+    }
+}
+
+
+static ngx_int_t
+ngx_rtmp_hls_playlist_reserve(ngx_rtmp_session_t *s, size_t size)
+{
+    u_char                         *p;
+    size_t                          len, cap, head;
+    ngx_buf_t                      *b;
+    ngx_rtmp_hls_ctx_t             *ctx;
+    ngx_rtmp_hls_app_conf_t        *hacf;
+
+    hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
+
+    b = &ctx->pl;
+    len = b->last - b->pos;
+    head = ngx_rtmp_hls_playlist_head(hacf);
+
+    if (b->start && (size_t) (b->end - b->last) >= size) {
+        return NGX_OK;
+    }
+
+    cap = b->end - b->start;
+
+    /* trimmed entries have left enough room at the front */
+
+    if (b->start && cap - head - len >= size) {
+        ngx_memmove(b->start + head, b->pos, len);
+
+        b->pos = b->start + head;
+        b->last = b->pos + len;
+
+        return NGX_OK;
+    }
+
+    if (cap == 0) {
+        cap = NGX_RTMP_HLS_PLAYLIST_SIZE;
+    }
+
+    while (cap < head + len + size) {
+        cap *= 2;
+    }
+
+    /* pool cannot free small blocks, see ngx_rtmp_hls_playlist_cleanup() */
+
+    p = ngx_alloc(cap, s->connection->log);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (b->start) {
+        ngx_memcpy(p + head, b->pos, len);
+        ngx_free(b->start);
+    }
+
+    b->start = p;
+    b->end = p + cap;
+    b->pos = p + head;
+    b->last = b->pos + len;
+
+    return NGX_OK;
+}
+
+
+static u_char *
+ngx_rtmp_hls_playlist_parts(ngx_rtmp_session_t *s, u_char *p, u_char *end,
+    ngx_int_t n, ngx_str_t *name_part, const char *sep)
+{
+    ngx_uint_t                      k;
+    ngx_rtmp_hls_frag_t            *f;
+    ngx_rtmp_hls_part_t            *part;
+    ngx_rtmp_hls_app_conf_t        *hacf;
+
+    hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
+
+    f = ngx_rtmp_hls_get_frag(s, n);
+    part = ngx_rtmp_hls_get_parts(s, n);
+
+    for (k = 0; k < f->nparts; k++, part++) {
+        p = ngx_slprintf(p, end,
+                         "#EXT-X-PART:DURATION=%.3f,URI=\"%V%V%s%uL.%ui.ts\"%s\n",
+                         part->duration, &hacf->base_url, name_part, sep,
+                         f->id, k, part->independent ? ",INDEPENDENT=YES" : "");
+    }
+
+    return p;
+}
+
+
+static u_char *
+ngx_rtmp_hls_playlist_key(ngx_rtmp_session_t *s, u_char *p, u_char *end,
+    ngx_rtmp_hls_frag_t *f)
+{
+    ngx_str_t                       name_part;
+    const char                     *sep;
+    ngx_rtmp_hls_ctx_t             *ctx;
+    ngx_rtmp_hls_app_conf_t        *hacf;
+
+    hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
+
+    sep = hacf->nested ? (hacf->key_url.len ? "/" : "") : "-";
+
+    name_part.len = 0;
+    if (!hacf->nested || hacf->key_url.len) {
+        name_part = ctx->name;
+    }
+
+    return ngx_slprintf(p, end, "#EXT-X-KEY:METHOD=AES-128,"
+                        "URI=\"%V%V%s%uL.key\",IV=0x%032XL\n",
+                        &hacf->key_url, &name_part, sep, f->key_id,
+                        f->key_id);
+}
+
+
+static ngx_int_t
+ngx_rtmp_hls_playlist_append(ngx_rtmp_session_t *s, ngx_int_t n,
+    ngx_str_t *name_part, const char *sep)
+{
+    u_char                         *p;
+    ngx_buf_t                      *b;
+    ngx_rtmp_hls_ctx_t             *ctx;
+    ngx_rtmp_hls_frag_t            *f;
+    ngx_rtmp_hls_app_conf_t        *hacf;
+
+    hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
+
+    if (ngx_rtmp_hls_playlist_reserve(s, hacf->base_url.len +
+                                         hacf->key_url.len +
+                                         2 * ctx->name.len + 256)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    b = &ctx->pl;
+    p = b->last;
+
+    f = ngx_rtmp_hls_get_frag(s, n);
+
+    if (f->discont) {
+        p = ngx_slprintf(p, b->end, "#EXT-X-DISCONTINUITY\n");
+    }
+
+    f->key_tag = 0;
+
+    if (hacf->keys && (b->last == b->pos || f->key_id != ctx->pl_key_id)) {
+        p = ngx_rtmp_hls_playlist_key(s, p, b->end, f);
+        f->key_tag = 1;
+    }
+
+    ctx->pl_key_id = f->key_id;
+
+    p = ngx_slprintf(p, b->end,
+                     "#EXTINF:%.3f,\n"
+                     "%V%V%s%uL.ts\n",
+                     f->duration, &hacf->base_url, name_part, sep, f->id);
+
+    ngx_log_debug5(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                   "hls: fragment frag=%uL, n=%i/%ui, duration=%.3f, "
+                   "discont=%i",
+                   ctx->frag, n + 1, ctx->nfrags, f->duration, f->discont);
+
+    f->entry_len = p - b->last;
+    b->last = p;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_rtmp_hls_write_playlist(ngx_rtmp_session_t *s)
+{
+    u_char                         *p, *end, *start;
+    size_t                          size;
+    ngx_buf_t                      *b;
+    ngx_rtmp_hls_ctx_t             *ctx;
+    ngx_rtmp_hls_output_t           out;
+    ngx_rtmp_hls_app_conf_t        *hacf;
+    ngx_rtmp_hls_frag_t            *f;
+    ngx_uint_t                      i, max_frag, nplain, nlines;
+    uint64_t                        key_id;
+    ngx_str_t                       name_part;
+    const char                     *sep;
+
+    hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
+
+    b = &ctx->pl;
+
+    sep = hacf->nested ? (hacf->base_url.len ? "/" : "") : "-";
+
+    name_part.len = 0;
+    if (!hacf->nested || hacf->base_url.len) {
+        name_part = ctx->name;
+    }
+
+    /* drop fragments which have left the window */
+
+    while (ctx->pl_first < ctx->frag && ctx->pl_first < ctx->pl_last) {
+        f = ngx_rtmp_hls_get_frag(s, (ngx_int_t) (ctx->pl_first - ctx->frag));
+        b->pos += f->entry_len;
+        ctx->pl_first++;
+    }
+
+    if (ctx->pl_first == ctx->pl_last) {
+        ctx->pl_first = ctx->frag;
+        ctx->pl_last = ctx->frag;
+
+        if (b->start) {
+            b->pos = b->start + ngx_rtmp_hls_playlist_head(hacf);
+            b->last = b->pos;
+        }
+    }
+
+    /* the last fragments are listed along with their parts */
+
+    nplain = ctx->nfrags;
+
+    if (hacf->partlen) {
+        nplain = ctx->nfrags > NGX_RTMP_HLS_PART_FRAGS ?
+                 ctx->nfrags - NGX_RTMP_HLS_PART_FRAGS : 0;
+    }
+
+    while (ctx->pl_last < ctx->frag + nplain) {
+        if (ngx_rtmp_hls_playlist_append(s,
+                                         (ngx_int_t) (ctx->pl_last - ctx->frag),
+                                         &name_part, sep)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        ctx->pl_last++;
+    }
+
+    /* target duration for the header */
+
+    max_frag = hacf->fraglen / 1000;
+
+    for (i = 0; i < ctx->nfrags; i++) {
+        f = ngx_rtmp_hls_get_frag(s, i);
+        if (f->duration > max_frag) {
+            max_frag = (ngx_uint_t) (f->duration + .5);
+        }
+    }
+
+    /* tail: fragments with parts and the fragment in progress */
+
+    nlines = 1;
+
+    for (i = nplain; i <= ctx->nfrags; i++) {
+        nlines += ngx_rtmp_hls_get_frag(s, i)->nparts + 3;
+    }
+
+    if (ngx_rtmp_hls_playlist_reserve(s, nlines * (hacf->base_url.len +
+                                                   hacf->key_url.len +
+                                                   ctx->name.len + 128))
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    /* header goes to the headroom, then right before the listed entries */
+
+    p = b->start;
+    end = b->pos;
+
+    p = ngx_slprintf(p, end,
+                     "#EXTM3U\n"
+                     "#EXT-X-VERSION:%ui\n"
+                     "#EXT-X-MEDIA-SEQUENCE:%uL\n"
+                     "#EXT-X-TARGETDURATION:%ui\n",
+                     hacf->partlen ? 6 : 3, ctx->frag, max_frag);
+
+    if (hacf->type == NGX_RTMP_HLS_TYPE_EVENT) {
+        p = ngx_slprintf(p, end, "#EXT-X-PLAYLIST-TYPE: EVENT\n");
+    }
+
+    if (hacf->partlen) {
+
+        /* blocking reload is implemented by the store http handler */
+
+        p = ngx_slprintf(p, end,
+                         "#EXT-X-SERVER-CONTROL:CAN-BLOCK-RELOAD=YES,"
+                         "PART-HOLD-BACK=%.3f\n"
+                         "#EXT-X-PART-INF:PART-TARGET=%.3f\n",
+                         hacf->partlen * 3 / 1000., hacf->partlen / 1000.);
+    }
+
+    /* key of the first fragment, its EXT-X-KEY may have been trimmed */
+
+    key_id = ctx->pl_key_id;
+
+    if (hacf->keys && ctx->nfrags) {
+        f = ngx_rtmp_hls_get_frag(s, 0);
+
+        if (ctx->pl_first == ctx->pl_last || !f->key_tag) {
+            p = ngx_rtmp_hls_playlist_key(s, p, end, f);
+        }
+
+        if (ctx->pl_first == ctx->pl_last) {
+            key_id = f->key_id;
+        }
+    }
+
+    if (p == end) {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                      "hls: playlist header too long");
+        return NGX_ERROR;
+    }
+
+    size = p - b->start;
+    ngx_memmove(b->pos - size, b->start, size);
+
+    end = b->end;
+    p = b->last;
+
+    for (i = nplain; i < ctx->nfrags; i++) {
+        f = ngx_rtmp_hls_get_frag(s, i);
+
+        if (f->discont) {
+            p = ngx_slprintf(p, end, "#EXT-X-DISCONTINUITY\n");
+        }
+
+        if (hacf->keys && f->key_id != key_id) {
+            p = ngx_rtmp_hls_playlist_key(s, p, end, f);
+        }
+
+        key_id = f->key_id;
+
+        p = ngx_rtmp_hls_playlist_parts(s, p, end, i, &name_part, sep);
+
+        p = ngx_slprintf(p, end,
+                         "#EXTINF:%.3f,\n"
+                         "%V%V%s%uL.ts\n",
+                         f->duration, &hacf->base_url, &name_part, sep, f->id);
+    }
+
+    f = ngx_rtmp_hls_get_frag(s, ctx->nfrags);
+
+    if (hacf->partlen && ctx->opened) {
+        p = ngx_rtmp_hls_playlist_parts(s, p, end, ctx->nfrags, &name_part,
+                                        sep);
+
+        if (ctx->part_opened) {
+            p = ngx_slprintf(p, end,
+                             "#EXT-X-PRELOAD-HINT:TYPE=PART,"
+                             "URI=\"%V%V%s%uL.%ui.ts\"\n",
+                             &hacf->base_url, &name_part, sep, f->id,
+                             f->nparts);
+        }
+    }
+
+    /* header, listed entries and tail are contiguous: one write */
+
+    start = b->pos - size;
+    size = p - start;
+
+    if (ngx_rtmp_hls_output_open(s, &out, &ctx->playlist, &ctx->playlist_bak)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (ngx_rtmp_hls_output_write(s, &out, start, size) != NGX_OK) {
+        ngx_rtmp_hls_output_abort(s, &out);
+        return NGX_ERROR;
+    }
+
+    if (out.entry) {
+        out.entry->msn = ctx->frag + ctx->nfrags;
+        out.entry->part = ctx->opened ? f->nparts : 0;
+        out.entry->hold = max_frag * 3000;
+    }
+
+    if (ngx_rtmp_hls_output_close(s, &out, ngx_rtmp_hls_store_ttl(s, 1000))
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (ctx->group) {
+        return ngx_rtmp_hls_write_variant_playlist(s);
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * In fmp4 format fragments are those written by the dash module, one
+ * file per track. Each track gets a media playlist, <stream>video.m3u8
+ * and <stream>audio.m3u8, and the stream playlist is a master playlist
+ * referencing them.
+ */
+
+static ngx_int_t
+ngx_rtmp_hls_write_track_playlist(ngx_rtmp_session_t *s, const char *track,
+    char type)
+{
+    u_char                         *buffer, *p, *end;
+    size_t                          size;
+    ngx_int_t                       rc;
+    ngx_rtmp_hls_ctx_t             *ctx;
+    ngx_rtmp_hls_app_conf_t        *hacf;
+    ngx_rtmp_hls_frag_t            *f;
+    ngx_uint_t                      i, max_frag;
+    ngx_str_t                       name_part;
+    const char                     *sep;
+
+    hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
+
+    p = ngx_sprintf(ctx->track_playlist.data + ctx->stream.len, "%s.m3u8",
+                    track);
+    ctx->track_playlist.len = p - ctx->track_playlist.data;
+
+    p = ngx_sprintf(ctx->track_playlist_bak.data + ctx->stream.len,
+                    "%s.m3u8.bak", track);
+    ctx->track_playlist_bak.len = p - ctx->track_playlist_bak.data;
+    *p = 0;
+
+    ctx->track_playlist.data[ctx->track_playlist.len] = 0;
+
+    max_frag = 1;
+
+    for (i = 0; i < ctx->nfrags; i++) {
+        f = ngx_rtmp_hls_get_frag(s, i);
+        if (f->duration > max_frag) {
+            max_frag = (ngx_uint_t) (f->duration + .5);
+        }
+    }
+
+    sep = hacf->nested ? (hacf->base_url.len ? "/" : "") : "-";
+
+    name_part.len = 0;
+    if (!hacf->nested || hacf->base_url.len) {
+        name_part = ctx->name;
+    }
+
+    /* header and a line pair per fragment, each has a URL */
+
+    size = (ctx->nfrags + 1) * (hacf->base_url.len + ctx->name.len + 128)
+           + 128;
+
+    buffer = ngx_alloc(size, s->connection->log);
+    if (buffer == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = buffer;
+    end = p + size;
+
+    p = ngx_slprintf(p, end,
+                     "#EXTM3U\n"
+                     "#EXT-X-VERSION:7\n"
+                     "#EXT-X-MEDIA-SEQUENCE:%uL\n"
+                     "#EXT-X-TARGETDURATION:%ui\n",
+                     ctx->frag, max_frag);
+
+    if (hacf->type == NGX_RTMP_HLS_TYPE_EVENT) {
+        p = ngx_slprintf(p, end, "#EXT-X-PLAYLIST-TYPE: EVENT\n");
+    }
+
+    p = ngx_slprintf(p, end, "#EXT-X-MAP:URI=\"%V%V%sinit.m4%c\"\n",
+                     &hacf->base_url, &name_part, sep, type);
+
+    for (i = 0; i < ctx->nfrags; i++) {
+        f = ngx_rtmp_hls_get_frag(s, i);
+
+        if (f->discont) {
+            p = ngx_slprintf(p, end, "#EXT-X-DISCONTINUITY\n");
+        }
+
+        p = ngx_slprintf(p, end,
+                         "#EXTINF:%.3f,\n"
+                         "%V%V%s%uL.m4%c\n",
+                         f->duration, &hacf->base_url, &name_part, sep,
+                         f->id, type);
+    }
+
+    rc = ngx_rtmp_hls_write_buffer(s, buffer, p - buffer,
+                                   &ctx->track_playlist,
+                                   &ctx->track_playlist_bak);
+
+    ngx_free(buffer);
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_rtmp_hls_write_master_playlist(ngx_rtmp_session_t *s)
+{
+    u_char                         *buffer, *p, *end;
+    size_t                          size;
+    ngx_int_t                       rc;
+    const char                     *sep, *aac;
+    ngx_str_t                       name_part;
+    ngx_uint_t                      bandwidth;
+    ngx_rtmp_hls_ctx_t             *ctx;
+    ngx_rtmp_codec_ctx_t           *codec_ctx;
+    ngx_rtmp_hls_app_conf_t        *hacf;
+
+    hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
+    codec_ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_codec_module);
+
+    if (codec_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    sep = hacf->nested ? (hacf->base_url.len ? "/" : "") : "-";
+
+    name_part.len = 0;
+    if (!hacf->nested || hacf->base_url.len) {
+        name_part = ctx->name;
+    }
+
+    aac = codec_ctx->aac_sbr ? "40.5" : "40.2";
+
+    bandwidth = (ngx_uint_t) ((codec_ctx->video_data_rate +
+                               codec_ctx->audio_data_rate) * 1000);
+
+    /* fixed text, codec list and the two track playlist URLs */
+
+    size = 2 * (hacf->base_url.len + ctx->name.len)
+           + sizeof(codec_ctx->video_codecs) + 512;
+
+    buffer = ngx_alloc(size, s->connection->log);
+    if (buffer == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = buffer;
+    end = p + size;
+
+    p = ngx_slprintf(p, end,
+                     "#EXTM3U\n"
+                     "#EXT-X-VERSION:7\n"
+                     "#EXT-X-INDEPENDENT-SEGMENTS\n");
+
+    if (ctx->has_video && ctx->has_audio) {
+        p = ngx_slprintf(p, end,
+                         "#EXT-X-MEDIA:TYPE=AUDIO,GROUP-ID=\"audio\","
+                         "NAME=\"audio\",DEFAULT=YES,AUTOSELECT=YES,"
+                         "URI=\"%V%V%saudio.m3u8\"\n",
+                         &hacf->base_url, &name_part, sep);
+    }
+
+    p = ngx_slprintf(p, end, "#EXT-X-STREAM-INF:BANDWIDTH=%ui,CODECS=\"",
+                     bandwidth);
+
+    if (ctx->has_video) {
+        p = ngx_slprintf(p, end, "%s%s", codec_ctx->video_codecs,
+                         ctx->has_audio ? "," : "");
+    }
+
+    if (ctx->has_audio) {
+        p = ngx_slprintf(p, end, "mp4a.%s", aac);
+    }
+
+    p = ngx_slprintf(p, end, "\"");
+
+    if (ctx->has_video && codec_ctx->width && codec_ctx->height) {
+        p = ngx_slprintf(p, end, ",RESOLUTION=%uix%ui",
+                         codec_ctx->width, codec_ctx->height);
+    }
+
+    if (ctx->has_video && ctx->has_audio) {
+        p = ngx_slprintf(p, end, ",AUDIO=\"audio\"");
+    }
+
+    p = ngx_slprintf(p, end, "\n%V%V%s%s.m3u8\n",
+                     &hacf->base_url, &name_part, sep,
+                     ctx->has_video ? "video" : "audio");
+
+    rc = ngx_rtmp_hls_write_buffer(s, buffer, p - buffer, &ctx->playlist,
+                                   &ctx->playlist_bak);
+
+    ngx_free(buffer);
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_rtmp_hls_dash_fragment(ngx_rtmp_session_t *s, ngx_rtmp_dash_fragment_t *v)
+{
+    ngx_uint_t                      master;
+    ngx_rtmp_hls_ctx_t             *ctx;
+    ngx_rtmp_hls_frag_t            *f;
+    ngx_rtmp_hls_app_conf_t        *hacf;
+
+    hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
+
+    if (hacf == NULL || !hacf->hls || ctx == NULL ||
+        hacf->format != NGX_RTMP_HLS_FORMAT_FMP4 ||
+        ctx->track_playlist.data == NULL)
+    {
+        goto next;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                   "hls: dash fragment timestamp=%uD, duration=%uD, "
+                   "stream='%V'", v->timestamp, v->duration, &v->stream);
+
+    f = ngx_rtmp_hls_get_frag(s, ctx->nfrags);
+
+    ngx_memzero(f, sizeof(*f));
+
+    f->id = v->timestamp;
+    f->duration = v->duration / 1000.;
+    f->active = 1;
+
+    ngx_rtmp_hls_next_frag(s);
+
+    /* media playlists go first for the master not to reference nothing */
+
+    if (v->video) {
+        ngx_rtmp_hls_write_track_playlist(s, "video", 'v');
+    }
+
+    if (v->audio) {
+        ngx_rtmp_hls_write_track_playlist(s, "audio", 'a');
+    }
+
+    master = (v->video != ctx->has_video || v->audio != ctx->has_audio);
+
+    ctx->has_video = v->video;
+    ctx->has_audio = v->audio;
+
+    if (master && (v->video || v->audio)) {
+        ngx_rtmp_hls_write_master_playlist(s);
+    }
+
+next:
+    return next_dash_fragment(s, v);
+}
+
+
+static ngx_int_t
+ngx_rtmp_hls_copy(ngx_rtmp_session_t *s, void *dst, u_char **src, size_t n,
+    ngx_chain_t **in)
+{
+    u_char  *last;
+    size_t   pn;
+
+    if (*in == NULL) {
+        return NGX_ERROR;
+    }
+
+    for ( ;; ) {
+        last = (*in)->buf->last;
+
+        if ((size_t)(last - *src) >= n) {
+            if (dst) {
+                ngx_memcpy(dst, *src, n);
+            }
+
+            *src += n;
 
             while (*in && *src == (*in)->buf->last) {
                 *in = (*in)->next;
@@ -665,23 +1729,179 @@ ngx_rtmp_hls_copy(ngx_rtmp_session_t *s, void *dst, u_char **src, size_t n,
 }
 
 
+/*
+ * Video frames are not copied: the output chain references the NAL
+ * units in the incoming chain, the codec header and static start codes,
+ * and the TS writer gathers them into packets.
+ */
+
 static ngx_int_t
-ngx_rtmp_hls_append_aud(ngx_rtmp_session_t *s, ngx_buf_t *out)
+ngx_rtmp_hls_append_ref(ngx_rtmp_session_t *s, ngx_chain_t ***ll, u_char *pos,
+    u_char *last)
 {
-    static u_char   aud_nal[] = { 0x00, 0x00, 0x00, 0x01, 0x09, 0xf0 };
+    ngx_buf_t           *b;
+    ngx_chain_t         *cl;
+    ngx_rtmp_hls_ctx_t  *ctx;
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
 
-    if (out->last + sizeof(aud_nal) > out->end) {
+    cl = ngx_chain_get_free_buf(s->connection->pool, &ctx->free);
+    if (cl == NULL) {
         return NGX_ERROR;
     }
 
-    out->last = ngx_cpymem(out->last, aud_nal, sizeof(aud_nal));
+    b = cl->buf;
+
+    b->start = pos;
+    b->pos = pos;
+    b->last = last;
+    b->end = last;
+    b->memory = 1;
+
+    **ll = cl;
+    *ll = &cl->next;
 
     return NGX_OK;
 }
 
 
 static ngx_int_t
-ngx_rtmp_hls_append_sps_pps(ngx_rtmp_session_t *s, ngx_buf_t *out)
+ngx_rtmp_hls_append_data(ngx_rtmp_session_t *s, ngx_chain_t ***ll,
+    u_char **src, size_t n, ngx_chain_t **in)
+{
+    u_char  *last;
+    size_t   pn;
+
+    if (*in == NULL) {
+        return NGX_ERROR;
+    }
+
+    for ( ;; ) {
+        last = (*in)->buf->last;
+        pn = ngx_min((size_t) (last - *src), n);
+
+        if (pn && ngx_rtmp_hls_append_ref(s, ll, *src, *src + pn) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        n -= pn;
+        *src += pn;
+
+        if (n == 0) {
+            while (*in && *src == (*in)->buf->last) {
+                *in = (*in)->next;
+                if (*in) {
+                    *src = (*in)->buf->pos;
+                }
+            }
+
+            return NGX_OK;
+        }
+
+        *in = (*in)->next;
+
+        if (*in == NULL) {
+            ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                          "hls: failed to read %uz byte(s)", n);
+            return NGX_ERROR;
+        }
+
+        *src = (*in)->buf->pos;
+    }
+}
+
+
+static ngx_int_t
+ngx_rtmp_hls_append_start_code(ngx_rtmp_session_t *s, ngx_chain_t ***ll,
+    size_t len)
+{
+    static u_char   start_code[] = { 0x00, 0x00, 0x00, 0x01 };
+
+    return ngx_rtmp_hls_append_ref(s, ll, start_code + 4 - len,
+                                   start_code + 4);
+}
+
+
+static void
+ngx_rtmp_hls_free_chain(ngx_rtmp_session_t *s, ngx_chain_t *out)
+{
+    ngx_chain_t         *cl;
+    ngx_rtmp_hls_ctx_t  *ctx;
+
+    if (out == NULL) {
+        return;
+    }
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
+
+    for (cl = out; cl->next; cl = cl->next) { /* void */ }
+
+    cl->next = ctx->free;
+    ctx->free = out;
+}
+
+
+/* H264 and HEVC NAL units are told apart by these classes */
+
+static ngx_uint_t
+ngx_rtmp_hls_nal_class(u_char nal, ngx_uint_t hevc)
+{
+    ngx_uint_t  type;
+
+    if (!hevc) {
+        type = nal & 0x1f;
+        return type == 8 ? NGX_RTMP_HLS_NAL_PARAMS : type;
+    }
+
+    type = (nal >> 1) & 0x3f;
+
+    if (type < 16) {
+        return NGX_RTMP_HLS_NAL_SLICE;
+    }
+
+    /* IRAP: BLA, IDR, CRA */
+
+    if (type <= 23) {
+        return NGX_RTMP_HLS_NAL_IDR;
+    }
+
+    switch (type) {
+
+    case 32: /* VPS */
+    case 33: /* SPS */
+    case 34: /* PPS */
+        return NGX_RTMP_HLS_NAL_PARAMS;
+
+    case 35:
+        return NGX_RTMP_HLS_NAL_AUD;
+
+    case 39: /* prefix SEI */
+        return NGX_RTMP_HLS_NAL_SEI;
+    }
+
+    return 0;
+}
+
+
+static ngx_int_t
+ngx_rtmp_hls_append_aud(ngx_rtmp_session_t *s, ngx_chain_t ***ll,
+    ngx_uint_t hevc)
+{
+    static u_char   aud_nal[] = { 0x00, 0x00, 0x00, 0x01, 0x09, 0xf0 };
+    static u_char   hevc_aud_nal[] = { 0x00, 0x00, 0x00, 0x01,
+                                       0x46, 0x01, 0x50 };
+
+    if (hevc) {
+        return ngx_rtmp_hls_append_ref(s, ll, hevc_aud_nal,
+                                       hevc_aud_nal + sizeof(hevc_aud_nal));
+    }
+
+    return ngx_rtmp_hls_append_ref(s, ll, aud_nal, aud_nal + sizeof(aud_nal));
+}
+
+
+static ngx_int_t
+ngx_rtmp_hls_append_sps_pps(ngx_rtmp_session_t *s, ngx_chain_t ***ll)
 {
     ngx_rtmp_codec_ctx_t           *codec_ctx;
     u_char                         *p;
@@ -749,42 +1969,100 @@ ngx_rtmp_hls_append_sps_pps(ngx_rtmp_session_t *s, ngx_buf_t *out)
                            "hls: header NAL length: %uz", (size_t) len);
 
             /* AnnexB prefix */
-            if (out->end - out->last < 4) {
-                ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
-                              "hls: too small buffer for header NAL size");
+            if (ngx_rtmp_hls_append_start_code(s, ll, 4) != NGX_OK) {
                 return NGX_ERROR;
             }
 
-            *out->last++ = 0;
-            *out->last++ = 0;
-            *out->last++ = 0;
-            *out->last++ = 1;
+            /* NAL body */
+            if (ngx_rtmp_hls_append_data(s, ll, &p, len, &in) != NGX_OK) {
+                return NGX_ERROR;
+            }
+        }
+
+        if (n == 1) {
+            break;
+        }
+
+        /* number of PPS NALs */
+        if (ngx_rtmp_hls_copy(s, &nnals, &p, 1, &in) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                       "hls: PPS number: %uz", nnals);
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_rtmp_hls_append_hevc_params(ngx_rtmp_session_t *s, ngx_chain_t ***ll)
+{
+    ngx_rtmp_codec_ctx_t           *codec_ctx;
+    u_char                         *p;
+    ngx_chain_t                    *in;
+    uint8_t                         narrays, type;
+    uint16_t                        nnals, len, rlen;
+
+    codec_ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_codec_module);
+
+    if (codec_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    in = codec_ctx->avc_header;
+    if (in == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = in->buf->pos;
+
+    /*
+     * Skip bytes:
+     * - flv fmt & packet type & composition time
+     *   or enhanced header & FourCC
+     * - fixed part of HEVC decoder configuration record
+     */
+
+    if (ngx_rtmp_hls_copy(s, NULL, &p, 5 + 22, &in) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_rtmp_hls_copy(s, &narrays, &p, 1, &in) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    /* VPS, SPS, PPS (and SEI) arrays */
+
+    for ( /* void */ ; narrays; narrays--) {
+
+        if (ngx_rtmp_hls_copy(s, &type, &p, 1, &in) != NGX_OK ||
+            ngx_rtmp_hls_copy(s, &rlen, &p, 2, &in) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        ngx_rtmp_rmemcpy(&nnals, &rlen, 2);
 
-            /* NAL body */
-            if (out->end - out->last < len) {
-                ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
-                              "hls: too small buffer for header NAL");
-                return NGX_ERROR;
-            }
+        ngx_log_debug2(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                       "hls: hevc NAL array type=%ui, number=%ui",
+                       (ngx_uint_t) (type & 0x3f), (ngx_uint_t) nnals);
+
+        for ( /* void */ ; nnals; nnals--) {
 
-            if (ngx_rtmp_hls_copy(s, out->last, &p, len, &in) != NGX_OK) {
+            if (ngx_rtmp_hls_copy(s, &rlen, &p, 2, &in) != NGX_OK) {
                 return NGX_ERROR;
             }
 
-            out->last += len;
-        }
-
-        if (n == 1) {
-            break;
-        }
+            ngx_rtmp_rmemcpy(&len, &rlen, 2);
 
-        /* number of PPS NALs */
-        if (ngx_rtmp_hls_copy(s, &nnals, &p, 1, &in) != NGX_OK) {
-            return NGX_ERROR;
+            if (ngx_rtmp_hls_append_start_code(s, ll, 4) != NGX_OK ||
+                ngx_rtmp_hls_append_data(s, ll, &p, len, &in) != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
         }
-
-        ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
-                       "hls: PPS number: %uz", nnals);
     }
 
     return NGX_OK;
@@ -815,10 +2093,145 @@ ngx_rtmp_hls_get_fragment_id(ngx_rtmp_session_t *s, uint64_t ts)
 }
 
 
+/*
+ * Low latency parts are written alongside the fragment: the fragment
+ * file tees its TS packets to the open part, so frames are muxed once
+ * and continuity counters match; each part starts with PAT/PMT.
+ * Parts are named after the fragment they belong to,
+ * <fragment id>.<part number>.ts.
+ */
+
+static ngx_int_t
+ngx_rtmp_hls_open_part(ngx_rtmp_session_t *s, uint64_t ts,
+    ngx_int_t independent)
+{
+    ngx_int_t                  rc;
+    ngx_str_t                  name;
+    ngx_rtmp_hls_ctx_t        *ctx;
+    ngx_rtmp_hls_frag_t       *f;
+    ngx_rtmp_hls_part_t       *part;
+    ngx_rtmp_hls_app_conf_t   *hacf;
+    ngx_rtmp_hls_main_conf_t  *hmcf;
+
+    hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
+
+    f = ngx_rtmp_hls_get_frag(s, ctx->nfrags);
+
+    if (f->nparts == hacf->maxparts) {
+        return NGX_OK;
+    }
+
+    name.data = ctx->partfile.data;
+    name.len = ngx_sprintf(name.data + ctx->partfile.len, "%uL.%ui.ts",
+                           f->id, f->nparts)
+               - name.data;
+    name.data[name.len] = 0;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                   "hls: open part file='%V', independent=%i",
+                   &name, independent);
+
+    ctx->part_file.hevc = ctx->file.hevc;
+
+    /* parts are only written to the store, see merge_app_conf */
+
+    hmcf = ngx_rtmp_get_module_main_conf(s, ngx_rtmp_hls_module);
+
+    rc = ngx_rtmp_mpegts_open_store(&ctx->part_file, hmcf->store_zone,
+                                    &name, ngx_rtmp_hls_store_ttl(s, 500),
+                                    s->connection->log);
+    if (rc != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    /* requests for the hinted part wait until it is complete */
+
+    (void) ngx_rtmp_hls_store_hint(hmcf->store_zone, &name,
+                                   ngx_rtmp_hls_store_ttl(s, 500),
+                                   hacf->partlen * 3, ctx->generation,
+                                   s->connection->log);
+
+    ctx->part_opened = 1;
+    ctx->part_ts = ts;
+
+    ctx->file.tee = &ctx->part_file;
+
+    part = ngx_rtmp_hls_get_parts(s, ctx->nfrags) + f->nparts;
+
+    part->duration = 0;
+    part->independent = independent;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_rtmp_hls_close_part(ngx_rtmp_session_t *s, uint64_t ts)
+{
+    ngx_rtmp_hls_ctx_t        *ctx;
+    ngx_rtmp_hls_frag_t       *f;
+    ngx_rtmp_hls_part_t       *part;
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
+
+    if (!ctx->part_opened) {
+        return;
+    }
+
+    ctx->file.tee = NULL;
+
+    ngx_rtmp_mpegts_close_file(&ctx->part_file);
+
+    ctx->part_opened = 0;
+
+    f = ngx_rtmp_hls_get_frag(s, ctx->nfrags);
+    part = ngx_rtmp_hls_get_parts(s, ctx->nfrags) + f->nparts;
+
+    part->duration = (ts - ctx->part_ts) / 90000.;
+
+    f->nparts++;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                   "hls: close part n=%ui, duration=%.3f",
+                   f->nparts - 1, part->duration);
+}
+
+
+static void
+ngx_rtmp_hls_next_part(ngx_rtmp_session_t *s, uint64_t ts,
+    ngx_int_t independent)
+{
+    /* buffered audio belongs to the part being closed */
+
+    ngx_rtmp_hls_flush_audio(s);
+
+    ngx_rtmp_hls_close_part(s, ts);
+    ngx_rtmp_hls_open_part(s, ts, independent);
+
+    ngx_rtmp_hls_write_playlist(s);
+}
+
+
+static ngx_int_t
+ngx_rtmp_hls_write_frame(ngx_rtmp_session_t *s, ngx_rtmp_mpegts_frame_t *f,
+    ngx_chain_t *in)
+{
+    ngx_rtmp_hls_ctx_t        *ctx;
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
+
+    /* the open part gets the same packets through the tee */
+
+    return ngx_rtmp_mpegts_write_frame(&ctx->file, f, in);
+}
+
+
 static ngx_int_t
 ngx_rtmp_hls_close_fragment(ngx_rtmp_session_t *s)
 {
     ngx_rtmp_hls_ctx_t         *ctx;
+    ngx_rtmp_hls_frag_t        *f;
 
     ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
     if (ctx == NULL || !ctx->opened) {
@@ -828,6 +2241,13 @@ ngx_rtmp_hls_close_fragment(ngx_rtmp_session_t *s)
     ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
                    "hls: close fragment n=%uL", ctx->frag);
 
+    if (ctx->part_opened) {
+        f = ngx_rtmp_hls_get_frag(s, ctx->nfrags);
+
+        ngx_rtmp_hls_close_part(s, ctx->frag_ts
+                                   + (uint64_t) (f->duration * 90000 + .5));
+    }
+
     ngx_rtmp_mpegts_close_file(&ctx->file);
 
     ctx->opened = 0;
@@ -845,11 +2265,16 @@ ngx_rtmp_hls_open_fragment(ngx_rtmp_session_t *s, uint64_t ts,
     ngx_int_t discont)
 {
     uint64_t                  id;
-    ngx_fd_t                  fd;
-    ngx_uint_t                g;
+    ngx_int_t                 rc;
+    ngx_str_t                 name;
+    ngx_uint_t                g, n;
     ngx_rtmp_hls_ctx_t       *ctx;
     ngx_rtmp_hls_frag_t      *f;
+    ngx_rtmp_hls_output_t     out;
+    ngx_rtmp_hls_group_t     *grp;
+    ngx_rtmp_codec_ctx_t     *codec_ctx;
     ngx_rtmp_hls_app_conf_t  *hacf;
+    ngx_rtmp_hls_main_conf_t *hmcf;
 
     ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
 
@@ -858,15 +2283,56 @@ ngx_rtmp_hls_open_fragment(ngx_rtmp_session_t *s, uint64_t ts,
     }
 
     hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
+    hmcf = ngx_rtmp_get_module_main_conf(s, ngx_rtmp_hls_module);
 
-    if (ngx_rtmp_hls_ensure_directory(s, &hacf->path) != NGX_OK) {
-        return NGX_ERROR;
+    if (!hacf->store) {
+        if (ngx_rtmp_hls_ensure_directory(s, &hacf->path) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        if (hacf->keys &&
+            ngx_rtmp_hls_ensure_directory(s, &hacf->key_path) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
     }
 
-    if (hacf->keys &&
-        ngx_rtmp_hls_ensure_directory(s, &hacf->key_path) != NGX_OK)
+    /* renditions of a group share fragment sequence numbers */
+
+    grp = ctx->group;
+
+    if (grp && grp->top == s) {
+        grp->frag = ctx->frag + ctx->nfrags;
+        ctx->group_frag = grp->frag;
+
+    } else if (grp && grp->top && ctx->nfrags == 0) {
+        if (ctx->group_frag == 0) {
+            ctx->group_frag = grp->frag;
+        }
+
+        ctx->frag = ctx->group_frag;
+
+    } else if (grp && grp->top &&
+               ctx->group_frag > ctx->frag + ctx->nfrags)
     {
-        return NGX_ERROR;
+        /*
+         * missed a cut of the top rendition; sequence numbers cannot
+         * skip inside the playlist, so start a new window in line
+         */
+
+        ngx_log_error(NGX_LOG_WARN, s->connection->log, 0,
+                      "hls: realign fragment %uL to group fragment %uL",
+                      ctx->frag + ctx->nfrags, ctx->group_frag);
+
+        for (n = 0; n < ctx->nfrags; n++) {
+            f = ngx_rtmp_hls_get_frag(s, n);
+            ngx_rtmp_hls_expire_frag(s, f, f->key_id != ctx->key_id, NULL,
+                                     hacf->playlen);
+        }
+
+        ctx->frag = ctx->group_frag;
+        ctx->nfrags = 0;
+        discont = 1;
     }
 
     id = ngx_rtmp_hls_get_fragment_id(s, ts);
@@ -890,35 +2356,47 @@ ngx_rtmp_hls_open_fragment(ngx_rtmp_session_t *s, uint64_t ts,
                 return NGX_ERROR;
             }
 
-            ngx_sprintf(ctx->keyfile.data + ctx->keyfile.len, "%uL.key%Z", id);
-
-            fd = ngx_open_file(ctx->keyfile.data, NGX_FILE_WRONLY,
-                               NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
+            name.data = ctx->keyfile.data;
+            name.len = ngx_sprintf(name.data + ctx->keyfile.len, "%uL.key", id)
+                       - name.data;
+            name.data[name.len] = 0;
 
-            if (fd == NGX_INVALID_FILE) {
-                ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                              "hls: failed to open key file '%s'",
-                              ctx->keyfile.data);
+            if (ngx_rtmp_hls_output_open(s, &out, &name, NULL) != NGX_OK) {
+                ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                              "hls: failed to open key file '%V'", &name);
                 return NGX_ERROR;
             }
 
-            if (ngx_write_fd(fd, ctx->key, 16) != 16) {
-                ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                              "hls: failed to write key file '%s'",
-                              ctx->keyfile.data);
-                ngx_close_file(fd);
+            if (ngx_rtmp_hls_output_write(s, &out, ctx->key, 16) != NGX_OK) {
+                ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                              "hls: failed to write key file '%V'", &name);
+                ngx_rtmp_hls_output_abort(s, &out);
                 return NGX_ERROR;
             }
 
-            ngx_close_file(fd);
+            ngx_rtmp_hls_output_close(s, &out, ngx_rtmp_hls_store_ttl(s, 500));
 
         } else {
             if (hacf->frags_per_key) {
                 ctx->key_frags--;
             }
 
-            if (ngx_set_file_time(ctx->keyfile.data, 0, ngx_cached_time->sec)
-                != NGX_OK)
+            if (hacf->store) {
+                name.data = ctx->keyfile.data;
+                name.len = ngx_strlen(name.data);
+
+                if (ngx_rtmp_hls_store_touch(hmcf->store_zone, &name,
+                                             ngx_rtmp_hls_store_ttl(s, 500))
+                    != NGX_OK)
+                {
+                    ngx_log_error(NGX_LOG_ALERT, s->connection->log, 0,
+                                  "hls: key '%V' is missing from store",
+                                  &name);
+                }
+
+            } else if (ngx_set_file_time(ctx->keyfile.data, 0,
+                                         ngx_cached_time->sec)
+                       != NGX_OK)
             {
                 ngx_log_error(NGX_LOG_ALERT, s->connection->log, ngx_errno,
                               ngx_set_file_time_n " '%s' failed",
@@ -943,10 +2421,25 @@ ngx_rtmp_hls_open_fragment(ngx_rtmp_session_t *s, uint64_t ts,
         return NGX_ERROR;
     }
 
-    if (ngx_rtmp_mpegts_open_file(&ctx->file, ctx->stream.data,
-                                  s->connection->log)
-        != NGX_OK)
-    {
+    codec_ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_codec_module);
+
+    ctx->file.hevc = (codec_ctx &&
+                      codec_ctx->video_codec_id == NGX_RTMP_VIDEO_HEVC);
+
+    if (hacf->store) {
+        name.data = ctx->stream.data;
+        name.len = ngx_strlen(name.data);
+
+        rc = ngx_rtmp_mpegts_open_store(&ctx->file, hmcf->store_zone, &name,
+                                        ngx_rtmp_hls_store_ttl(s, 500),
+                                        s->connection->log);
+
+    } else {
+        rc = ngx_rtmp_mpegts_open_file(&ctx->file, ctx->stream.data,
+                                       s->connection->log);
+    }
+
+    if (rc != NGX_OK) {
         return NGX_ERROR;
     }
 
@@ -963,10 +2456,22 @@ ngx_rtmp_hls_open_fragment(ngx_rtmp_session_t *s, uint64_t ts,
 
     ctx->frag_ts = ts;
 
+    /* fragments start at key frames */
+
+    if (hacf->partlen) {
+        ngx_rtmp_hls_open_part(s, ts, 1);
+    }
+
     /* start fragment with audio to make iPhone happy */
 
     ngx_rtmp_hls_flush_audio(s);
 
+    /* announce the first part */
+
+    if (hacf->partlen) {
+        ngx_rtmp_hls_write_playlist(s);
+    }
+
     return NGX_OK;
 }
 
@@ -983,8 +2488,12 @@ ngx_rtmp_hls_restore_stream(ngx_rtmp_session_t *s)
     double                          duration;
     ngx_int_t                       discont;
     uint64_t                        mag, key_id, base;
+    ngx_rtmp_hls_app_conf_t        *hacf;
+    ngx_rtmp_hls_main_conf_t       *hmcf;
     static u_char                   buffer[4096];
 
+    hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
+    hmcf = ngx_rtmp_get_module_main_conf(s, ngx_rtmp_hls_module);
     ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
 
     ngx_memzero(&file, sizeof(file));
@@ -993,10 +2502,15 @@ ngx_rtmp_hls_restore_stream(ngx_rtmp_session_t *s)
 
     ngx_str_set(&file.name, "m3u8");
 
-    file.fd = ngx_open_file(ctx->playlist.data, NGX_FILE_RDONLY, NGX_FILE_OPEN,
-                            0);
-    if (file.fd == NGX_INVALID_FILE) {
-        return;
+    if (hacf->store) {
+        file.fd = NGX_INVALID_FILE;
+
+    } else {
+        file.fd = ngx_open_file(ctx->playlist.data, NGX_FILE_RDONLY,
+                                NGX_FILE_OPEN, 0);
+        if (file.fd == NGX_INVALID_FILE) {
+            return;
+        }
     }
 
     offset = 0;
@@ -1008,7 +2522,14 @@ ngx_rtmp_hls_restore_stream(ngx_rtmp_session_t *s)
 
     for ( ;; ) {
 
-        ret = ngx_read_file(&file, buffer, sizeof(buffer), offset);
+        if (hacf->store) {
+            ret = ngx_rtmp_hls_store_read(hmcf->store_zone, &ctx->playlist,
+                                          buffer, sizeof(buffer), offset);
+
+        } else {
+            ret = ngx_read_file(&file, buffer, sizeof(buffer), offset);
+        }
+
         if (ret <= 0) {
             goto done;
         }
@@ -1162,7 +2683,9 @@ ngx_rtmp_hls_restore_stream(ngx_rtmp_session_t *s)
     }
 
 done:
-    ngx_close_file(file.fd);
+    if (file.fd != NGX_INVALID_FILE) {
+        ngx_close_file(file.fd);
+    }
 }
 
 
@@ -1220,51 +2743,204 @@ ngx_rtmp_hls_ensure_directory(ngx_rtmp_session_t *s, ngx_str_t *path)
         return NGX_OK;
     }
 
-    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
+
+    len = path->len;
+    if (path->data[len - 1] == '/') {
+        len--;
+    }
+
+    if (len + 1 + ctx->name.len + 1 > sizeof(zpath)) {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0, "hls: too long path");
+        return NGX_ERROR;
+    }
+
+    ngx_snprintf(zpath, sizeof(zpath) - 1, "%*s/%V%Z", len, path->data,
+                 &ctx->name);
+
+    if (ngx_file_info(zpath, &fi) != NGX_FILE_ERROR) {
+
+        if (ngx_is_dir(&fi)) {
+            ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                           "hls: directory '%s' exists", zpath);
+            return NGX_OK;
+        }
+
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                      "hls: '%s' exists and is not a directory", zpath);
+
+        return  NGX_ERROR;
+    }
+
+    if (ngx_errno != NGX_ENOENT) {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
+                      "hls: " ngx_file_info_n " failed on '%s'", zpath);
+        return NGX_ERROR;
+    }
+
+    /* NGX_ENOENT */
+
+    if (ngx_create_dir(zpath, NGX_RTMP_HLS_DIR_ACCESS) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
+                      "hls: " ngx_create_dir_n " failed on '%s'", zpath);
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                   "hls: directory '%s' created", zpath);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_rtmp_hls_join_group(ngx_rtmp_session_t *s)
+{
+    size_t                     len;
+    ngx_rtmp_hls_ctx_t        *ctx;
+    ngx_rtmp_hls_group_t      *g;
+    ngx_rtmp_hls_app_conf_t   *hacf;
+    ngx_rtmp_hls_main_conf_t  *hmcf;
+
+    hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
+    hmcf = ngx_rtmp_get_module_main_conf(s, ngx_rtmp_hls_module);
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
+
+    len = ctx->name.len - ctx->var->suffix.len;
+
+    for (g = hmcf->groups; g; g = g->next) {
+        if (g->conf == hacf && g->len == len &&
+            ngx_memcmp(g->name, ctx->name.data, len) == 0)
+        {
+            break;
+        }
+    }
+
+    if (g == NULL) {
+        g = hmcf->free_groups;
+
+        if (g) {
+            hmcf->free_groups = g->next;
+
+        } else {
+            g = ngx_palloc(hmcf->pool, sizeof(ngx_rtmp_hls_group_t));
+            if (g == NULL) {
+                return NGX_ERROR;
+            }
+        }
+
+        ngx_memzero(g, sizeof(ngx_rtmp_hls_group_t));
+
+        g->conf = hacf;
+        g->len = ngx_min(len, sizeof(g->name));
+        ngx_memcpy(g->name, ctx->name.data, g->len);
+
+        g->next = hmcf->groups;
+        hmcf->groups = g;
+    }
+
+    g->nmembers++;
+
+    if (ctx->var == hacf->variant->elts) {
+        g->top = s;
+    }
+
+    ctx->group = g;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                   "hls: join group '%*s', members=%ui",
+                   g->len, g->name, g->nmembers);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_rtmp_hls_leave_group(ngx_rtmp_session_t *s)
+{
+    ngx_rtmp_hls_ctx_t        *ctx;
+    ngx_rtmp_hls_group_t      *g, **gg;
+    ngx_rtmp_hls_main_conf_t  *hmcf;
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
+
+    g = ctx->group;
+    if (g == NULL) {
+        return;
+    }
+
+    ctx->group = NULL;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                   "hls: leave group '%*s', members=%ui",
+                   g->len, g->name, g->nmembers - 1);
+
+    /* other renditions fall back to their own slicing */
+
+    if (g->top == s) {
+        g->top = NULL;
+    }
+
+    if (--g->nmembers) {
+        return;
+    }
+
+    hmcf = ngx_rtmp_get_module_main_conf(s, ngx_rtmp_hls_module);
 
-    len = path->len;
-    if (path->data[len - 1] == '/') {
-        len--;
+    for (gg = &hmcf->groups; *gg; gg = &(*gg)->next) {
+        if (*gg == g) {
+            *gg = g->next;
+            break;
+        }
     }
 
-    if (len + 1 + ctx->name.len + 1 > sizeof(zpath)) {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0, "hls: too long path");
-        return NGX_ERROR;
-    }
+    g->next = hmcf->free_groups;
+    hmcf->free_groups = g;
+}
 
-    ngx_snprintf(zpath, sizeof(zpath) - 1, "%*s/%V%Z", len, path->data,
-                 &ctx->name);
 
-    if (ngx_file_info(zpath, &fi) != NGX_FILE_ERROR) {
+static ngx_int_t
+ngx_rtmp_hls_check_dash(ngx_rtmp_session_t *s)
+{
+    ngx_str_t                       hpath, dpath;
+    ngx_rtmp_hls_app_conf_t        *hacf;
+    ngx_rtmp_dash_app_conf_t       *dacf;
 
-        if (ngx_is_dir(&fi)) {
-            ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
-                           "hls: directory '%s' exists", zpath);
-            return NGX_OK;
-        }
+    hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
+    dacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_dash_module);
 
+    if (dacf == NULL || !dacf->dash || dacf->path.len == 0) {
         ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
-                      "hls: '%s' exists and is not a directory", zpath);
-
-        return  NGX_ERROR;
+                      "hls: fmp4 fragment format requires dash");
+        return NGX_ERROR;
     }
 
-    if (ngx_errno != NGX_ENOENT) {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                      "hls: " ngx_file_info_n " failed on '%s'", zpath);
-        return NGX_ERROR;
+    if (hacf->base_url.len) {
+        return NGX_OK;
     }
 
-    /* NGX_ENOENT */
+    /* fragments are referenced relative to the playlists */
 
-    if (ngx_create_dir(zpath, NGX_RTMP_HLS_DIR_ACCESS) == NGX_FILE_ERROR) {
-        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
-                      "hls: " ngx_create_dir_n " failed on '%s'", zpath);
-        return NGX_ERROR;
+    hpath = hacf->path;
+    dpath = dacf->path;
+
+    while (hpath.len > 1 && hpath.data[hpath.len - 1] == '/') {
+        hpath.len--;
     }
 
-    ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
-                   "hls: directory '%s' created", zpath);
+    while (dpath.len > 1 && dpath.data[dpath.len - 1] == '/') {
+        dpath.len--;
+    }
+
+    if (hpath.len != dpath.len ||
+        ngx_strncmp(hpath.data, dpath.data, hpath.len) != 0 ||
+        !hacf->nested != !dacf->nested)
+    {
+        ngx_log_error(NGX_LOG_WARN, s->connection->log, 0,
+                      "hls: dash fragments in '%V' are not next to "
+                      "playlists in '%V', hls_base_url is needed",
+                      &dacf->path, &hacf->path);
+    }
 
     return NGX_OK;
 }
@@ -1274,13 +2950,17 @@ static ngx_int_t
 ngx_rtmp_hls_publish(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
 {
     ngx_rtmp_hls_app_conf_t        *hacf;
+    ngx_rtmp_hls_main_conf_t       *hmcf;
     ngx_rtmp_hls_ctx_t             *ctx;
     u_char                         *p, *pp;
     ngx_rtmp_hls_frag_t            *f;
-    ngx_buf_t                      *b;
+    ngx_rtmp_hls_part_t            *part;
+    ngx_buf_t                      *b, pl;
+    ngx_chain_t                    *free;
     size_t                          len;
     ngx_rtmp_hls_variant_t         *var;
     ngx_uint_t                      n;
+    ngx_pool_cleanup_t             *cln;
 
     hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
     if (hacf == NULL || !hacf->hls || hacf->path.len == 0) {
@@ -1291,6 +2971,12 @@ ngx_rtmp_hls_publish(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
         goto next;
     }
 
+    if (hacf->format == NGX_RTMP_HLS_FORMAT_FMP4 &&
+        ngx_rtmp_hls_check_dash(s) != NGX_OK)
+    {
+        goto next;
+    }
+
     ngx_log_debug2(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
                    "hls: publish: name='%s' type='%s'",
                    v->name, v->type);
@@ -1300,17 +2986,42 @@ ngx_rtmp_hls_publish(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
     if (ctx == NULL) {
 
         ctx = ngx_pcalloc(s->connection->pool, sizeof(ngx_rtmp_hls_ctx_t));
+        if (ctx == NULL) {
+            goto next;
+        }
+
+        cln = ngx_pool_cleanup_add(s->connection->pool, 0);
+        if (cln == NULL) {
+            goto next;
+        }
+
+        cln->handler = ngx_rtmp_hls_playlist_cleanup;
+        cln->data = ctx;
+
         ngx_rtmp_set_ctx(s, ctx, ngx_rtmp_hls_module);
 
     } else {
 
+        ngx_rtmp_hls_leave_group(s);
+
         f = ctx->frags;
         b = ctx->aframe;
+        part = ctx->parts;
+        pl = ctx->pl;
+        free = ctx->free;
 
         ngx_memzero(ctx, sizeof(ngx_rtmp_hls_ctx_t));
 
         ctx->frags = f;
         ctx->aframe = b;
+        ctx->parts = part;
+        ctx->pl = pl;
+        ctx->free = free;
+
+        if (pl.start) {
+            ctx->pl.pos = pl.start + ngx_rtmp_hls_playlist_head(hacf);
+            ctx->pl.last = ctx->pl.pos;
+        }
 
         if (b) {
             b->pos = b->last = b->start;
@@ -1326,6 +3037,20 @@ ngx_rtmp_hls_publish(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
         }
     }
 
+    if (hacf->partlen && ctx->parts == NULL) {
+        ctx->parts = ngx_pcalloc(s->connection->pool,
+                                 sizeof(ngx_rtmp_hls_part_t) * hacf->maxparts *
+                                 (hacf->winfrags * 2 + 1));
+        if (ctx->parts == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (hacf->store) {
+        hmcf = ngx_rtmp_get_module_main_conf(s, ngx_rtmp_hls_module);
+        ctx->generation = ngx_rtmp_hls_store_generation(hmcf->store_zone);
+    }
+
     if (ngx_strstr(v->name, "..")) {
         ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
                       "hls: bad stream name: '%s'", v->name);
@@ -1369,6 +3094,40 @@ ngx_rtmp_hls_publish(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
     ngx_memcpy(ctx->stream.data, ctx->playlist.data, ctx->stream.len - 1);
     ctx->stream.data[ctx->stream.len - 1] = (hacf->nested ? '/' : '-');
 
+    /* track playlist paths: stream prefix followed by <track>.m3u8 */
+
+    if (hacf->format == NGX_RTMP_HLS_FORMAT_FMP4) {
+        len = ctx->stream.len + sizeof("video.m3u8.bak");
+
+        ctx->track_playlist.data = ngx_palloc(s->connection->pool, len);
+        ctx->track_playlist_bak.data = ngx_palloc(s->connection->pool, len);
+
+        if (ctx->track_playlist.data == NULL ||
+            ctx->track_playlist_bak.data == NULL)
+        {
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(ctx->track_playlist.data, ctx->stream.data,
+                   ctx->stream.len);
+        ngx_memcpy(ctx->track_playlist_bak.data, ctx->stream.data,
+                   ctx->stream.len);
+    }
+
+    /* part file path: stream prefix followed by <id>.<part>.ts */
+
+    if (hacf->partlen) {
+        ctx->partfile.len = ctx->stream.len;
+        ctx->partfile.data = ngx_palloc(s->connection->pool,
+                                        ctx->stream.len + NGX_INT64_LEN + 1 +
+                                        NGX_INT_T_LEN + sizeof(".ts"));
+        if (ctx->partfile.data == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(ctx->partfile.data, ctx->stream.data, ctx->stream.len);
+    }
+
     /* varint playlist path */
 
     if (hacf->variant) {
@@ -1405,6 +3164,10 @@ ngx_rtmp_hls_publish(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
                 pp = ngx_cpymem(pp, ".bak", sizeof(".bak") - 1);
                 *pp = 0;
 
+                if (ngx_rtmp_hls_join_group(s) != NGX_OK) {
+                    return NGX_ERROR;
+                }
+
                 break;
             }
         }
@@ -1465,7 +3228,15 @@ ngx_rtmp_hls_publish(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
                    &ctx->playlist, &ctx->playlist_bak,
                    &ctx->stream, &ctx->keyfile);
 
-    if (hacf->continuous) {
+    if (hacf->format == NGX_RTMP_HLS_FORMAT_FMP4) {
+
+        /* fragments are written by dash, only playlists are here */
+
+        if (ngx_rtmp_hls_ensure_directory(s, &hacf->path) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+    } else if (hacf->continuous) {
         ngx_rtmp_hls_restore_stream(s);
     }
 
@@ -1474,6 +3245,83 @@ next:
 }
 
 
+static void
+ngx_rtmp_hls_expire_stream(ngx_rtmp_session_t *s)
+{
+    u_char                         *p;
+    ngx_str_t                      *guard;
+    ngx_uint_t                      i;
+    ngx_rtmp_hls_ctx_t             *ctx;
+    ngx_rtmp_hls_frag_t            *f;
+    ngx_rtmp_hls_expire_t          *e;
+    ngx_rtmp_hls_app_conf_t        *hacf;
+
+    hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
+
+    if (ctx->playlist.data == NULL) {
+        return;
+    }
+
+    ngx_rtmp_hls_expire(s, ctx->playlist.data, ctx->playlist.len, NULL,
+                        hacf->playlen);
+
+    /* other renditions keep refreshing the variant playlist */
+
+    if (ctx->var_playlist.data) {
+        ngx_rtmp_hls_expire(s, ctx->var_playlist.data, ctx->var_playlist.len,
+                            NULL, hacf->playlen);
+    }
+
+    if (ctx->track_playlist.data) {
+        p = ngx_cpymem(ctx->track_playlist.data + ctx->stream.len,
+                       "video.m3u8", sizeof("video.m3u8") - 1);
+        ngx_rtmp_hls_expire(s, ctx->track_playlist.data,
+                            p - ctx->track_playlist.data, NULL,
+                            hacf->playlen);
+
+        p = ngx_cpymem(ctx->track_playlist.data + ctx->stream.len,
+                       "audio.m3u8", sizeof("audio.m3u8") - 1);
+        ngx_rtmp_hls_expire(s, ctx->track_playlist.data,
+                            p - ctx->track_playlist.data, NULL,
+                            hacf->playlen);
+    }
+
+    /* continuous stream coming back rewrites the playlist and lists them */
+
+    guard = hacf->continuous ? &ctx->playlist : NULL;
+
+    for (i = 0; i < ctx->nfrags; i++) {
+        f = ngx_rtmp_hls_get_frag(s, i);
+
+        ngx_rtmp_hls_expire_frag(s, f,
+                                 i + 1 == ctx->nfrags ||
+                                 f->key_id != ngx_rtmp_hls_get_frag(s, i + 1)
+                                              ->key_id,
+                                 guard, hacf->playlen * 2);
+    }
+
+    /* nested directories go after the last files queued in them */
+
+    if (hacf->nested) {
+        e = ngx_rtmp_hls_expire(s, ctx->stream.data, ctx->stream.len - 1,
+                                NULL, hacf->playlen * 2);
+        if (e) {
+            e->dir = 1;
+        }
+
+        if (ctx->keyfile.data) {
+            e = ngx_rtmp_hls_expire(s, ctx->keyfile.data,
+                                    ctx->keyfile.len - 1, NULL,
+                                    hacf->playlen * 2);
+            if (e) {
+                e->dir = 1;
+            }
+        }
+    }
+}
+
+
 static ngx_int_t
 ngx_rtmp_hls_close_stream(ngx_rtmp_session_t *s, ngx_rtmp_close_stream_t *v)
 {
@@ -1493,6 +3341,10 @@ ngx_rtmp_hls_close_stream(ngx_rtmp_session_t *s, ngx_rtmp_close_stream_t *v)
 
     ngx_rtmp_hls_close_fragment(s);
 
+    ngx_rtmp_hls_leave_group(s);
+
+    ngx_rtmp_hls_expire_stream(s);
+
 next:
     return next_close_stream(s, v);
 }
@@ -1560,21 +3412,24 @@ ngx_rtmp_hls_parse_aac_header(ngx_rtmp_session_t *s, ngx_uint_t *objtype,
 
 static void
 ngx_rtmp_hls_update_fragment(ngx_rtmp_session_t *s, uint64_t ts,
-    ngx_int_t boundary, ngx_uint_t flush_rate)
+    ngx_int_t boundary, ngx_int_t key, ngx_uint_t flush_rate)
 {
     ngx_rtmp_hls_ctx_t         *ctx;
     ngx_rtmp_hls_app_conf_t    *hacf;
     ngx_rtmp_hls_frag_t        *f;
     ngx_msec_t                  ts_frag_len;
-    ngx_int_t                   same_frag, force,discont;
+    ngx_int_t                   same_frag, force,discont, cut;
     ngx_buf_t                  *b;
     int64_t                     d;
+    uint64_t                    dur;
+    ngx_rtmp_hls_group_t       *g;
 
     hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
     ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
     f = NULL;
     force = 0;
     discont = 1;
+    cut = boundary;
 
     if (ctx->opened) {
         f = ngx_rtmp_hls_get_frag(s, ctx->nfrags);
@@ -1615,9 +3470,47 @@ ngx_rtmp_hls_update_fragment(ngx_rtmp_session_t *s, uint64_t ts,
             break;
     }
 
+    /*
+     * other renditions of the group close their fragment at the first
+     * key frame after the top rendition has started a new one; they
+     * come from other publishers with timestamps of their own, so only
+     * the group fragment number is compared
+     */
+
+    g = ctx->group;
+
+    if (g && g->top && g->top != s && f) {
+        boundary = 0;
+
+        if (cut && g->frag > ctx->group_frag) {
+            boundary = 1;
+            ctx->group_frag = g->frag;
+        }
+    }
+
     if (boundary || force) {
         ngx_rtmp_hls_close_fragment(s);
         ngx_rtmp_hls_open_fragment(s, ts, discont);
+
+    } else if (hacf->partlen && ctx->opened && (flush_rate == 1 || key)) {
+
+        /*
+         * parts are cut at video frames, or audio frames if there's no
+         * video; the part is closed before the frame which would make
+         * it longer than hls_partial_fragment
+         */
+
+        dur = ts > ctx->last_ts ? ts - ctx->last_ts : 0;
+
+        if (ts >= ctx->part_ts &&
+            ts - ctx->part_ts + dur > (uint64_t) hacf->partlen * 90)
+        {
+            ngx_rtmp_hls_next_part(s, ts, key);
+        }
+    }
+
+    if (flush_rate == 1 || key) {
+        ctx->last_ts = ts;
     }
 
     b = ctx->aframe;
@@ -1637,6 +3530,7 @@ ngx_rtmp_hls_flush_audio(ngx_rtmp_session_t *s)
     ngx_rtmp_mpegts_frame_t         frame;
     ngx_int_t                       rc;
     ngx_buf_t                      *b;
+    ngx_chain_t                     out;
 
     ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_hls_module);
 
@@ -1661,7 +3555,10 @@ ngx_rtmp_hls_flush_audio(ngx_rtmp_session_t *s)
     ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
                    "hls: flush audio pts=%uL", frame.pts);
 
-    rc = ngx_rtmp_mpegts_write_frame(&ctx->file, &frame, b);
+    out.buf = b;
+    out.next = NULL;
+
+    rc = ngx_rtmp_hls_write_frame(s, &frame, &out);
 
     if (rc != NGX_OK) {
         ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
@@ -1696,6 +3593,7 @@ ngx_rtmp_hls_audio(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
     codec_ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_codec_module);
 
     if (hacf == NULL || !hacf->hls || ctx == NULL ||
+        hacf->format == NGX_RTMP_HLS_FORMAT_FMP4 ||
         codec_ctx == NULL  || h->mlen < 2)
     {
         return NGX_OK;
@@ -1742,7 +3640,8 @@ ngx_rtmp_hls_audio(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
      * do it in video handler
      */
 
-    ngx_rtmp_hls_update_fragment(s, pts, codec_ctx->avc_header == NULL, 2);
+    ngx_rtmp_hls_update_fragment(s, pts, codec_ctx->avc_header == NULL,
+                                 codec_ctx->avc_header == NULL, 2);
 
     if (b->last + size > b->end) {
         ngx_rtmp_hls_flush_audio(s);
@@ -1843,15 +3742,15 @@ ngx_rtmp_hls_video(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
     ngx_rtmp_hls_app_conf_t        *hacf;
     ngx_rtmp_hls_ctx_t             *ctx;
     ngx_rtmp_codec_ctx_t           *codec_ctx;
-    u_char                         *p;
+    u_char                         *p, *nal;
     uint8_t                         fmt, ftype, htype, nal_type, src_nal_type;
     uint32_t                        len, rlen;
-    ngx_buf_t                       out, *b;
+    ngx_buf_t                      *b;
+    ngx_chain_t                    *out, **ll, *nal_in;
     uint32_t                        cts;
     ngx_rtmp_mpegts_frame_t         frame;
-    ngx_uint_t                      nal_bytes;
+    ngx_uint_t                      nal_bytes, hevc;
     ngx_int_t                       aud_sent, sps_pps_sent, boundary;
-    static u_char                   buffer[NGX_RTMP_HLS_BUFSIZE];
 
     hacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_hls_module);
 
@@ -1860,16 +3759,19 @@ ngx_rtmp_hls_video(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
     codec_ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_codec_module);
 
     if (hacf == NULL || !hacf->hls || ctx == NULL || codec_ctx == NULL ||
+        hacf->format == NGX_RTMP_HLS_FORMAT_FMP4 ||
         codec_ctx->avc_header == NULL || h->mlen < 1)
     {
         return NGX_OK;
     }
 
-    /* Only H264 is supported */
-    if (codec_ctx->video_codec_id != NGX_RTMP_VIDEO_H264) {
+    /* Only H264 and HEVC are supported */
+    if (!ngx_rtmp_is_avc_like(codec_ctx->video_codec_id)) {
         return NGX_OK;
     }
 
+    hevc = (codec_ctx->video_codec_id == NGX_RTMP_VIDEO_HEVC);
+
     p = in->buf->pos;
     if (ngx_rtmp_hls_copy(s, &fmt, &p, 1, &in) != NGX_OK) {
         return NGX_ERROR;
@@ -1879,35 +3781,54 @@ ngx_rtmp_hls_video(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
      * 2: inter frame
      * 3: disposable inter frame */
 
-    ftype = (fmt & 0xf0) >> 4;
+    ftype = (fmt & 0x70) >> 4;
 
-    /* H264 HDR/PICT */
+    cts = 0;
 
-    if (ngx_rtmp_hls_copy(s, &htype, &p, 1, &in) != NGX_OK) {
-        return NGX_ERROR;
-    }
+    if (fmt & NGX_RTMP_VIDEO_EX_HEADER) {
 
-    /* proceed only with PICT */
+        /* enhanced RTMP: FourCC, composition time only in CodedFrames */
 
-    if (htype != 1) {
-        return NGX_OK;
-    }
+        htype = fmt & 0x0f;
 
-    /* 3 bytes: decoder delay */
+        if (htype != NGX_RTMP_VIDEO_PACKET_CODED_FRAMES &&
+            htype != NGX_RTMP_VIDEO_PACKET_CODED_FRAMES_X)
+        {
+            return NGX_OK;
+        }
 
-    if (ngx_rtmp_hls_copy(s, &cts, &p, 3, &in) != NGX_OK) {
-        return NGX_ERROR;
+        if (ngx_rtmp_hls_copy(s, NULL, &p, 4, &in) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+    } else {
+
+        /* H264 HDR/PICT */
+
+        if (ngx_rtmp_hls_copy(s, &htype, &p, 1, &in) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        /* proceed only with PICT */
+
+        if (htype != 1) {
+            return NGX_OK;
+        }
     }
 
-    cts = ((cts & 0x00FF0000) >> 16) | ((cts & 0x000000FF) << 16) |
-          (cts & 0x0000FF00);
+    /* 3 bytes: decoder delay */
+
+    if (htype == 1) {
+        if (ngx_rtmp_hls_copy(s, &cts, &p, 3, &in) != NGX_OK) {
+            return NGX_ERROR;
+        }
 
-    ngx_memzero(&out, sizeof(out));
+        cts = ((cts & 0x00FF0000) >> 16) | ((cts & 0x000000FF) << 16) |
+              (cts & 0x0000FF00);
+    }
 
-    out.start = buffer;
-    out.end = buffer + sizeof(buffer);
-    out.pos = out.start;
-    out.last = out.pos;
+    out = NULL;
+    ll = &out;
 
     nal_bytes = codec_ctx->avc_nal_bytes;
     aud_sent = 0;
@@ -1915,7 +3836,7 @@ ngx_rtmp_hls_video(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
 
     while (in) {
         if (ngx_rtmp_hls_copy(s, &rlen, &p, nal_bytes, &in) != NGX_OK) {
-            return NGX_OK;
+            goto done;
         }
 
         len = 0;
@@ -1925,48 +3846,59 @@ ngx_rtmp_hls_video(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
             continue;
         }
 
+        nal = p;
+        nal_in = in;
+
         if (ngx_rtmp_hls_copy(s, &src_nal_type, &p, 1, &in) != NGX_OK) {
-            return NGX_OK;
+            goto done;
         }
 
-        nal_type = src_nal_type & 0x1f;
+        nal_type = ngx_rtmp_hls_nal_class(src_nal_type, hevc);
 
-        ngx_log_debug2(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
-                       "hls: h264 NAL type=%ui, len=%uD",
-                       (ngx_uint_t) nal_type, len);
+        ngx_log_debug3(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                       "hls: %s NAL type=%ui, len=%uD",
+                       hevc ? "hevc" : "h264",
+                       (ngx_uint_t) (hevc ? (src_nal_type >> 1) & 0x3f
+                                          : src_nal_type & 0x1f),
+                       len);
 
-        if (nal_type >= 7 && nal_type <= 9) {
+        if (nal_type == NGX_RTMP_HLS_NAL_PARAMS ||
+            nal_type == NGX_RTMP_HLS_NAL_AUD)
+        {
             if (ngx_rtmp_hls_copy(s, NULL, &p, len - 1, &in) != NGX_OK) {
-                return NGX_ERROR;
+                goto failed;
             }
             continue;
         }
 
         if (!aud_sent) {
             switch (nal_type) {
-                case 1:
-                case 5:
-                case 6:
-                    if (ngx_rtmp_hls_append_aud(s, &out) != NGX_OK) {
+                case NGX_RTMP_HLS_NAL_SLICE:
+                case NGX_RTMP_HLS_NAL_IDR:
+                case NGX_RTMP_HLS_NAL_SEI:
+                    if (ngx_rtmp_hls_append_aud(s, &ll, hevc) != NGX_OK) {
                         ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
                                       "hls: error appending AUD NAL");
                     }
                     /* fall through */
-                case 9:
+                case NGX_RTMP_HLS_NAL_AUD:
                     aud_sent = 1;
                     break;
             }
         }
 
         switch (nal_type) {
-            case 1:
+            case NGX_RTMP_HLS_NAL_SLICE:
                 sps_pps_sent = 0;
                 break;
-            case 5:
+            case NGX_RTMP_HLS_NAL_IDR:
                 if (sps_pps_sent) {
                     break;
                 }
-                if (ngx_rtmp_hls_append_sps_pps(s, &out) != NGX_OK) {
+                if ((hevc ? ngx_rtmp_hls_append_hevc_params(s, &ll)
+                          : ngx_rtmp_hls_append_sps_pps(s, &ll))
+                    != NGX_OK)
+                {
                     ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
                                   "hls: error appenging SPS/PPS NALs");
                 }
@@ -1974,38 +3906,20 @@ ngx_rtmp_hls_video(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
                 break;
         }
 
-        /* AnnexB prefix */
-
-        if (out.end - out.last < 5) {
-            ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
-                          "hls: not enough buffer for AnnexB prefix");
-            return NGX_OK;
-        }
-
-        /* first AnnexB prefix is long (4 bytes) */
+        /* AnnexB prefix, first one is long (4 bytes) */
 
-        if (out.last == out.pos) {
-            *out.last++ = 0;
+        if (ngx_rtmp_hls_append_start_code(s, &ll, out ? 3 : 4) != NGX_OK) {
+            goto failed;
         }
 
-        *out.last++ = 0;
-        *out.last++ = 0;
-        *out.last++ = 1;
-        *out.last++ = src_nal_type;
-
-        /* NAL body */
-
-        if (out.end - out.last < (ngx_int_t) len) {
-            ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
-                          "hls: not enough buffer for NAL");
-            return NGX_OK;
-        }
+        /* NAL header and body referenced in place */
 
-        if (ngx_rtmp_hls_copy(s, out.last, &p, len - 1, &in) != NGX_OK) {
-            return NGX_ERROR;
+        if (ngx_rtmp_hls_append_data(s, &ll, &nal, len, &nal_in) != NGX_OK) {
+            goto failed;
         }
 
-        out.last += (len - 1);
+        p = nal;
+        in = nal_in;
     }
 
     ngx_memzero(&frame, sizeof(frame));
@@ -2027,23 +3941,33 @@ ngx_rtmp_hls_video(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
     boundary = frame.key && (codec_ctx->aac_header == NULL || !ctx->opened ||
                              (b && b->last > b->pos));
 
-    ngx_rtmp_hls_update_fragment(s, frame.dts, boundary, 1);
+    ngx_rtmp_hls_update_fragment(s, frame.dts, boundary, frame.key, 1);
 
     if (!ctx->opened) {
-        return NGX_OK;
+        goto done;
     }
 
     ngx_log_debug2(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
                    "hls: video pts=%uL, dts=%uL", frame.pts, frame.dts);
 
-    if (ngx_rtmp_mpegts_write_frame(&ctx->file, &frame, &out) != NGX_OK) {
+    if (ngx_rtmp_hls_write_frame(s, &frame, out) != NGX_OK) {
         ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
                       "hls: video frame failed");
     }
 
     ctx->video_cc = frame.cc;
 
+done:
+
+    ngx_rtmp_hls_free_chain(s, out);
+
     return NGX_OK;
+
+failed:
+
+    ngx_rtmp_hls_free_chain(s, out);
+
+    return NGX_ERROR;
 }
 
 
@@ -2220,12 +4144,18 @@ ngx_rtmp_hls_cleanup(void *data)
 {
     ngx_rtmp_hls_cleanup_t *cleanup = data;
 
+    /*
+     * workers expire what they create, the scan is left with files of
+     * previous runs, of crashed workers and of workers which exited
+     * before their files expired
+     */
+
     ngx_rtmp_hls_cleanup_dir(&cleanup->path, cleanup->playlen);
 
 #if (nginx_version >= 1011005)
-    return cleanup->playlen * 2;
+    return NGX_RTMP_HLS_CLEANUP_SCAN * 1000;
 #else
-    return cleanup->playlen / 500;
+    return NGX_RTMP_HLS_CLEANUP_SCAN;
 #endif
 }
 
@@ -2282,6 +4212,60 @@ ngx_rtmp_hls_variant(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 }
 
 
+static void *
+ngx_rtmp_hls_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_rtmp_hls_main_conf_t   *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_rtmp_hls_main_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    conf->store_size = NGX_CONF_UNSET_SIZE;
+    conf->pool = cf->pool;
+
+    ngx_queue_init(&conf->expire);
+
+    conf->expire_evt.handler = ngx_rtmp_hls_expire_handler;
+    conf->expire_evt.data = conf;
+    conf->expire_evt.log = &cf->cycle->new_log;
+    conf->expire_evt.cancelable = 1;
+
+    return conf;
+}
+
+
+static char *
+ngx_rtmp_hls_init_main_conf(ngx_conf_t *cf, void *conf)
+{
+    ngx_rtmp_hls_main_conf_t   *hmcf = conf;
+
+    ngx_conf_init_size_value(hmcf->store_size, NGX_RTMP_HLS_STORE_SIZE);
+
+    return NGX_CONF_OK;
+}
+
+
+ngx_shm_zone_t *
+ngx_rtmp_hls_store_get_zone(ngx_conf_t *cf)
+{
+    ngx_rtmp_hls_main_conf_t   *hmcf;
+
+    hmcf = ngx_rtmp_conf_get_module_main_conf(cf, ngx_rtmp_hls_module);
+
+    /* may come before ngx_rtmp_hls_init_main_conf() from dash_store */
+
+    if (hmcf->store_zone == NULL) {
+        ngx_conf_init_size_value(hmcf->store_size, NGX_RTMP_HLS_STORE_SIZE);
+
+        hmcf->store_zone = ngx_rtmp_hls_store_add_zone(cf, hmcf->store_size);
+    }
+
+    return hmcf->store_zone;
+}
+
+
 static void *
 ngx_rtmp_hls_create_app_conf(ngx_conf_t *cf)
 {
@@ -2309,6 +4293,9 @@ ngx_rtmp_hls_create_app_conf(ngx_conf_t *cf)
     conf->granularity = NGX_CONF_UNSET;
     conf->keys = NGX_CONF_UNSET;
     conf->frags_per_key = NGX_CONF_UNSET_UINT;
+    conf->store = NGX_CONF_UNSET;
+    conf->partlen = NGX_CONF_UNSET_MSEC;
+    conf->format = NGX_CONF_UNSET_UINT;
 
     return conf;
 }
@@ -2347,14 +4334,64 @@ ngx_rtmp_hls_merge_app_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_str_value(conf->key_path, prev->key_path, "");
     ngx_conf_merge_str_value(conf->key_url, prev->key_url, "");
     ngx_conf_merge_uint_value(conf->frags_per_key, prev->frags_per_key, 0);
+    ngx_conf_merge_value(conf->store, prev->store, 0);
+    ngx_conf_merge_msec_value(conf->partlen, prev->partlen, 0);
+    ngx_conf_merge_uint_value(conf->format, prev->format,
+                              NGX_RTMP_HLS_FORMAT_MPEGTS);
+
+    if (conf->format == NGX_RTMP_HLS_FORMAT_FMP4 &&
+        (conf->keys || conf->partlen || conf->store || conf->variant))
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "hls_fragment_format fmp4 is not supported with "
+                           "hls_keys, hls_partial_fragment, hls_store "
+                           "or hls_variant");
+        return NGX_CONF_ERROR;
+    }
 
     if (conf->fraglen) {
         conf->winfrags = conf->playlen / conf->fraglen;
     }
 
+    if (conf->partlen) {
+        if (conf->partlen > conf->fraglen) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "hls_partial_fragment is longer than "
+                               "hls_fragment");
+            return NGX_CONF_ERROR;
+        }
+
+        if (conf->keys) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "hls_partial_fragment is not supported "
+                               "with hls_keys");
+            return NGX_CONF_ERROR;
+        }
+
+        /* players expect blocking reload with parts, that is the store */
+
+        if (!conf->store) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "hls_partial_fragment requires hls_store");
+            return NGX_CONF_ERROR;
+        }
+
+        /* fragments are forced to close at hls_max_fragment */
+
+        conf->maxparts = conf->max_fraglen / conf->partlen + 1;
+    }
+
+    /* store entries expire by themselves, there is no directory to clean */
+
+    if (conf->hls && conf->store) {
+        if (ngx_rtmp_hls_store_get_zone(cf) == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
     /* schedule cleanup */
 
-    if (conf->hls && conf->path.len && conf->cleanup &&
+    if (conf->hls && conf->path.len && conf->cleanup && !conf->store &&
         conf->type != NGX_RTMP_HLS_TYPE_EVENT)
     {
         if (conf->path.data[conf->path.len - 1] == '/') {
@@ -2387,7 +4424,7 @@ ngx_rtmp_hls_merge_app_conf(ngx_conf_t *cf, void *parent, void *child)
 
     ngx_conf_merge_str_value(conf->path, prev->path, "");
 
-    if (conf->keys && conf->cleanup && conf->key_path.len &&
+    if (conf->keys && conf->cleanup && !conf->store && conf->key_path.len &&
         ngx_strcmp(conf->key_path.data, conf->path.data) != 0 &&
         conf->type != NGX_RTMP_HLS_TYPE_EVENT)
     {
@@ -2455,5 +4492,8 @@ ngx_rtmp_hls_postconfiguration(ngx_conf_t *cf)
     next_stream_eof = ngx_rtmp_stream_eof;
     ngx_rtmp_stream_eof = ngx_rtmp_hls_stream_eof;
 
+    next_dash_fragment = ngx_rtmp_dash_fragment;
+    ngx_rtmp_dash_fragment = ngx_rtmp_hls_dash_fragment;
+
     return NGX_OK;
 }
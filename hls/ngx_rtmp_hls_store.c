@@ -0,0 +1,529 @@
+
+/*
+ * Copyright (C) Roman Arutyunyan
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include "ngx_rtmp_hls_store.h"
+
+
+/*
+ * HLS segment store: playlists, fragments and keys of the live window
+ * are kept in shared memory under the path they would have on disk and
+ * served from there by ngx_rtmp_hls_http_module. An entry is built
+ * unlinked by one writer and becomes visible at close, replacing the
+ * previous entry of the same name; after that it never changes.
+ * Readers hold a reference for the lifetime of the request, so expired
+ * and replaced entries are freed only when the last reader is done.
+ * A pending entry is an empty placeholder linked in advance so that
+ * readers can wait for the real one instead of getting 404.
+ */
+
+
+extern ngx_module_t  ngx_rtmp_hls_module;
+
+
+static ngx_str_t  ngx_rtmp_hls_store_name = ngx_string("rtmp_hls_store");
+
+
+static ngx_int_t
+ngx_rtmp_hls_store_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_slab_pool_t                *shpool;
+    ngx_rtmp_hls_store_shctx_t     *sh;
+
+    if (data) {
+        shm_zone->data = data;
+        return NGX_OK;
+    }
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        shm_zone->data = shpool->data;
+        return NGX_OK;
+    }
+
+    sh = ngx_slab_calloc(shpool, sizeof(ngx_rtmp_hls_store_shctx_t));
+    if (sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_rbtree_init(&sh->rbtree, &sh->sentinel, ngx_str_rbtree_insert_value);
+    ngx_queue_init(&sh->entries);
+
+    shpool->data = sh;
+    shm_zone->data = sh;
+
+    return NGX_OK;
+}
+
+
+ngx_shm_zone_t *
+ngx_rtmp_hls_store_add_zone(ngx_conf_t *cf, size_t size)
+{
+    ngx_shm_zone_t                 *zone;
+
+    /* zero size refers to the zone declared by rtmp{} */
+
+    zone = ngx_shared_memory_add(cf, &ngx_rtmp_hls_store_name, size,
+                                 &ngx_rtmp_hls_module);
+    if (zone == NULL) {
+        return NULL;
+    }
+
+    zone->init = ngx_rtmp_hls_store_init_zone;
+
+    return zone;
+}
+
+
+static void
+ngx_rtmp_hls_store_free_locked(ngx_slab_pool_t *shpool,
+    ngx_rtmp_hls_store_entry_t *e)
+{
+    ngx_rtmp_hls_store_block_t     *b, *next;
+
+    for (b = e->head; b; b = next) {
+        next = b->next;
+        ngx_slab_free_locked(shpool, b);
+    }
+
+    ngx_slab_free_locked(shpool, e);
+}
+
+
+static void
+ngx_rtmp_hls_store_unlink_locked(ngx_slab_pool_t *shpool,
+    ngx_rtmp_hls_store_shctx_t *sh, ngx_rtmp_hls_store_entry_t *e)
+{
+    ngx_rbtree_delete(&sh->rbtree, &e->sn.node);
+    ngx_queue_remove(&e->queue);
+
+    e->linked = 0;
+
+    if (e->refs == 0) {
+        ngx_rtmp_hls_store_free_locked(shpool, e);
+    }
+}
+
+
+/*
+ * entries are queued by expiry time; few distinct ttls are in use, so
+ * the place is almost always found right at the tail
+ */
+
+static void
+ngx_rtmp_hls_store_queue_locked(ngx_rtmp_hls_store_shctx_t *sh,
+    ngx_rtmp_hls_store_entry_t *e)
+{
+    ngx_queue_t                    *q;
+    ngx_rtmp_hls_store_entry_t     *prev;
+
+    for (q = ngx_queue_last(&sh->entries);
+         q != ngx_queue_sentinel(&sh->entries);
+         q = ngx_queue_prev(q))
+    {
+        prev = ngx_queue_data(q, ngx_rtmp_hls_store_entry_t, queue);
+
+        if (prev->expire <= e->expire) {
+            break;
+        }
+    }
+
+    ngx_queue_insert_after(q, &e->queue);
+}
+
+
+static void
+ngx_rtmp_hls_store_sweep_locked(ngx_slab_pool_t *shpool,
+    ngx_rtmp_hls_store_shctx_t *sh, ngx_uint_t force)
+{
+    ngx_queue_t                    *q, *next;
+    ngx_rtmp_hls_store_entry_t     *e;
+
+    if (!force && sh->sweep == ngx_time()) {
+        return;
+    }
+
+    sh->sweep = ngx_time();
+
+    for (q = ngx_queue_head(&sh->entries);
+         q != ngx_queue_sentinel(&sh->entries);
+         q = next)
+    {
+        next = ngx_queue_next(q);
+
+        e = ngx_queue_data(q, ngx_rtmp_hls_store_entry_t, queue);
+
+        if (e->expire > ngx_time()) {
+            break;
+        }
+
+        ngx_rtmp_hls_store_unlink_locked(shpool, sh, e);
+    }
+}
+
+
+static void *
+ngx_rtmp_hls_store_alloc_locked(ngx_slab_pool_t *shpool,
+    ngx_rtmp_hls_store_shctx_t *sh, size_t size)
+{
+    void                           *p;
+
+    p = ngx_slab_alloc_locked(shpool, size);
+    if (p) {
+        return p;
+    }
+
+    /* give expired entries back before failing */
+
+    ngx_rtmp_hls_store_sweep_locked(shpool, sh, 1);
+
+    return ngx_slab_alloc_locked(shpool, size);
+}
+
+
+static ngx_rtmp_hls_store_entry_t *
+ngx_rtmp_hls_store_lookup_locked(ngx_rtmp_hls_store_shctx_t *sh,
+    ngx_str_t *name)
+{
+    ngx_str_node_t                 *sn;
+
+    sn = ngx_str_rbtree_lookup(&sh->rbtree, name, ngx_crc32_short(name->data,
+                                                                  name->len));
+    if (sn == NULL) {
+        return NULL;
+    }
+
+    return (ngx_rtmp_hls_store_entry_t *) sn;
+}
+
+
+ngx_rtmp_hls_store_entry_t *
+ngx_rtmp_hls_store_open(ngx_shm_zone_t *zone, ngx_str_t *name, ngx_log_t *log)
+{
+    ngx_slab_pool_t                *shpool;
+    ngx_rtmp_hls_store_shctx_t     *sh;
+    ngx_rtmp_hls_store_entry_t     *e;
+
+    shpool = (ngx_slab_pool_t *) zone->shm.addr;
+    sh = zone->data;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    ngx_rtmp_hls_store_sweep_locked(shpool, sh, 0);
+
+    e = ngx_rtmp_hls_store_alloc_locked(shpool, sh,
+                                        sizeof(ngx_rtmp_hls_store_entry_t)
+                                        + name->len);
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    if (e == NULL) {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                      "hls store: no memory for '%V'", name);
+        return NULL;
+    }
+
+    ngx_memzero(e, sizeof(ngx_rtmp_hls_store_entry_t));
+
+    e->sn.str.len = name->len;
+    e->sn.str.data = (u_char *) e + sizeof(ngx_rtmp_hls_store_entry_t);
+    e->sn.node.key = ngx_crc32_short(name->data, name->len);
+
+    ngx_memcpy(e->sn.str.data, name->data, name->len);
+
+    /* writer's reference */
+    e->refs = 1;
+
+    return e;
+}
+
+
+ngx_rtmp_hls_store_block_t *
+ngx_rtmp_hls_store_alloc_block(ngx_shm_zone_t *zone, ngx_log_t *log)
+{
+    ngx_slab_pool_t                *shpool;
+    ngx_rtmp_hls_store_block_t     *b;
+
+    shpool = (ngx_slab_pool_t *) zone->shm.addr;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    b = ngx_rtmp_hls_store_alloc_locked(shpool, zone->data,
+                                        NGX_RTMP_HLS_STORE_BLOCK_SIZE);
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    if (b == NULL) {
+        ngx_log_error(NGX_LOG_ERR, log, 0, "hls store: no memory");
+        return NULL;
+    }
+
+    b->next = NULL;
+    b->pos = ngx_rtmp_hls_store_block_data(b);
+    b->last = b->pos;
+    b->end = (u_char *) b + NGX_RTMP_HLS_STORE_BLOCK_SIZE;
+
+    return b;
+}
+
+
+void
+ngx_rtmp_hls_store_free_block(ngx_shm_zone_t *zone,
+    ngx_rtmp_hls_store_block_t *b)
+{
+    ngx_slab_free((ngx_slab_pool_t *) zone->shm.addr, b);
+}
+
+
+void
+ngx_rtmp_hls_store_append_block(ngx_rtmp_hls_store_entry_t *e,
+    ngx_rtmp_hls_store_block_t *b)
+{
+    b->next = NULL;
+
+    if (e->tail) {
+        e->tail->next = b;
+
+    } else {
+        e->head = b;
+    }
+
+    e->tail = b;
+    e->size += b->last - b->pos;
+}
+
+
+ngx_int_t
+ngx_rtmp_hls_store_write(ngx_shm_zone_t *zone, ngx_rtmp_hls_store_entry_t *e,
+    u_char *data, size_t len, ngx_log_t *log)
+{
+    size_t                          n;
+    ngx_rtmp_hls_store_block_t     *b;
+
+    while (len) {
+        b = e->tail;
+
+        if (b == NULL || b->last == b->end) {
+            b = ngx_rtmp_hls_store_alloc_block(zone, log);
+            if (b == NULL) {
+                return NGX_ERROR;
+            }
+
+            ngx_rtmp_hls_store_append_block(e, b);
+        }
+
+        n = ngx_min(len, (size_t) (b->end - b->last));
+
+        b->last = ngx_cpymem(b->last, data, n);
+        e->size += n;
+
+        data += n;
+        len -= n;
+    }
+
+    return NGX_OK;
+}
+
+
+void
+ngx_rtmp_hls_store_close(ngx_shm_zone_t *zone, ngx_rtmp_hls_store_entry_t *e,
+    time_t ttl)
+{
+    ngx_slab_pool_t                *shpool;
+    ngx_rtmp_hls_store_shctx_t     *sh;
+    ngx_rtmp_hls_store_entry_t     *old;
+
+    shpool = (ngx_slab_pool_t *) zone->shm.addr;
+    sh = zone->data;
+
+    e->mtime = ngx_time();
+    e->expire = e->mtime + ttl;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    old = ngx_rtmp_hls_store_lookup_locked(sh, &e->sn.str);
+    if (old) {
+        ngx_rtmp_hls_store_unlink_locked(shpool, sh, old);
+    }
+
+    ngx_rbtree_insert(&sh->rbtree, &e->sn.node);
+    ngx_rtmp_hls_store_queue_locked(sh, e);
+
+    e->linked = 1;
+    e->refs--;
+
+    sh->generation++;
+    e->generation = sh->generation;
+
+    ngx_shmtx_unlock(&shpool->mutex);
+}
+
+
+void
+ngx_rtmp_hls_store_abort(ngx_shm_zone_t *zone, ngx_rtmp_hls_store_entry_t *e)
+{
+    ngx_slab_pool_t                *shpool;
+
+    shpool = (ngx_slab_pool_t *) zone->shm.addr;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    ngx_rtmp_hls_store_free_locked(shpool, e);
+
+    ngx_shmtx_unlock(&shpool->mutex);
+}
+
+
+/*
+ * An entry linked up to the given generation is left from an earlier
+ * publish of the stream, the placeholder replaces it when linked.
+ */
+
+ngx_int_t
+ngx_rtmp_hls_store_hint(ngx_shm_zone_t *zone, ngx_str_t *name, time_t ttl,
+    ngx_msec_t hold, ngx_atomic_uint_t generation, ngx_log_t *log)
+{
+    ngx_slab_pool_t                *shpool;
+    ngx_rtmp_hls_store_shctx_t     *sh;
+    ngx_rtmp_hls_store_entry_t     *e;
+
+    shpool = (ngx_slab_pool_t *) zone->shm.addr;
+    sh = zone->data;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    e = ngx_rtmp_hls_store_lookup_locked(sh, name);
+
+    if (e && e->generation > generation) {
+        ngx_shmtx_unlock(&shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    e = ngx_rtmp_hls_store_open(zone, name, log);
+    if (e == NULL) {
+        return NGX_ERROR;
+    }
+
+    e->pending = 1;
+    e->hold = hold;
+
+    ngx_rtmp_hls_store_close(zone, e, ttl);
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_rtmp_hls_store_touch(ngx_shm_zone_t *zone, ngx_str_t *name, time_t ttl)
+{
+    ngx_slab_pool_t                *shpool;
+    ngx_rtmp_hls_store_entry_t     *e;
+
+    shpool = (ngx_slab_pool_t *) zone->shm.addr;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    e = ngx_rtmp_hls_store_lookup_locked(zone->data, name);
+    if (e && !e->pending) {
+        e->mtime = ngx_time();
+        e->expire = e->mtime + ttl;
+
+        ngx_queue_remove(&e->queue);
+        ngx_rtmp_hls_store_queue_locked(zone->data, e);
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    return e ? NGX_OK : NGX_DECLINED;
+}
+
+
+ngx_rtmp_hls_store_entry_t *
+ngx_rtmp_hls_store_acquire(ngx_shm_zone_t *zone, ngx_str_t *name)
+{
+    ngx_slab_pool_t                *shpool;
+    ngx_rtmp_hls_store_entry_t     *e;
+
+    shpool = (ngx_slab_pool_t *) zone->shm.addr;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    e = ngx_rtmp_hls_store_lookup_locked(zone->data, name);
+    if (e && e->expire > ngx_time()) {
+        e->refs++;
+
+    } else {
+        e = NULL;
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    return e;
+}
+
+
+void
+ngx_rtmp_hls_store_release(ngx_shm_zone_t *zone,
+    ngx_rtmp_hls_store_entry_t *e)
+{
+    ngx_slab_pool_t                *shpool;
+
+    shpool = (ngx_slab_pool_t *) zone->shm.addr;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    if (--e->refs == 0 && !e->linked) {
+        ngx_rtmp_hls_store_free_locked(shpool, e);
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+}
+
+
+ssize_t
+ngx_rtmp_hls_store_read(ngx_shm_zone_t *zone, ngx_str_t *name, u_char *buf,
+    size_t size, off_t offset)
+{
+    u_char                         *p;
+    size_t                          n;
+    ngx_rtmp_hls_store_entry_t     *e;
+    ngx_rtmp_hls_store_block_t     *b;
+
+    e = ngx_rtmp_hls_store_acquire(zone, name);
+    if (e == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (e->pending) {
+        ngx_rtmp_hls_store_release(zone, e);
+        return NGX_ERROR;
+    }
+
+    p = buf;
+
+    for (b = e->head; b && size; b = b->next) {
+        n = b->last - b->pos;
+
+        if (offset >= (off_t) n) {
+            offset -= n;
+            continue;
+        }
+
+        n = ngx_min(size, n - (size_t) offset);
+
+        p = ngx_cpymem(p, b->pos + offset, n);
+        size -= n;
+        offset = 0;
+    }
+
+    ngx_rtmp_hls_store_release(zone, e);
+
+    return p - buf;
+}
@@ -0,0 +1,107 @@
+
+/*
+ * Copyright (C) Roman Arutyunyan
+ */
+
+
+#ifndef _NGX_RTMP_HLS_STORE_H_INCLUDED_
+#define _NGX_RTMP_HLS_STORE_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+/* slab allocates blocks in whole pages, header included */
+#define NGX_RTMP_HLS_STORE_BLOCK_SIZE   65536
+
+
+typedef struct ngx_rtmp_hls_store_block_s ngx_rtmp_hls_store_block_t;
+
+struct ngx_rtmp_hls_store_block_s {
+    ngx_rtmp_hls_store_block_t         *next;
+    u_char                             *pos;
+    u_char                             *last;
+    u_char                             *end;
+};
+
+
+#define ngx_rtmp_hls_store_block_data(b)                                      \
+    ((u_char *) (b) + sizeof(ngx_rtmp_hls_store_block_t))
+
+
+typedef struct {
+    ngx_str_node_t                      sn;
+    ngx_queue_t                         queue;
+    ngx_rtmp_hls_store_block_t         *head;
+    ngx_rtmp_hls_store_block_t         *tail;
+    off_t                               size;
+    time_t                              mtime;
+    time_t                              expire;
+    ngx_uint_t                          refs;
+
+    /* playlist progress for blocking reload: segment in progress
+     * and the number of its parts listed */
+    uint64_t                            msn;
+    ngx_uint_t                          part;
+
+    /* how long a request may wait for this entry to progress */
+    ngx_msec_t                          hold;
+
+    /* store generation when linked */
+    ngx_atomic_uint_t                   generation;
+
+    unsigned                            linked:1;
+
+    /* placeholder of a part announced by EXT-X-PRELOAD-HINT */
+    unsigned                            pending:1;
+} ngx_rtmp_hls_store_entry_t;
+
+
+typedef struct {
+    ngx_rbtree_t                        rbtree;
+    ngx_rbtree_node_t                   sentinel;
+    ngx_queue_t                         entries;
+    time_t                              sweep;
+
+    /* bumped whenever an entry is linked, read without the mutex */
+    ngx_atomic_t                        generation;
+} ngx_rtmp_hls_store_shctx_t;
+
+
+#define ngx_rtmp_hls_store_generation(zone)                                   \
+    (((ngx_rtmp_hls_store_shctx_t *) (zone)->data)->generation)
+
+
+ngx_shm_zone_t *ngx_rtmp_hls_store_add_zone(ngx_conf_t *cf, size_t size);
+
+/* zone of hls_store_size, shared by hls_store and dash_store */
+ngx_shm_zone_t *ngx_rtmp_hls_store_get_zone(ngx_conf_t *cf);
+
+ngx_rtmp_hls_store_entry_t *ngx_rtmp_hls_store_open(ngx_shm_zone_t *zone,
+    ngx_str_t *name, ngx_log_t *log);
+ngx_int_t ngx_rtmp_hls_store_write(ngx_shm_zone_t *zone,
+    ngx_rtmp_hls_store_entry_t *e, u_char *data, size_t len, ngx_log_t *log);
+ngx_rtmp_hls_store_block_t *ngx_rtmp_hls_store_alloc_block(
+    ngx_shm_zone_t *zone, ngx_log_t *log);
+void ngx_rtmp_hls_store_append_block(ngx_rtmp_hls_store_entry_t *e,
+    ngx_rtmp_hls_store_block_t *b);
+void ngx_rtmp_hls_store_free_block(ngx_shm_zone_t *zone,
+    ngx_rtmp_hls_store_block_t *b);
+void ngx_rtmp_hls_store_close(ngx_shm_zone_t *zone,
+    ngx_rtmp_hls_store_entry_t *e, time_t ttl);
+void ngx_rtmp_hls_store_abort(ngx_shm_zone_t *zone,
+    ngx_rtmp_hls_store_entry_t *e);
+ngx_int_t ngx_rtmp_hls_store_hint(ngx_shm_zone_t *zone, ngx_str_t *name,
+    time_t ttl, ngx_msec_t hold, ngx_atomic_uint_t generation, ngx_log_t *log);
+ngx_int_t ngx_rtmp_hls_store_touch(ngx_shm_zone_t *zone, ngx_str_t *name,
+    time_t ttl);
+ssize_t ngx_rtmp_hls_store_read(ngx_shm_zone_t *zone, ngx_str_t *name,
+    u_char *buf, size_t size, off_t offset);
+ngx_rtmp_hls_store_entry_t *ngx_rtmp_hls_store_acquire(ngx_shm_zone_t *zone,
+    ngx_str_t *name);
+void ngx_rtmp_hls_store_release(ngx_shm_zone_t *zone,
+    ngx_rtmp_hls_store_entry_t *e);
+
+
+#endif /* _NGX_RTMP_HLS_STORE_H_INCLUDED_ */
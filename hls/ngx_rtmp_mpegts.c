@@ -71,94 +71,171 @@ static u_char ngx_rtmp_mpegts_header[] = {
 };
 
 
+/* PMT of HEVC video differs in stream type and CRC */
+#define NGX_RTMP_MPEGTS_VIDEO_TYPE_OFF  (188 + 17)
+#define NGX_RTMP_MPEGTS_PMT_CRC_OFF     (188 + 27)
+
+
+static u_char ngx_rtmp_mpegts_hevc_crc[] = { 0xc7, 0x72, 0xb7, 0xcb };
+
+
 /* 700 ms PCR delay */
 #define NGX_RTMP_HLS_DELAY  63000
 
 
 static ngx_int_t
-ngx_rtmp_mpegts_write_file(ngx_rtmp_mpegts_file_t *file, u_char *in,
-    size_t in_size)
+ngx_rtmp_mpegts_alloc_block(ngx_rtmp_mpegts_file_t *file)
 {
-    u_char   *out;
-    size_t    out_size, n;
-    ssize_t   rc;
+    ngx_rtmp_hls_store_block_t  *b;
 
-    static u_char  buf[1024];
+    b = ngx_rtmp_hls_store_alloc_block(file->zone, file->log);
+    if (b == NULL) {
+        return NGX_ERROR;
+    }
 
-    if (!file->encrypt) {
-        ngx_log_debug1(NGX_LOG_DEBUG_CORE, file->log, 0,
-                       "mpegts: write %uz bytes", in_size);
+    file->block = b;
 
-        rc = ngx_write_fd(file->fd, in, in_size);
-        if (rc < 0) {
-            return NGX_ERROR;
-        }
+    file->out = b->pos;
+    file->out_start = file->out + 16;
+    file->out_last = file->out_start;
+    file->out_end = file->out_start
+                    + (b->end - file->out_start - 16) / 188 * 188;
 
-        return NGX_OK;
-    }
+    return NGX_OK;
+}
 
-    /* encrypt */
 
-    ngx_log_debug1(NGX_LOG_DEBUG_CORE, file->log, 0,
-                   "mpegts: write %uz encrypted bytes", in_size);
+/* full block is handed over to the store entry as is, no copy */
 
-    out = buf;
-    out_size = sizeof(buf);
+static ngx_int_t
+ngx_rtmp_mpegts_publish_block(ngx_rtmp_mpegts_file_t *file, u_char *p,
+    size_t size)
+{
+    ngx_rtmp_hls_store_block_t  *b;
 
-    if (file->size > 0 && file->size + in_size >= 16) {
-        ngx_memcpy(file->buf + file->size, in, 16 - file->size);
+    b = file->block;
 
-        in += 16 - file->size;
-        in_size -= 16 - file->size;
+    file->block = NULL;
+    file->out = NULL;
 
-        AES_cbc_encrypt(file->buf, out, 16, &file->key, file->iv, AES_ENCRYPT);
+    if (size == 0) {
+        ngx_rtmp_hls_store_free_block(file->zone, b);
+        return NGX_OK;
+    }
 
-        out += 16;
-        out_size -= 16;
+    ngx_log_debug1(NGX_LOG_DEBUG_CORE, file->log, 0,
+                   "mpegts: store %uz bytes", size);
 
-        file->size = 0;
-    }
+    b->pos = p;
+    b->last = p + size;
 
-    for ( ;; ) {
-        n = in_size & ~0x0f;
+    ngx_rtmp_hls_store_append_block(file->entry, b);
 
-        if (n > 0) {
-            if (n > out_size) {
-                n = out_size;
-            }
+    return NGX_OK;
+}
 
-            AES_cbc_encrypt(in, out, n, &file->key, file->iv, AES_ENCRYPT);
 
-            in += n;
-            in_size -= n;
+/*
+ * TS packets are built right in the output buffer which is written
+ * out when full and when the file is closed; in store mode the buffer
+ * is a store block which is linked to the entry instead. Encrypted
+ * files are encrypted in place at flush, the whole buffer in one EVP
+ * call (which uses AES-NI where available); up to 15 bytes of an
+ * incomplete AES block are carried over in file->buf and prepended
+ * next time, that is what the 16 bytes of headroom before out_start
+ * are for.
+ */
 
-        } else if (out == buf) {
-            break;
-        }
+ngx_int_t
+ngx_rtmp_mpegts_flush_file(ngx_rtmp_mpegts_file_t *file)
+{
+    u_char   *p;
+    size_t    size, n;
+    ssize_t   rc;
+    int       len;
+
+    p = file->out_start;
+    size = file->out_last - p;
+
+    if (file->encrypt) {
+        p -= file->size;
+        ngx_memcpy(p, file->buf, file->size);
+        size += file->size;
+
+        n = size & ~0x0f;
 
-        rc = ngx_write_fd(file->fd, buf, out - buf + n);
-        if (rc < 0) {
+        if (n && EVP_EncryptUpdate(file->cipher, p, &len, p, (int) n) != 1) {
+            ngx_log_error(NGX_LOG_ERR, file->log, 0,
+                          "mpegts: encryption failed");
             return NGX_ERROR;
         }
 
-        out = buf;
-        out_size = sizeof(buf);
+        file->size = size - n;
+        ngx_memcpy(file->buf, p + n, file->size);
+
+        size = n;
+    }
+
+    file->out_last = file->out_start;
+
+    if (file->block) {
+        return ngx_rtmp_mpegts_publish_block(file, p, size);
     }
 
-    if (in_size) {
-        ngx_memcpy(file->buf + file->size, in, in_size);
-        file->size += in_size;
+    if (size == 0) {
+        return NGX_OK;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, file->log, 0,
+                   "mpegts: write %uz bytes%s", size,
+                   file->encrypt ? " encrypted" : "");
+
+    rc = ngx_write_fd(file->fd, p, size);
+    if (rc < 0) {
+        return NGX_ERROR;
     }
 
     return NGX_OK;
 }
 
 
-static ngx_int_t
+static u_char *
+ngx_rtmp_mpegts_get_packet(ngx_rtmp_mpegts_file_t *file)
+{
+    u_char  *p;
+
+    if (file->out && file->out_end - file->out_last < 188 &&
+        ngx_rtmp_mpegts_flush_file(file) != NGX_OK)
+    {
+        return NULL;
+    }
+
+    if (file->out == NULL && ngx_rtmp_mpegts_alloc_block(file) != NGX_OK) {
+        return NULL;
+    }
+
+    p = file->out_last;
+    file->out_last += 188;
+
+    return p;
+}
+
+
+static void
 ngx_rtmp_mpegts_write_header(ngx_rtmp_mpegts_file_t *file)
 {
-    return ngx_rtmp_mpegts_write_file(file, ngx_rtmp_mpegts_header,
-                                      sizeof(ngx_rtmp_mpegts_header));
+    u_char  *p;
+
+    p = file->out_last;
+
+    file->out_last = ngx_cpymem(p, ngx_rtmp_mpegts_header,
+                                sizeof(ngx_rtmp_mpegts_header));
+
+    if (file->hevc) {
+        p[NGX_RTMP_MPEGTS_VIDEO_TYPE_OFF] = 0x24;
+        ngx_memcpy(p + NGX_RTMP_MPEGTS_PMT_CRC_OFF, ngx_rtmp_mpegts_hevc_crc,
+                   sizeof(ngx_rtmp_mpegts_hevc_crc));
+    }
 }
 
 
@@ -196,23 +273,77 @@ ngx_rtmp_mpegts_write_pts(u_char *p, ngx_uint_t fb, uint64_t pts)
 }
 
 
+static u_char *
+ngx_rtmp_mpegts_copy(u_char *p, ngx_chain_t **in, u_char **pos, size_t n)
+{
+    size_t  size;
+
+    while (n) {
+        size = (*in)->buf->last - *pos;
+
+        if (size == 0) {
+            *in = (*in)->next;
+            *pos = (*in)->buf->pos;
+            continue;
+        }
+
+        if (size > n) {
+            size = n;
+        }
+
+        p = ngx_cpymem(p, *pos, size);
+
+        *pos += size;
+        n -= size;
+    }
+
+    return p;
+}
+
+
+/*
+ * Frame data is gathered from the buffers of the chain straight into
+ * TS packets; buffers are left intact so that the same frame can be
+ * written to more than one file. A frame is packetized once: if there
+ * is a tee file, every finished packet is copied to it as is.
+ */
+
 ngx_int_t
 ngx_rtmp_mpegts_write_frame(ngx_rtmp_mpegts_file_t *file,
-    ngx_rtmp_mpegts_frame_t *f, ngx_buf_t *b)
+    ngx_rtmp_mpegts_frame_t *f, ngx_chain_t *in)
 {
-    ngx_uint_t  pes_size, header_size, body_size, in_size, stuff_size, flags;
-    u_char      packet[188], *p, *base;
-    ngx_int_t   first, rc;
+    ngx_uint_t    pes_size, header_size, body_size, in_size, stuff_size,
+                  flags;
+    u_char       *packet, *p, *base, *pos;
+    size_t        size;
+    ngx_int_t     first;
+    ngx_chain_t  *cl;
+
+    size = 0;
+
+    for (cl = in; cl; cl = cl->next) {
+        size += cl->buf->last - cl->buf->pos;
+    }
 
     ngx_log_debug6(NGX_LOG_DEBUG_CORE, file->log, 0,
                    "mpegts: pid=%ui, sid=%ui, pts=%uL, "
-                   "dts=%uL, key=%ui, size=%ui",
+                   "dts=%uL, key=%ui, size=%uz",
                    f->pid, f->sid, f->pts, f->dts,
-                   (ngx_uint_t) f->key, (size_t) (b->last - b->pos));
+                   (ngx_uint_t) f->key, size);
 
+    if (size == 0) {
+        return NGX_OK;
+    }
+
+    pos = in->buf->pos;
     first = 1;
 
-    while (b->pos < b->last) {
+    while (size) {
+        packet = ngx_rtmp_mpegts_get_packet(file);
+        if (packet == NULL) {
+            return NGX_ERROR;
+        }
+
         p = packet;
 
         f->cc++;
@@ -253,7 +384,7 @@ ngx_rtmp_mpegts_write_frame(ngx_rtmp_mpegts_file_t *file,
                 flags |= 0x40; /* DTS */
             }
 
-            pes_size = (b->last - b->pos) + header_size + 3;
+            pes_size = size + header_size + 3;
             if (pes_size > 0xffff) {
                 pes_size = 0;
             }
@@ -275,12 +406,12 @@ ngx_rtmp_mpegts_write_frame(ngx_rtmp_mpegts_file_t *file,
             first = 0;
         }
 
-        body_size = (ngx_uint_t) (packet + sizeof(packet) - p);
-        in_size = (ngx_uint_t) (b->last - b->pos);
+        body_size = (ngx_uint_t) (packet + 188 - p);
+        in_size = size;
 
         if (body_size <= in_size) {
-            ngx_memcpy(p, b->pos, body_size);
-            b->pos += body_size;
+            ngx_rtmp_mpegts_copy(p, &in, &pos, body_size);
+            size -= body_size;
 
         } else {
             stuff_size = (body_size - in_size);
@@ -309,13 +440,17 @@ ngx_rtmp_mpegts_write_frame(ngx_rtmp_mpegts_file_t *file,
                 }
             }
 
-            ngx_memcpy(p, b->pos, in_size);
-            b->pos = b->last;
+            ngx_rtmp_mpegts_copy(p, &in, &pos, in_size);
+            size = 0;
         }
 
-        rc = ngx_rtmp_mpegts_write_file(file, packet, sizeof(packet));
-        if (rc != NGX_OK) {
-            return rc;
+        if (file->tee) {
+            p = ngx_rtmp_mpegts_get_packet(file->tee);
+            if (p == NULL) {
+                return NGX_ERROR;
+            }
+
+            ngx_memcpy(p, packet, 188);
         }
     }
 
@@ -323,24 +458,56 @@ ngx_rtmp_mpegts_write_frame(ngx_rtmp_mpegts_file_t *file,
 }
 
 
+static void
+ngx_rtmp_mpegts_free_cipher(ngx_rtmp_mpegts_file_t *file)
+{
+    if (file->cipher) {
+        EVP_CIPHER_CTX_free(file->cipher);
+        file->cipher = NULL;
+    }
+
+    file->encrypt = 0;
+}
+
+
 ngx_int_t
 ngx_rtmp_mpegts_init_encryption(ngx_rtmp_mpegts_file_t *file,
     u_char *key, size_t key_len, uint64_t iv)
 {
-    if (AES_set_encrypt_key(key, key_len * 8, &file->key)) {
+    u_char  ivb[16];
+
+    if (key_len != 16) {
         return NGX_ERROR;
     }
 
-    ngx_memzero(file->iv, 8);
+    ngx_memzero(ivb, 8);
+
+    ivb[8]  = (u_char) (iv >> 56);
+    ivb[9]  = (u_char) (iv >> 48);
+    ivb[10] = (u_char) (iv >> 40);
+    ivb[11] = (u_char) (iv >> 32);
+    ivb[12] = (u_char) (iv >> 24);
+    ivb[13] = (u_char) (iv >> 16);
+    ivb[14] = (u_char) (iv >> 8);
+    ivb[15] = (u_char) (iv);
+
+    if (file->cipher == NULL) {
+        file->cipher = EVP_CIPHER_CTX_new();
+        if (file->cipher == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    /* padding is added by ngx_rtmp_mpegts_close_file() */
+
+    if (EVP_EncryptInit_ex(file->cipher, EVP_aes_128_cbc(), NULL, key, ivb)
+        != 1)
+    {
+        ngx_rtmp_mpegts_free_cipher(file);
+        return NGX_ERROR;
+    }
 
-    file->iv[8]  = (u_char) (iv >> 56);
-    file->iv[9]  = (u_char) (iv >> 48);
-    file->iv[10] = (u_char) (iv >> 40);
-    file->iv[11] = (u_char) (iv >> 32);
-    file->iv[12] = (u_char) (iv >> 24);
-    file->iv[13] = (u_char) (iv >> 16);
-    file->iv[14] = (u_char) (iv >> 8);
-    file->iv[15] = (u_char) (iv);
+    EVP_CIPHER_CTX_set_padding(file->cipher, 0);
 
     file->encrypt = 1;
 
@@ -354,46 +521,128 @@ ngx_rtmp_mpegts_open_file(ngx_rtmp_mpegts_file_t *file, u_char *path,
 {
     file->log = log;
 
+    /* headroom and tailroom for AES blocks */
+
+    file->out = ngx_memalign(16, NGX_RTMP_MPEGTS_BUF_SIZE + 32, log);
+    if (file->out == NULL) {
+        ngx_rtmp_mpegts_free_cipher(file);
+        return NGX_ERROR;
+    }
+
+    file->out_start = file->out + 16;
+    file->out_last = file->out_start;
+    file->out_end = file->out_start + NGX_RTMP_MPEGTS_BUF_SIZE;
+
     file->fd = ngx_open_file(path, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE,
                              NGX_FILE_DEFAULT_ACCESS);
 
     if (file->fd == NGX_INVALID_FILE) {
         ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
                       "hls: error creating fragment file");
+        ngx_free(file->out);
+        file->out = NULL;
+        ngx_rtmp_mpegts_free_cipher(file);
         return NGX_ERROR;
     }
 
     file->size = 0;
 
-    if (ngx_rtmp_mpegts_write_header(file) != NGX_OK) {
-        ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
-                      "hls: error writing fragment header");
-        ngx_close_file(file->fd);
-        return NGX_ERROR;
+    ngx_rtmp_mpegts_write_header(file);
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_rtmp_mpegts_open_store(ngx_rtmp_mpegts_file_t *file, ngx_shm_zone_t *zone,
+    ngx_str_t *name, time_t ttl, ngx_log_t *log)
+{
+    file->log = log;
+    file->zone = zone;
+    file->ttl = ttl;
+
+    file->entry = ngx_rtmp_hls_store_open(zone, name, log);
+    if (file->entry == NULL) {
+        goto failed;
     }
 
+    if (ngx_rtmp_mpegts_alloc_block(file) != NGX_OK) {
+        ngx_rtmp_hls_store_abort(zone, file->entry);
+        file->entry = NULL;
+        goto failed;
+    }
+
+    file->size = 0;
+
+    ngx_rtmp_mpegts_write_header(file);
+
     return NGX_OK;
+
+failed:
+
+    file->zone = NULL;
+    ngx_rtmp_mpegts_free_cipher(file);
+
+    return NGX_ERROR;
 }
 
 
 ngx_int_t
 ngx_rtmp_mpegts_close_file(ngx_rtmp_mpegts_file_t *file)
 {
-    u_char   buf[16];
-    ssize_t  rc;
+    ngx_int_t  rc;
+    size_t     pad;
+
+    if (file->zone && file->out == NULL &&
+        ngx_rtmp_mpegts_alloc_block(file) != NGX_OK)
+    {
+        rc = NGX_ERROR;
+        goto done;
+    }
 
     if (file->encrypt) {
-        ngx_memset(file->buf + file->size, 16 - file->size, 16 - file->size);
 
-        AES_cbc_encrypt(file->buf, buf, 16, &file->key, file->iv, AES_ENCRYPT);
+        /* PKCS#7 padding goes to the tailroom, last block
+         * is written with the rest of the buffer */
 
-        rc = ngx_write_fd(file->fd, buf, 16);
-        if (rc < 0) {
-            return NGX_ERROR;
-        }
+        pad = 16 - (file->size + (file->out_last - file->out_start)) % 16;
+
+        ngx_memset(file->out_last, pad, pad);
+        file->out_last += pad;
     }
 
-    ngx_close_file(file->fd);
+    rc = ngx_rtmp_mpegts_flush_file(file);
 
-    return NGX_OK;
+    if (file->zone == NULL) {
+        ngx_close_file(file->fd);
+
+        ngx_free(file->out);
+        file->out = NULL;
+
+        ngx_rtmp_mpegts_free_cipher(file);
+
+        return rc;
+    }
+
+done:
+
+    if (file->block) {
+        ngx_rtmp_hls_store_free_block(file->zone, file->block);
+        file->block = NULL;
+        file->out = NULL;
+    }
+
+    if (rc == NGX_OK) {
+        ngx_rtmp_hls_store_close(file->zone, file->entry, file->ttl);
+
+    } else {
+        ngx_rtmp_hls_store_abort(file->zone, file->entry);
+    }
+
+    file->entry = NULL;
+    file->zone = NULL;
+
+    ngx_rtmp_mpegts_free_cipher(file);
+
+    return rc;
 }
@@ -10,18 +10,38 @@
 
 #include <ngx_config.h>
 #include <ngx_core.h>
-#include <openssl/aes.h>
+#include <openssl/evp.h>
+#include "ngx_rtmp_hls_store.h"
 
 
-typedef struct {
+/* output buffer holds whole TS packets */
+#define NGX_RTMP_MPEGTS_BUF_SIZE    (65536 / 188 * 188)
+
+
+typedef struct ngx_rtmp_mpegts_file_s  ngx_rtmp_mpegts_file_t;
+
+struct ngx_rtmp_mpegts_file_s {
     ngx_fd_t    fd;
     ngx_log_t  *log;
     unsigned    encrypt:1;
+    unsigned    hevc:1;     /* video stream type in PMT */
     unsigned    size:4;
     u_char      buf[16];
-    u_char      iv[16];
-    AES_KEY     key;
-} ngx_rtmp_mpegts_file_t;
+    EVP_CIPHER_CTX *cipher;
+    u_char     *out;
+    u_char     *out_start;
+    u_char     *out_last;
+    u_char     *out_end;
+
+    /* fragment goes to the store instead of fd */
+    ngx_shm_zone_t                 *zone;
+    ngx_rtmp_hls_store_entry_t     *entry;
+    ngx_rtmp_hls_store_block_t     *block;
+    time_t                          ttl;
+
+    /* finished TS packets are copied there as well */
+    ngx_rtmp_mpegts_file_t         *tee;
+};
 
 
 typedef struct {
@@ -38,9 +58,12 @@ ngx_int_t ngx_rtmp_mpegts_init_encryption(ngx_rtmp_mpegts_file_t *file,
     u_char *key, size_t key_len, uint64_t iv);
 ngx_int_t ngx_rtmp_mpegts_open_file(ngx_rtmp_mpegts_file_t *file, u_char *path,
     ngx_log_t *log);
+ngx_int_t ngx_rtmp_mpegts_open_store(ngx_rtmp_mpegts_file_t *file,
+    ngx_shm_zone_t *zone, ngx_str_t *name, time_t ttl, ngx_log_t *log);
+ngx_int_t ngx_rtmp_mpegts_flush_file(ngx_rtmp_mpegts_file_t *file);
 ngx_int_t ngx_rtmp_mpegts_close_file(ngx_rtmp_mpegts_file_t *file);
 ngx_int_t ngx_rtmp_mpegts_write_frame(ngx_rtmp_mpegts_file_t *file,
-    ngx_rtmp_mpegts_frame_t *f, ngx_buf_t *b);
+    ngx_rtmp_mpegts_frame_t *f, ngx_chain_t *in);
 
 
 #endif /* _NGX_RTMP_MPEGTS_H_INCLUDED_ */
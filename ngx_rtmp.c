@@ -567,6 +567,9 @@ found:
     addr->wildcard = listen->wildcard;
     addr->so_keepalive = listen->so_keepalive;
     addr->proxy_protocol = listen->proxy_protocol;
+#if (NGX_HAVE_REUSEPORT)
+    addr->reuseport = listen->reuseport;
+#endif
 #if (NGX_HAVE_KEEPALIVE_TUNABLE)
     addr->tcp_keepidle = listen->tcp_keepidle;
     addr->tcp_keepintvl = listen->tcp_keepintvl;
@@ -647,6 +650,11 @@ ngx_rtmp_optimize_servers(ngx_conf_t *cf, ngx_array_t *ports)
 
             ls->wildcard = addr[i].wildcard;
 
+#if (NGX_HAVE_REUSEPORT)
+            /* event module clones the socket for each worker */
+            ls->reuseport = addr[i].reuseport;
+#endif
+
             mport = ngx_palloc(cf->pool, sizeof(ngx_rtmp_port_t));
             if (mport == NULL) {
                 return NGX_CONF_ERROR;
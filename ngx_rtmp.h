@@ -45,6 +45,9 @@ typedef struct {
 #endif
     unsigned                so_keepalive:2;
     unsigned                proxy_protocol:1;
+#if (NGX_HAVE_REUSEPORT)
+    unsigned                reuseport:1;
+#endif
 #if (NGX_HAVE_KEEPALIVE_TUNABLE)
     int                     tcp_keepidle;
     int                     tcp_keepintvl;
@@ -57,6 +60,7 @@ typedef struct {
     ngx_rtmp_conf_ctx_t    *ctx;
     ngx_str_t               addr_text;
     unsigned                proxy_protocol:1;
+    unsigned                bus:1;
 } ngx_rtmp_addr_conf_t;
 
 typedef struct {
@@ -101,6 +105,9 @@ typedef struct {
 #endif
     unsigned                so_keepalive:2;
     unsigned                proxy_protocol:1;
+#if (NGX_HAVE_REUSEPORT)
+    unsigned                reuseport:1;
+#endif
 #if (NGX_HAVE_KEEPALIVE_TUNABLE)
     int                     tcp_keepidle;
     int                     tcp_keepintvl;
@@ -161,6 +168,20 @@ typedef struct {
  * + max 4  extended header (timestamp) */
 #define NGX_RTMP_MAX_CHUNK_HEADER       18
 
+/* outbound chunk sizes are chunk_size << class */
+#define NGX_RTMP_MAX_CHUNK_CLASSES      8
+#define NGX_RTMP_CHUNK_ADAPT_INTERVAL   2000    /* msec */
+#define NGX_RTMP_CHUNK_TIME             20      /* msec of bitrate */
+#define NGX_RTMP_CHUNK_RTT_SLACK        20000   /* usec */
+
+
+/* Max number of buffers gathered into a single vectored send */
+#define NGX_RTMP_OUT_VECS               64
+
+
+/* Size input buffer grows to, several chunks are read at once */
+#define NGX_RTMP_IN_BUF_SIZE            65536
+
 
 typedef struct {
     uint32_t                csid;       /* chunk stream id */
@@ -243,18 +264,28 @@ typedef struct {
     unsigned                relay:1;
     unsigned                static_relay:1;
 
+    /* fed from live bus, has no peer */
+    unsigned                bus:1;
+
+    /* connection is passed to the worker owning the stream */
+    unsigned                handoff:1;
+
     /* input stream 0 (reserved by RTMP spec)
      * is used as free chain link */
 
     ngx_rtmp_stream_t      *in_streams;
-    uint32_t                in_csid;
     ngx_uint_t              in_chunk_size;
     ngx_pool_t             *in_pool;
     uint32_t                in_bytes;
     uint32_t                in_last_ack;
 
-    ngx_pool_t             *in_old_pool;
-    ngx_int_t               in_chunk_size_changing;
+    /* read buffer, chunks are parsed in place */
+    ngx_chain_t            *in_buf;
+
+    /* read buffers still referenced by messages
+     * or shared output chains */
+    ngx_chain_t            *in_pinned;
+    ngx_chain_t           **in_pinned_last;
 
     ngx_connection_t       *connection;
 
@@ -265,6 +296,15 @@ typedef struct {
     ngx_chain_t            *out_chain;
     u_char                 *out_bpos;
     unsigned                out_buffer:1;
+    ngx_chain_t            *out_vec;    /* scratch links for vectored send */
+
+    /* outbound chunk size class, adapted to bitrate and rtt */
+    ngx_uint_t              out_chunk_class;
+    ngx_msec_t              out_chunk_time;
+    uint32_t                out_chunk_bytes;
+    ngx_uint_t              out_chunk_rtt;  /* lowest rtt seen, usec */
+
+    size_t                  out_queued; /* bytes queued for sending */
     size_t                  out_queue;
     size_t                  out_cork;
     ngx_chain_t            *out[0];
@@ -319,8 +359,11 @@ typedef struct ngx_rtmp_core_srv_conf_s {
     ngx_uint_t              ack_window;
 
     ngx_int_t               chunk_size;
+    ngx_int_t               max_chunk_size;
+    ngx_uint_t              nchunk_classes;
     ngx_pool_t             *pool;
-    ngx_chain_t            *free;
+    ngx_chain_t            *free[NGX_RTMP_MAX_CHUNK_CLASSES];
+    ngx_chain_t            *free_links;
     ngx_chain_t            *free_hs;
     size_t                  max_message;
     ngx_flag_t              play_time_fix;
@@ -394,6 +437,12 @@ typedef struct {
 #define ngx_rtmp_conf_get_module_app_conf(cf, module)                        \
     ((ngx_rtmp_conf_ctx_t *) cf->ctx)->app_conf[module.ctx_index]
 
+#define ngx_rtmp_cycle_get_module_main_conf(cycle, module)                   \
+    (cycle->conf_ctx[ngx_rtmp_module.index] ?                                 \
+        ((ngx_rtmp_conf_ctx_t *) cycle->conf_ctx[ngx_rtmp_module.index])      \
+            ->main_conf[module.ctx_index]                                     \
+        : NULL)
+
 
 #ifdef NGX_DEBUG
 char* ngx_rtmp_message_type(uint8_t type);
@@ -401,6 +450,7 @@ char* ngx_rtmp_user_message_type(uint16_t evt);
 #endif
 
 void ngx_rtmp_init_connection(ngx_connection_t *c);
+ngx_rtmp_addr_conf_t * ngx_rtmp_find_addr_conf(ngx_connection_t *c);
 ngx_rtmp_session_t * ngx_rtmp_init_session(ngx_connection_t *c,
      ngx_rtmp_addr_conf_t *addr_conf);
 void ngx_rtmp_finalize_session(ngx_rtmp_session_t *s);
@@ -408,12 +458,18 @@ void ngx_rtmp_handshake(ngx_rtmp_session_t *s);
 void ngx_rtmp_client_handshake(ngx_rtmp_session_t *s, unsigned async);
 void ngx_rtmp_free_handshake_buffers(ngx_rtmp_session_t *s);
 void ngx_rtmp_cycle(ngx_rtmp_session_t *s);
+void ngx_rtmp_resume(ngx_rtmp_session_t *s, u_char *pos, size_t size);
+ngx_int_t ngx_rtmp_handoff(ngx_rtmp_session_t *s, u_char *pos, size_t size);
 void ngx_rtmp_reset_ping(ngx_rtmp_session_t *s);
 ngx_int_t ngx_rtmp_fire_event(ngx_rtmp_session_t *s, ngx_uint_t evt,
         ngx_rtmp_header_t *h, ngx_chain_t *in);
 
 
 ngx_int_t ngx_rtmp_set_chunk_size(ngx_rtmp_session_t *s, ngx_uint_t size);
+ngx_int_t ngx_rtmp_set_out_chunk_class(ngx_rtmp_session_t *s,
+        ngx_uint_t cls);
+ngx_int_t ngx_rtmp_adapt_chunk_size(ngx_rtmp_session_t *s);
+void ngx_rtmp_free_in_bufs(ngx_rtmp_session_t *s);
 
 
 /* Bit reverse: we need big-endians in many places  */
@@ -479,11 +535,17 @@ ngx_int_t ngx_rtmp_amf_shared_object_handler(ngx_rtmp_session_t *s,
 #define ngx_rtmp_ref_put(b)                 \
     --ngx_rtmp_ref(b)
 
-ngx_chain_t * ngx_rtmp_alloc_shared_buf(ngx_rtmp_core_srv_conf_t *cscf);
+#define ngx_rtmp_chunk_class_size(cscf, cls)                                \
+    ((size_t) (cscf)->chunk_size << (cls))
+
+ngx_chain_t * ngx_rtmp_alloc_shared_buf(ngx_rtmp_core_srv_conf_t *cscf,
+        ngx_uint_t cls);
+ngx_chain_t * ngx_rtmp_alloc_shared_link(ngx_rtmp_core_srv_conf_t *cscf);
+void ngx_rtmp_free_in_data(void *data);
 void ngx_rtmp_free_shared_chain(ngx_rtmp_core_srv_conf_t *cscf,
         ngx_chain_t *in);
 ngx_chain_t * ngx_rtmp_append_shared_bufs(ngx_rtmp_core_srv_conf_t *cscf,
-        ngx_chain_t *head, ngx_chain_t *in);
+        ngx_uint_t cls, ngx_chain_t *head, ngx_chain_t *in);
 
 #define ngx_rtmp_acquire_shared_chain(in)   \
     ngx_rtmp_ref_get(in);                   \
@@ -492,6 +554,9 @@ ngx_chain_t * ngx_rtmp_append_shared_bufs(ngx_rtmp_core_srv_conf_t *cscf,
 /* Sending messages */
 void ngx_rtmp_prepare_message(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
         ngx_rtmp_header_t *lh, ngx_chain_t *out);
+ngx_chain_t * ngx_rtmp_prepare_shared_message(ngx_rtmp_session_t *s,
+        ngx_rtmp_header_t *h, ngx_rtmp_header_t *lh, ngx_chain_t *in,
+        ngx_uint_t cls);
 ngx_int_t ngx_rtmp_send_message(ngx_rtmp_session_t *s, ngx_chain_t *out,
         ngx_uint_t priority);
 
@@ -590,10 +655,23 @@ ngx_int_t ngx_rtmp_send_sample_access(ngx_rtmp_session_t *s);
 #define NGX_RTMP_VIDEO_DISPOSABLE_FRAME     3
 
 
+/*
+ * Enhanced RTMP video tag: the top bit of the first byte is set,
+ * frame type follows, the low 4 bits are packet type instead of
+ * codec id, codec FourCC goes next
+ */
+#define NGX_RTMP_VIDEO_EX_HEADER            0x80
+
+#define NGX_RTMP_VIDEO_PACKET_SEQUENCE_START    0
+#define NGX_RTMP_VIDEO_PACKET_CODED_FRAMES      1
+#define NGX_RTMP_VIDEO_PACKET_SEQUENCE_END      2
+#define NGX_RTMP_VIDEO_PACKET_CODED_FRAMES_X    3
+
+
 static ngx_inline ngx_int_t
 ngx_rtmp_get_video_frame_type(ngx_chain_t *in)
 {
-    return (in->buf->pos[0] & 0xf0) >> 4;
+    return (in->buf->pos[0] & 0x70) >> 4;
 }
 
 
@@ -604,6 +682,17 @@ ngx_rtmp_is_codec_header(ngx_chain_t *in)
 }
 
 
+static ngx_inline ngx_int_t
+ngx_rtmp_is_video_codec_header(ngx_chain_t *in)
+{
+    if (in->buf->pos[0] & NGX_RTMP_VIDEO_EX_HEADER) {
+        return (in->buf->pos[0] & 0x0f) == NGX_RTMP_VIDEO_PACKET_SEQUENCE_START;
+    }
+
+    return ngx_rtmp_is_codec_header(in);
+}
+
+
 extern ngx_rtmp_bandwidth_t                 ngx_rtmp_bw_out;
 extern ngx_rtmp_bandwidth_t                 ngx_rtmp_bw_in;
 
@@ -618,6 +707,7 @@ extern ngx_thread_volatile ngx_event_t     *ngx_rtmp_init_queue;
 #endif
 
 extern ngx_uint_t                           ngx_rtmp_max_module;
+extern ngx_module_t                         ngx_rtmp_module;
 extern ngx_module_t                         ngx_rtmp_core_module;
 
 
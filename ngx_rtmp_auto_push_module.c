@@ -184,6 +184,10 @@ ngx_rtmp_auto_push_init_process(ngx_cycle_t *cycle)
      * Nginx generates bad addr_text with this enabled */
     ls->addr_ntop = 0;
 
+#if (NGX_HAVE_REUSEPORT)
+    ls->reuseport = 0;
+#endif
+
     ls->socklen = sizeof(struct sockaddr_un);
     saun = ngx_pcalloc(cycle->pool, ls->socklen);
     ls->sockaddr = (struct sockaddr *) saun;
@@ -17,6 +17,10 @@
 #define NGX_RTMP_CODEC_META_COPY    2
 
 
+/* unescaped HEVC SPS prefix, up to picture size and cropping */
+#define NGX_RTMP_CODEC_SPS_SIZE     256
+
+
 static void * ngx_rtmp_codec_create_app_conf(ngx_conf_t *cf);
 static char * ngx_rtmp_codec_merge_app_conf(ngx_conf_t *cf,
        void *parent, void *child);
@@ -26,10 +30,14 @@ static ngx_int_t ngx_rtmp_codec_copy_meta(ngx_rtmp_session_t *s,
        ngx_rtmp_header_t *h, ngx_chain_t *in);
 static ngx_int_t ngx_rtmp_codec_prepare_meta(ngx_rtmp_session_t *s,
        uint32_t timestamp);
+static void ngx_rtmp_codec_free_meta(ngx_rtmp_session_t *s,
+       ngx_rtmp_codec_ctx_t *ctx);
 static void ngx_rtmp_codec_parse_aac_header(ngx_rtmp_session_t *s,
        ngx_chain_t *in);
 static void ngx_rtmp_codec_parse_avc_header(ngx_rtmp_session_t *s,
        ngx_chain_t *in);
+static void ngx_rtmp_codec_parse_hevc_header(ngx_rtmp_session_t *s,
+       ngx_chain_t *in);
 #if (NGX_DEBUG)
 static void ngx_rtmp_codec_dump_header(ngx_rtmp_session_t *s, const char *type,
        ngx_chain_t *in);
@@ -122,6 +130,11 @@ video_codecs[] = {
     "On2-VP6-Alpha",
     "ScreenVideo2",
     "H264",
+    "",
+    "",
+    "",
+    "",
+    "HEVC",
 };
 
 
@@ -181,10 +194,7 @@ ngx_rtmp_codec_disconnect(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
         ctx->aac_header = NULL;
     }
 
-    if (ctx->meta) {
-        ngx_rtmp_free_shared_chain(cscf, ctx->meta);
-        ctx->meta = NULL;
-    }
+    ngx_rtmp_codec_free_meta(s, ctx);
 
     return NGX_OK;
 }
@@ -197,6 +207,7 @@ ngx_rtmp_codec_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
     ngx_rtmp_core_srv_conf_t           *cscf;
     ngx_rtmp_codec_ctx_t               *ctx;
     ngx_chain_t                       **header;
+    u_char                             *p;
     uint8_t                             fmt;
     static ngx_uint_t                   sample_rates[] =
                                         { 5512, 11025, 22050, 44100 };
@@ -225,6 +236,26 @@ ngx_rtmp_codec_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
         if (ctx->sample_rate == 0) {
             ctx->sample_rate = sample_rates[(fmt & 0x0c) >> 2];
         }
+    } else if (fmt & NGX_RTMP_VIDEO_EX_HEADER) {
+
+        /* enhanced RTMP: codec FourCC follows */
+
+        if (in->buf->last - in->buf->pos < 5) {
+            return NGX_OK;
+        }
+
+        p = in->buf->pos + 1;
+
+        if (ngx_strncmp(p, "hvc1", 4) == 0) {
+            ctx->video_codec_id = NGX_RTMP_VIDEO_HEVC;
+
+        } else if (ngx_strncmp(p, "avc1", 4) == 0) {
+            ctx->video_codec_id = NGX_RTMP_VIDEO_H264;
+
+        } else {
+            ctx->video_codec_id = 0;
+        }
+
     } else {
         ctx->video_codec_id = (fmt & 0x0f);
     }
@@ -235,7 +266,9 @@ ngx_rtmp_codec_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
     }
 
     /* no conf */
-    if (!ngx_rtmp_is_codec_header(in)) {
+    if (h->type == NGX_RTMP_MSG_AUDIO ? !ngx_rtmp_is_codec_header(in)
+                                      : !ngx_rtmp_is_video_codec_header(in))
+    {
         return NGX_OK;
     }
 
@@ -251,6 +284,10 @@ ngx_rtmp_codec_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
         if (ctx->video_codec_id == NGX_RTMP_VIDEO_H264) {
             header = &ctx->avc_header;
             ngx_rtmp_codec_parse_avc_header(s, in);
+
+        } else if (ctx->video_codec_id == NGX_RTMP_VIDEO_HEVC) {
+            header = &ctx->avc_header;
+            ngx_rtmp_codec_parse_hevc_header(s, in);
         }
     }
 
@@ -262,7 +299,7 @@ ngx_rtmp_codec_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
         ngx_rtmp_free_shared_chain(cscf, *header);
     }
 
-    *header = ngx_rtmp_append_shared_bufs(cscf, NULL, in);
+    *header = ngx_rtmp_append_shared_bufs(cscf, 0, NULL, in);
 
     return NGX_OK;
 }
@@ -377,6 +414,9 @@ ngx_rtmp_codec_parse_avc_header(ngx_rtmp_session_t *s, ngx_chain_t *in)
     ctx->avc_compat = (ngx_uint_t) ngx_rtmp_bit_read_8(&br);
     ctx->avc_level = (ngx_uint_t) ngx_rtmp_bit_read_8(&br);
 
+    ngx_sprintf(ctx->video_codecs, "avc1.%02uxi%02uxi%02uxi%Z",
+                ctx->avc_profile, ctx->avc_compat, ctx->avc_level);
+
     /* nal bytes */
     ctx->avc_nal_bytes = (ngx_uint_t) ((ngx_rtmp_bit_read_8(&br) & 0x03) + 1);
 
@@ -533,6 +573,234 @@ ngx_rtmp_codec_parse_avc_header(ngx_rtmp_session_t *s, ngx_chain_t *in)
 }
 
 
+static void
+ngx_rtmp_codec_parse_hevc_sps(ngx_rtmp_session_t *s, u_char *p, size_t len)
+{
+    ngx_uint_t              i, n, zeros, max_sub_layers, cf_idc, width,
+                            height, crop_left, crop_right, crop_top,
+                            crop_bottom, sub_width, sub_height;
+    u_char                  sub_profile[8], sub_level[8];
+    u_char                  sps[NGX_RTMP_CODEC_SPS_SIZE];
+    ngx_rtmp_codec_ctx_t   *ctx;
+    ngx_rtmp_bit_reader_t   br;
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_codec_module);
+
+    /* remove emulation prevention bytes, flags are full of zeros */
+
+    for (i = 0, n = 0, zeros = 0; i < len && n < sizeof(sps); i++) {
+        if (zeros >= 2 && p[i] == 3) {
+            zeros = 0;
+            continue;
+        }
+
+        zeros = (p[i] == 0 ? zeros + 1 : 0);
+        sps[n++] = p[i];
+    }
+
+    ngx_rtmp_bit_init_reader(&br, sps, sps + n);
+
+    /* nal unit header */
+    ngx_rtmp_bit_read(&br, 16);
+
+    /* VPS id */
+    ngx_rtmp_bit_read(&br, 4);
+
+    /* max sub layers - 1 */
+    max_sub_layers = (ngx_uint_t) ngx_rtmp_bit_read(&br, 3);
+
+    /* temporal id nesting */
+    ngx_rtmp_bit_read(&br, 1);
+
+    /* general profile: space, tier, idc, compatibility, constraints */
+    ngx_rtmp_bit_read(&br, 88);
+
+    /* general level idc */
+    ngx_rtmp_bit_read(&br, 8);
+
+    for (n = 0; n < max_sub_layers; n++) {
+        sub_profile[n] = (u_char) ngx_rtmp_bit_read(&br, 1);
+        sub_level[n] = (u_char) ngx_rtmp_bit_read(&br, 1);
+    }
+
+    if (max_sub_layers) {
+        for (n = max_sub_layers; n < 8; n++) {
+
+            /* reserved zero 2 bits */
+            ngx_rtmp_bit_read(&br, 2);
+        }
+    }
+
+    for (n = 0; n < max_sub_layers; n++) {
+        if (sub_profile[n]) {
+            ngx_rtmp_bit_read(&br, 88);
+        }
+
+        if (sub_level[n]) {
+            ngx_rtmp_bit_read(&br, 8);
+        }
+    }
+
+    /* SPS id */
+    ngx_rtmp_bit_read_golomb(&br);
+
+    /* chroma format idc */
+    cf_idc = (ngx_uint_t) ngx_rtmp_bit_read_golomb(&br);
+
+    if (cf_idc == 3) {
+
+        /* separate colour plane */
+        ngx_rtmp_bit_read(&br, 1);
+    }
+
+    /* pic width & height in luma samples */
+    width = (ngx_uint_t) ngx_rtmp_bit_read_golomb(&br);
+    height = (ngx_uint_t) ngx_rtmp_bit_read_golomb(&br);
+
+    /* conformance window */
+    if (ngx_rtmp_bit_read(&br, 1)) {
+
+        crop_left = (ngx_uint_t) ngx_rtmp_bit_read_golomb(&br);
+        crop_right = (ngx_uint_t) ngx_rtmp_bit_read_golomb(&br);
+        crop_top = (ngx_uint_t) ngx_rtmp_bit_read_golomb(&br);
+        crop_bottom = (ngx_uint_t) ngx_rtmp_bit_read_golomb(&br);
+
+    } else {
+
+        crop_left = 0;
+        crop_right = 0;
+        crop_top = 0;
+        crop_bottom = 0;
+    }
+
+    if (ngx_rtmp_bit_read_err(&br)) {
+        return;
+    }
+
+    sub_width = (cf_idc == 1 || cf_idc == 2) ? 2 : 1;
+    sub_height = (cf_idc == 1) ? 2 : 1;
+
+    ctx->width = width - (crop_left + crop_right) * sub_width;
+    ctx->height = height - (crop_top + crop_bottom) * sub_height;
+}
+
+
+static void
+ngx_rtmp_codec_parse_hevc_header(ngx_rtmp_session_t *s, ngx_chain_t *in)
+{
+    u_char                 *p, *last, *v;
+    uint32_t                compat, rcompat;
+    ngx_uint_t              n, k, narrays, nnals, len, type, space, tier,
+                            profile, level;
+    u_char                  constraint[6];
+    ngx_rtmp_codec_ctx_t   *ctx;
+    ngx_rtmp_bit_reader_t   br;
+
+    static const char      *spaces[] = { "", "A", "B", "C" };
+
+#if (NGX_DEBUG)
+    ngx_rtmp_codec_dump_header(s, "hevc", in);
+#endif
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_codec_module);
+
+    ngx_rtmp_bit_init_reader(&br, in->buf->pos, in->buf->last);
+
+    /*
+     * flv fmt & packet type & composition time
+     * or enhanced header & FourCC, then configuration version
+     */
+
+    ngx_rtmp_bit_read(&br, 48);
+
+    space = (ngx_uint_t) ngx_rtmp_bit_read(&br, 2);
+    tier = (ngx_uint_t) ngx_rtmp_bit_read(&br, 1);
+    profile = (ngx_uint_t) ngx_rtmp_bit_read(&br, 5);
+    compat = ngx_rtmp_bit_read_32(&br);
+
+    for (n = 0; n < 6; n++) {
+        constraint[n] = ngx_rtmp_bit_read_8(&br);
+    }
+
+    level = (ngx_uint_t) ngx_rtmp_bit_read_8(&br);
+
+    /*
+     * min spatial segmentation, parallelism type, chroma format,
+     * bit depths, average frame rate, constant frame rate,
+     * temporal layers, temporal id nested
+     */
+
+    ngx_rtmp_bit_read(&br, 16 + 8 + 8 + 8 + 8 + 16 + 6);
+
+    /* nal bytes */
+    ctx->avc_nal_bytes = (ngx_uint_t) (ngx_rtmp_bit_read(&br, 2) + 1);
+
+    narrays = (ngx_uint_t) ngx_rtmp_bit_read_8(&br);
+
+    if (ngx_rtmp_bit_read_err(&br)) {
+        return;
+    }
+
+    /* codecs: compatibility flags are in reverse bit order */
+
+    for (rcompat = 0, n = 0; n < 32; n++) {
+        rcompat = (rcompat << 1) | ((compat >> n) & 1);
+    }
+
+    v = ngx_sprintf(ctx->video_codecs, "hvc1.%s%ui.%uxD.%c%ui",
+                    spaces[space], profile, rcompat, tier ? 'H' : 'L',
+                    level);
+
+    for (k = 6; k && constraint[k - 1] == 0; k--) { /* void */ }
+
+    for (n = 0; n < k; n++) {
+        v = ngx_sprintf(v, ".%02uXi", (ngx_uint_t) constraint[n]);
+    }
+
+    *v = 0;
+
+    /* parameter set arrays, picture size is in SPS */
+
+    p = br.pos;
+    last = in->buf->last;
+
+    for (n = 0; n < narrays; n++) {
+        if (last - p < 3) {
+            return;
+        }
+
+        type = p[0] & 0x3f;
+        nnals = (p[1] << 8) | p[2];
+        p += 3;
+
+        for (k = 0; k < nnals; k++) {
+            if (last - p < 2) {
+                return;
+            }
+
+            len = (p[0] << 8) | p[1];
+            p += 2;
+
+            if ((ngx_uint_t) (last - p) < len) {
+                return;
+            }
+
+            if (type == 33) {
+                ngx_rtmp_codec_parse_hevc_sps(s, p, len);
+            }
+
+            p += len;
+        }
+    }
+
+    ngx_log_debug5(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                   "codec: hevc header codecs=%s, "
+                   "nal_bytes=%ui, arrays=%ui, width=%ui, height=%ui",
+                   ctx->video_codecs, ctx->avc_nal_bytes, narrays,
+                   ctx->width, ctx->height);
+}
+
+
 #if (NGX_DEBUG)
 static void
 ngx_rtmp_codec_dump_header(ngx_rtmp_session_t *s, const char *type,
@@ -561,7 +829,6 @@ static ngx_int_t
 ngx_rtmp_codec_reconstruct_meta(ngx_rtmp_session_t *s)
 {
     ngx_rtmp_codec_ctx_t           *ctx;
-    ngx_rtmp_core_srv_conf_t       *cscf;
     ngx_int_t                       rc;
 
     static struct {
@@ -652,12 +919,7 @@ ngx_rtmp_codec_reconstruct_meta(ngx_rtmp_session_t *s)
         return NGX_OK;
     }
 
-    cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
-
-    if (ctx->meta) {
-        ngx_rtmp_free_shared_chain(cscf, ctx->meta);
-        ctx->meta = NULL;
-    }
+    ngx_rtmp_codec_free_meta(s, ctx);
 
     v.width = ctx->width;
     v.height = ctx->height;
@@ -691,11 +953,9 @@ ngx_rtmp_codec_copy_meta(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
 
     cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
 
-    if (ctx->meta) {
-        ngx_rtmp_free_shared_chain(cscf, ctx->meta);
-    }
+    ngx_rtmp_codec_free_meta(s, ctx);
 
-    ctx->meta = ngx_rtmp_append_shared_bufs(cscf, NULL, in);
+    ctx->meta = ngx_rtmp_append_shared_bufs(cscf, 0, NULL, in);
 
     if (ctx->meta == NULL) {
         return NGX_ERROR;
@@ -705,19 +965,61 @@ ngx_rtmp_codec_copy_meta(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
 }
 
 
+static void
+ngx_rtmp_codec_free_meta(ngx_rtmp_session_t *s, ngx_rtmp_codec_ctx_t *ctx)
+{
+    ngx_rtmp_core_srv_conf_t  *cscf;
+    ngx_uint_t                 n;
+
+    cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
+
+    if (ctx->meta) {
+        ngx_rtmp_free_shared_chain(cscf, ctx->meta);
+        ctx->meta = NULL;
+    }
+
+    for (n = 1; n < NGX_RTMP_MAX_CHUNK_CLASSES; n++) {
+        if (ctx->meta_class[n]) {
+            ngx_rtmp_free_shared_chain(cscf, ctx->meta_class[n]);
+            ctx->meta_class[n] = NULL;
+        }
+    }
+}
+
+
+/*
+ * Subscribers sending with a larger chunk size get a copy of multi-chunk
+ * meta chunked for them and keep their chunk size, which is adapted to
+ * their bitrate.
+ */
+
 static ngx_int_t
 ngx_rtmp_codec_prepare_meta(ngx_rtmp_session_t *s, uint32_t timestamp)
 {
-    ngx_rtmp_header_t      h;
-    ngx_rtmp_codec_ctx_t  *ctx;
+    ngx_rtmp_header_t          h;
+    ngx_rtmp_codec_ctx_t      *ctx;
+    ngx_rtmp_core_srv_conf_t  *cscf;
+    ngx_uint_t                 n;
 
     ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_codec_module);
+    cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
 
     ngx_memzero(&h, sizeof(h));
     h.csid = NGX_RTMP_CSID_AMF;
     h.msid = NGX_RTMP_MSID;
     h.type = NGX_RTMP_MSG_AMF_META;
     h.timestamp = timestamp;
+
+    for (n = 1; ctx->meta->next && n < cscf->nchunk_classes; n++) {
+        ctx->meta_class[n] = ngx_rtmp_append_shared_bufs(cscf, n, NULL,
+                                                         ctx->meta);
+        if (ctx->meta_class[n] == NULL) {
+            break;
+        }
+
+        ngx_rtmp_prepare_message(s, &h, NULL, ctx->meta_class[n]);
+    }
+
     ngx_rtmp_prepare_message(s, &h, NULL, ctx->meta);
 
     ctx->meta_version = ngx_rtmp_codec_get_next_version();
@@ -41,10 +41,17 @@ enum {
     NGX_RTMP_VIDEO_ON2_VP6          = 4,
     NGX_RTMP_VIDEO_ON2_VP6_ALPHA    = 5,
     NGX_RTMP_VIDEO_SCREEN2          = 6,
-    NGX_RTMP_VIDEO_H264             = 7
+    NGX_RTMP_VIDEO_H264             = 7,
+    /* de facto id, enhanced RTMP 'hvc1' is mapped to it as well */
+    NGX_RTMP_VIDEO_HEVC             = 12
 };
 
 
+/* video codecs sending decoder configuration, kept in avc_header */
+#define ngx_rtmp_is_avc_like(id)                                              \
+    ((id) == NGX_RTMP_VIDEO_H264 || (id) == NGX_RTMP_VIDEO_HEVC)
+
+
 u_char * ngx_rtmp_get_audio_codec_name(ngx_uint_t id);
 u_char * ngx_rtmp_get_video_codec_name(ngx_uint_t id);
 
@@ -73,11 +80,19 @@ typedef struct {
     u_char                      profile[32];
     u_char                      level[32];
 
+    /* RFC 6381 codecs parameter of video, avc1.* or hvc1.* */
+    u_char                      video_codecs[64];
+
+    /* AVC or HEVC decoder configuration */
     ngx_chain_t                *avc_header;
     ngx_chain_t                *aac_header;
 
     ngx_chain_t                *meta;
     ngx_uint_t                  meta_version;
+
+    /* meta taking more than one base size chunk, chunked with the
+     * larger out chunk sizes; [0] is not used, that is meta */
+    ngx_chain_t                *meta_class[NGX_RTMP_MAX_CHUNK_CLASSES];
 } ngx_rtmp_codec_ctx_t;
 
 
@@ -312,7 +312,6 @@ static const char *
 ngx_rtmp_control_walk_app(ngx_http_request_t *r,
     ngx_rtmp_core_app_conf_t *cacf)
 {
-    size_t                     len;
     ngx_str_t                  name;
     const char                *s;
     ngx_uint_t                 n;
@@ -324,32 +323,26 @@ ngx_rtmp_control_walk_app(ngx_http_request_t *r,
     if (ngx_http_arg(r, (u_char *) "name", sizeof("name") - 1, &name) != NGX_OK)
     {
         for (n = 0; n < (ngx_uint_t) lacf->nbuckets; ++n) {
-            for (ls = lacf->streams[n]; ls; ls = ls->next) {
-                s = ngx_rtmp_control_walk_stream(r, ls);
-                if (s != NGX_CONF_OK) {
-                    return s;
-                }
+            ls = lacf->streams[n];
+            if (ls == NULL) {
+                continue;
+            }
+
+            s = ngx_rtmp_control_walk_stream(r, ls);
+            if (s != NGX_CONF_OK) {
+                return s;
             }
         }
 
         return NGX_CONF_OK;
     }
 
-    for (ls = lacf->streams[ngx_hash_key(name.data, name.len) % lacf->nbuckets];
-         ls; ls = ls->next) 
-    {
-        len = ngx_strlen(ls->name);
-        if (name.len != len || ngx_strncmp(name.data, ls->name, name.len)) {
-            continue;
-        }
-
-        s = ngx_rtmp_control_walk_stream(r, ls);
-        if (s != NGX_CONF_OK) {
-            return s;
-        }
+    ls = ngx_rtmp_live_find_stream(lacf, name.data, name.len);
+    if (ls == NULL) {
+        return NGX_CONF_OK;
     }
 
-    return NGX_CONF_OK;
+    return ngx_rtmp_control_walk_stream(r, ls);
 }
 
 
@@ -107,6 +107,13 @@ static ngx_command_t  ngx_rtmp_core_commands[] = {
       offsetof(ngx_rtmp_core_srv_conf_t, chunk_size),
       NULL },
 
+    { ngx_string("max_chunk_size"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_RTMP_SRV_CONF_OFFSET,
+      offsetof(ngx_rtmp_core_srv_conf_t, max_chunk_size),
+      NULL },
+
     { ngx_string("max_message"),
       NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_size_slot,
@@ -241,6 +248,7 @@ ngx_rtmp_core_create_srv_conf(ngx_conf_t *cf)
     conf->so_keepalive = NGX_CONF_UNSET;
     conf->max_streams = NGX_CONF_UNSET;
     conf->chunk_size = NGX_CONF_UNSET;
+    conf->max_chunk_size = NGX_CONF_UNSET;
     conf->ack_window = NGX_CONF_UNSET_UINT;
     conf->max_message = NGX_CONF_UNSET_SIZE;
     conf->out_queue = NGX_CONF_UNSET_SIZE;
@@ -267,6 +275,8 @@ ngx_rtmp_core_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_value(conf->so_keepalive, prev->so_keepalive, 0);
     ngx_conf_merge_value(conf->max_streams, prev->max_streams, 32);
     ngx_conf_merge_value(conf->chunk_size, prev->chunk_size, 4096);
+    ngx_conf_merge_value(conf->max_chunk_size, prev->max_chunk_size,
+            conf->chunk_size);
     ngx_conf_merge_uint_value(conf->ack_window, prev->ack_window, 5000000);
     ngx_conf_merge_size_value(conf->max_message, prev->max_message,
             1 * 1024 * 1024);
@@ -287,6 +297,24 @@ ngx_rtmp_core_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
 
     conf->pool = prev->pool;
 
+    if (conf->max_chunk_size < conf->chunk_size) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"max_chunk_size\" is less than \"chunk_size\"");
+        return NGX_CONF_ERROR;
+    }
+
+    /* sessions send with chunk_size << class,
+     * class 0 is announced at connect */
+
+    conf->nchunk_classes = 1;
+
+    while (conf->nchunk_classes < NGX_RTMP_MAX_CHUNK_CLASSES &&
+           ngx_rtmp_chunk_class_size(conf, conf->nchunk_classes)
+           <= (size_t) conf->max_chunk_size)
+    {
+        conf->nchunk_classes++;
+    }
+
     return NGX_CONF_OK;
 }
 
@@ -746,6 +774,18 @@ ngx_rtmp_core_listen(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strcmp(value[i].data, "reuseport") == 0) {
+#if (NGX_HAVE_REUSEPORT)
+            ls->reuseport = 1;
+            ls->bind = 1;
+#else
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "reuseport is not supported "
+                               "on this platform, ignored");
+#endif
+            continue;
+        }
+
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "the invalid \"%V\" parameter", &value[i]);
         return NGX_CONF_ERROR;
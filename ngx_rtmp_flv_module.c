@@ -386,7 +386,8 @@ ngx_rtmp_flv_read_meta(ngx_rtmp_session_t *s, ngx_file_t *f)
     ngx_rtmp_flv_init_index(s, &in);
 
     /* output chain */
-    out = ngx_rtmp_append_shared_bufs(cscf, NULL, &in);
+    out = ngx_rtmp_append_shared_bufs(cscf, s->out_chunk_class, NULL,
+                                      &in);
 
     ngx_rtmp_prepare_message(s, &h, NULL, out);
     ngx_rtmp_send_message(s, out, 0);
@@ -503,7 +504,8 @@ ngx_rtmp_flv_send(ngx_rtmp_session_t *s, ngx_file_t *f, ngx_uint_t *ts)
     in_buf.last = ngx_rtmp_flv_buffer + size;
 
     /* output chain */
-    out = ngx_rtmp_append_shared_bufs(cscf, NULL, &in);
+    out = ngx_rtmp_append_shared_bufs(cscf, s->out_chunk_class, NULL,
+                                      &in);
 
     ngx_rtmp_prepare_message(s, &h, ctx->msg_mask & (1 << h.type) ?
                              &lh : NULL, out);
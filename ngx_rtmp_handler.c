@@ -11,9 +11,11 @@
 
 
 static void ngx_rtmp_recv(ngx_event_t *rev);
+static void ngx_rtmp_process_input(ngx_rtmp_session_t *s, u_char *old_pos,
+       size_t old_size);
+static ngx_int_t ngx_rtmp_parse_chunks(ngx_rtmp_session_t *s);
 static void ngx_rtmp_send(ngx_event_t *rev);
 static void ngx_rtmp_ping(ngx_event_t *rev);
-static ngx_int_t ngx_rtmp_finalize_set_chunk_size(ngx_rtmp_session_t *s);
 
 
 ngx_uint_t                  ngx_rtmp_naccepted;
@@ -82,6 +84,15 @@ ngx_rtmp_user_message_type(uint16_t evt)
 
 void
 ngx_rtmp_cycle(ngx_rtmp_session_t *s)
+{
+    ngx_rtmp_resume(s, NULL, 0);
+}
+
+
+/* start session cycle with data already read from connection */
+
+void
+ngx_rtmp_resume(ngx_rtmp_session_t *s, u_char *pos, size_t size)
 {
     ngx_connection_t           *c;
 
@@ -94,37 +105,244 @@ ngx_rtmp_cycle(ngx_rtmp_session_t *s)
     s->ping_evt.handler = ngx_rtmp_ping;
     ngx_rtmp_reset_ping(s);
 
-    ngx_rtmp_recv(c->read);
+    ngx_rtmp_process_input(s, pos, size);
 }
 
 
+/*
+ * Input is read into large refcounted buffers and parsed in place.
+ * Each chunk payload becomes a link pointing into the read buffer and
+ * holding a reference to it; message handlers and shared output chains
+ * see the same memory. A read buffer is rewound when nothing else
+ * references it, otherwise it's retired to the pinned list and reused
+ * later. Bytes are only moved when a chunk spans the end of a buffer.
+ */
+
 static ngx_chain_t *
-ngx_rtmp_alloc_in_buf(ngx_rtmp_session_t *s)
+ngx_rtmp_alloc_in_buf(ngx_rtmp_session_t *s, size_t size)
 {
-    ngx_chain_t        *cl;
+    ngx_chain_t        *cl, **ll;
     ngx_buf_t          *b;
-    size_t              size;
+    u_char             *p;
 
-    if ((cl = ngx_alloc_chain_link(s->in_pool)) == NULL
-       || (cl->buf = ngx_calloc_buf(s->in_pool)) == NULL)
-    {
-        return NULL;
+    /*
+     * reuse pinned buffer no longer referenced by subscribers; one held
+     * by a gop cache must not keep those retired after it from reuse
+     */
+
+    for (ll = &s->in_pinned; *ll; ll = &(*ll)->next) {
+        if (ngx_rtmp_ref((*ll)->buf->start) == 1) {
+            break;
+        }
+    }
+
+    cl = *ll;
+
+    if (cl) {
+        *ll = cl->next;
+        if (*ll == NULL) {
+            s->in_pinned_last = ll;
+        }
+
+        cl->next = NULL;
+        b = cl->buf;
+
+        if ((size_t) (b->end - b->start) >= size) {
+            b->pos = b->last = b->start;
+            return cl;
+        }
+
+        /* chunk size has grown */
+        ngx_rtmp_free_in_data(b->start);
+
+    } else {
+        cl = ngx_alloc_chain_link(s->in_pool);
+        if (cl == NULL) {
+            return NULL;
+        }
+
+        cl->next = NULL;
+
+        cl->buf = ngx_calloc_buf(s->in_pool);
+        if (cl->buf == NULL) {
+            return NULL;
+        }
+
+        b = cl->buf;
     }
 
-    cl->next = NULL;
-    b = cl->buf;
-    size = s->in_chunk_size + NGX_RTMP_MAX_CHUNK_HEADER;
+    /* buffer data is refcounted and may outlive the session
+     * while shared output chains still reference it */
 
-    b->start = b->last = b->pos = ngx_palloc(s->in_pool, size);
-    if (b->start == NULL) {
+    p = ngx_alloc(NGX_RTMP_REFCOUNT_BYTES + size, s->connection->log);
+    if (p == NULL) {
+        b->start = NULL;
         return NULL;
     }
+
+    b->start = b->last = b->pos = p + NGX_RTMP_REFCOUNT_BYTES;
     b->end = b->start + size;
 
+    ngx_rtmp_ref_set(b->start, 1);
+
     return cl;
 }
 
 
+/* make room for a full chunk and at least size bytes after b->pos */
+
+static ngx_buf_t *
+ngx_rtmp_reserve_in_buf(ngx_rtmp_session_t *s, size_t size)
+{
+    ngx_chain_t        *cl;
+    ngx_buf_t          *b, *nb;
+    size_t              need, alloc;
+
+    need = ngx_max(size, s->in_chunk_size + NGX_RTMP_MAX_CHUNK_HEADER);
+    alloc = need;
+
+    cl = s->in_buf;
+
+    if (cl) {
+        b = cl->buf;
+        alloc = b->end - b->start;
+
+        /* last read filled the buffer, read more at once */
+
+        if (b->last == b->end && alloc < NGX_RTMP_IN_BUF_SIZE) {
+            alloc = ngx_min(alloc * 2, NGX_RTMP_IN_BUF_SIZE);
+            goto replace;
+        }
+
+        if (ngx_rtmp_ref(b->start) == 1) {
+
+            /* nobody else refers to the buffer, move tail to start */
+
+            if (b->pos != b->start && (size_t) (b->end - b->pos) < need) {
+                b->last = ngx_movemem(b->start, b->pos, b->last - b->pos);
+                b->pos = b->start;
+            }
+
+            if (b->pos == b->last) {
+                b->pos = b->last = b->start;
+            }
+        }
+
+        /* with nothing to carry over prefer a new buffer to a short read */
+
+        if ((size_t) (b->end - b->pos) >= need
+            && (b->pos != b->last || (size_t) (b->end - b->last) >= alloc / 4))
+        {
+            return b;
+        }
+    }
+
+replace:
+
+    cl = ngx_rtmp_alloc_in_buf(s, ngx_max(alloc, need));
+    if (cl == NULL) {
+        return NULL;
+    }
+
+    nb = cl->buf;
+
+    if (s->in_buf) {
+
+        /* carry chunk spanning buffer end, retire old buffer */
+
+        b = s->in_buf->buf;
+        nb->last = ngx_cpymem(nb->last, b->pos, b->last - b->pos);
+        b->pos = b->last;
+
+        *s->in_pinned_last = s->in_buf;
+        s->in_pinned_last = &s->in_buf->next;
+    }
+
+    s->in_buf = cl;
+
+    return nb;
+}
+
+
+static ngx_chain_t *
+ngx_rtmp_alloc_in_link(ngx_rtmp_session_t *s)
+{
+    ngx_chain_t        *cl;
+
+    /* input stream 0 keeps free links */
+    cl = s->in_streams[0].in;
+    if (cl) {
+        s->in_streams[0].in = cl->next;
+        return cl;
+    }
+
+    cl = ngx_alloc_chain_link(s->in_pool);
+    if (cl == NULL) {
+        return NULL;
+    }
+
+    cl->buf = ngx_calloc_buf(s->in_pool);
+    if (cl->buf == NULL) {
+        return NULL;
+    }
+
+    return cl;
+}
+
+
+static void
+ngx_rtmp_free_in_links(ngx_rtmp_session_t *s, ngx_chain_t *head)
+{
+    ngx_chain_t        *cl, *next;
+
+    for (cl = head; cl; cl = next) {
+        next = cl->next;
+
+        ngx_rtmp_free_in_data(cl->buf->start);
+
+        cl->next = s->in_streams[0].in;
+        s->in_streams[0].in = cl;
+    }
+}
+
+
+void
+ngx_rtmp_free_in_bufs(ngx_rtmp_session_t *s)
+{
+    ngx_rtmp_core_srv_conf_t   *cscf;
+    ngx_rtmp_stream_t          *st;
+    ngx_chain_t                *cl;
+    ngx_int_t                   n;
+
+    cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
+
+    /* partially received messages */
+    for (n = 1; n < cscf->max_streams; ++n) {
+        st = &s->in_streams[n];
+
+        if (st->in) {
+            cl = st->in->next;
+            st->in->next = NULL;
+            st->in = NULL;
+
+            ngx_rtmp_free_in_links(s, cl);
+        }
+    }
+
+    if (s->in_buf) {
+        ngx_rtmp_free_in_data(s->in_buf->buf->start);
+        s->in_buf = NULL;
+    }
+
+    for (cl = s->in_pinned; cl; cl = cl->next) {
+        ngx_rtmp_free_in_data(cl->buf->start);
+    }
+
+    s->in_pinned = NULL;
+    s->in_pinned_last = &s->in_pinned;
+}
+
+
 void
 ngx_rtmp_reset_ping(ngx_rtmp_session_t *s)
 {
@@ -191,299 +409,425 @@ ngx_rtmp_ping(ngx_event_t *pev)
 
 static void
 ngx_rtmp_recv(ngx_event_t *rev)
+{
+    ngx_connection_t           *c;
+
+    c = rev->data;
+
+    if (c->destroyed) {
+        return;
+    }
+
+    ngx_rtmp_process_input(c->data, NULL, 0);
+}
+
+
+static void
+ngx_rtmp_process_input(ngx_rtmp_session_t *s, u_char *old_pos,
+    size_t old_size)
 {
     ngx_int_t                   n;
     ngx_connection_t           *c;
-    ngx_rtmp_session_t         *s;
-    ngx_rtmp_core_srv_conf_t   *cscf;
-    ngx_rtmp_header_t          *h;
-    ngx_rtmp_stream_t          *st, *st0;
-    ngx_chain_t                *in, *head;
     ngx_buf_t                  *b;
-    u_char                     *p, *pp, *old_pos;
-    size_t                      size, fsize, old_size;
-    uint8_t                     fmt, ext;
-    uint32_t                    csid, timestamp;
 
-    c = rev->data;
-    s = c->data;
-    b = NULL;
-    old_pos = NULL;
-    old_size = 0;
-    cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
+    c = s->connection;
 
     if (c->destroyed) {
         return;
     }
 
-    for( ;; ) {
+    if (old_size) {
 
-        st = &s->in_streams[s->in_csid];
+        ngx_log_debug1(NGX_LOG_DEBUG_RTMP, c->log, 0,
+                "reusing formerly read data: %d", old_size);
 
-        /* allocate new buffer */
-        if (st->in == NULL) {
-            st->in = ngx_rtmp_alloc_in_buf(s);
-            if (st->in == NULL) {
-                ngx_log_error(NGX_LOG_INFO, c->log, 0,
-                        "in buf alloc failed");
-                ngx_rtmp_finalize_session(s);
-                return;
-            }
+        b = ngx_rtmp_reserve_in_buf(s, old_size);
+        if (b == NULL) {
+            ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                    "in buf alloc failed");
+            ngx_rtmp_finalize_session(s);
+            return;
         }
 
-        h  = &st->hdr;
-        in = st->in;
-        b  = in->buf;
-
-        if (old_size) {
+        b->last = ngx_cpymem(b->last, old_pos, old_size);
+    }
 
-            ngx_log_debug1(NGX_LOG_DEBUG_RTMP, c->log, 0,
-                    "reusing formerly read data: %d", old_size);
+    for( ;; ) {
 
-            b->pos = b->start;
+        switch (ngx_rtmp_parse_chunks(s)) {
 
-            size = ngx_min((size_t) (b->end - b->start), old_size);
-            b->last = ngx_movemem(b->pos, old_pos, size);
+        case NGX_ERROR:
+            ngx_rtmp_finalize_session(s);
+            return;
 
-            if (s->in_chunk_size_changing) {
-                ngx_rtmp_finalize_set_chunk_size(s);
-            }
+        case NGX_DONE:
+            return;
+        }
 
-        } else {
+        b = ngx_rtmp_reserve_in_buf(s, 0);
+        if (b == NULL) {
+            ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                    "in buf alloc failed");
+            ngx_rtmp_finalize_session(s);
+            return;
+        }
 
-            if (old_pos) {
-                b->pos = b->last = b->start;
-            }
+        n = c->recv(c, b->last, b->end - b->last);
 
-            n = c->recv(c, b->last, b->end - b->last);
+        if (n == NGX_ERROR || n == 0) {
+            ngx_rtmp_finalize_session(s);
+            return;
+        }
 
-            if (n == NGX_ERROR || n == 0) {
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
                 ngx_rtmp_finalize_session(s);
-                return;
-            }
-
-            if (n == NGX_AGAIN) {
-                if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
-                    ngx_rtmp_finalize_session(s);
-                }
-                return;
             }
+            return;
+        }
 
-            s->ping_reset = 1;
-            ngx_rtmp_update_bandwidth(&ngx_rtmp_bw_in, n);
-            b->last += n;
-            s->in_bytes += n;
-
-            if (s->in_bytes >= 0xf0000000) {
-                ngx_log_debug0(NGX_LOG_DEBUG_RTMP, c->log, 0,
-                               "resetting byte counter");
-                s->in_bytes = 0;
-                s->in_last_ack = 0;
-            }
+        s->ping_reset = 1;
+        ngx_rtmp_update_bandwidth(&ngx_rtmp_bw_in, n);
+        b->last += n;
+        s->in_bytes += n;
+
+        if (s->in_bytes >= 0xf0000000) {
+            ngx_log_debug0(NGX_LOG_DEBUG_RTMP, c->log, 0,
+                           "resetting byte counter");
+            s->in_bytes = 0;
+            s->in_last_ack = 0;
+        }
 
-            if (s->ack_size && s->in_bytes - s->in_last_ack >= s->ack_size) {
+        if (s->ack_size && s->in_bytes - s->in_last_ack >= s->ack_size) {
 
-                s->in_last_ack = s->in_bytes;
+            s->in_last_ack = s->in_bytes;
 
-                ngx_log_debug1(NGX_LOG_DEBUG_RTMP, c->log, 0,
-                        "sending RTMP ACK(%uD)", s->in_bytes);
+            ngx_log_debug1(NGX_LOG_DEBUG_RTMP, c->log, 0,
+                    "sending RTMP ACK(%uD)", s->in_bytes);
 
-                if (ngx_rtmp_send_ack(s, s->in_bytes)) {
-                    ngx_rtmp_finalize_session(s);
-                    return;
-                }
+            if (ngx_rtmp_send_ack(s, s->in_bytes)) {
+                ngx_rtmp_finalize_session(s);
+                return;
             }
         }
+    }
+}
 
-        old_pos = NULL;
-        old_size = 0;
 
-        /* parse headers */
-        if (b->pos == b->start) {
-            p = b->pos;
+/*
+ * Handle all complete chunks in the read buffer. Returns NGX_AGAIN
+ * when more data is needed, NGX_DONE when the connection has been
+ * passed to another worker.
+ */
 
-            /* chunk basic header */
-            fmt  = (*p >> 6) & 0x03;
-            csid = *p++ & 0x3f;
+static ngx_int_t
+ngx_rtmp_parse_chunks(ngx_rtmp_session_t *s)
+{
+    ngx_connection_t           *c;
+    ngx_rtmp_core_srv_conf_t   *cscf;
+    ngx_rtmp_header_t          *h;
+    ngx_rtmp_stream_t          *st;
+    ngx_chain_t                *cl, *head;
+    ngx_buf_t                  *b, *lb;
+    u_char                     *p, *pp;
+    size_t                      size, fsize;
+    uint8_t                     fmt, ext, type;
+    uint32_t                    csid, timestamp, mlen, msid;
+    ngx_int_t                   rc;
 
-            if (csid == 0) {
-                if (b->last - p < 1)
-                    continue;
-                csid = 64;
-                csid += *(uint8_t*)p++;
+    if (s->in_buf == NULL) {
+        return NGX_AGAIN;
+    }
 
-            } else if (csid == 1) {
-                if (b->last - p < 2)
-                    continue;
-                csid = 64;
-                csid += *(uint8_t*)p++;
-                csid += (uint32_t)256 * (*(uint8_t*)p++);
-            }
+    c = s->connection;
+    cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
+    b = s->in_buf->buf;
 
-            ngx_log_debug2(NGX_LOG_DEBUG_RTMP, c->log, 0,
-                    "RTMP bheader fmt=%d csid=%D",
-                    (int)fmt, csid);
+    for ( ;; ) {
 
-            if (csid >= (uint32_t)cscf->max_streams) {
-                ngx_log_error(NGX_LOG_INFO, c->log, 0,
-                    "RTMP in chunk stream too big: %D >= %D",
-                    csid, cscf->max_streams);
-                ngx_rtmp_finalize_session(s);
-                return;
-            }
+        p = b->pos;
 
-            /* link orphan */
-            if (s->in_csid == 0) {
+        if (p == b->last) {
+            return NGX_AGAIN;
+        }
 
-                /* unlink from stream #0 */
-                st->in = st->in->next;
+        /* chunk basic header */
+        fmt  = (*p >> 6) & 0x03;
+        csid = *p++ & 0x3f;
+
+        if (csid == 0) {
+            if (b->last - p < 1)
+                return NGX_AGAIN;
+            csid = 64;
+            csid += *(uint8_t*)p++;
+
+        } else if (csid == 1) {
+            if (b->last - p < 2)
+                return NGX_AGAIN;
+            csid = 64;
+            csid += *(uint8_t*)p++;
+            csid += (uint32_t)256 * (*(uint8_t*)p++);
+        }
 
-                /* link to new stream */
-                s->in_csid = csid;
-                st = &s->in_streams[csid];
-                if (st->in == NULL) {
-                    in->next = in;
-                } else {
-                    in->next = st->in->next;
-                    st->in->next = in;
-                }
-                st->in = in;
-                h = &st->hdr;
-                h->csid = csid;
-            }
+        ngx_log_debug2(NGX_LOG_DEBUG_RTMP, c->log, 0,
+                "RTMP bheader fmt=%d csid=%D",
+                (int)fmt, csid);
 
-            ext = st->ext;
-            timestamp = st->dtime;
-            if (fmt <= 2 ) {
-                if (b->last - p < 3)
-                    continue;
-                /* timestamp:
-                 *  big-endian 3b -> little-endian 4b */
-                pp = (u_char*)&timestamp;
+        if (csid >= (uint32_t)cscf->max_streams) {
+            ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                "RTMP in chunk stream too big: %D >= %D",
+                csid, cscf->max_streams);
+            return NGX_ERROR;
+        }
+
+        st = &s->in_streams[csid];
+        h = &st->hdr;
+
+        /* header is only applied when the whole chunk is here */
+        ext = st->ext;
+        timestamp = st->dtime;
+        mlen = h->mlen;
+        type = h->type;
+        msid = h->msid;
+
+        if (fmt <= 2 ) {
+            if (b->last - p < 3)
+                return NGX_AGAIN;
+            /* timestamp:
+             *  big-endian 3b -> little-endian 4b */
+            pp = (u_char*)&timestamp;
+            pp[2] = *p++;
+            pp[1] = *p++;
+            pp[0] = *p++;
+            pp[3] = 0;
+
+            ext = (timestamp == 0x00ffffff);
+
+            if (fmt <= 1) {
+                if (b->last - p < 4)
+                    return NGX_AGAIN;
+                /* size:
+                 *  big-endian 3b -> little-endian 4b
+                 * type:
+                 *  1b -> 1b*/
+                pp = (u_char*)&mlen;
                 pp[2] = *p++;
                 pp[1] = *p++;
                 pp[0] = *p++;
                 pp[3] = 0;
+                type = *(uint8_t*)p++;
 
-                ext = (timestamp == 0x00ffffff);
-
-                if (fmt <= 1) {
+                if (fmt == 0) {
                     if (b->last - p < 4)
-                        continue;
-                    /* size:
-                     *  big-endian 3b -> little-endian 4b
-                     * type:
-                     *  1b -> 1b*/
-                    pp = (u_char*)&h->mlen;
-                    pp[2] = *p++;
-                    pp[1] = *p++;
+                        return NGX_AGAIN;
+                    /* stream:
+                     *  little-endian 4b -> little-endian 4b */
+                    pp = (u_char*)&msid;
                     pp[0] = *p++;
-                    pp[3] = 0;
-                    h->type = *(uint8_t*)p++;
-
-                    if (fmt == 0) {
-                        if (b->last - p < 4)
-                            continue;
-                        /* stream:
-                         *  little-endian 4b -> little-endian 4b */
-                        pp = (u_char*)&h->msid;
-                        pp[0] = *p++;
-                        pp[1] = *p++;
-                        pp[2] = *p++;
-                        pp[3] = *p++;
-                    }
+                    pp[1] = *p++;
+                    pp[2] = *p++;
+                    pp[3] = *p++;
                 }
             }
+        }
 
-            /* extended header */
-            if (ext) {
-                if (b->last - p < 4)
-                    continue;
-                pp = (u_char*)&timestamp;
-                pp[3] = *p++;
-                pp[2] = *p++;
-                pp[1] = *p++;
-                pp[0] = *p++;
-            }
+        /* extended header */
+        if (ext) {
+            if (b->last - p < 4)
+                return NGX_AGAIN;
+            pp = (u_char*)&timestamp;
+            pp[3] = *p++;
+            pp[2] = *p++;
+            pp[1] = *p++;
+            pp[0] = *p++;
+        }
 
-            if (st->len == 0) {
-                /* Messages with type=3 should
-                 * never have ext timestamp field
-                 * according to standard.
-                 * However that's not always the case
-                 * in real life */
-                st->ext = (ext && cscf->publish_time_fix);
-                if (fmt) {
-                    st->dtime = timestamp;
-                } else {
-                    h->timestamp = timestamp;
-                    st->dtime = 0;
-                }
-            }
+        if (mlen > cscf->max_message) {
+            ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                    "too big message: %uz", cscf->max_message);
+            return NGX_ERROR;
+        }
 
-            ngx_log_debug8(NGX_LOG_DEBUG_RTMP, c->log, 0,
-                    "RTMP mheader fmt=%d %s (%d) "
-                    "time=%uD+%uD mlen=%D len=%D msid=%D",
-                    (int)fmt, ngx_rtmp_message_type(h->type), (int)h->type,
-                    h->timestamp, st->dtime, h->mlen, st->len, h->msid);
+        fsize = mlen - st->len;
+        size = ngx_min(fsize, s->in_chunk_size);
 
-            /* header done */
-            b->pos = p;
+        if ((size_t) (b->last - p) < size) {
+            return NGX_AGAIN;
+        }
 
-            if (h->mlen > cscf->max_message) {
-                ngx_log_error(NGX_LOG_INFO, c->log, 0,
-                        "too big message: %uz", cscf->max_message);
-                ngx_rtmp_finalize_session(s);
-                return;
+        /* header done */
+        h->csid = csid;
+        h->mlen = mlen;
+        h->type = type;
+        h->msid = msid;
+
+        if (st->len == 0) {
+            /* Messages with type=3 should
+             * never have ext timestamp field
+             * according to standard.
+             * However that's not always the case
+             * in real life */
+            st->ext = (ext && cscf->publish_time_fix);
+            if (fmt) {
+                st->dtime = timestamp;
+            } else {
+                h->timestamp = timestamp;
+                st->dtime = 0;
             }
         }
 
-        size = b->last - b->pos;
-        fsize = h->mlen - st->len;
+        ngx_log_debug8(NGX_LOG_DEBUG_RTMP, c->log, 0,
+                "RTMP mheader fmt=%d %s (%d) "
+                "time=%uD+%uD mlen=%D len=%D msid=%D",
+                (int)fmt, ngx_rtmp_message_type(h->type), (int)h->type,
+                h->timestamp, st->dtime, h->mlen, st->len, h->msid);
 
-        if (size < ngx_min(fsize, s->in_chunk_size))
-            continue;
+        /* link chunk payload in place */
+
+        cl = ngx_rtmp_alloc_in_link(s);
+        if (cl == NULL) {
+            ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                    "in buf alloc failed");
+            return NGX_ERROR;
+        }
+
+        lb = cl->buf;
+        lb->start = b->start;
+        lb->end = b->end;
+        lb->pos = p;
+        lb->last = p + size;
 
-        /* buffer is ready */
+        ngx_rtmp_ref_get(b->start);
+
+        /* message chain is circular, st->in is the last link */
+        if (st->in == NULL) {
+            cl->next = cl;
+        } else {
+            cl->next = st->in->next;
+            st->in->next = cl;
+        }
+        st->in = cl;
+
+        b->pos = p + size;
 
         if (fsize > s->in_chunk_size) {
             /* collect fragmented chunks */
-            st->len += s->in_chunk_size;
-            b->last = b->pos + s->in_chunk_size;
-            old_pos = b->last;
-            old_size = size - s->in_chunk_size;
+            st->len += size;
+            continue;
+        }
 
-        } else {
-            /* handle! */
-            head = st->in->next;
-            st->in->next = NULL;
-            b->last = b->pos + fsize;
-            old_pos = b->last;
-            old_size = size - fsize;
-            st->len = 0;
-            h->timestamp += st->dtime;
+        /* handle! */
+        head = st->in->next;
+        st->in->next = NULL;
+        st->in = NULL;
+        st->len = 0;
+        h->timestamp += st->dtime;
 
-            if (ngx_rtmp_receive_message(s, h, head) != NGX_OK) {
-                ngx_rtmp_finalize_session(s);
-                return;
+        rc = ngx_rtmp_receive_message(s, h, head);
+
+        ngx_rtmp_free_in_links(s, head);
+
+        if (rc != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        if (s->handoff) {
+            /* unparsed data moves along with the connection */
+            switch (ngx_rtmp_handoff(s, b->pos, b->last - b->pos)) {
+            case NGX_OK:
+                return NGX_DONE;
+            case NGX_ERROR:
+                return NGX_ERROR;
             }
+        }
+    }
+}
 
-            if (s->in_chunk_size_changing) {
-                /* copy old data to a new buffer */
-                if (!old_size) {
-                    ngx_rtmp_finalize_set_chunk_size(s);
-                }
 
-            } else {
-                /* add used bufs to stream #0 */
-                st0 = &s->in_streams[0];
-                st->in->next = st0->in;
-                st0->in = head;
-                st->in = NULL;
+static ngx_chain_t *
+ngx_rtmp_gather_out(ngx_rtmp_session_t *s)
+{
+    ngx_chain_t                *cl, *ln;
+    ngx_uint_t                  n;
+    size_t                      pos;
+    u_char                     *bpos;
+
+    /* map as much of the output queue as fits
+     * into scratch links without touching shared chains */
+
+    cl = s->out_vec;
+    ln = s->out_chain;
+    bpos = s->out_bpos;
+    pos = s->out_pos;
+
+    for (n = 0; n < NGX_RTMP_OUT_VECS; ) {
+        cl[n].buf->pos = bpos;
+        cl[n].buf->last = ln->buf->last;
+        cl[n].next = &cl[n + 1];
+        ++n;
+
+        ln = ln->next;
+        if (ln == NULL) {
+            pos = (pos + 1) % s->out_queue;
+            if (pos == s->out_last) {
+                break;
             }
+            ln = s->out[pos];
         }
 
-        s->in_csid = 0;
+        bpos = ln->buf->pos;
+    }
+
+    cl[n - 1].next = NULL;
+
+    return cl;
+}
+
+
+static size_t
+ngx_rtmp_message_size(ngx_chain_t *out)
+{
+    size_t                      size;
+
+    for (size = 0; out; out = out->next) {
+        size += out->buf->last - out->buf->pos;
+    }
+
+    return size;
+}
+
+
+static void
+ngx_rtmp_advance_out(ngx_rtmp_session_t *s, off_t sent)
+{
+    ngx_rtmp_core_srv_conf_t   *cscf;
+    off_t                       size;
+
+    cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
+
+    while (s->out_chain) {
+        size = s->out_chain->buf->last - s->out_bpos;
+
+        if (size > sent) {
+            s->out_bpos += sent;
+            return;
+        }
+
+        sent -= size;
+
+        s->out_chain = s->out_chain->next;
+        if (s->out_chain == NULL) {
+            s->out_queued -= ngx_rtmp_message_size(s->out[s->out_pos]);
+            ngx_rtmp_free_shared_chain(cscf, s->out[s->out_pos]);
+            ++s->out_pos;
+            s->out_pos %= s->out_queue;
+            if (s->out_pos == s->out_last) {
+                return;
+            }
+            s->out_chain = s->out[s->out_pos];
+        }
+
+        s->out_bpos = s->out_chain->buf->pos;
     }
 }
 
@@ -493,8 +837,8 @@ ngx_rtmp_send(ngx_event_t *wev)
 {
     ngx_connection_t           *c;
     ngx_rtmp_session_t         *s;
-    ngx_int_t                   n;
-    ngx_rtmp_core_srv_conf_t   *cscf;
+    ngx_chain_t                *cl;
+    off_t                       sent;
 
     c = wev->data;
     s = c->data;
@@ -521,38 +865,31 @@ ngx_rtmp_send(ngx_event_t *wev)
     }
 
     while (s->out_chain) {
-        n = c->send(c, s->out_bpos, s->out_chain->buf->last - s->out_bpos);
+        sent = c->sent;
 
-        if (n == NGX_AGAIN || n == 0) {
-            ngx_add_timer(c->write, s->timeout);
-            if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
-                ngx_rtmp_finalize_session(s);
-            }
-            return;
-        }
+        cl = c->send_chain(c, ngx_rtmp_gather_out(s), 0);
 
-        if (n < 0) {
+        if (cl == NGX_CHAIN_ERROR) {
             ngx_rtmp_finalize_session(s);
             return;
         }
 
-        s->out_bytes += n;
-        s->ping_reset = 1;
-        ngx_rtmp_update_bandwidth(&ngx_rtmp_bw_out, n);
-        s->out_bpos += n;
-        if (s->out_bpos == s->out_chain->buf->last) {
-            s->out_chain = s->out_chain->next;
-            if (s->out_chain == NULL) {
-                cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
-                ngx_rtmp_free_shared_chain(cscf, s->out[s->out_pos]);
-                ++s->out_pos;
-                s->out_pos %= s->out_queue;
-                if (s->out_pos == s->out_last) {
-                    break;
-                }
-                s->out_chain = s->out[s->out_pos];
+        sent = c->sent - sent;
+
+        if (sent) {
+            s->out_bytes += sent;
+            s->ping_reset = 1;
+            ngx_rtmp_update_bandwidth(&ngx_rtmp_bw_out, sent);
+        }
+
+        ngx_rtmp_advance_out(s, sent);
+
+        if (cl) {
+            ngx_add_timer(c->write, s->timeout);
+            if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+                ngx_rtmp_finalize_session(s);
             }
-            s->out_bpos = s->out_chain->buf->pos;
+            return;
         }
     }
 
@@ -564,46 +901,20 @@ ngx_rtmp_send(ngx_event_t *wev)
 }
 
 
-void
-ngx_rtmp_prepare_message(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
-        ngx_rtmp_header_t *lh, ngx_chain_t *out)
+static size_t
+ngx_rtmp_write_header(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
+        ngx_rtmp_header_t *lh, uint32_t mlen, u_char *hdr, u_char *th,
+        size_t *thsize)
 {
-    ngx_chain_t                *l;
     u_char                     *p, *pp;
-    ngx_int_t                   hsize, thsize;
-#if (NGX_DEBUG)
-    ngx_int_t                   nbufs;
-#endif
-    uint32_t                    mlen, timestamp, ext_timestamp;
+    size_t                      hsize;
+    uint32_t                    timestamp, ext_timestamp;
     static uint8_t              hdrsize[] = { 12, 8, 4, 1 };
-    u_char                      th[7];
     ngx_rtmp_core_srv_conf_t   *cscf;
     uint8_t                     fmt;
-    ngx_connection_t           *c;
 
-    c = s->connection;
     cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
 
-    if (h->csid >= (uint32_t)cscf->max_streams) {
-        ngx_log_error(NGX_LOG_INFO, c->log, 0,
-                "RTMP out chunk stream too big: %D >= %D",
-                h->csid, cscf->max_streams);
-        ngx_rtmp_finalize_session(s);
-        return;
-    }
-
-    /* detect packet size */
-    mlen = 0;
-#if (NGX_DEBUG)
-    nbufs = 0;
-#endif
-    for(l = out; l; l = l->next) {
-        mlen += (l->buf->last - l->buf->pos);
-#if (NGX_DEBUG)
-        ++nbufs;
-#endif
-    }
-
     fmt = 0;
     if (lh && lh->csid && h->msid == lh->msid) {
         ++fmt;
@@ -625,11 +936,11 @@ ngx_rtmp_prepare_message(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
 
     hsize = hdrsize[fmt];
 
-    ngx_log_debug8(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+    ngx_log_debug7(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
             "RTMP prep %s (%d) fmt=%d csid=%uD timestamp=%uD "
-            "mlen=%uD msid=%uD nbufs=%d",
+            "mlen=%uD msid=%uD",
             ngx_rtmp_message_type(h->type), (int)h->type, (int)fmt,
-            h->csid, timestamp, mlen, h->msid, nbufs);
+            h->csid, timestamp, mlen, h->msid);
 
     ext_timestamp = 0;
     if (timestamp >= 0x00ffffff) {
@@ -645,9 +956,7 @@ ngx_rtmp_prepare_message(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
         }
     }
 
-    /* fill initial header */
-    out->buf->pos -= hsize;
-    p = out->buf->pos;
+    p = hdr;
 
     /* basic header */
     *p = (fmt << 6);
@@ -663,8 +972,8 @@ ngx_rtmp_prepare_message(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
     }
 
     /* create fmt3 header for successive fragments */
-    thsize = p - out->buf->pos;
-    ngx_memcpy(th, out->buf->pos, thsize);
+    *thsize = p - hdr;
+    ngx_memcpy(th, hdr, *thsize);
     th[0] |= 0xc0;
 
     /* message header */
@@ -702,11 +1011,50 @@ ngx_rtmp_prepare_message(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
          * wants data to be encoded;
          * ffmpeg complains */
         if (cscf->play_time_fix) {
-            ngx_memcpy(&th[thsize], p - 4, 4);
-            thsize += 4;
+            ngx_memcpy(&th[*thsize], p - 4, 4);
+            *thsize += 4;
         }
     }
 
+    return hsize;
+}
+
+
+void
+ngx_rtmp_prepare_message(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
+        ngx_rtmp_header_t *lh, ngx_chain_t *out)
+{
+    ngx_chain_t                *l;
+    size_t                      hsize, thsize;
+    uint32_t                    mlen;
+    u_char                      hdr[NGX_RTMP_MAX_CHUNK_HEADER];
+    u_char                      th[7];
+    ngx_rtmp_core_srv_conf_t   *cscf;
+    ngx_connection_t           *c;
+
+    c = s->connection;
+    cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
+
+    if (h->csid >= (uint32_t)cscf->max_streams) {
+        ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                "RTMP out chunk stream too big: %D >= %D",
+                h->csid, cscf->max_streams);
+        ngx_rtmp_finalize_session(s);
+        return;
+    }
+
+    /* detect packet size */
+    mlen = 0;
+    for(l = out; l; l = l->next) {
+        mlen += (l->buf->last - l->buf->pos);
+    }
+
+    hsize = ngx_rtmp_write_header(s, h, lh, mlen, hdr, th, &thsize);
+
+    /* fill initial header */
+    out->buf->pos -= hsize;
+    ngx_memcpy(out->buf->pos, hdr, hsize);
+
     /* append headers to successive fragments */
     for(out = out->next; out; out = out->next) {
         out->buf->pos -= thsize;
@@ -715,12 +1063,104 @@ ngx_rtmp_prepare_message(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
 }
 
 
+ngx_chain_t *
+ngx_rtmp_prepare_shared_message(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
+        ngx_rtmp_header_t *lh, ngx_chain_t *in, ngx_uint_t cls)
+{
+    ngx_chain_t                *cl, *l, *head, **ll;
+    ngx_buf_t                  *b;
+    u_char                     *p;
+    size_t                      hsize, thsize, size, left, chunk_size;
+    uint32_t                    mlen;
+    u_char                      hdr[NGX_RTMP_MAX_CHUNK_HEADER];
+    u_char                      th[7];
+    ngx_rtmp_core_srv_conf_t   *cscf;
+
+    /* Build message from small header links and links borrowing
+     * payload slices of refcounted input bufs. No payload is copied;
+     * only chunk headers are generated for each variant. */
+
+    cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
+
+    chunk_size = ngx_rtmp_chunk_class_size(cscf, cls);
+
+    if (h->csid >= (uint32_t)cscf->max_streams) {
+        ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
+                "RTMP out chunk stream too big: %D >= %D",
+                h->csid, cscf->max_streams);
+        return NULL;
+    }
+
+    mlen = 0;
+    for (cl = in; cl; cl = cl->next) {
+        mlen += (cl->buf->last - cl->buf->pos);
+    }
+
+    hsize = ngx_rtmp_write_header(s, h, lh, mlen, hdr, th, &thsize);
+
+    head = ngx_rtmp_alloc_shared_link(cscf);
+    if (head == NULL) {
+        return NULL;
+    }
+
+    head->buf->last = ngx_cpymem(head->buf->last, hdr, hsize);
+    ll = &head->next;
+    left = chunk_size;
+
+    for (cl = in; cl; cl = cl->next) {
+        b = cl->buf;
+
+        for (p = b->pos; p != b->last; p += size) {
+
+            if (left == 0) {
+                l = ngx_rtmp_alloc_shared_link(cscf);
+                if (l == NULL) {
+                    goto failed;
+                }
+
+                l->buf->last = ngx_cpymem(l->buf->last, th, thsize);
+                *ll = l;
+                ll = &l->next;
+                left = chunk_size;
+            }
+
+            size = ngx_min((size_t) (b->last - p), left);
+
+            l = ngx_rtmp_alloc_shared_link(cscf);
+            if (l == NULL) {
+                goto failed;
+            }
+
+            l->buf->start = b->start;
+            l->buf->end = b->end;
+            l->buf->pos = p;
+            l->buf->last = p + size;
+            ngx_rtmp_ref_get(b->start);
+
+            *ll = l;
+            ll = &l->next;
+            left -= size;
+        }
+    }
+
+    return head;
+
+failed:
+    ngx_rtmp_free_shared_chain(cscf, head);
+    return NULL;
+}
+
+
 ngx_int_t
 ngx_rtmp_send_message(ngx_rtmp_session_t *s, ngx_chain_t *out,
         ngx_uint_t priority)
 {
     ngx_uint_t                      nmsg;
 
+    if (s->bus) {
+        return NGX_OK;
+    }
+
     nmsg = (s->out_last - s->out_pos) % s->out_queue + 1;
 
     if (priority > 3) {
@@ -738,12 +1178,13 @@ ngx_rtmp_send_message(ngx_rtmp_session_t *s, ngx_chain_t *out,
 
     s->out[s->out_last++] = out;
     s->out_last %= s->out_queue;
+    s->out_queued += ngx_rtmp_message_size(out);
 
     ngx_rtmp_acquire_shared_chain(out);
 
-    ngx_log_debug3(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
-            "RTMP send nmsg=%ui, priority=%ui #%ui",
-            nmsg, priority, s->out_last);
+    ngx_log_debug4(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+            "RTMP send nmsg=%ui, priority=%ui #%ui queued=%uz",
+            nmsg, priority, s->out_last, s->out_queued);
 
     if (priority && s->out_buffer && nmsg < s->out_cork) {
         return NGX_OK;
@@ -822,11 +1263,6 @@ ngx_rtmp_receive_message(ngx_rtmp_session_t *s,
 ngx_int_t
 ngx_rtmp_set_chunk_size(ngx_rtmp_session_t *s, ngx_uint_t size)
 {
-    ngx_rtmp_core_srv_conf_t           *cscf;
-    ngx_chain_t                        *li, *fli, *lo, *flo;
-    ngx_buf_t                          *bi, *bo;
-    ngx_int_t                           n;
-
     ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
         "setting chunk_size=%ui", size);
 
@@ -836,75 +1272,143 @@ ngx_rtmp_set_chunk_size(ngx_rtmp_session_t *s, ngx_uint_t size)
         return NGX_ERROR;
     }
 
-    cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
+    /* read buffers are grown on demand, fragments
+     * of messages received so far stay where they are */
 
-    s->in_old_pool = s->in_pool;
     s->in_chunk_size = size;
-    s->in_pool = ngx_create_pool(4096, s->connection->log);
-
-    /* copy existing chunk data */
-    if (s->in_old_pool) {
-        s->in_chunk_size_changing = 1;
-        s->in_streams[0].in = NULL;
-
-        for(n = 1; n < cscf->max_streams; ++n) {
-            /* stream buffer is circular
-             * for all streams except for the current one
-             * (which caused this chunk size change);
-             * we can simply ignore it */
-            li = s->in_streams[n].in;
-            if (li == NULL || li->next == NULL) {
-                s->in_streams[n].in = NULL;
-                continue;
-            }
-            /* move from last to the first */
-            li = li->next;
-            fli = li;
-            lo = ngx_rtmp_alloc_in_buf(s);
-            if (lo == NULL) {
-                return NGX_ERROR;
-            }
-            flo = lo;
-            for ( ;; ) {
-                bi = li->buf;
-                bo = lo->buf;
-
-                if (bo->end - bo->last >= bi->last - bi->pos) {
-                    bo->last = ngx_cpymem(bo->last, bi->pos,
-                            bi->last - bi->pos);
-                    li = li->next;
-                    if (li == fli)  {
-                        lo->next = flo;
-                        s->in_streams[n].in = lo;
-                        break;
-                    }
-                    continue;
-                }
 
-                bi->pos += (ngx_cpymem(bo->last, bi->pos,
-                            bo->end - bo->last) - bo->last);
-                lo->next = ngx_rtmp_alloc_in_buf(s);
-                lo = lo->next;
-                if (lo == NULL) {
-                    return NGX_ERROR;
-                }
-            }
-        }
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_rtmp_set_out_chunk_class(ngx_rtmp_session_t *s, ngx_uint_t cls)
+{
+    ngx_rtmp_core_srv_conf_t   *cscf;
+    ngx_int_t                   rc;
+
+    if (cls == s->out_chunk_class) {
+        return NGX_OK;
     }
 
+    cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                   "setting out chunk_size=%uz class=%ui",
+                   ngx_rtmp_chunk_class_size(cscf, cls), cls);
+
+    /* messages queued so far are chunked with the old size
+     * and go out before the peer learns the new one */
+
+    rc = ngx_rtmp_send_chunk_size(s,
+                         (uint32_t) ngx_rtmp_chunk_class_size(cscf, cls));
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    s->out_chunk_class = cls;
+
     return NGX_OK;
 }
 
 
-static ngx_int_t
-ngx_rtmp_finalize_set_chunk_size(ngx_rtmp_session_t *s)
+static ngx_uint_t
+ngx_rtmp_get_rtt(ngx_rtmp_session_t *s)
 {
-    if (s->in_chunk_size_changing && s->in_old_pool) {
-        ngx_destroy_pool(s->in_old_pool);
-        s->in_old_pool = NULL;
-        s->in_chunk_size_changing = 0;
+#if (NGX_HAVE_TCP_INFO)
+
+    struct tcp_info             ti;
+    socklen_t                   len;
+
+    len = sizeof(struct tcp_info);
+
+    if (getsockopt(s->connection->fd, IPPROTO_TCP, TCP_INFO, &ti, &len)
+        == -1)
+    {
+        return 0;
     }
-    return NGX_OK;
+
+    return ti.tcpi_rtt;
+
+#else
+
+    return 0;
+
+#endif
+}
+
+
+/*
+ * Pick outbound chunk size for a session sending a stream.
+ *
+ * Chunks are sized to carry about NGX_RTMP_CHUNK_TIME of the
+ * observed outbound bitrate: high bitrates get fewer headers and
+ * bufs per frame, low bitrates keep audio and video interleaved
+ * finely. When rtt grows well above the lowest seen, data queues
+ * up on the path and chunk size steps down instead of up.
+ * Size changes by at most one class per interval.
+ */
+
+ngx_int_t
+ngx_rtmp_adapt_chunk_size(ngx_rtmp_session_t *s)
+{
+    ngx_rtmp_core_srv_conf_t   *cscf;
+    ngx_msec_t                  elapsed;
+    ngx_uint_t                  cls, target, rtt;
+    uint64_t                    budget;
+
+    cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
+
+    if (cscf->nchunk_classes < 2) {
+        return NGX_OK;
+    }
+
+    elapsed = ngx_current_msec - s->out_chunk_time;
+
+    if (elapsed < NGX_RTMP_CHUNK_ADAPT_INTERVAL) {
+        return NGX_OK;
+    }
+
+    budget = (uint64_t) (uint32_t) (s->out_bytes - s->out_chunk_bytes)
+             * NGX_RTMP_CHUNK_TIME / elapsed;
+
+    s->out_chunk_time = ngx_current_msec;
+    s->out_chunk_bytes = s->out_bytes;
+
+    for (target = 0; target + 1 < cscf->nchunk_classes; ++target) {
+        if (ngx_rtmp_chunk_class_size(cscf, target + 1) > budget) {
+            break;
+        }
+    }
+
+    cls = s->out_chunk_class;
+
+    rtt = ngx_rtmp_get_rtt(s);
+
+    if (rtt) {
+        if (s->out_chunk_rtt == 0 || rtt < s->out_chunk_rtt) {
+            s->out_chunk_rtt = rtt;
+        }
+
+        if (rtt > s->out_chunk_rtt * 2 + NGX_RTMP_CHUNK_RTT_SLACK &&
+            target >= cls)
+        {
+            target = (cls ? cls - 1 : 0);
+        }
+    }
+
+    ngx_log_debug4(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                   "adapt chunk: budget=%uL rtt=%ui min_rtt=%ui target=%ui",
+                   budget, rtt, s->out_chunk_rtt, target);
+
+    if (target > cls) {
+        cls++;
+
+    } else if (target < cls) {
+        cls--;
+    }
+
+    return ngx_rtmp_set_out_chunk_class(s, cls);
 }
 
 
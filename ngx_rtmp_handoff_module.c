@@ -0,0 +1,877 @@
+/*
+ * Copyright (C) Roman Arutyunyan
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include "ngx_rtmp.h"
+#include "ngx_rtmp_cmd_module.h"
+#include "ngx_rtmp_live_bus_module.h"
+
+
+/*
+ * Stream affinity handoff. With "reuseport" listeners each worker accepts
+ * its own share of clients regardless of the streams they play. When a
+ * client plays a stream published on another worker (as seen in live bus
+ * directory) the connection descriptor is passed to that worker over a
+ * datagram socket along with session state and input not parsed yet.
+ * The receiving worker restores the session and replays "play" locally,
+ * so the stream is never copied through the bus for that client.
+ *
+ * The module is listed last so that its play handler is called first,
+ * before any notifications or relays are started for the client.
+ */
+
+
+#define NGX_RTMP_HANDOFF_MAX_WORKERS    64
+#define NGX_RTMP_HANDOFF_BUFSIZE        65536
+
+
+static ngx_rtmp_play_pt                 next_play;
+
+
+static ngx_int_t ngx_rtmp_handoff_init_module(ngx_cycle_t *cycle);
+static ngx_int_t ngx_rtmp_handoff_init_process(ngx_cycle_t *cycle);
+static ngx_int_t ngx_rtmp_handoff_postconfiguration(ngx_conf_t *cf);
+static void * ngx_rtmp_handoff_create_main_conf(ngx_conf_t *cf);
+static char * ngx_rtmp_handoff_init_main_conf(ngx_conf_t *cf, void *conf);
+
+
+typedef struct {
+    ngx_flag_t                          handoff;
+} ngx_rtmp_handoff_main_conf_t;
+
+
+typedef struct {
+    ngx_rtmp_play_t                     play;
+    ngx_uint_t                          worker;
+    unsigned                            received:1;
+} ngx_rtmp_handoff_ctx_t;
+
+
+/* message header, followed by chunk stream headers and unparsed input */
+typedef struct {
+    ngx_uint_t                          listening;
+    ngx_msec_t                          uptime;
+    ngx_msec_t                          peer_epoch;
+    uint32_t                            buflen;
+    uint32_t                            ack_size;
+    uint32_t                            in_bytes;
+    uint32_t                            in_last_ack;
+    uint32_t                            in_chunk_size;
+    uint32_t                            out_chunk_class;
+    uint32_t                            acodecs;
+    uint32_t                            vcodecs;
+    uint32_t                            nstreams;
+    uint32_t                            size;
+    u_char                              addr_text[NGX_SOCKADDR_STRLEN];
+    u_char                              app[NGX_RTMP_MAX_NAME];
+    u_char                              args[NGX_RTMP_MAX_ARGS];
+    u_char                              flashver[32];
+    u_char                              swf_url[NGX_RTMP_MAX_URL];
+    u_char                              tc_url[NGX_RTMP_MAX_URL];
+    u_char                              page_url[NGX_RTMP_MAX_URL];
+    ngx_rtmp_play_t                     play;
+} ngx_rtmp_handoff_msg_t;
+
+
+typedef struct {
+    ngx_rtmp_header_t                   hdr;
+    uint32_t                            dtime;
+    uint8_t                             ext;
+} ngx_rtmp_handoff_stream_t;
+
+
+/* socket pairs, one per worker: [2n] to send, [2n + 1] to receive */
+static int                             *ngx_rtmp_handoff_fds;
+static ngx_uint_t                       ngx_rtmp_handoff_nfds;
+
+static u_char                          *ngx_rtmp_handoff_buf;
+
+
+static ngx_command_t  ngx_rtmp_handoff_commands[] = {
+
+    { ngx_string("handoff"),
+      NGX_RTMP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_flag_slot,
+      NGX_RTMP_MAIN_CONF_OFFSET,
+      offsetof(ngx_rtmp_handoff_main_conf_t, handoff),
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_rtmp_module_t  ngx_rtmp_handoff_module_ctx = {
+    NULL,                                   /* preconfiguration */
+    ngx_rtmp_handoff_postconfiguration,     /* postconfiguration */
+    ngx_rtmp_handoff_create_main_conf,      /* create main configuration */
+    ngx_rtmp_handoff_init_main_conf,        /* init main configuration */
+    NULL,                                   /* create server configuration */
+    NULL,                                   /* merge server configuration */
+    NULL,                                   /* create app configuration */
+    NULL                                    /* merge app configuration */
+};
+
+
+ngx_module_t  ngx_rtmp_handoff_module = {
+    NGX_MODULE_V1,
+    &ngx_rtmp_handoff_module_ctx,           /* module context */
+    ngx_rtmp_handoff_commands,              /* module directives */
+    NGX_RTMP_MODULE,                        /* module type */
+    NULL,                                   /* init master */
+    ngx_rtmp_handoff_init_module,           /* init module */
+    ngx_rtmp_handoff_init_process,          /* init process */
+    NULL,                                   /* init thread */
+    NULL,                                   /* exit thread */
+    NULL,                                   /* exit process */
+    NULL,                                   /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static void *
+ngx_rtmp_handoff_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_rtmp_handoff_main_conf_t   *hmcf;
+
+    hmcf = ngx_pcalloc(cf->pool, sizeof(ngx_rtmp_handoff_main_conf_t));
+    if (hmcf == NULL) {
+        return NULL;
+    }
+
+    hmcf->handoff = NGX_CONF_UNSET;
+
+    return hmcf;
+}
+
+
+static char *
+ngx_rtmp_handoff_init_main_conf(ngx_conf_t *cf, void *conf)
+{
+    ngx_rtmp_handoff_main_conf_t   *hmcf = conf;
+
+    ngx_conf_init_value(hmcf->handoff, 0);
+
+#if !(NGX_LINUX)
+    if (hmcf->handoff) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"handoff\" is not supported on this platform");
+        return NGX_CONF_ERROR;
+    }
+#endif
+
+    return NGX_CONF_OK;
+}
+
+
+static void
+ngx_rtmp_handoff_close_fds(void *data)
+{
+    int                            *fds = data;
+
+    ngx_uint_t                      n;
+
+    for (n = 0; fds[n] != -1; ++n) {
+        close(fds[n]);
+    }
+}
+
+
+static ngx_int_t
+ngx_rtmp_handoff_init_module(ngx_cycle_t *cycle)
+{
+#if (NGX_LINUX)
+    ngx_rtmp_handoff_main_conf_t   *hmcf;
+    ngx_core_conf_t                *ccf;
+    ngx_pool_cleanup_t             *cln;
+    ngx_uint_t                      n, nfds;
+    int                            *fds;
+
+    ngx_rtmp_handoff_fds = NULL;
+    ngx_rtmp_handoff_nfds = 0;
+
+    hmcf = ngx_rtmp_cycle_get_module_main_conf(cycle, ngx_rtmp_handoff_module);
+    if (hmcf == NULL || !hmcf->handoff) {
+        return NGX_OK;
+    }
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
+
+    nfds = ngx_min((ngx_uint_t) ccf->worker_processes,
+                   NGX_RTMP_HANDOFF_MAX_WORKERS);
+
+    /* sockets are created before fork to be shared by all workers */
+
+    fds = ngx_palloc(cycle->pool, sizeof(int) * (2 * nfds + 1));
+    if (fds == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln = ngx_pool_cleanup_add(cycle->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (n = 0; n < nfds; ++n) {
+        if (socketpair(AF_UNIX, SOCK_DGRAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0,
+                       &fds[2 * n])
+            == -1)
+        {
+            ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_socket_errno,
+                          "handoff: socketpair() failed");
+            break;
+        }
+    }
+
+    fds[2 * n] = -1;
+
+    cln->handler = ngx_rtmp_handoff_close_fds;
+    cln->data = fds;
+
+    if (n != nfds) {
+        return NGX_ERROR;
+    }
+
+    ngx_rtmp_handoff_fds = fds;
+    ngx_rtmp_handoff_nfds = nfds;
+
+#endif
+
+    return NGX_OK;
+}
+
+
+static u_char *
+ngx_rtmp_handoff_put_str(u_char *dst, size_t size, ngx_str_t *str)
+{
+    if (str->len >= size) {
+        return NULL;
+    }
+
+    *ngx_cpymem(dst, str->data, str->len) = 0;
+
+    return dst;
+}
+
+
+static ngx_int_t
+ngx_rtmp_handoff_get_str(ngx_rtmp_session_t *s, ngx_str_t *str, u_char *src,
+    size_t size)
+{
+    str->len = ngx_strnlen(src, size);
+    if (str->len == size) {
+        return NGX_ERROR;
+    }
+
+    str->data = ngx_pnalloc(s->connection->pool, str->len);
+    if (str->data == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(str->data, src, str->len);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_rtmp_handoff_play(ngx_rtmp_session_t *s, ngx_rtmp_play_t *v)
+{
+    ngx_rtmp_core_srv_conf_t       *cscf;
+    ngx_rtmp_handoff_ctx_t         *ctx;
+    ngx_int_t                       worker;
+    ngx_int_t                       n;
+
+    if (ngx_rtmp_handoff_buf == NULL || s->relay || s->auto_pushed ||
+        s->bus)
+    {
+        goto next;
+    }
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_handoff_module);
+    if (ctx && ctx->received) {
+        goto next;
+    }
+
+    worker = ngx_rtmp_live_bus_find_worker(&s->app, v->name);
+    if (worker == NGX_DECLINED || (ngx_uint_t) worker == ngx_worker ||
+        (ngx_uint_t) worker >= ngx_rtmp_handoff_nfds)
+    {
+        goto next;
+    }
+
+    /* only a session with nothing half-sent or half-received
+     * can be restored elsewhere */
+
+    if (s->out_pos != s->out_last) {
+        goto next;
+    }
+
+    cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
+
+    for (n = 1; n < cscf->max_streams; ++n) {
+        if (s->in_streams[n].len) {
+            goto next;
+        }
+    }
+
+    if (ctx == NULL) {
+        ctx = ngx_pcalloc(s->connection->pool, sizeof(ngx_rtmp_handoff_ctx_t));
+        if (ctx == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_rtmp_set_ctx(s, ctx, ngx_rtmp_handoff_module);
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                   "handoff: '%s' is published by worker %i", v->name, worker);
+
+    /* connection is passed as soon as the message is handled */
+
+    ctx->play = *v;
+    ctx->worker = worker;
+
+    s->handoff = 1;
+
+    return NGX_OK;
+
+next:
+    return next_play(s, v);
+}
+
+
+static ngx_int_t
+ngx_rtmp_handoff_send(ngx_rtmp_session_t *s, ngx_rtmp_handoff_ctx_t *ctx,
+    u_char *pos, size_t size)
+{
+    ngx_connection_t               *c;
+    ngx_rtmp_core_srv_conf_t       *cscf;
+    ngx_rtmp_handoff_msg_t         *hm;
+    ngx_rtmp_handoff_stream_t      *hs;
+    ngx_listening_t                *ls;
+    ngx_uint_t                      n;
+    ssize_t                         rc;
+    size_t                          len;
+    struct iovec                    iov;
+    struct msghdr                   msg;
+
+    union {
+        struct cmsghdr              cm;
+        char                        space[CMSG_SPACE(sizeof(int))];
+    } cmsg;
+
+    c = s->connection;
+    cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
+
+    len = sizeof(ngx_rtmp_handoff_msg_t)
+          + sizeof(ngx_rtmp_handoff_stream_t) * cscf->max_streams + size;
+
+    if (len > NGX_RTMP_HANDOFF_BUFSIZE) {
+        return NGX_DECLINED;
+    }
+
+    hm = (ngx_rtmp_handoff_msg_t *) ngx_rtmp_handoff_buf;
+    ngx_memzero(hm, sizeof(ngx_rtmp_handoff_msg_t));
+
+    ls = ngx_cycle->listening.elts;
+    for (n = 0; n < ngx_cycle->listening.nelts; ++n) {
+        if (&ls[n] == c->listening) {
+            break;
+        }
+    }
+
+    if (n == ngx_cycle->listening.nelts) {
+        return NGX_DECLINED;
+    }
+
+    hm->listening = n;
+    hm->uptime = ngx_current_msec - s->epoch;
+    hm->peer_epoch = s->peer_epoch;
+    hm->buflen = s->buflen;
+    hm->ack_size = s->ack_size;
+    hm->in_bytes = s->in_bytes;
+    hm->in_last_ack = s->in_last_ack;
+    hm->in_chunk_size = (uint32_t) s->in_chunk_size;
+    hm->out_chunk_class = (uint32_t) s->out_chunk_class;
+    hm->acodecs = s->acodecs;
+    hm->vcodecs = s->vcodecs;
+    hm->nstreams = (uint32_t) cscf->max_streams;
+    hm->size = (uint32_t) size;
+    hm->play = ctx->play;
+
+    if (ngx_rtmp_handoff_put_str(hm->addr_text, sizeof(hm->addr_text),
+                                 &c->addr_text) == NULL
+        || ngx_rtmp_handoff_put_str(hm->app, sizeof(hm->app),
+                                    &s->app) == NULL
+        || ngx_rtmp_handoff_put_str(hm->args, sizeof(hm->args),
+                                    &s->args) == NULL
+        || ngx_rtmp_handoff_put_str(hm->flashver, sizeof(hm->flashver),
+                                    &s->flashver) == NULL
+        || ngx_rtmp_handoff_put_str(hm->swf_url, sizeof(hm->swf_url),
+                                    &s->swf_url) == NULL
+        || ngx_rtmp_handoff_put_str(hm->tc_url, sizeof(hm->tc_url),
+                                    &s->tc_url) == NULL
+        || ngx_rtmp_handoff_put_str(hm->page_url, sizeof(hm->page_url),
+                                    &s->page_url) == NULL)
+    {
+        return NGX_DECLINED;
+    }
+
+    hs = (ngx_rtmp_handoff_stream_t *) (hm + 1);
+
+    for (n = 0; n < (ngx_uint_t) cscf->max_streams; ++n, ++hs) {
+        hs->hdr = s->in_streams[n].hdr;
+        hs->dtime = s->in_streams[n].dtime;
+        hs->ext = s->in_streams[n].ext;
+    }
+
+    if (size) {
+        ngx_memcpy(hs, pos, size);
+    }
+
+    ngx_memzero(&cmsg, sizeof(cmsg));
+
+    cmsg.cm.cmsg_len = CMSG_LEN(sizeof(int));
+    cmsg.cm.cmsg_level = SOL_SOCKET;
+    cmsg.cm.cmsg_type = SCM_RIGHTS;
+
+    ngx_memcpy(CMSG_DATA(&cmsg.cm), &c->fd, sizeof(int));
+
+    iov.iov_base = (char *) hm;
+    iov.iov_len = len;
+
+    ngx_memzero(&msg, sizeof(msg));
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = (caddr_t) &cmsg;
+    msg.msg_controllen = sizeof(cmsg);
+
+    rc = sendmsg(ngx_rtmp_handoff_fds[2 * ctx->worker], &msg, 0);
+
+    if (rc == -1) {
+        ngx_log_error(NGX_LOG_ERR, c->log, ngx_socket_errno,
+                      "handoff: sendmsg() failed");
+        return NGX_DECLINED;
+    }
+
+    /*
+     * The socket stays open in the other worker, so closing the
+     * descriptor here would not remove it from this worker's epoll set
+     */
+
+    if (ngx_del_conn) {
+        ngx_del_conn(c, 0);
+
+    } else {
+        if (c->read->active) {
+            ngx_del_event(c->read, NGX_READ_EVENT, 0);
+        }
+
+        if (c->write->active) {
+            ngx_del_event(c->write, NGX_WRITE_EVENT, 0);
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_rtmp_handoff(ngx_rtmp_session_t *s, u_char *pos, size_t size)
+{
+    ngx_rtmp_handoff_ctx_t         *ctx;
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_handoff_module);
+
+    if (ngx_rtmp_handoff_send(s, ctx, pos, size) == NGX_OK) {
+        ngx_log_error(NGX_LOG_INFO, s->connection->log, 0,
+                      "handoff: passed to worker %ui to play '%s'",
+                      ctx->worker, ctx->play.name);
+
+        ngx_rtmp_finalize_session(s);
+        return NGX_OK;
+    }
+
+    /* play in this worker, stream is then read from bus */
+
+    s->handoff = 0;
+
+    if (next_play(s, &ctx->play) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return NGX_DECLINED;
+}
+
+
+static ngx_int_t
+ngx_rtmp_handoff_restore(ngx_rtmp_session_t *s, ngx_rtmp_handoff_msg_t *hm)
+{
+    ngx_rtmp_core_srv_conf_t       *cscf;
+    ngx_rtmp_core_app_conf_t      **cacfp;
+    ngx_rtmp_handoff_stream_t      *hs;
+    ngx_uint_t                      n;
+
+    cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
+
+    if (hm->nstreams != (uint32_t) cscf->max_streams) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_rtmp_handoff_get_str(s, &s->app, hm->app,
+                                 sizeof(hm->app)) != NGX_OK
+        || ngx_rtmp_handoff_get_str(s, &s->args, hm->args,
+                                    sizeof(hm->args)) != NGX_OK
+        || ngx_rtmp_handoff_get_str(s, &s->flashver, hm->flashver,
+                                    sizeof(hm->flashver)) != NGX_OK
+        || ngx_rtmp_handoff_get_str(s, &s->swf_url, hm->swf_url,
+                                    sizeof(hm->swf_url)) != NGX_OK
+        || ngx_rtmp_handoff_get_str(s, &s->tc_url, hm->tc_url,
+                                    sizeof(hm->tc_url)) != NGX_OK
+        || ngx_rtmp_handoff_get_str(s, &s->page_url, hm->page_url,
+                                    sizeof(hm->page_url)) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    cacfp = cscf->applications.elts;
+    for (n = 0; n < cscf->applications.nelts; ++n, ++cacfp) {
+        if ((*cacfp)->name.len == s->app.len &&
+            ngx_strncmp((*cacfp)->name.data, s->app.data, s->app.len) == 0)
+        {
+            s->app_conf = (*cacfp)->app_conf;
+            break;
+        }
+    }
+
+    if (s->app_conf == NULL ||
+        hm->out_chunk_class >= cscf->nchunk_classes)
+    {
+        return NGX_ERROR;
+    }
+
+    s->connected = 1;
+    s->epoch = ngx_current_msec - hm->uptime;
+    s->peer_epoch = hm->peer_epoch;
+    s->buflen = hm->buflen;
+    s->ack_size = hm->ack_size;
+    s->in_bytes = hm->in_bytes;
+    s->in_last_ack = hm->in_last_ack;
+    s->acodecs = hm->acodecs;
+    s->vcodecs = hm->vcodecs;
+    s->out_chunk_class = hm->out_chunk_class;
+
+    if (hm->in_chunk_size != s->in_chunk_size &&
+        ngx_rtmp_set_chunk_size(s, hm->in_chunk_size) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    hs = (ngx_rtmp_handoff_stream_t *) (hm + 1);
+
+    for (n = 1; n < hm->nstreams; ++n) {
+        s->in_streams[n].hdr = hs[n].hdr;
+        s->in_streams[n].dtime = hs[n].dtime;
+        s->in_streams[n].ext = hs[n].ext;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_rtmp_handoff_accept(ngx_socket_t fd, ngx_rtmp_handoff_msg_t *hm,
+    size_t len)
+{
+    ngx_connection_t               *c;
+    ngx_listening_t                *ls;
+    ngx_log_t                      *log;
+    ngx_rtmp_session_t             *s;
+    ngx_rtmp_addr_conf_t           *addr_conf;
+    ngx_rtmp_handoff_ctx_t         *ctx;
+    ngx_pool_t                     *pool;
+    struct sockaddr                *sa, *local_sa;
+    socklen_t                       socklen, local_socklen;
+    u_char                         *data;
+
+    if (len < sizeof(ngx_rtmp_handoff_msg_t) ||
+        len != sizeof(ngx_rtmp_handoff_msg_t) + hm->size +
+               sizeof(ngx_rtmp_handoff_stream_t) * hm->nstreams ||
+        hm->listening >= ngx_cycle->listening.nelts)
+    {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                      "handoff: bad message");
+        goto failed;
+    }
+
+    ls = ngx_cycle->listening.elts;
+    ls = &ls[hm->listening];
+
+    if (ls->handler != ngx_rtmp_init_connection) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                      "handoff: bad listening socket");
+        goto failed;
+    }
+
+    c = ngx_get_connection(fd, ngx_cycle->log);
+    if (c == NULL) {
+        goto failed;
+    }
+
+    c->pool = ngx_create_pool(ls->pool_size, ngx_cycle->log);
+    if (c->pool == NULL) {
+        ngx_close_connection(c);
+        return;
+    }
+
+    log = ngx_palloc(c->pool, sizeof(ngx_log_t));
+    sa = ngx_palloc(c->pool, NGX_SOCKADDRLEN);
+    local_sa = ngx_palloc(c->pool, NGX_SOCKADDRLEN);
+    c->addr_text.len = ngx_strnlen(hm->addr_text, sizeof(hm->addr_text));
+    c->addr_text.data = ngx_pnalloc(c->pool, c->addr_text.len);
+
+    if (log == NULL || sa == NULL || local_sa == NULL ||
+        c->addr_text.data == NULL)
+    {
+        goto close;
+    }
+
+    ngx_memcpy(c->addr_text.data, hm->addr_text, c->addr_text.len);
+
+    socklen = NGX_SOCKADDRLEN;
+
+    if (getpeername(fd, sa, &socklen) == -1) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_socket_errno,
+                      "handoff: getpeername() failed");
+        goto close;
+    }
+
+    /*
+     * the listening address is the wildcard for "*:port", server{}
+     * is found by the address the client actually connected to
+     */
+
+    local_socklen = NGX_SOCKADDRLEN;
+
+    if (getsockname(fd, local_sa, &local_socklen) == -1) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_socket_errno,
+                      "handoff: getsockname() failed");
+        goto close;
+    }
+
+    *log = ls->log;
+
+    c->log = log;
+    c->pool->log = log;
+    c->read->log = log;
+    c->write->log = log;
+
+    c->recv = ngx_recv;
+    c->send = ngx_send;
+    c->recv_chain = ngx_recv_chain;
+    c->send_chain = ngx_send_chain;
+
+    c->sockaddr = sa;
+    c->socklen = socklen;
+    c->listening = ls;
+    c->local_sockaddr = local_sa;
+    c->local_socklen = local_socklen;
+
+    c->write->ready = 1;
+
+    c->number = ngx_atomic_fetch_add(ngx_connection_counter, 1);
+
+    addr_conf = ngx_rtmp_find_addr_conf(c);
+    if (addr_conf == NULL) {
+        goto close;
+    }
+
+#if (NGX_STAT_STUB)
+    (void) ngx_atomic_fetch_add(ngx_stat_active, 1);
+#endif
+
+    s = ngx_rtmp_init_session(c, addr_conf);
+    if (s == NULL) {
+        return;
+    }
+
+    ctx = ngx_pcalloc(c->pool, sizeof(ngx_rtmp_handoff_ctx_t));
+    if (ctx == NULL) {
+        ngx_rtmp_finalize_session(s);
+        return;
+    }
+
+    ctx->received = 1;
+
+    ngx_rtmp_set_ctx(s, ctx, ngx_rtmp_handoff_module);
+
+    if (ngx_rtmp_handoff_restore(s, hm) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                      "handoff: failed to restore session");
+        ngx_rtmp_finalize_session(s);
+        return;
+    }
+
+    ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                  "handoff: *%ui client '%V' received to play '%s'",
+                  c->number, &c->addr_text, hm->play.name);
+
+    if (ngx_rtmp_play(s, &hm->play) != NGX_OK) {
+        ngx_rtmp_finalize_session(s);
+        return;
+    }
+
+    data = (u_char *) hm + sizeof(ngx_rtmp_handoff_msg_t)
+           + sizeof(ngx_rtmp_handoff_stream_t) * hm->nstreams;
+
+    ngx_rtmp_resume(s, data, hm->size);
+
+    return;
+
+close:
+
+    pool = c->pool;
+    ngx_close_connection(c);
+    ngx_destroy_pool(pool);
+    return;
+
+failed:
+
+    close(fd);
+}
+
+
+static void
+ngx_rtmp_handoff_recv(ngx_event_t *rev)
+{
+    ngx_connection_t               *c;
+    ngx_err_t                       err;
+    ngx_socket_t                    fd;
+    ssize_t                         n;
+    struct iovec                    iov;
+    struct msghdr                   msg;
+
+    union {
+        struct cmsghdr              cm;
+        char                        space[CMSG_SPACE(sizeof(int))];
+    } cmsg;
+
+    c = rev->data;
+
+    for ( ;; ) {
+        iov.iov_base = (char *) ngx_rtmp_handoff_buf;
+        iov.iov_len = NGX_RTMP_HANDOFF_BUFSIZE;
+
+        ngx_memzero(&msg, sizeof(msg));
+
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = (caddr_t) &cmsg;
+        msg.msg_controllen = sizeof(cmsg);
+
+        n = recvmsg(c->fd, &msg, 0);
+
+        if (n == -1) {
+            err = ngx_socket_errno;
+
+            if (err == NGX_EINTR) {
+                continue;
+            }
+
+            if (err != NGX_EAGAIN) {
+                ngx_log_error(NGX_LOG_ALERT, rev->log, err,
+                              "handoff: recvmsg() failed");
+            }
+
+            return;
+        }
+
+        if (msg.msg_controllen < sizeof(struct cmsghdr) ||
+            cmsg.cm.cmsg_len != CMSG_LEN(sizeof(int)) ||
+            cmsg.cm.cmsg_level != SOL_SOCKET ||
+            cmsg.cm.cmsg_type != SCM_RIGHTS)
+        {
+            ngx_log_error(NGX_LOG_ALERT, rev->log, 0,
+                          "handoff: message without descriptor");
+            continue;
+        }
+
+        ngx_memcpy(&fd, CMSG_DATA(&cmsg.cm), sizeof(int));
+
+        if (msg.msg_flags & (MSG_TRUNC|MSG_CTRUNC)) {
+            ngx_log_error(NGX_LOG_ALERT, rev->log, 0,
+                          "handoff: truncated message");
+            close(fd);
+            continue;
+        }
+
+        ngx_rtmp_handoff_accept(fd,
+                                (ngx_rtmp_handoff_msg_t *) ngx_rtmp_handoff_buf,
+                                (size_t) n);
+    }
+}
+
+
+static ngx_int_t
+ngx_rtmp_handoff_init_process(ngx_cycle_t *cycle)
+{
+    ngx_rtmp_handoff_main_conf_t   *hmcf;
+    ngx_connection_t               *c;
+
+    ngx_rtmp_handoff_buf = NULL;
+
+    if (ngx_process != NGX_PROCESS_WORKER) {
+        return NGX_OK;
+    }
+
+    hmcf = ngx_rtmp_cycle_get_module_main_conf(cycle, ngx_rtmp_handoff_module);
+    if (hmcf == NULL || !hmcf->handoff ||
+        ngx_worker >= ngx_rtmp_handoff_nfds)
+    {
+        return NGX_OK;
+    }
+
+    c = ngx_get_connection(ngx_rtmp_handoff_fds[2 * ngx_worker + 1],
+                           cycle->log);
+    if (c == NULL) {
+        return NGX_ERROR;
+    }
+
+    c->read->handler = ngx_rtmp_handoff_recv;
+    c->read->log = cycle->log;
+    c->data = NULL;
+
+    if (ngx_add_event(c->read, NGX_READ_EVENT, 0) != NGX_OK) {
+        ngx_free_connection(c);
+        return NGX_ERROR;
+    }
+
+    ngx_rtmp_handoff_buf = ngx_alloc(NGX_RTMP_HANDOFF_BUFSIZE, cycle->log);
+    if (ngx_rtmp_handoff_buf == NULL) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_rtmp_handoff_postconfiguration(ngx_conf_t *cf)
+{
+    ngx_rtmp_handoff_main_conf_t   *hmcf;
+
+    hmcf = ngx_rtmp_conf_get_module_main_conf(cf, ngx_rtmp_handoff_module);
+    if (!hmcf->handoff) {
+        return NGX_OK;
+    }
+
+    next_play = ngx_rtmp_play;
+    ngx_rtmp_play = ngx_rtmp_handoff_play;
+
+    return NGX_OK;
+}
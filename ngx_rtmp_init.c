@@ -16,28 +16,59 @@ static u_char * ngx_rtmp_log_error(ngx_log_t *log, u_char *buf, size_t len);
 
 void
 ngx_rtmp_init_connection(ngx_connection_t *c)
+{
+    ngx_rtmp_session_t    *s;
+    ngx_rtmp_addr_conf_t  *addr_conf;
+
+    ++ngx_rtmp_naccepted;
+
+    addr_conf = ngx_rtmp_find_addr_conf(c);
+    if (addr_conf == NULL) {
+        ngx_rtmp_close_connection(c);
+        return;
+    }
+
+    ngx_log_error(NGX_LOG_INFO, c->log, 0, "*%ui client connected '%V'",
+                  c->number, &c->addr_text);
+
+    s = ngx_rtmp_init_session(c, addr_conf);
+    if (s == NULL) {
+        return;
+    }
+
+    /* only auto-pushed connections are
+     * done through unix socket */
+
+    s->auto_pushed = (c->local_sockaddr->sa_family == AF_UNIX);
+
+    if (addr_conf->proxy_protocol) {
+        ngx_rtmp_proxy_protocol(s);
+
+    } else {
+        ngx_rtmp_handshake(s);
+    }
+}
+
+
+ngx_rtmp_addr_conf_t *
+ngx_rtmp_find_addr_conf(ngx_connection_t *c)
 {
     ngx_uint_t             i;
     ngx_rtmp_port_t       *port;
     struct sockaddr       *sa;
     struct sockaddr_in    *sin;
     ngx_rtmp_in_addr_t    *addr;
-    ngx_rtmp_session_t    *s;
     ngx_rtmp_addr_conf_t  *addr_conf;
-    ngx_int_t              unix_socket;
 #if (NGX_HAVE_INET6)
     struct sockaddr_in6   *sin6;
     ngx_rtmp_in6_addr_t   *addr6;
 #endif
 
-    ++ngx_rtmp_naccepted;
-
     /* find the server configuration for the address:port */
 
     /* AF_INET only */
 
     port = c->listening->servers;
-    unix_socket = 0;
 
     if (port->naddrs > 1) {
 
@@ -50,8 +81,7 @@ ngx_rtmp_init_connection(ngx_connection_t *c)
          */
 
         if (ngx_connection_local_sockaddr(c, NULL, 0) != NGX_OK) {
-            ngx_rtmp_close_connection(c);
-            return;
+            return NULL;
         }
 
         sa = c->local_sockaddr;
@@ -77,11 +107,7 @@ ngx_rtmp_init_connection(ngx_connection_t *c)
             break;
 #endif
 
-        case AF_UNIX:
-            unix_socket = 1;
-            /* fall through */
-
-        default: /* AF_INET */
+        default: /* AF_INET, AF_UNIX */
             sin = (struct sockaddr_in *) sa;
 
             addr = port->addrs;
@@ -109,36 +135,14 @@ ngx_rtmp_init_connection(ngx_connection_t *c)
             break;
 #endif
 
-        case AF_UNIX:
-            unix_socket = 1;
-            /* fall through */
-
-        default: /* AF_INET */
+        default: /* AF_INET, AF_UNIX */
             addr = port->addrs;
             addr_conf = &addr[0].conf;
             break;
         }
     }
 
-    ngx_log_error(NGX_LOG_INFO, c->log, 0, "*%ui client connected '%V'",
-                  c->number, &c->addr_text);
-
-    s = ngx_rtmp_init_session(c, addr_conf);
-    if (s == NULL) {
-        return;
-    }
-
-    /* only auto-pushed connections are
-     * done through unix socket */
-
-    s->auto_pushed = unix_socket;
-
-    if (addr_conf->proxy_protocol) {
-        ngx_rtmp_proxy_protocol(s);
-
-    } else {
-        ngx_rtmp_handshake(s);
-    }
+    return addr_conf;
 }
 
 
@@ -148,6 +152,8 @@ ngx_rtmp_init_session(ngx_connection_t *c, ngx_rtmp_addr_conf_t *addr_conf)
     ngx_rtmp_session_t             *s;
     ngx_rtmp_core_srv_conf_t       *cscf;
     ngx_rtmp_error_log_ctx_t       *ctx;
+    ngx_buf_t                      *b;
+    ngx_uint_t                      n;
 
     s = ngx_pcalloc(c->pool, sizeof(ngx_rtmp_session_t) +
             sizeof(ngx_chain_t *) * ((ngx_rtmp_core_srv_conf_t *)
@@ -161,6 +167,9 @@ ngx_rtmp_init_session(ngx_connection_t *c, ngx_rtmp_addr_conf_t *addr_conf)
     s->main_conf = addr_conf->ctx->main_conf;
     s->srv_conf = addr_conf->ctx->srv_conf;
 
+    /* known before NGX_RTMP_CONNECT handlers run */
+    s->bus = addr_conf->bus;
+
     s->addr_text = &addr_conf->addr_text;
 
     c->data = s;
@@ -199,11 +208,33 @@ ngx_rtmp_init_session(ngx_connection_t *c, ngx_rtmp_addr_conf_t *addr_conf)
         return NULL;
     }
 
+    s->out_vec = ngx_pcalloc(c->pool, sizeof(ngx_chain_t)
+            * NGX_RTMP_OUT_VECS);
+    b = ngx_pcalloc(c->pool, sizeof(ngx_buf_t) * NGX_RTMP_OUT_VECS);
+    if (s->out_vec == NULL || b == NULL) {
+        ngx_rtmp_close_connection(c);
+        return NULL;
+    }
+
+    for (n = 0; n < NGX_RTMP_OUT_VECS; n++) {
+        b[n].memory = 1;
+        s->out_vec[n].buf = &b[n];
+    }
+
 #if (nginx_version >= 1007005)
     ngx_queue_init(&s->posted_dry_events);
 #endif
 
+    s->in_pool = ngx_create_pool(4096, c->log);
+    if (s->in_pool == NULL) {
+        ngx_rtmp_close_connection(c);
+        return NULL;
+    }
+
+    s->in_pinned_last = &s->in_pinned;
+
     s->epoch = ngx_current_msec;
+    s->out_chunk_time = ngx_current_msec;
     s->timeout = cscf->timeout;
     s->buflen = cscf->buflen;
     ngx_rtmp_set_chunk_size(s, NGX_RTMP_DEFAULT_CHUNK_SIZE);
@@ -299,11 +330,8 @@ ngx_rtmp_close_session_handler(ngx_event_t *e)
         ngx_del_timer(&s->ping_evt);
     }
 
-    if (s->in_old_pool) {
-        ngx_destroy_pool(s->in_old_pool);
-    }
-
     if (s->in_pool) {
+        ngx_rtmp_free_in_bufs(s);
         ngx_destroy_pool(s->in_pool);
     }
 
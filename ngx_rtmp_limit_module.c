@@ -90,7 +90,10 @@ ngx_rtmp_limit_connect(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
     ngx_int_t                   rc;
 
     lmcf = ngx_rtmp_get_module_main_conf(s, ngx_rtmp_limit_module);
-    if (lmcf->max_conn == NGX_CONF_UNSET) {
+
+    /* live bus sessions are internal, not client connections */
+
+    if (lmcf->max_conn == NGX_CONF_UNSET || s->bus) {
         return NGX_OK;
     }
 
@@ -127,7 +130,7 @@ ngx_rtmp_limit_disconnect(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
     uint32_t                   *nconn, n;
 
     lmcf = ngx_rtmp_get_module_main_conf(s, ngx_rtmp_limit_module);
-    if (lmcf->max_conn == NGX_CONF_UNSET) {
+    if (lmcf->max_conn == NGX_CONF_UNSET || s->bus) {
         return NGX_OK;
     }
 
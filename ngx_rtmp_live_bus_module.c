@@ -0,0 +1,1502 @@
+/*
+ * Copyright (C) Roman Arutyunyan
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include "ngx_rtmp.h"
+#include "ngx_rtmp_cmd_module.h"
+#include "ngx_rtmp_codec_module.h"
+#include "ngx_rtmp_live_module.h"
+#include "ngx_rtmp_live_bus_module.h"
+
+#if (NGX_LINUX)
+#include <sys/eventfd.h>
+#endif
+
+
+/*
+ * Live bus: a stream published on one worker is written into a ring
+ * buffer in shared memory. Other workers playing the stream read frames
+ * from the ring and feed them into the local live module through a
+ * peerless "bus" session publishing the stream locally. Readers are woken
+ * up through per-worker eventfds created by master.
+ */
+
+
+#define NGX_RTMP_LIVE_BUS_MAX_WORKERS   64
+
+/* how often readers make sure the publishing worker is alive */
+#define NGX_RTMP_LIVE_BUS_CHECK         5000
+
+
+/* largest record, the whole ring less the record header */
+#define ngx_rtmp_live_bus_max_rec(st)                                         \
+    ((st)->size - sizeof(ngx_rtmp_live_bus_rec_t))
+
+
+static ngx_rtmp_publish_pt              next_publish;
+static ngx_rtmp_play_pt                 next_play;
+static ngx_rtmp_close_stream_pt         next_close_stream;
+
+
+static ngx_int_t ngx_rtmp_live_bus_init_module(ngx_cycle_t *cycle);
+static ngx_int_t ngx_rtmp_live_bus_init_process(ngx_cycle_t *cycle);
+static ngx_int_t ngx_rtmp_live_bus_postconfiguration(ngx_conf_t *cf);
+static void * ngx_rtmp_live_bus_create_main_conf(ngx_conf_t *cf);
+static char * ngx_rtmp_live_bus_init_main_conf(ngx_conf_t *cf, void *conf);
+
+
+/* ring record, followed by message payload */
+typedef struct {
+    uint32_t                            mlen;
+    uint32_t                            timestamp;
+    uint8_t                             type;
+    uint8_t                             reserved[3];
+} ngx_rtmp_live_bus_rec_t;
+
+
+#define NGX_RTMP_LIVE_BUS_META          0
+#define NGX_RTMP_LIVE_BUS_VIDEO_HEADER  1
+#define NGX_RTMP_LIVE_BUS_AUDIO_HEADER  2
+#define NGX_RTMP_LIVE_BUS_NHEADERS      3
+
+
+typedef struct ngx_rtmp_live_bus_stream_s ngx_rtmp_live_bus_stream_t;
+
+struct ngx_rtmp_live_bus_stream_s {
+    ngx_rtmp_live_bus_stream_t         *next;
+    u_char                              app[NGX_RTMP_MAX_NAME];
+    u_char                              name[NGX_RTMP_MAX_NAME];
+    ngx_uint_t                          worker;
+    ngx_pid_t                           pid;
+    ngx_uint_t                          refs;
+    ngx_atomic_t                        head;
+    ngx_atomic_t                        key;
+
+    /* size of the record being written past head */
+    ngx_atomic_t                        wlen;
+
+    /* records too big for the ring */
+    ngx_atomic_t                        rejected;
+    ngx_atomic_t                        closed;
+    ngx_atomic_t                        readers[NGX_RTMP_LIVE_BUS_MAX_WORKERS];
+
+    /* last codec headers & metadata for late readers,
+     * each is a record followed by payload */
+    u_char                             *headers[NGX_RTMP_LIVE_BUS_NHEADERS];
+
+    u_char                             *data;
+    size_t                              size;
+};
+
+
+typedef struct {
+    ngx_rtmp_live_bus_stream_t         *streams;
+    ngx_atomic_t                        pending[NGX_RTMP_LIVE_BUS_MAX_WORKERS];
+} ngx_rtmp_live_bus_shctx_t;
+
+
+typedef struct {
+    ngx_flag_t                          bus;
+    size_t                              size;
+    size_t                              buffer;
+    ngx_shm_zone_t                     *shm_zone;
+} ngx_rtmp_live_bus_main_conf_t;
+
+
+typedef struct ngx_rtmp_live_bus_ctx_s ngx_rtmp_live_bus_ctx_t;
+
+struct ngx_rtmp_live_bus_ctx_s {
+    ngx_rtmp_session_t                 *session;
+    ngx_rtmp_live_bus_stream_t         *stream;
+    ngx_rtmp_live_bus_ctx_t            *next;       /* local readers */
+    ngx_atomic_uint_t                   pos;
+    ngx_event_t                         join_evt;
+    ngx_event_t                         check_evt;
+    unsigned                            publishing:1;
+    unsigned                            joined:1;
+};
+
+
+static ngx_str_t    ngx_rtmp_live_bus_shm_name = ngx_string("rtmp_live_bus");
+
+
+/* notification descriptors, one per worker */
+static int                             *ngx_rtmp_live_bus_fds;
+static ngx_uint_t                       ngx_rtmp_live_bus_nfds;
+
+/* this worker takes part in the bus */
+static ngx_uint_t                       ngx_rtmp_live_bus_enabled;
+
+static ngx_rtmp_live_bus_ctx_t         *ngx_rtmp_live_bus_readers;
+
+
+static ngx_command_t  ngx_rtmp_live_bus_commands[] = {
+
+    { ngx_string("live_bus"),
+      NGX_RTMP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_flag_slot,
+      NGX_RTMP_MAIN_CONF_OFFSET,
+      offsetof(ngx_rtmp_live_bus_main_conf_t, bus),
+      NULL },
+
+    { ngx_string("live_bus_size"),
+      NGX_RTMP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_RTMP_MAIN_CONF_OFFSET,
+      offsetof(ngx_rtmp_live_bus_main_conf_t, size),
+      NULL },
+
+    { ngx_string("live_bus_buffer"),
+      NGX_RTMP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_RTMP_MAIN_CONF_OFFSET,
+      offsetof(ngx_rtmp_live_bus_main_conf_t, buffer),
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_rtmp_module_t  ngx_rtmp_live_bus_module_ctx = {
+    NULL,                                   /* preconfiguration */
+    ngx_rtmp_live_bus_postconfiguration,    /* postconfiguration */
+    ngx_rtmp_live_bus_create_main_conf,     /* create main configuration */
+    ngx_rtmp_live_bus_init_main_conf,       /* init main configuration */
+    NULL,                                   /* create server configuration */
+    NULL,                                   /* merge server configuration */
+    NULL,                                   /* create app configuration */
+    NULL                                    /* merge app configuration */
+};
+
+
+ngx_module_t  ngx_rtmp_live_bus_module = {
+    NGX_MODULE_V1,
+    &ngx_rtmp_live_bus_module_ctx,          /* module context */
+    ngx_rtmp_live_bus_commands,             /* module directives */
+    NGX_RTMP_MODULE,                        /* module type */
+    NULL,                                   /* init master */
+    ngx_rtmp_live_bus_init_module,          /* init module */
+    ngx_rtmp_live_bus_init_process,         /* init process */
+    NULL,                                   /* init thread */
+    NULL,                                   /* exit thread */
+    NULL,                                   /* exit process */
+    NULL,                                   /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static void *
+ngx_rtmp_live_bus_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_rtmp_live_bus_main_conf_t  *lbcf;
+
+    lbcf = ngx_pcalloc(cf->pool, sizeof(ngx_rtmp_live_bus_main_conf_t));
+    if (lbcf == NULL) {
+        return NULL;
+    }
+
+    lbcf->bus = NGX_CONF_UNSET;
+    lbcf->size = NGX_CONF_UNSET_SIZE;
+    lbcf->buffer = NGX_CONF_UNSET_SIZE;
+
+    return lbcf;
+}
+
+
+static char *
+ngx_rtmp_live_bus_init_main_conf(ngx_conf_t *cf, void *conf)
+{
+    ngx_rtmp_live_bus_main_conf_t  *lbcf = conf;
+
+    ngx_conf_init_value(lbcf->bus, 0);
+    ngx_conf_init_size_value(lbcf->size, 64 * 1024 * 1024);
+    ngx_conf_init_size_value(lbcf->buffer, 2 * 1024 * 1024);
+
+#if !(NGX_LINUX)
+    if (lbcf->bus) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"live_bus\" is not supported on this platform");
+        return NGX_CONF_ERROR;
+    }
+#endif
+
+    if (lbcf->buffer * 2 > lbcf->size) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"live_bus_buffer\" is too big "
+                           "for \"live_bus_size\"");
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static void
+ngx_rtmp_live_bus_close_fds(void *data)
+{
+    int                        *fds = data;
+
+    ngx_uint_t                  n;
+
+    for (n = 0; fds[n] != -1; ++n) {
+        close(fds[n]);
+    }
+}
+
+
+static ngx_int_t
+ngx_rtmp_live_bus_init_module(ngx_cycle_t *cycle)
+{
+#if (NGX_LINUX)
+    ngx_rtmp_live_bus_main_conf_t  *lbcf;
+    ngx_core_conf_t                *ccf;
+    ngx_pool_cleanup_t             *cln;
+    ngx_uint_t                      n, nfds;
+    int                            *fds;
+
+    ngx_rtmp_live_bus_fds = NULL;
+    ngx_rtmp_live_bus_nfds = 0;
+
+    lbcf = ngx_rtmp_cycle_get_module_main_conf(cycle, ngx_rtmp_live_bus_module);
+    if (lbcf == NULL || !lbcf->bus) {
+        return NGX_OK;
+    }
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
+
+    nfds = ccf->worker_processes;
+
+    if (nfds > NGX_RTMP_LIVE_BUS_MAX_WORKERS) {
+        ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+                      "live_bus: only %d workers of %ui take part in bus",
+                      NGX_RTMP_LIVE_BUS_MAX_WORKERS, nfds);
+        nfds = NGX_RTMP_LIVE_BUS_MAX_WORKERS;
+    }
+
+    /* descriptors are created before fork to be shared by all workers */
+
+    fds = ngx_palloc(cycle->pool, sizeof(int) * (nfds + 1));
+    if (fds == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln = ngx_pool_cleanup_add(cycle->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (n = 0; n < nfds; ++n) {
+        fds[n] = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+        if (fds[n] == -1) {
+            ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                          "live_bus: eventfd() failed");
+            break;
+        }
+    }
+
+    fds[n] = -1;
+
+    cln->handler = ngx_rtmp_live_bus_close_fds;
+    cln->data = fds;
+
+    if (n != nfds) {
+        return NGX_ERROR;
+    }
+
+    ngx_rtmp_live_bus_fds = fds;
+    ngx_rtmp_live_bus_nfds = nfds;
+
+#endif
+
+    return NGX_OK;
+}
+
+
+static ngx_rtmp_live_bus_shctx_t *
+ngx_rtmp_live_bus_get_shctx(ngx_slab_pool_t **shpool)
+{
+    ngx_rtmp_live_bus_main_conf_t  *lbcf;
+
+    lbcf = ngx_rtmp_cycle_get_module_main_conf(ngx_cycle,
+                                               ngx_rtmp_live_bus_module);
+
+    *shpool = (ngx_slab_pool_t *) lbcf->shm_zone->shm.addr;
+
+    return lbcf->shm_zone->data;
+}
+
+
+static void
+ngx_rtmp_live_bus_signal(ngx_rtmp_live_bus_stream_t *st)
+{
+    ngx_rtmp_live_bus_shctx_t      *sh;
+    ngx_slab_pool_t                *shpool;
+    ngx_uint_t                      n;
+    uint64_t                        one;
+
+    sh = ngx_rtmp_live_bus_get_shctx(&shpool);
+
+    one = 1;
+
+    /* wake up each reading worker once until it drains the bus */
+
+    for (n = 0; n < ngx_rtmp_live_bus_nfds; ++n) {
+        if (n == ngx_worker || st->readers[n] == 0) {
+            continue;
+        }
+
+        if (!ngx_atomic_cmp_set(&sh->pending[n], 0, 1)) {
+            continue;
+        }
+
+        if (write(ngx_rtmp_live_bus_fds[n], &one, sizeof(one)) == -1 &&
+            ngx_errno != NGX_EAGAIN)
+        {
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                          "live_bus: eventfd write failed");
+        }
+    }
+}
+
+
+static void
+ngx_rtmp_live_bus_write(ngx_rtmp_live_bus_stream_t *st, ngx_atomic_uint_t pos,
+    u_char *p, size_t n)
+{
+    size_t                      off, size;
+
+    off = pos % st->size;
+    size = ngx_min(n, st->size - off);
+
+    ngx_memcpy(st->data + off, p, size);
+
+    if (n > size) {
+        ngx_memcpy(st->data, p + size, n - size);
+    }
+}
+
+
+static void
+ngx_rtmp_live_bus_read(ngx_rtmp_live_bus_stream_t *st, ngx_atomic_uint_t pos,
+    u_char *p, size_t n)
+{
+    size_t                      off, size;
+
+    off = pos % st->size;
+    size = ngx_min(n, st->size - off);
+
+    ngx_memcpy(p, st->data + off, size);
+
+    if (n > size) {
+        ngx_memcpy(p + size, st->data, n - size);
+    }
+}
+
+
+static ngx_rtmp_live_bus_stream_t *
+ngx_rtmp_live_bus_find_stream(ngx_rtmp_live_bus_shctx_t *sh, ngx_str_t *app,
+    u_char *name)
+{
+    ngx_rtmp_live_bus_stream_t     *st;
+
+    for (st = sh->streams; st; st = st->next) {
+        if (!st->closed &&
+            ngx_strncmp(st->app, app->data, app->len) == 0 &&
+            st->app[app->len] == 0 &&
+            ngx_strcmp(st->name, name) == 0)
+        {
+            return st;
+        }
+    }
+
+    return NULL;
+}
+
+
+ngx_int_t
+ngx_rtmp_live_bus_find_worker(ngx_str_t *app, u_char *name)
+{
+    ngx_int_t                       worker;
+    ngx_rtmp_live_bus_stream_t     *st;
+    ngx_rtmp_live_bus_shctx_t      *sh;
+    ngx_slab_pool_t                *shpool;
+
+    if (!ngx_rtmp_live_bus_enabled) {
+        return NGX_DECLINED;
+    }
+
+    sh = ngx_rtmp_live_bus_get_shctx(&shpool);
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    st = ngx_rtmp_live_bus_find_stream(sh, app, name);
+    worker = st ? (ngx_int_t) st->worker : NGX_DECLINED;
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    return worker;
+}
+
+
+/* called with zone mutex locked */
+
+static void
+ngx_rtmp_live_bus_unref_locked(ngx_slab_pool_t *shpool,
+    ngx_rtmp_live_bus_shctx_t *sh, ngx_rtmp_live_bus_stream_t *st)
+{
+    ngx_rtmp_live_bus_stream_t    **pst;
+    ngx_uint_t                      n;
+
+    if (--st->refs) {
+        return;
+    }
+
+    for (pst = &sh->streams; *pst; pst = &(*pst)->next) {
+        if (*pst == st) {
+            *pst = st->next;
+            break;
+        }
+    }
+
+    for (n = 0; n < NGX_RTMP_LIVE_BUS_NHEADERS; ++n) {
+        if (st->headers[n]) {
+            ngx_slab_free_locked(shpool, st->headers[n]);
+        }
+    }
+
+    ngx_slab_free_locked(shpool, st->data);
+    ngx_slab_free_locked(shpool, st);
+}
+
+
+static ngx_int_t
+ngx_rtmp_live_bus_put(ngx_rtmp_session_t *s, ngx_rtmp_live_bus_ctx_t *ctx,
+    ngx_rtmp_live_bus_rec_t *rec, ngx_chain_t *in, ngx_int_t header,
+    ngx_uint_t key)
+{
+    ngx_rtmp_live_bus_stream_t     *st;
+    ngx_slab_pool_t                *shpool;
+    ngx_atomic_uint_t               pos, head;
+    u_char                         *p;
+    size_t                          n;
+
+    st = ctx->stream;
+
+    if (rec->mlen > ngx_rtmp_live_bus_max_rec(st)) {
+        st->rejected++;
+
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                      "live_bus: %s too big for bus buffer: %uD, "
+                      "%uA rejected, live_bus_buffer is %uz",
+                      key ? "key frame" : "message", rec->mlen,
+                      st->rejected, st->size);
+        return NGX_ERROR;
+    }
+
+    /*
+     * single writer; data is written past head before head moves,
+     * readers detect overwritten data with ngx_rtmp_live_bus_valid()
+     */
+
+    head = st->head;
+    pos = head;
+
+    st->wlen = sizeof(*rec) + rec->mlen;
+    ngx_memory_barrier();
+
+    ngx_rtmp_live_bus_write(st, pos, (u_char *) rec, sizeof(*rec));
+    pos += sizeof(*rec);
+
+    for (; in; in = in->next) {
+        n = in->buf->last - in->buf->pos;
+        ngx_rtmp_live_bus_write(st, pos, in->buf->pos, n);
+        pos += n;
+    }
+
+    if (key) {
+        st->key = head;
+    }
+
+    ngx_memory_barrier();
+
+    st->head = pos;
+
+    if (header != NGX_ERROR) {
+        (void) ngx_rtmp_live_bus_get_shctx(&shpool);
+
+        ngx_shmtx_lock(&shpool->mutex);
+
+        p = ngx_slab_alloc_locked(shpool, pos - head);
+        if (p) {
+            ngx_rtmp_live_bus_read(st, head, p, pos - head);
+
+            if (st->headers[header]) {
+                ngx_slab_free_locked(shpool, st->headers[header]);
+            }
+
+            st->headers[header] = p;
+        }
+
+        ngx_shmtx_unlock(&shpool->mutex);
+
+        if (p == NULL) {
+            ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                          "live_bus: failed to store header");
+        }
+    }
+
+    ngx_rtmp_live_bus_signal(st);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_rtmp_live_bus_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
+    ngx_chain_t *in)
+{
+    ngx_rtmp_live_bus_ctx_t        *ctx;
+    ngx_rtmp_codec_ctx_t           *codec_ctx;
+    ngx_rtmp_live_bus_rec_t         rec;
+    ngx_int_t                       header;
+    ngx_uint_t                      key;
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_live_bus_module);
+    if (ctx == NULL || !ctx->publishing || in == NULL || in->buf == NULL) {
+        return NGX_OK;
+    }
+
+    codec_ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_codec_module);
+
+    header = NGX_ERROR;
+    key = 0;
+
+    if (h->type == NGX_RTMP_MSG_VIDEO) {
+        if (codec_ctx && ngx_rtmp_is_avc_like(codec_ctx->video_codec_id) &&
+            ngx_rtmp_is_video_codec_header(in))
+        {
+            header = NGX_RTMP_LIVE_BUS_VIDEO_HEADER;
+
+        } else {
+            key = (ngx_rtmp_get_video_frame_type(in) ==
+                   NGX_RTMP_VIDEO_KEY_FRAME);
+        }
+
+    } else if (codec_ctx && codec_ctx->audio_codec_id == NGX_RTMP_AUDIO_AAC &&
+               ngx_rtmp_is_codec_header(in))
+    {
+        header = NGX_RTMP_LIVE_BUS_AUDIO_HEADER;
+    }
+
+    ngx_memzero(&rec, sizeof(rec));
+
+    rec.mlen = h->mlen;
+    rec.timestamp = h->timestamp;
+    rec.type = h->type;
+
+    (void) ngx_rtmp_live_bus_put(s, ctx, &rec, in, header, key);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_rtmp_live_bus_meta(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
+    ngx_chain_t *in, ngx_str_t *func)
+{
+    ngx_rtmp_live_bus_ctx_t        *ctx;
+    ngx_rtmp_live_bus_rec_t         rec;
+    ngx_chain_t                     cl;
+    ngx_buf_t                       b;
+    ngx_chain_t                    *l;
+    u_char                          name[3 + sizeof("@setDataFrame") - 1];
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_live_bus_module);
+    if (ctx == NULL || !ctx->publishing) {
+        return NGX_OK;
+    }
+
+    /* restore function name consumed by AMF dispatcher */
+
+    name[0] = NGX_RTMP_AMF_STRING;
+    name[1] = (u_char) (func->len >> 8);
+    name[2] = (u_char) func->len;
+    ngx_memcpy(name + 3, func->data, func->len);
+
+    ngx_memzero(&b, sizeof(b));
+    b.pos = name;
+    b.last = name + 3 + func->len;
+
+    cl.buf = &b;
+    cl.next = in;
+
+    ngx_memzero(&rec, sizeof(rec));
+
+    for (l = &cl; l; l = l->next) {
+        rec.mlen += l->buf->last - l->buf->pos;
+    }
+
+    rec.timestamp = h->timestamp;
+    rec.type = NGX_RTMP_MSG_AMF_META;
+
+    (void) ngx_rtmp_live_bus_put(s, ctx, &rec, &cl, NGX_RTMP_LIVE_BUS_META, 0);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_rtmp_live_bus_set_data_frame(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
+    ngx_chain_t *in)
+{
+    static ngx_str_t    func = ngx_string("@setDataFrame");
+
+    return ngx_rtmp_live_bus_meta(s, h, in, &func);
+}
+
+
+static ngx_int_t
+ngx_rtmp_live_bus_on_meta_data(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
+    ngx_chain_t *in)
+{
+    static ngx_str_t    func = ngx_string("onMetaData");
+
+    return ngx_rtmp_live_bus_meta(s, h, in, &func);
+}
+
+
+static void
+ngx_rtmp_live_bus_inject(ngx_rtmp_session_t *s, ngx_rtmp_live_bus_rec_t *rec,
+    u_char *data)
+{
+    ngx_rtmp_header_t               h;
+    ngx_chain_t                     cl;
+    ngx_buf_t                       b;
+
+    ngx_memzero(&h, sizeof(h));
+
+    h.type = rec->type;
+    h.mlen = rec->mlen;
+    h.timestamp = rec->timestamp;
+    h.msid = NGX_RTMP_MSID;
+
+    switch (rec->type) {
+    case NGX_RTMP_MSG_VIDEO:
+        h.csid = NGX_RTMP_CSID_VIDEO;
+        break;
+    case NGX_RTMP_MSG_AUDIO:
+        h.csid = NGX_RTMP_CSID_AUDIO;
+        break;
+    default:
+        h.csid = NGX_RTMP_CSID_AMF;
+    }
+
+    /* payload is refcounted so that live subscribers can share it */
+
+    ngx_memzero(&b, sizeof(b));
+    b.start = b.pos = data;
+    b.end = b.last = data + rec->mlen;
+    b.memory = 1;
+
+    cl.buf = &b;
+    cl.next = NULL;
+
+    s->current_time = rec->timestamp;
+
+    if (ngx_rtmp_receive_message(s, &h, &cl) != NGX_OK) {
+        ngx_rtmp_finalize_session(s);
+    }
+
+    ngx_rtmp_free_in_data(data);
+}
+
+
+static u_char *
+ngx_rtmp_live_bus_alloc_data(size_t size, ngx_log_t *log)
+{
+    u_char                         *p;
+
+    p = ngx_alloc(NGX_RTMP_REFCOUNT_BYTES + size, log);
+    if (p == NULL) {
+        return NULL;
+    }
+
+    p += NGX_RTMP_REFCOUNT_BYTES;
+
+    ngx_rtmp_ref_set(p, 1);
+
+    return p;
+}
+
+
+/*
+ * data at pos is intact unless the writer has already moved head, or
+ * is writing a record which reaches as far as pos + size; wlen is set
+ * before the record is written, so it is read after head
+ */
+
+static ngx_uint_t
+ngx_rtmp_live_bus_valid(ngx_rtmp_live_bus_stream_t *st,
+    ngx_atomic_uint_t pos, ngx_atomic_uint_t head)
+{
+    return head - pos <= st->size - st->wlen;
+}
+
+
+static void
+ngx_rtmp_live_bus_resync(ngx_rtmp_live_bus_ctx_t *ctx)
+{
+    ngx_rtmp_live_bus_stream_t     *st;
+    ngx_atomic_uint_t               key, head;
+
+    st = ctx->stream;
+
+    key = st->key;
+    ngx_memory_barrier();
+    head = st->head;
+
+    ctx->pos = (ngx_rtmp_live_bus_valid(st, key, head) ? key : head);
+
+    ngx_log_error(NGX_LOG_INFO, ctx->session->connection->log, 0,
+                  "live_bus: reader overrun, skip %uA bytes",
+                  head - ctx->pos);
+}
+
+
+static void
+ngx_rtmp_live_bus_pump(ngx_rtmp_live_bus_ctx_t *ctx)
+{
+    ngx_rtmp_session_t             *s;
+    ngx_rtmp_live_bus_stream_t     *st;
+    ngx_rtmp_live_bus_rec_t         rec;
+    ngx_atomic_uint_t               head;
+    u_char                         *data;
+
+    s = ctx->session;
+    st = ctx->stream;
+
+    while (!s->connection->destroyed) {
+        head = st->head;
+        ngx_memory_barrier();
+
+        if (ctx->pos == head) {
+            break;
+        }
+
+        if (!ngx_rtmp_live_bus_valid(st, ctx->pos, head)) {
+            ngx_rtmp_live_bus_resync(ctx);
+            continue;
+        }
+
+        ngx_rtmp_live_bus_read(st, ctx->pos, (u_char *) &rec, sizeof(rec));
+
+        /* torn record is caught below, its length must be sane anyway */
+
+        if (rec.mlen > ngx_rtmp_live_bus_max_rec(st)) {
+            ngx_rtmp_live_bus_resync(ctx);
+            continue;
+        }
+
+        data = ngx_rtmp_live_bus_alloc_data(rec.mlen, s->connection->log);
+        if (data == NULL) {
+            ngx_rtmp_finalize_session(s);
+            return;
+        }
+
+        ngx_rtmp_live_bus_read(st, ctx->pos + sizeof(rec), data, rec.mlen);
+
+        /* writer could have started overwriting it while we were copying */
+
+        ngx_memory_barrier();
+
+        if (!ngx_rtmp_live_bus_valid(st, ctx->pos, st->head)) {
+            ngx_rtmp_free_in_data(data);
+            ngx_rtmp_live_bus_resync(ctx);
+            continue;
+        }
+
+        ctx->pos += sizeof(rec) + rec.mlen;
+
+        ngx_rtmp_live_bus_inject(s, &rec, data);
+    }
+
+    if (st->closed && ctx->pos == st->head) {
+        ngx_log_debug0(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                       "live_bus: publisher gone");
+        ngx_rtmp_finalize_session(s);
+    }
+}
+
+
+static ngx_uint_t
+ngx_rtmp_live_bus_idle(ngx_rtmp_live_bus_ctx_t *ctx)
+{
+    ngx_rtmp_live_ctx_t            *lctx;
+
+    lctx = ngx_rtmp_get_module_ctx(ctx->session, ngx_rtmp_live_module);
+
+    return lctx == NULL || lctx->stream == NULL ||
+           (lctx->stream->ctx == lctx && lctx->next == NULL);
+}
+
+
+static void
+ngx_rtmp_live_bus_notify(ngx_event_t *rev)
+{
+    ngx_connection_t               *c;
+    ngx_rtmp_live_bus_shctx_t      *sh;
+    ngx_slab_pool_t                *shpool;
+    ngx_rtmp_live_bus_ctx_t        *ctx;
+    uint64_t                        n;
+
+    c = rev->data;
+
+    if (read(c->fd, &n, sizeof(n)) == -1 && ngx_errno != NGX_EAGAIN) {
+        ngx_log_error(NGX_LOG_ALERT, c->log, ngx_errno,
+                      "live_bus: eventfd read failed");
+    }
+
+    sh = ngx_rtmp_live_bus_get_shctx(&shpool);
+
+    sh->pending[ngx_worker] = 0;
+    ngx_memory_barrier();
+
+    /* sessions are closed from posted events, list stays intact */
+
+    for (ctx = ngx_rtmp_live_bus_readers; ctx; ctx = ctx->next) {
+
+        /* player has not joined yet, see ngx_rtmp_live_bus_join() */
+
+        if (!ctx->joined) {
+            continue;
+        }
+
+        if (ngx_rtmp_live_bus_idle(ctx)) {
+            ngx_log_debug0(NGX_LOG_DEBUG_RTMP, ctx->session->connection->log,
+                           0, "live_bus: no local subscribers");
+            ngx_rtmp_finalize_session(ctx->session);
+            continue;
+        }
+
+        ngx_rtmp_live_bus_pump(ctx);
+    }
+}
+
+
+static void
+ngx_rtmp_live_bus_join(ngx_event_t *ev)
+{
+    ngx_rtmp_live_bus_ctx_t        *ctx;
+
+    ctx = ev->data;
+
+    /*
+     * posted from ngx_rtmp_live_bus_attach(), the player has joined
+     * the local stream by now and gets frames since the last keyframe
+     */
+
+    ctx->joined = 1;
+
+    ngx_rtmp_live_bus_pump(ctx);
+}
+
+
+static void
+ngx_rtmp_live_bus_check(ngx_event_t *ev)
+{
+    ngx_rtmp_live_bus_ctx_t        *ctx;
+    ngx_rtmp_live_bus_stream_t     *st;
+    ngx_rtmp_live_bus_shctx_t      *sh;
+    ngx_slab_pool_t                *shpool;
+
+    ctx = ev->data;
+    st = ctx->stream;
+
+    if (st == NULL) {
+        return;
+    }
+
+    /* publishing worker died without closing the stream */
+
+    if (!st->closed && kill(st->pid, 0) == -1 && ngx_errno == NGX_ESRCH) {
+        ngx_log_error(NGX_LOG_ERR, ev->log, 0,
+                      "live_bus: worker %ui publishing '%s' is gone",
+                      st->worker, st->name);
+
+        if (ngx_atomic_cmp_set(&st->closed, 0, 1)) {
+            sh = ngx_rtmp_live_bus_get_shctx(&shpool);
+
+            /* drop the reference the publisher would have dropped */
+
+            ngx_shmtx_lock(&shpool->mutex);
+            ngx_rtmp_live_bus_unref_locked(shpool, sh, st);
+            ngx_shmtx_unlock(&shpool->mutex);
+        }
+    }
+
+    if (st->closed) {
+        ngx_rtmp_finalize_session(ctx->session);
+        return;
+    }
+
+    ngx_add_timer(ev, NGX_RTMP_LIVE_BUS_CHECK);
+}
+
+
+static void
+ngx_rtmp_live_bus_attach(ngx_rtmp_live_bus_ctx_t *ctx)
+{
+    ngx_rtmp_live_bus_stream_t     *st;
+    ngx_slab_pool_t                *shpool;
+    ngx_rtmp_live_bus_rec_t        *rec;
+    ngx_rtmp_session_t             *s;
+    ngx_uint_t                      n;
+    u_char                         *data[NGX_RTMP_LIVE_BUS_NHEADERS];
+    ngx_rtmp_live_bus_rec_t         recs[NGX_RTMP_LIVE_BUS_NHEADERS];
+    ngx_atomic_uint_t               key, head;
+
+    s = ctx->session;
+    st = ctx->stream;
+
+    (void) ngx_rtmp_live_bus_get_shctx(&shpool);
+
+    /* snapshot codec headers & metadata */
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    for (n = 0; n < NGX_RTMP_LIVE_BUS_NHEADERS; ++n) {
+        data[n] = NULL;
+
+        if (st->headers[n] == NULL) {
+            continue;
+        }
+
+        rec = (ngx_rtmp_live_bus_rec_t *) st->headers[n];
+        recs[n] = *rec;
+
+        data[n] = ngx_rtmp_live_bus_alloc_data(rec->mlen, s->connection->log);
+        if (data[n]) {
+            ngx_memcpy(data[n], rec + 1, rec->mlen);
+        }
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    for (n = 0; n < NGX_RTMP_LIVE_BUS_NHEADERS; ++n) {
+        if (data[n]) {
+            ngx_rtmp_live_bus_inject(s, &recs[n], data[n]);
+        }
+    }
+
+    /* start from last keyframe */
+
+    key = st->key;
+    ngx_memory_barrier();
+    head = st->head;
+
+    ctx->pos = (ngx_rtmp_live_bus_valid(st, key, head) ? key : head);
+
+    ctx->next = ngx_rtmp_live_bus_readers;
+    ngx_rtmp_live_bus_readers = ctx;
+
+    (void) ngx_atomic_fetch_add(&st->readers[ngx_worker], 1);
+
+    /* frames are pumped once the player has joined the local stream */
+
+    ctx->join_evt.handler = ngx_rtmp_live_bus_join;
+    ctx->join_evt.data = ctx;
+    ctx->join_evt.log = s->connection->log;
+
+    ngx_post_event(&ctx->join_evt, &ngx_posted_events);
+
+    ctx->check_evt.handler = ngx_rtmp_live_bus_check;
+    ctx->check_evt.data = ctx;
+    ctx->check_evt.log = s->connection->log;
+    ctx->check_evt.cancelable = 1;
+
+    ngx_add_timer(&ctx->check_evt, NGX_RTMP_LIVE_BUS_CHECK);
+}
+
+
+static ngx_int_t
+ngx_rtmp_live_bus_create_session(ngx_rtmp_session_t *s,
+    ngx_rtmp_live_bus_stream_t *st, u_char *name)
+{
+    ngx_rtmp_live_bus_ctx_t        *ctx;
+    ngx_rtmp_live_ctx_t            *lctx;
+    ngx_rtmp_addr_conf_t           *addr_conf;
+    ngx_rtmp_conf_ctx_t            *addr_ctx;
+    ngx_rtmp_session_t             *bs;
+    ngx_rtmp_publish_t              v;
+    ngx_connection_t               *c;
+    ngx_pool_t                     *pool;
+    ngx_log_t                      *log;
+    ngx_socket_t                    fd;
+
+    pool = ngx_create_pool(4096, ngx_cycle->log);
+    if (pool == NULL) {
+        return NGX_ERROR;
+    }
+
+    log = ngx_palloc(pool, sizeof(ngx_log_t));
+    addr_conf = ngx_pcalloc(pool, sizeof(ngx_rtmp_addr_conf_t));
+    addr_ctx = ngx_pcalloc(pool, sizeof(ngx_rtmp_conf_ctx_t));
+
+    if (log == NULL || addr_conf == NULL || addr_ctx == NULL) {
+        goto failed;
+    }
+
+    /* copy log to keep shared log unchanged */
+    *log = *ngx_cycle->log;
+
+    /* bus session never does i/o, its connection holds a duplicate
+     * of the notification descriptor to go through usual close path */
+
+    fd = dup(ngx_rtmp_live_bus_fds[ngx_worker]);
+    if (fd == (ngx_socket_t) -1) {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, ngx_errno,
+                      "live_bus: dup() failed");
+        goto failed;
+    }
+
+    c = ngx_get_connection(fd, log);
+    if (c == NULL) {
+        close(fd);
+        goto failed;
+    }
+
+    c->pool = pool;
+    c->log = log;
+    c->read->log = log;
+    c->write->log = log;
+    ngx_str_set(&c->addr_text, "ngx-live-bus");
+
+    addr_conf->ctx = addr_ctx;
+    addr_conf->bus = 1;
+    addr_ctx->main_conf = s->main_conf;
+    addr_ctx->srv_conf = s->srv_conf;
+    ngx_str_set(&addr_conf->addr_text, "ngx-live-bus");
+
+#if (NGX_STAT_STUB)
+    (void) ngx_atomic_fetch_add(ngx_stat_active, 1);
+#endif
+
+    bs = ngx_rtmp_init_session(c, addr_conf);
+    if (bs == NULL) {
+        /* no need to destroy pool */
+        return NGX_ERROR;
+    }
+
+    bs->app_conf = s->app_conf;
+    bs->auto_pushed = 1;
+    ngx_str_set(&bs->flashver, "ngx-live-bus");
+
+    bs->app.data = ngx_pstrdup(pool, &s->app);
+    if (bs->app.data == NULL) {
+        goto finalize;
+    }
+
+    bs->app.len = s->app.len;
+
+    ctx = ngx_pcalloc(pool, sizeof(ngx_rtmp_live_bus_ctx_t));
+    if (ctx == NULL) {
+        goto finalize;
+    }
+
+    ctx->session = bs;
+
+    ngx_rtmp_set_ctx(bs, ctx, ngx_rtmp_live_bus_module);
+
+    ngx_memzero(&v, sizeof(ngx_rtmp_publish_t));
+    v.silent = 1;
+    ngx_cpystrn(v.name, name, sizeof(v.name));
+    ngx_cpystrn(v.type, (u_char *) "live", sizeof(v.type));
+
+    if (ngx_rtmp_publish(bs, &v) != NGX_OK) {
+        goto finalize;
+    }
+
+    lctx = ngx_rtmp_get_module_ctx(bs, ngx_rtmp_live_module);
+    if (lctx == NULL || !lctx->publishing) {
+        goto finalize;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                   "live_bus: attach '%s' from worker %ui",
+                   name, st->worker);
+
+    ctx->stream = st;
+
+    ngx_rtmp_live_bus_attach(ctx);
+
+    return NGX_OK;
+
+finalize:
+    ngx_rtmp_finalize_session(bs);
+    return NGX_ERROR;
+
+failed:
+    ngx_destroy_pool(pool);
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_rtmp_live_bus_publish(ngx_rtmp_session_t *s, ngx_rtmp_publish_t *v)
+{
+    ngx_rtmp_live_bus_main_conf_t  *lbcf;
+    ngx_rtmp_live_app_conf_t       *lacf;
+    ngx_rtmp_live_bus_ctx_t        *ctx;
+    ngx_rtmp_live_bus_stream_t     *st;
+    ngx_rtmp_live_bus_shctx_t      *sh;
+    ngx_slab_pool_t                *shpool;
+
+    if (!ngx_rtmp_live_bus_enabled || s->auto_pushed) {
+        goto next;
+    }
+
+    lacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_live_module);
+    if (lacf == NULL || !lacf->live) {
+        goto next;
+    }
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_live_bus_module);
+    if (ctx && ctx->stream) {
+        goto next;
+    }
+
+    if (s->app.len >= NGX_RTMP_MAX_NAME) {
+        goto next;
+    }
+
+    if (ctx == NULL) {
+        ctx = ngx_pcalloc(s->connection->pool,
+                          sizeof(ngx_rtmp_live_bus_ctx_t));
+        if (ctx == NULL) {
+            goto next;
+        }
+
+        ngx_rtmp_set_ctx(s, ctx, ngx_rtmp_live_bus_module);
+    }
+
+    ctx->session = s;
+
+    lbcf = ngx_rtmp_get_module_main_conf(s, ngx_rtmp_live_bus_module);
+
+    sh = ngx_rtmp_live_bus_get_shctx(&shpool);
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    st = ngx_rtmp_live_bus_find_stream(sh, &s->app, v->name);
+
+    /* publishing worker died without closing the stream, take it over */
+
+    if (st && kill(st->pid, 0) == -1 && ngx_errno == NGX_ESRCH &&
+        ngx_atomic_cmp_set(&st->closed, 0, 1))
+    {
+        ngx_rtmp_live_bus_unref_locked(shpool, sh, st);
+        st = NULL;
+    }
+
+    if (st) {
+        ngx_shmtx_unlock(&shpool->mutex);
+
+        /* same as a second publisher on one worker, see live module */
+
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                      "live_bus: '%s' already published by worker %ui",
+                      v->name, st->worker);
+
+        ngx_rtmp_send_status(s, "NetStream.Publish.BadName", "error",
+                             "Already publishing");
+
+        return NGX_ERROR;
+    }
+
+    st = ngx_slab_calloc_locked(shpool, sizeof(ngx_rtmp_live_bus_stream_t));
+    if (st == NULL) {
+        goto nomem;
+    }
+
+    st->data = ngx_slab_alloc_locked(shpool, lbcf->buffer);
+    if (st->data == NULL) {
+        ngx_slab_free_locked(shpool, st);
+        goto nomem;
+    }
+
+    st->size = lbcf->buffer;
+    st->worker = ngx_worker;
+    st->pid = ngx_pid;
+    st->refs = 1;
+
+    ngx_memcpy(st->app, s->app.data, s->app.len);
+    ngx_cpystrn(st->name, v->name, sizeof(st->name));
+
+    st->next = sh->streams;
+    sh->streams = st;
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                   "live_bus: publish '%s'", v->name);
+
+    ctx->stream = st;
+    ctx->publishing = 1;
+
+    goto next;
+
+nomem:
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                  "live_bus: out of shared memory, '%s' not shared",
+                  v->name);
+
+next:
+    return next_publish(s, v);
+}
+
+
+static ngx_int_t
+ngx_rtmp_live_bus_play(ngx_rtmp_session_t *s, ngx_rtmp_play_t *v)
+{
+    ngx_rtmp_live_app_conf_t       *lacf;
+    ngx_rtmp_live_stream_t         *ls;
+    ngx_rtmp_live_bus_stream_t     *st;
+    ngx_rtmp_live_bus_shctx_t      *sh;
+    ngx_slab_pool_t                *shpool;
+
+    if (!ngx_rtmp_live_bus_enabled || s->auto_pushed) {
+        goto next;
+    }
+
+    lacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_live_module);
+    if (lacf == NULL || !lacf->live) {
+        goto next;
+    }
+
+    /* stream is published in this worker or already read from bus */
+
+    ls = ngx_rtmp_live_find_stream(lacf, v->name, ngx_strlen(v->name));
+    if (ls && ls->publishing) {
+        goto next;
+    }
+
+    sh = ngx_rtmp_live_bus_get_shctx(&shpool);
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    st = ngx_rtmp_live_bus_find_stream(sh, &s->app, v->name);
+    if (st && st->worker != ngx_worker) {
+        st->refs++;
+
+    } else {
+        st = NULL;
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    if (st == NULL) {
+        goto next;
+    }
+
+    if (ngx_rtmp_live_bus_create_session(s, st, v->name) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
+                      "live_bus: failed to read '%s' from bus", v->name);
+
+        ngx_shmtx_lock(&shpool->mutex);
+        ngx_rtmp_live_bus_unref_locked(shpool, sh, st);
+        ngx_shmtx_unlock(&shpool->mutex);
+    }
+
+next:
+    return next_play(s, v);
+}
+
+
+static ngx_int_t
+ngx_rtmp_live_bus_close_stream(ngx_rtmp_session_t *s,
+    ngx_rtmp_close_stream_t *v)
+{
+    ngx_rtmp_live_bus_ctx_t        *ctx, **pctx;
+    ngx_rtmp_live_bus_stream_t     *st;
+    ngx_rtmp_live_bus_shctx_t      *sh;
+    ngx_slab_pool_t                *shpool;
+
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_live_bus_module);
+    if (ctx == NULL || ctx->stream == NULL) {
+        goto next;
+    }
+
+    st = ctx->stream;
+    ctx->stream = NULL;
+
+    sh = ngx_rtmp_live_bus_get_shctx(&shpool);
+
+    if (ctx->publishing) {
+        ngx_log_debug0(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                       "live_bus: unpublish");
+
+        ctx->publishing = 0;
+
+        st->closed = 1;
+        ngx_memory_barrier();
+
+        ngx_rtmp_live_bus_signal(st);
+
+    } else {
+        ngx_log_debug0(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                       "live_bus: detach");
+
+        if (ctx->join_evt.posted) {
+            ngx_delete_posted_event(&ctx->join_evt);
+        }
+
+        if (ctx->check_evt.timer_set) {
+            ngx_del_timer(&ctx->check_evt);
+        }
+
+        for (pctx = &ngx_rtmp_live_bus_readers; *pctx; pctx = &(*pctx)->next) {
+            if (*pctx == ctx) {
+                *pctx = ctx->next;
+                break;
+            }
+        }
+
+        (void) ngx_atomic_fetch_add(&st->readers[ngx_worker], -1);
+    }
+
+    ngx_shmtx_lock(&shpool->mutex);
+    ngx_rtmp_live_bus_unref_locked(shpool, sh, st);
+    ngx_shmtx_unlock(&shpool->mutex);
+
+next:
+    return next_close_stream(s, v);
+}
+
+
+static ngx_int_t
+ngx_rtmp_live_bus_init_process(ngx_cycle_t *cycle)
+{
+    ngx_rtmp_live_bus_main_conf_t  *lbcf;
+    ngx_connection_t               *c;
+
+    ngx_rtmp_live_bus_enabled = 0;
+    ngx_rtmp_live_bus_readers = NULL;
+
+    if (ngx_process != NGX_PROCESS_WORKER) {
+        return NGX_OK;
+    }
+
+    lbcf = ngx_rtmp_cycle_get_module_main_conf(cycle, ngx_rtmp_live_bus_module);
+    if (lbcf == NULL || !lbcf->bus || ngx_worker >= ngx_rtmp_live_bus_nfds) {
+        return NGX_OK;
+    }
+
+    c = ngx_get_connection(ngx_rtmp_live_bus_fds[ngx_worker], cycle->log);
+    if (c == NULL) {
+        return NGX_ERROR;
+    }
+
+    c->read->handler = ngx_rtmp_live_bus_notify;
+    c->read->log = cycle->log;
+    c->data = NULL;
+
+    if (ngx_add_event(c->read, NGX_READ_EVENT, 0) != NGX_OK) {
+        ngx_free_connection(c);
+        return NGX_ERROR;
+    }
+
+    ngx_rtmp_live_bus_enabled = 1;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_rtmp_live_bus_shm_init(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_slab_pool_t                *shpool;
+    ngx_rtmp_live_bus_shctx_t      *sh;
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        shm_zone->data = shpool->data;
+        return NGX_OK;
+    }
+
+    sh = ngx_slab_calloc(shpool, sizeof(ngx_rtmp_live_bus_shctx_t));
+    if (sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    shpool->data = sh;
+    shm_zone->data = sh;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_rtmp_live_bus_postconfiguration(ngx_conf_t *cf)
+{
+    ngx_rtmp_core_main_conf_t      *cmcf;
+    ngx_rtmp_live_bus_main_conf_t  *lbcf;
+    ngx_rtmp_handler_pt            *h;
+    ngx_rtmp_amf_handler_t         *ch;
+
+    lbcf = ngx_rtmp_conf_get_module_main_conf(cf, ngx_rtmp_live_bus_module);
+    if (!lbcf->bus) {
+        return NGX_OK;
+    }
+
+    lbcf->shm_zone = ngx_shared_memory_add(cf, &ngx_rtmp_live_bus_shm_name,
+                                           lbcf->size,
+                                           &ngx_rtmp_live_bus_module);
+    if (lbcf->shm_zone == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* ring readers are woken through descriptors of their own cycle,
+     * never share streams with workers of another cycle */
+
+    lbcf->shm_zone->init = ngx_rtmp_live_bus_shm_init;
+    lbcf->shm_zone->noreuse = 1;
+
+    cmcf = ngx_rtmp_conf_get_module_main_conf(cf, ngx_rtmp_core_module);
+
+    h = ngx_array_push(&cmcf->events[NGX_RTMP_MSG_AUDIO]);
+    *h = ngx_rtmp_live_bus_av;
+
+    h = ngx_array_push(&cmcf->events[NGX_RTMP_MSG_VIDEO]);
+    *h = ngx_rtmp_live_bus_av;
+
+    ch = ngx_array_push(&cmcf->amf);
+    if (ch == NULL) {
+        return NGX_ERROR;
+    }
+    ngx_str_set(&ch->name, "@setDataFrame");
+    ch->handler = ngx_rtmp_live_bus_set_data_frame;
+
+    ch = ngx_array_push(&cmcf->amf);
+    if (ch == NULL) {
+        return NGX_ERROR;
+    }
+    ngx_str_set(&ch->name, "onMetaData");
+    ch->handler = ngx_rtmp_live_bus_on_meta_data;
+
+    next_publish = ngx_rtmp_publish;
+    ngx_rtmp_publish = ngx_rtmp_live_bus_publish;
+
+    next_play = ngx_rtmp_play;
+    ngx_rtmp_play = ngx_rtmp_live_bus_play;
+
+    next_close_stream = ngx_rtmp_close_stream;
+    ngx_rtmp_close_stream = ngx_rtmp_live_bus_close_stream;
+
+    return NGX_OK;
+}
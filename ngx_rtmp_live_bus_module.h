@@ -0,0 +1,22 @@
+/*
+ * Copyright (C) Roman Arutyunyan
+ */
+
+
+#ifndef _NGX_RTMP_LIVE_BUS_H_INCLUDED_
+#define _NGX_RTMP_LIVE_BUS_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include "ngx_rtmp.h"
+
+
+/* worker publishing the stream or NGX_DECLINED */
+ngx_int_t ngx_rtmp_live_bus_find_worker(ngx_str_t *app, u_char *name);
+
+
+extern ngx_module_t  ngx_rtmp_live_bus_module;
+
+
+#endif /* _NGX_RTMP_LIVE_BUS_H_INCLUDED_ */
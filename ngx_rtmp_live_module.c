@@ -27,6 +27,9 @@ static char *ngx_rtmp_live_set_msec_slot(ngx_conf_t *cf, ngx_command_t *cmd,
        void *conf);
 static void ngx_rtmp_live_start(ngx_rtmp_session_t *s);
 static void ngx_rtmp_live_stop(ngx_rtmp_session_t *s);
+static void ngx_rtmp_live_free_cache(ngx_rtmp_session_t *s,
+       ngx_rtmp_live_stream_t *stream);
+static void ngx_rtmp_live_send_cache(ngx_rtmp_session_t *s);
 
 
 static ngx_command_t  ngx_rtmp_live_commands[] = {
@@ -40,7 +43,7 @@ static ngx_command_t  ngx_rtmp_live_commands[] = {
 
     { ngx_string("stream_buckets"),
       NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
-      ngx_conf_set_str_slot,
+      ngx_conf_set_num_slot,
       NGX_RTMP_APP_CONF_OFFSET,
       offsetof(ngx_rtmp_live_app_conf_t, nbuckets),
       NULL },
@@ -108,6 +111,41 @@ static ngx_command_t  ngx_rtmp_live_commands[] = {
       offsetof(ngx_rtmp_live_app_conf_t, idle_timeout),
       NULL },
 
+    { ngx_string("out_queue_high"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_live_app_conf_t, queue_high),
+      NULL },
+
+    { ngx_string("out_queue_low"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_live_app_conf_t, queue_low),
+      NULL },
+
+    { ngx_string("gop_cache"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_live_app_conf_t, gop_cache),
+      NULL },
+
+    { ngx_string("gop_cache_size"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_live_app_conf_t, gop_cache_size),
+      NULL },
+
+    { ngx_string("gop_cache_duration"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_live_app_conf_t, gop_cache_duration),
+      NULL },
+
       ngx_null_command
 };
 
@@ -161,17 +199,34 @@ ngx_rtmp_live_create_app_conf(ngx_conf_t *cf)
     lacf->publish_notify = NGX_CONF_UNSET;
     lacf->play_restart = NGX_CONF_UNSET;
     lacf->idle_streams = NGX_CONF_UNSET;
+    lacf->queue_high = NGX_CONF_UNSET_SIZE;
+    lacf->queue_low = NGX_CONF_UNSET_SIZE;
+    lacf->gop_cache = NGX_CONF_UNSET;
+    lacf->gop_cache_size = NGX_CONF_UNSET_SIZE;
+    lacf->gop_cache_duration = NGX_CONF_UNSET_MSEC;
 
     return lacf;
 }
 
 
+static void
+ngx_rtmp_live_free_index(void *data)
+{
+    ngx_rtmp_live_app_conf_t   *lacf = data;
+
+    ngx_free(lacf->streams);
+}
+
+
 static char *
 ngx_rtmp_live_merge_app_conf(ngx_conf_t *cf, void *parent, void *child)
 {
     ngx_rtmp_live_app_conf_t *prev = parent;
     ngx_rtmp_live_app_conf_t *conf = child;
 
+    ngx_uint_t                n;
+    ngx_pool_cleanup_t       *cln;
+
     ngx_conf_merge_value(conf->live, prev->live, 0);
     ngx_conf_merge_value(conf->nbuckets, prev->nbuckets, 1024);
     ngx_conf_merge_msec_value(conf->buflen, prev->buflen, 0);
@@ -183,14 +238,50 @@ ngx_rtmp_live_merge_app_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_value(conf->publish_notify, prev->publish_notify, 0);
     ngx_conf_merge_value(conf->play_restart, prev->play_restart, 0);
     ngx_conf_merge_value(conf->idle_streams, prev->idle_streams, 1);
+    ngx_conf_merge_size_value(conf->queue_high, prev->queue_high, 0);
+    ngx_conf_merge_size_value(conf->queue_low, prev->queue_low,
+                              conf->queue_high / 2);
+
+    if (conf->queue_low > conf->queue_high) {
+        conf->queue_low = conf->queue_high;
+    }
+
+    ngx_conf_merge_value(conf->gop_cache, prev->gop_cache, 0);
+    ngx_conf_merge_size_value(conf->gop_cache_size, prev->gop_cache_size,
+                              4 * 1024 * 1024);
+    ngx_conf_merge_msec_value(conf->gop_cache_duration,
+                              prev->gop_cache_duration, 10000);
 
     conf->pool = ngx_create_pool(4096, &cf->cycle->new_log);
     if (conf->pool == NULL) {
         return NGX_CONF_ERROR;
     }
 
-    conf->streams = ngx_pcalloc(cf->pool,
-            sizeof(ngx_rtmp_live_stream_t *) * conf->nbuckets);
+    /* index grows by doubling, keep its size a power of 2 */
+
+    n = 16;
+    while (n < (ngx_uint_t) conf->nbuckets) {
+        n <<= 1;
+    }
+
+    conf->nbuckets = n;
+
+    /* index is regrown at run time, pool would keep every old copy */
+
+    conf->streams = ngx_calloc(sizeof(ngx_rtmp_live_stream_t *)
+                               * conf->nbuckets, cf->log);
+    if (conf->streams == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    cln = ngx_pool_cleanup_add(cf->pool, 0);
+    if (cln == NULL) {
+        ngx_free(conf->streams);
+        return NGX_CONF_ERROR;
+    }
+
+    cln->handler = ngx_rtmp_live_free_index;
+    cln->data = conf;
 
     return NGX_CONF_OK;
 }
@@ -218,11 +309,75 @@ ngx_rtmp_live_set_msec_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 }
 
 
-static ngx_rtmp_live_stream_t **
+ngx_rtmp_live_stream_t *
+ngx_rtmp_live_find_stream(ngx_rtmp_live_app_conf_t *lacf, u_char *name,
+    size_t len)
+{
+    ngx_rtmp_live_stream_t     *stream;
+    ngx_uint_t                  hash, mask, n;
+
+    len = ngx_min(len, NGX_RTMP_MAX_NAME - 1);
+    hash = ngx_hash_key(name, len);
+    mask = lacf->nbuckets - 1;
+
+    for (n = hash & mask; lacf->streams[n]; n = (n + 1) & mask) {
+        stream = lacf->streams[n];
+
+        if (stream->hash == hash && stream->len == len &&
+            ngx_memcmp(stream->name, name, len) == 0)
+        {
+            return stream;
+        }
+    }
+
+    return NULL;
+}
+
+
+static ngx_int_t
+ngx_rtmp_live_grow_index(ngx_rtmp_live_app_conf_t *lacf, ngx_log_t *log)
+{
+    ngx_rtmp_live_stream_t    **streams, **old;
+    ngx_uint_t                  n, m, mask, nbuckets;
+
+    nbuckets = lacf->nbuckets * 2;
+
+    streams = ngx_calloc(sizeof(ngx_rtmp_live_stream_t *) * nbuckets, log);
+    if (streams == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_RTMP, log, 0,
+                   "live: grow stream index to %ui", nbuckets);
+
+    mask = nbuckets - 1;
+    old = lacf->streams;
+
+    for (n = 0; n < (ngx_uint_t) lacf->nbuckets; ++n) {
+        if (old[n] == NULL) {
+            continue;
+        }
+
+        for (m = old[n]->hash & mask; streams[m]; m = (m + 1) & mask);
+
+        streams[m] = old[n];
+    }
+
+    lacf->streams = streams;
+    lacf->nbuckets = nbuckets;
+
+    ngx_free(old);
+
+    return NGX_OK;
+}
+
+
+static ngx_rtmp_live_stream_t *
 ngx_rtmp_live_get_stream(ngx_rtmp_session_t *s, u_char *name, int create)
 {
     ngx_rtmp_live_app_conf_t   *lacf;
-    ngx_rtmp_live_stream_t    **stream;
+    ngx_rtmp_live_stream_t     *stream;
+    ngx_uint_t                  mask, n;
     size_t                      len;
 
     lacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_live_module);
@@ -231,36 +386,220 @@ ngx_rtmp_live_get_stream(ngx_rtmp_session_t *s, u_char *name, int create)
     }
 
     len = ngx_strlen(name);
-    stream = &lacf->streams[ngx_hash_key(name, len) % lacf->nbuckets];
-
-    for (; *stream; stream = &(*stream)->next) {
-        if (ngx_strcmp(name, (*stream)->name) == 0) {
-            return stream;
-        }
-    }
 
-    if (!create) {
-        return NULL;
+    stream = ngx_rtmp_live_find_stream(lacf, name, len);
+    if (stream || !create) {
+        return stream;
     }
 
     ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
             "live: create stream '%s'", name);
 
+    /* keep load factor below 1/2 */
+
+    if ((lacf->nstreams + 1) * 2 > (ngx_uint_t) lacf->nbuckets &&
+        ngx_rtmp_live_grow_index(lacf, s->connection->log) != NGX_OK)
+    {
+        return NULL;
+    }
+
     if (lacf->free_streams) {
-        *stream = lacf->free_streams;
-        lacf->free_streams = lacf->free_streams->next;
+        stream = lacf->free_streams;
+        lacf->free_streams = stream->next;
+        --lacf->nfree_streams;
+
     } else {
-        *stream = ngx_palloc(lacf->pool, sizeof(ngx_rtmp_live_stream_t));
+        stream = ngx_alloc(sizeof(ngx_rtmp_live_stream_t),
+                           s->connection->log);
+        if (stream == NULL) {
+            return NULL;
+        }
     }
-    ngx_memzero(*stream, sizeof(ngx_rtmp_live_stream_t));
-    ngx_memcpy((*stream)->name, name,
-            ngx_min(sizeof((*stream)->name) - 1, len));
-    (*stream)->epoch = ngx_current_msec;
+
+    ngx_memzero(stream, sizeof(ngx_rtmp_live_stream_t));
+
+    stream->len = ngx_min(sizeof(stream->name) - 1, len);
+    ngx_memcpy(stream->name, name, stream->len);
+    stream->hash = ngx_hash_key(stream->name, stream->len);
+    stream->epoch = ngx_current_msec;
+
+    mask = lacf->nbuckets - 1;
+
+    for (n = stream->hash & mask; lacf->streams[n]; n = (n + 1) & mask);
+
+    lacf->streams[n] = stream;
+    ++lacf->nstreams;
 
     return stream;
 }
 
 
+static void
+ngx_rtmp_live_delete_stream(ngx_rtmp_live_app_conf_t *lacf,
+    ngx_rtmp_live_stream_t *stream)
+{
+    ngx_uint_t                  mask, n, m, k;
+
+    mask = lacf->nbuckets - 1;
+
+    for (n = stream->hash & mask; lacf->streams[n] != stream;
+         n = (n + 1) & mask)
+    {
+        if (lacf->streams[n] == NULL) {
+            return;
+        }
+    }
+
+    /* backward shift deletion keeps probe sequences intact */
+
+    lacf->streams[n] = NULL;
+
+    for (m = (n + 1) & mask; lacf->streams[m]; m = (m + 1) & mask) {
+        k = lacf->streams[m]->hash & mask;
+
+        if ((m > n && (k <= n || k > m)) || (m < n && k <= n && k > m)) {
+            lacf->streams[n] = lacf->streams[m];
+            lacf->streams[m] = NULL;
+            n = m;
+        }
+    }
+
+    --lacf->nstreams;
+
+    if (stream->subs) {
+        ngx_free(stream->subs);
+        stream->subs = NULL;
+    }
+
+    if (lacf->nfree_streams >= NGX_RTMP_LIVE_MAX_FREE_STREAMS) {
+        ngx_free(stream);
+        return;
+    }
+
+    stream->next = lacf->free_streams;
+    lacf->free_streams = stream;
+    ++lacf->nfree_streams;
+}
+
+
+static ngx_int_t
+ngx_rtmp_live_attach(ngx_rtmp_live_ctx_t *ctx)
+{
+    ngx_rtmp_live_stream_t     *stream;
+    ngx_rtmp_live_sub_t        *subs, *sub;
+    ngx_uint_t                  n, nalloc;
+
+    if (ctx->sub) {
+        return NGX_OK;
+    }
+
+    stream = ctx->stream;
+
+    if (stream->nsubs == stream->nalloc_subs) {
+        nalloc = stream->nalloc_subs ? stream->nalloc_subs * 2 : 16;
+
+        subs = ngx_alloc(sizeof(ngx_rtmp_live_sub_t) * nalloc,
+                         ctx->session->connection->log);
+        if (subs == NULL) {
+            return NGX_ERROR;
+        }
+
+        if (stream->subs) {
+            ngx_memcpy(subs, stream->subs,
+                       sizeof(ngx_rtmp_live_sub_t) * stream->nsubs);
+            ngx_free(stream->subs);
+        }
+
+        stream->subs = subs;
+        stream->nalloc_subs = nalloc;
+
+        for (n = 0; n < stream->nsubs; ++n) {
+            subs[n].ctx->sub = &subs[n];
+        }
+    }
+
+    sub = &stream->subs[stream->nsubs++];
+
+    sub->session = ctx->session;
+    sub->ctx = ctx;
+    sub->cs[0] = ctx->cs[0];
+    sub->cs[1] = ctx->cs[1];
+    sub->meta_version = ctx->meta_version;
+    sub->ndropped = ctx->ndropped;
+    sub->dropping = ctx->dropping;
+
+    ctx->sub = sub;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_rtmp_live_detach(ngx_rtmp_live_ctx_t *ctx)
+{
+    ngx_rtmp_live_stream_t     *stream;
+    ngx_rtmp_live_sub_t        *sub, *last;
+
+    sub = ctx->sub;
+    if (sub == NULL) {
+        return;
+    }
+
+    ctx->cs[0] = sub->cs[0];
+    ctx->cs[1] = sub->cs[1];
+    ctx->meta_version = sub->meta_version;
+    ctx->ndropped = sub->ndropped;
+    ctx->dropping = sub->dropping;
+
+    ctx->sub = NULL;
+
+    /* move the last slot into the hole */
+
+    stream = ctx->stream;
+    last = &stream->subs[--stream->nsubs];
+
+    if (sub != last) {
+        *sub = *last;
+        sub->ctx->sub = sub;
+    }
+}
+
+
+/*
+ * Messages prepared once for all subscribers are chunked with the base
+ * size, a chunk per buf. One taking a single chunk goes out as is with
+ * any chunk size; for a longer one the chunk size is set back to the
+ * base and the adaptation timer takes it up again.
+ */
+
+static ngx_int_t
+ngx_rtmp_live_send_base(ngx_rtmp_session_t *s, ngx_chain_t *msg)
+{
+    if (msg->next && ngx_rtmp_set_out_chunk_class(s, 0) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return ngx_rtmp_send_message(s, msg, 0);
+}
+
+
+static ngx_int_t
+ngx_rtmp_live_send_meta(ngx_rtmp_session_t *s, ngx_rtmp_codec_ctx_t *codec_ctx)
+{
+    ngx_chain_t                *meta;
+
+    /* multi-chunk meta is also chunked for the larger sizes */
+
+    meta = codec_ctx->meta_class[s->out_chunk_class];
+
+    if (s->out_chunk_class == 0 || meta == NULL) {
+        return ngx_rtmp_live_send_base(s, codec_ctx->meta);
+    }
+
+    return ngx_rtmp_send_message(s, meta, 0);
+}
+
+
 static void
 ngx_rtmp_live_idle(ngx_event_t *pev)
 {
@@ -284,6 +623,7 @@ ngx_rtmp_live_set_status(ngx_rtmp_session_t *s, ngx_chain_t *control,
 {
     ngx_rtmp_live_app_conf_t   *lacf;
     ngx_rtmp_live_ctx_t        *ctx, *pctx;
+    ngx_rtmp_live_chunk_stream_t  *cs;
     ngx_chain_t               **cl;
     ngx_event_t                *e;
     size_t                      n;
@@ -336,7 +676,7 @@ ngx_rtmp_live_set_status(ngx_rtmp_session_t *s, ngx_chain_t *control,
 
     /* subscriber */
 
-    if (control && ngx_rtmp_send_message(s, control, 0) != NGX_OK) {
+    if (control && ngx_rtmp_live_send_base(s, control) != NGX_OK) {
         ngx_rtmp_finalize_session(s);
         return;
     }
@@ -345,18 +685,20 @@ ngx_rtmp_live_set_status(ngx_rtmp_session_t *s, ngx_chain_t *control,
         cl = status;
 
         for (n = 0; n < nstatus; ++n, ++cl) {
-            if (*cl && ngx_rtmp_send_message(s, *cl, 0) != NGX_OK) {
+            if (*cl && ngx_rtmp_live_send_base(s, *cl) != NGX_OK) {
                 ngx_rtmp_finalize_session(s);
                 return;
             }
         }
     }
 
-    ctx->cs[0].active = 0;
-    ctx->cs[0].dropped = 0;
+    cs = ngx_rtmp_live_get_cs(ctx);
+
+    cs[0].active = 0;
+    cs[0].dropped = 0;
 
-    ctx->cs[1].active = 0;
-    ctx->cs[1].dropped = 0;
+    cs[1].active = 0;
+    cs[1].dropped = 0;
 }
 
 
@@ -441,6 +783,311 @@ ngx_rtmp_live_stop(ngx_rtmp_session_t *s)
 }
 
 
+static void
+ngx_rtmp_live_free_frame(ngx_rtmp_session_t *s, ngx_rtmp_live_stream_t *stream)
+{
+    ngx_rtmp_live_app_conf_t   *lacf;
+    ngx_rtmp_core_srv_conf_t   *cscf;
+    ngx_rtmp_live_frame_t      *f;
+
+    lacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_live_module);
+    cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
+
+    f = stream->gop_head;
+
+    stream->gop_head = f->next;
+    if (stream->gop_head == NULL) {
+        stream->gop_tail = NULL;
+    }
+
+    stream->gop_size -= f->size;
+    if (f->key) {
+        --stream->ngops;
+    }
+
+    ngx_rtmp_free_shared_chain(cscf, f->pkt);
+
+    f->next = lacf->free_frames;
+    lacf->free_frames = f;
+}
+
+
+static void
+ngx_rtmp_live_free_cache(ngx_rtmp_session_t *s, ngx_rtmp_live_stream_t *stream)
+{
+    while (stream->gop_head) {
+        ngx_rtmp_live_free_frame(s, stream);
+    }
+}
+
+
+static void
+ngx_rtmp_live_cache_frame(ngx_rtmp_session_t *s, ngx_rtmp_header_t *ch,
+                          ngx_chain_t *in, size_t size, ngx_uint_t key)
+{
+    ngx_rtmp_live_app_conf_t   *lacf;
+    ngx_rtmp_live_ctx_t        *ctx;
+    ngx_rtmp_live_stream_t     *stream;
+    ngx_rtmp_live_frame_t      *f;
+    ngx_chain_t                *pkt;
+
+    lacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_live_module);
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_live_module);
+    stream = ctx->stream;
+
+    /* cache starts at keyframe */
+    if (!key && stream->gop_head == NULL) {
+        return;
+    }
+
+    /* cached frames are chunked with the base size */
+
+    pkt = ngx_rtmp_prepare_shared_message(s, ch, NULL, in, 0);
+    if (pkt == NULL) {
+        return;
+    }
+
+    f = lacf->free_frames;
+    if (f) {
+        lacf->free_frames = f->next;
+
+    } else {
+        f = ngx_palloc(lacf->pool, sizeof(ngx_rtmp_live_frame_t));
+        if (f == NULL) {
+            ngx_rtmp_free_shared_chain(
+                    ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module),
+                    pkt);
+            return;
+        }
+    }
+
+    f->pkt = pkt;
+    f->next = NULL;
+    f->timestamp = ch->timestamp;
+    f->csid = ch->csid;
+    f->size = size;
+    f->key = key;
+
+    if (stream->gop_tail) {
+        stream->gop_tail->next = f;
+    } else {
+        stream->gop_head = f;
+    }
+
+    stream->gop_tail = f;
+    stream->gop_size += f->size;
+
+    if (key) {
+        ++stream->ngops;
+    }
+
+    /*
+     * drop oldest GOPs exceeding count, size or duration limits; audio
+     * may be slightly older than the key frame heading the cache
+     */
+
+    while (stream->gop_head &&
+           (stream->ngops > (ngx_uint_t) lacf->gop_cache ||
+            stream->gop_size > lacf->gop_cache_size ||
+            (int32_t) (stream->gop_tail->timestamp
+                       - stream->gop_head->timestamp)
+            > (int32_t) lacf->gop_cache_duration))
+    {
+        do {
+            ngx_rtmp_live_free_frame(s, stream);
+        } while (stream->gop_head && !stream->gop_head->key);
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                   "live: gop cache ngops=%ui size=%uz key=%ui",
+                   stream->ngops, stream->gop_size, key);
+}
+
+
+static ngx_int_t
+ngx_rtmp_live_send_header(ngx_rtmp_session_t *s, ngx_chain_t *header,
+                          uint8_t type, uint32_t csid, uint32_t timestamp)
+{
+    ngx_rtmp_core_srv_conf_t   *cscf;
+    ngx_rtmp_header_t           ch;
+    ngx_chain_t                *pkt;
+    ngx_int_t                   rc;
+
+    cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
+
+    ngx_memzero(&ch, sizeof(ch));
+
+    ch.timestamp = timestamp;
+    ch.msid = NGX_RTMP_MSID;
+    ch.csid = csid;
+    ch.type = type;
+
+    pkt = ngx_rtmp_append_shared_bufs(cscf, s->out_chunk_class, NULL, header);
+    if (pkt == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_rtmp_prepare_message(s, &ch, NULL, pkt);
+
+    rc = ngx_rtmp_send_message(s, pkt, 0);
+
+    ngx_rtmp_free_shared_chain(cscf, pkt);
+
+    return rc;
+}
+
+
+static void
+ngx_rtmp_live_send_cache(ngx_rtmp_session_t *s)
+{
+    ngx_rtmp_core_srv_conf_t   *cscf;
+    ngx_rtmp_live_app_conf_t   *lacf;
+    ngx_rtmp_live_ctx_t        *ctx, *pctx;
+    ngx_rtmp_live_sub_t        *sub;
+    ngx_rtmp_live_stream_t     *stream;
+    ngx_rtmp_live_frame_t      *f;
+    ngx_rtmp_codec_ctx_t       *codec_ctx;
+    ngx_rtmp_live_frame_t      *start;
+    ngx_rtmp_live_chunk_stream_t  *cs;
+    ngx_uint_t                  nframes, room;
+    size_t                      size, limit;
+    uint32_t                    timestamp;
+
+    lacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_live_module);
+    ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_live_module);
+
+    if (lacf == NULL || !lacf->gop_cache || ctx == NULL ||
+        ctx->sub == NULL || !ctx->stream->active ||
+        ctx->stream->gop_head == NULL)
+    {
+        return;
+    }
+
+    stream = ctx->stream;
+    sub = ctx->sub;
+
+    for (pctx = stream->ctx; pctx; pctx = pctx->next) {
+        if (pctx->publishing) {
+            break;
+        }
+    }
+
+    if (pctx == NULL) {
+        return;
+    }
+
+    /*
+     * the burst must fit in the out queue, leaving room for metadata,
+     * codec headers and a chunk size change, and stay below
+     * out_queue_high; older GOPs are skipped, with no GOP fitting
+     * playback starts at the next key frame
+     */
+
+    room = s->out_queue - 1 - (s->out_last - s->out_pos) % s->out_queue;
+    room = room > 5 ? room - 5 : 0;
+
+    limit = (size_t) -1;
+
+    if (lacf->queue_high) {
+        limit = lacf->queue_high > s->out_queued ?
+                lacf->queue_high - s->out_queued : 0;
+    }
+
+    nframes = 0;
+
+    for (f = stream->gop_head; f; f = f->next) {
+        nframes++;
+    }
+
+    size = stream->gop_size;
+
+    for (start = stream->gop_head; start; start = start->next) {
+        if (start->key && nframes <= room && size < limit) {
+            break;
+        }
+
+        nframes--;
+        size -= start->size;
+    }
+
+    if (start == NULL) {
+        ngx_log_debug2(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                       "live: gop cache does not fit, room=%ui limit=%uz",
+                       room, limit);
+        return;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                   "live: send gop cache nframes=%ui size=%uz",
+                   nframes, size);
+
+    /* codec headers and metadata precede cached frames */
+
+    codec_ctx = ngx_rtmp_get_module_ctx(pctx->session, ngx_rtmp_codec_module);
+
+    if (codec_ctx) {
+        timestamp = start->timestamp;
+
+        if (codec_ctx->meta &&
+            ngx_rtmp_live_send_meta(s, codec_ctx) == NGX_OK)
+        {
+            sub->meta_version = codec_ctx->meta_version;
+        }
+
+        if (codec_ctx->avc_header &&
+            ngx_rtmp_live_send_header(s, codec_ctx->avc_header,
+                                      NGX_RTMP_MSG_VIDEO, sub->cs[0].csid,
+                                      timestamp)
+            != NGX_OK)
+        {
+            goto failed;
+        }
+
+        if (codec_ctx->aac_header &&
+            ngx_rtmp_live_send_header(s, codec_ctx->aac_header,
+                                      NGX_RTMP_MSG_AUDIO,
+                                      lacf->interleave ? sub->cs[0].csid :
+                                                         sub->cs[1].csid,
+                                      timestamp)
+            != NGX_OK)
+        {
+            goto failed;
+        }
+    }
+
+    /* cached frames are chunked with the base size */
+
+    cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
+
+    for (f = start; f; f = f->next) {
+        if (f->size > ngx_rtmp_chunk_class_size(cscf, 0) &&
+            ngx_rtmp_set_out_chunk_class(s, 0) != NGX_OK)
+        {
+            goto failed;
+        }
+
+        if (ngx_rtmp_send_message(s, f->pkt, 0) != NGX_OK) {
+            goto failed;
+        }
+
+        cs = &sub->cs[f->csid == sub->cs[0].csid ? 0 : 1];
+        cs->active = 1;
+        cs->timestamp = f->timestamp;
+        s->current_time = f->timestamp;
+    }
+
+    return;
+
+failed:
+
+    ngx_log_debug0(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
+                   "live: gop cache send failed");
+
+    sub->cs[0].active = 0;
+    sub->cs[1].active = 0;
+}
+
+
 static ngx_int_t
 ngx_rtmp_live_stream_begin(ngx_rtmp_session_t *s, ngx_rtmp_stream_begin_t *v)
 {
@@ -487,7 +1134,7 @@ static void
 ngx_rtmp_live_join(ngx_rtmp_session_t *s, u_char *name, unsigned publisher)
 {
     ngx_rtmp_live_ctx_t            *ctx;
-    ngx_rtmp_live_stream_t        **stream;
+    ngx_rtmp_live_stream_t         *stream;
     ngx_rtmp_live_app_conf_t       *lacf;
 
     lacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_live_module);
@@ -517,7 +1164,7 @@ ngx_rtmp_live_join(ngx_rtmp_session_t *s, u_char *name, unsigned publisher)
     stream = ngx_rtmp_live_get_stream(s, name, publisher || lacf->idle_streams);
 
     if (stream == NULL ||
-        !(publisher || (*stream)->publishing || lacf->idle_streams))
+        !(publisher || stream->publishing || lacf->idle_streams))
     {
         ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
                       "live: stream not found");
@@ -531,7 +1178,7 @@ ngx_rtmp_live_join(ngx_rtmp_session_t *s, u_char *name, unsigned publisher)
     }
 
     if (publisher) {
-        if ((*stream)->publishing) {
+        if (stream->publishing) {
             ngx_log_error(NGX_LOG_ERR, s->connection->log, 0,
                           "live: already publishing");
 
@@ -541,14 +1188,14 @@ ngx_rtmp_live_join(ngx_rtmp_session_t *s, u_char *name, unsigned publisher)
             return;
         }
 
-        (*stream)->publishing = 1;
+        stream->publishing = 1;
     }
 
-    ctx->stream = *stream;
+    ctx->stream = stream;
     ctx->publishing = publisher;
-    ctx->next = (*stream)->ctx;
+    ctx->next = stream->ctx;
 
-    (*stream)->ctx = ctx;
+    stream->ctx = ctx;
 
     if (lacf->buflen) {
         s->out_buffer = 1;
@@ -557,6 +1204,11 @@ ngx_rtmp_live_join(ngx_rtmp_session_t *s, u_char *name, unsigned publisher)
     ctx->cs[0].csid = NGX_RTMP_CSID_VIDEO;
     ctx->cs[1].csid = NGX_RTMP_CSID_AUDIO;
 
+    if (!ctx->publishing && ngx_rtmp_live_attach(ctx) != NGX_OK) {
+        ngx_rtmp_finalize_session(s);
+        return;
+    }
+
     if (!ctx->publishing && ctx->stream->active) {
         ngx_rtmp_live_start(s);
     }
@@ -568,7 +1220,6 @@ ngx_rtmp_live_close_stream(ngx_rtmp_session_t *s, ngx_rtmp_close_stream_t *v)
 {
     ngx_rtmp_session_t             *ss;
     ngx_rtmp_live_ctx_t            *ctx, **cctx, *pctx;
-    ngx_rtmp_live_stream_t        **stream;
     ngx_rtmp_live_app_conf_t       *lacf;
 
     lacf = ngx_rtmp_get_module_app_conf(s, ngx_rtmp_live_module);
@@ -592,6 +1243,7 @@ ngx_rtmp_live_close_stream(ngx_rtmp_session_t *s, ngx_rtmp_close_stream_t *v)
 
     if (ctx->stream->publishing && ctx->publishing) {
         ctx->stream->publishing = 0;
+        ngx_rtmp_live_free_cache(s, ctx->stream);
     }
 
     for (cctx = &ctx->stream->ctx; *cctx; cctx = &(*cctx)->next) {
@@ -601,6 +1253,8 @@ ngx_rtmp_live_close_stream(ngx_rtmp_session_t *s, ngx_rtmp_close_stream_t *v)
         }
     }
 
+    ngx_rtmp_live_detach(ctx);
+
     if (ctx->publishing || ctx->stream->active) {
         ngx_rtmp_live_stop(s);
     }
@@ -629,14 +1283,7 @@ ngx_rtmp_live_close_stream(ngx_rtmp_session_t *s, ngx_rtmp_close_stream_t *v)
                    "live: delete empty stream '%s'",
                    ctx->stream->name);
 
-    stream = ngx_rtmp_live_get_stream(s, ctx->stream->name, 0);
-    if (stream == NULL) {
-        goto next;
-    }
-    *stream = (*stream)->next;
-
-    ctx->stream->next = lacf->free_streams;
-    lacf->free_streams = ctx->stream;
+    ngx_rtmp_live_delete_stream(lacf, ctx->stream);
     ctx->stream = NULL;
 
     if (!ctx->silent && !ctx->publishing && !lacf->play_restart) {
@@ -675,6 +1322,10 @@ ngx_rtmp_live_pause(ngx_rtmp_session_t *s, ngx_rtmp_pause_t *v)
 
         ngx_rtmp_live_stop(s);
 
+        if (!ctx->publishing) {
+            ngx_rtmp_live_detach(ctx);
+        }
+
     } else {
         if (ngx_rtmp_send_status(s, "NetStream.Unpause.Notify", "status",
                                  "Unpaused live")
@@ -685,7 +1336,12 @@ ngx_rtmp_live_pause(ngx_rtmp_session_t *s, ngx_rtmp_pause_t *v)
 
         ctx->paused = 0;
 
+        if (!ctx->publishing && ngx_rtmp_live_attach(ctx) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
         ngx_rtmp_live_start(s);
+        ngx_rtmp_live_send_cache(s);
     }
 
 next:
@@ -696,19 +1352,22 @@ static ngx_int_t
 ngx_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
                  ngx_chain_t *in)
 {
-    ngx_rtmp_live_ctx_t            *ctx, *pctx;
+    ngx_rtmp_live_ctx_t            *ctx;
+    ngx_rtmp_live_sub_t            *sub, *last;
     ngx_rtmp_codec_ctx_t           *codec_ctx;
-    ngx_chain_t                    *header, *coheader, *meta,
-                                   *apkt, *aapkt, *acopkt, *rpkt;
+    ngx_chain_t                    *header, *coheader, *meta, *aapkt;
+    ngx_chain_t                    *apkt[NGX_RTMP_MAX_CHUNK_CLASSES];
+    ngx_chain_t                    *acopkt[NGX_RTMP_MAX_CHUNK_CLASSES];
+    ngx_chain_t                    *rpkt[NGX_RTMP_MAX_CHUNK_CLASSES];
     ngx_rtmp_core_srv_conf_t       *cscf;
     ngx_rtmp_live_app_conf_t       *lacf;
     ngx_rtmp_session_t             *ss;
     ngx_rtmp_header_t               ch, lh, clh;
-    ngx_int_t                       rc, mandatory, dummy_audio;
+    ngx_int_t                       rc, mandatory, dummy_audio, resync;
     ngx_uint_t                      prio;
     ngx_uint_t                      peers;
     ngx_uint_t                      meta_version;
-    ngx_uint_t                      csidx;
+    ngx_uint_t                      csidx, cls, n;
     uint32_t                        delta;
     ngx_rtmp_live_chunk_stream_t   *cs;
 #ifdef NGX_DEBUG
@@ -752,15 +1411,19 @@ ngx_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
     s->current_time = h->timestamp;
 
     peers = 0;
-    apkt = NULL;
     aapkt = NULL;
-    acopkt = NULL;
     header = NULL;
     coheader = NULL;
     meta = NULL;
     meta_version = 0;
     mandatory = 0;
 
+    /* packets are built lazily for each chunk size class in use */
+
+    ngx_memzero(apkt, sizeof(apkt));
+    ngx_memzero(acopkt, sizeof(acopkt));
+    ngx_memzero(rpkt, sizeof(rpkt));
+
     prio = (h->type == NGX_RTMP_MSG_VIDEO ?
             ngx_rtmp_get_video_frame_type(in) : 0);
 
@@ -802,10 +1465,6 @@ ngx_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
         ch.timestamp = lh.timestamp;
     }
 */
-    rpkt = ngx_rtmp_append_shared_bufs(cscf, NULL, in);
-
-    ngx_rtmp_prepare_message(s, &ch, &lh, rpkt);
-
     codec_ctx = ngx_rtmp_get_module_ctx(s, ngx_rtmp_codec_module);
 
     if (codec_ctx) {
@@ -831,8 +1490,8 @@ ngx_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
                 coheader = codec_ctx->aac_header;
             }
 
-            if (codec_ctx->video_codec_id == NGX_RTMP_VIDEO_H264 &&
-                ngx_rtmp_is_codec_header(in))
+            if (ngx_rtmp_is_avc_like(codec_ctx->video_codec_id) &&
+                ngx_rtmp_is_video_codec_header(in))
             {
                 prio = 0;
                 mandatory = 1;
@@ -845,27 +1504,77 @@ ngx_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
         }
     }
 
+    if (lacf->gop_cache) {
+        ngx_rtmp_live_cache_frame(s, &ch, in, h->mlen,
+                                  h->type == NGX_RTMP_MSG_VIDEO &&
+                                  prio == NGX_RTMP_VIDEO_KEY_FRAME &&
+                                  !mandatory);
+    }
+
+    /* subscribers dropped on queue overflow resume from a keyframe;
+     * audio-only streams resume from any audio packet */
+
+    if (h->type == NGX_RTMP_MSG_VIDEO) {
+        resync = (prio == NGX_RTMP_VIDEO_KEY_FRAME && !mandatory);
+
+    } else {
+        resync = (codec_ctx == NULL || codec_ctx->video_codec_id == 0);
+    }
+
     /* broadcast to all subscribers */
 
-    for (pctx = ctx->stream->ctx; pctx; pctx = pctx->next) {
-        if (pctx == ctx || pctx->paused) {
-            continue;
+    sub = ctx->stream->subs;
+    last = sub + ctx->stream->nsubs;
+
+    for (; sub < last; ++sub) {
+        ss = sub->session;
+        cs = &sub->cs[csidx];
+
+        /* drop GOP on queue overflow */
+
+        if (lacf->queue_high) {
+
+            if (!sub->dropping && ss->out_queued >= lacf->queue_high) {
+                ngx_log_debug1(NGX_LOG_DEBUG_RTMP, ss->connection->log, 0,
+                               "live: queue overflow %uz, drop gop",
+                               ss->out_queued);
+
+                sub->dropping = 1;
+                sub->cs[0].active = 0;
+                sub->cs[1].active = 0;
+            }
+
+            if (sub->dropping) {
+                if (!resync || ss->out_queued > lacf->queue_low) {
+                    ++sub->ndropped;
+                    continue;
+                }
+
+                ngx_log_debug1(NGX_LOG_DEBUG_RTMP, ss->connection->log, 0,
+                               "live: queue drained %uz, resume",
+                               ss->out_queued);
+
+                sub->dropping = 0;
+            }
         }
 
-        ss = pctx->session;
-        cs = &pctx->cs[csidx];
+        /* chunk size only changes between messages */
+
+        ngx_rtmp_adapt_chunk_size(ss);
 
         /* send metadata */
 
-        if (meta && meta_version != pctx->meta_version) {
+        if (meta && meta_version != sub->meta_version) {
             ngx_log_debug0(NGX_LOG_DEBUG_RTMP, ss->connection->log, 0,
                            "live: meta");
 
-            if (ngx_rtmp_send_message(ss, meta, 0) == NGX_OK) {
-                pctx->meta_version = meta_version;
+            if (ngx_rtmp_live_send_meta(ss, codec_ctx) == NGX_OK) {
+                sub->meta_version = meta_version;
             }
         }
 
+        cls = ss->out_chunk_class;
+
         /* sync stream */
 
         if (cs->active && (lacf->sync && cs->dropped > lacf->sync)) {
@@ -887,7 +1596,7 @@ ngx_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
             }
 
             if (lacf->wait_video && h->type == NGX_RTMP_MSG_AUDIO &&
-                !pctx->cs[0].active)
+                !sub->cs[0].active)
             {
                 ngx_log_debug0(NGX_LOG_DEBUG_RTMP, ss->connection->log, 0,
                                "live: waiting for video");
@@ -904,11 +1613,11 @@ ngx_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
 
             dummy_audio = 0;
             if (lacf->wait_video && h->type == NGX_RTMP_MSG_VIDEO &&
-                !pctx->cs[1].active)
+                !sub->cs[1].active)
             {
                 dummy_audio = 1;
                 if (aapkt == NULL) {
-                    aapkt = ngx_rtmp_alloc_shared_buf(cscf);
+                    aapkt = ngx_rtmp_alloc_shared_buf(cscf, 0);
                     ngx_rtmp_prepare_message(s, &clh, NULL, aapkt);
                 }
             }
@@ -922,24 +1631,27 @@ ngx_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
                                type_s, lh.timestamp);
 
                 if (header) {
-                    if (apkt == NULL) {
-                        apkt = ngx_rtmp_append_shared_bufs(cscf, NULL, header);
-                        ngx_rtmp_prepare_message(s, &lh, NULL, apkt);
+                    if (apkt[cls] == NULL) {
+                        apkt[cls] = ngx_rtmp_append_shared_bufs(cscf, cls,
+                                                                NULL, header);
+                        ngx_rtmp_prepare_message(s, &lh, NULL, apkt[cls]);
                     }
 
-                    rc = ngx_rtmp_send_message(ss, apkt, 0);
+                    rc = ngx_rtmp_send_message(ss, apkt[cls], 0);
                     if (rc != NGX_OK) {
                         continue;
                     }
                 }
 
                 if (coheader) {
-                    if (acopkt == NULL) {
-                        acopkt = ngx_rtmp_append_shared_bufs(cscf, NULL, coheader);
-                        ngx_rtmp_prepare_message(s, &clh, NULL, acopkt);
+                    if (acopkt[cls] == NULL) {
+                        acopkt[cls] = ngx_rtmp_append_shared_bufs(cscf, cls,
+                                                                  NULL,
+                                                                  coheader);
+                        ngx_rtmp_prepare_message(s, &clh, NULL, acopkt[cls]);
                     }
 
-                    rc = ngx_rtmp_send_message(ss, acopkt, 0);
+                    rc = ngx_rtmp_send_message(ss, acopkt[cls], 0);
                     if (rc != NGX_OK) {
                         continue;
                     }
@@ -960,12 +1672,15 @@ ngx_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
                                "live: abs %s packet timestamp=%uD",
                                type_s, ch.timestamp);
 
-                if (apkt == NULL) {
-                    apkt = ngx_rtmp_append_shared_bufs(cscf, NULL, in);
-                    ngx_rtmp_prepare_message(s, &ch, NULL, apkt);
+                if (apkt[cls] == NULL) {
+                    apkt[cls] = ngx_rtmp_prepare_shared_message(s, &ch, NULL,
+                                                                in, cls);
+                    if (apkt[cls] == NULL) {
+                        continue;
+                    }
                 }
 
-                rc = ngx_rtmp_send_message(ss, apkt, prio);
+                rc = ngx_rtmp_send_message(ss, apkt[cls], prio);
                 if (rc != NGX_OK) {
                     continue;
                 }
@@ -990,8 +1705,17 @@ ngx_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
                        "live: rel %s packet delta=%uD",
                        type_s, delta);
 
-        if (ngx_rtmp_send_message(ss, rpkt, prio) != NGX_OK) {
-            ++pctx->ndropped;
+        /* payload is shared with publisher input bufs,
+         * only chunk headers are built for each variant */
+
+        if (rpkt[cls] == NULL) {
+            rpkt[cls] = ngx_rtmp_prepare_shared_message(s, &ch, &lh, in, cls);
+        }
+
+        if (rpkt[cls] == NULL ||
+            ngx_rtmp_send_message(ss, rpkt[cls], prio) != NGX_OK)
+        {
+            ++sub->ndropped;
 
             cs->dropped += delta;
 
@@ -1009,22 +1733,24 @@ ngx_rtmp_live_av(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
         ss->current_time = cs->timestamp;
     }
 
-    if (rpkt) {
-        ngx_rtmp_free_shared_chain(cscf, rpkt);
-    }
+    for (n = 0; n < cscf->nchunk_classes; ++n) {
+        if (rpkt[n]) {
+            ngx_rtmp_free_shared_chain(cscf, rpkt[n]);
+        }
 
-    if (apkt) {
-        ngx_rtmp_free_shared_chain(cscf, apkt);
+        if (apkt[n]) {
+            ngx_rtmp_free_shared_chain(cscf, apkt[n]);
+        }
+
+        if (acopkt[n]) {
+            ngx_rtmp_free_shared_chain(cscf, acopkt[n]);
+        }
     }
 
     if (aapkt) {
         ngx_rtmp_free_shared_chain(cscf, aapkt);
     }
 
-    if (acopkt) {
-        ngx_rtmp_free_shared_chain(cscf, acopkt);
-    }
-
     ngx_rtmp_update_bandwidth(&ctx->stream->bw_in, h->mlen);
     ngx_rtmp_update_bandwidth(&ctx->stream->bw_out, h->mlen * peers);
 
@@ -1108,6 +1834,8 @@ ngx_rtmp_live_play(ngx_rtmp_session_t *s, ngx_rtmp_play_t *v)
         ngx_rtmp_send_sample_access(s);
     }
 
+    ngx_rtmp_live_send_cache(s);
+
 next:
     return next_play(s, v);
 }
@@ -18,6 +18,8 @@
 
 typedef struct ngx_rtmp_live_ctx_s ngx_rtmp_live_ctx_t;
 typedef struct ngx_rtmp_live_stream_s ngx_rtmp_live_stream_t;
+typedef struct ngx_rtmp_live_frame_s ngx_rtmp_live_frame_t;
+typedef struct ngx_rtmp_live_sub_s ngx_rtmp_live_sub_t;
 
 
 typedef struct {
@@ -28,10 +30,34 @@ typedef struct {
 } ngx_rtmp_live_chunk_stream_t;
 
 
+/* Broadcast state of a subscriber, kept in a contiguous per-stream array
+ * while the subscriber is attached (joined and not paused) */
+struct ngx_rtmp_live_sub_s {
+    ngx_rtmp_session_t                 *session;
+    ngx_rtmp_live_ctx_t                *ctx;
+    ngx_rtmp_live_chunk_stream_t        cs[2];
+    ngx_uint_t                          meta_version;
+    ngx_uint_t                          ndropped;
+    unsigned                            dropping:1;
+};
+
+
+/* GOP cache entry */
+struct ngx_rtmp_live_frame_s {
+    ngx_chain_t                        *pkt;        /* absolute message */
+    ngx_rtmp_live_frame_t              *next;
+    uint32_t                            timestamp;
+    uint32_t                            csid;
+    size_t                              size;
+    unsigned                            key:1;
+};
+
+
 struct ngx_rtmp_live_ctx_s {
     ngx_rtmp_session_t                 *session;
     ngx_rtmp_live_stream_t             *stream;
     ngx_rtmp_live_ctx_t                *next;
+    ngx_rtmp_live_sub_t                *sub;        /* NULL if detached */
     ngx_uint_t                          ndropped;
     ngx_rtmp_live_chunk_stream_t        cs[2];
     ngx_uint_t                          meta_version;
@@ -40,26 +66,47 @@ struct ngx_rtmp_live_ctx_s {
     unsigned                            publishing:1;
     unsigned                            silent:1;
     unsigned                            paused:1;
+    unsigned                            dropping:1;
 };
 
 
 struct ngx_rtmp_live_stream_s {
     u_char                              name[NGX_RTMP_MAX_NAME];
-    ngx_rtmp_live_stream_t             *next;
+    size_t                              len;
+    ngx_uint_t                          hash;
+    ngx_rtmp_live_stream_t             *next;       /* free list */
     ngx_rtmp_live_ctx_t                *ctx;
+    ngx_rtmp_live_sub_t                *subs;
+    ngx_uint_t                          nsubs;
+    ngx_uint_t                          nalloc_subs;
     ngx_rtmp_bandwidth_t                bw_in;
     ngx_rtmp_bandwidth_t                bw_in_audio;
     ngx_rtmp_bandwidth_t                bw_in_video;
     ngx_rtmp_bandwidth_t                bw_out;
     ngx_msec_t                          epoch;
+    ngx_rtmp_live_frame_t              *gop_head;
+    ngx_rtmp_live_frame_t              *gop_tail;
+    size_t                              gop_size;
+    ngx_uint_t                          ngops;
     unsigned                            active:1;
     unsigned                            publishing:1;
 };
 
 
+/* Chunk stream state is held by the subscriber slot while attached */
+#define ngx_rtmp_live_get_cs(ctx)   ((ctx)->sub ? (ctx)->sub->cs : (ctx)->cs)
+#define ngx_rtmp_live_get_ndropped(ctx)                                       \
+    ((ctx)->sub ? (ctx)->sub->ndropped : (ctx)->ndropped)
+
+
+/* Max number of freed streams kept for reuse per application */
+#define NGX_RTMP_LIVE_MAX_FREE_STREAMS  256
+
+
 typedef struct {
-    ngx_int_t                           nbuckets;
-    ngx_rtmp_live_stream_t            **streams;
+    ngx_int_t                           nbuckets;   /* index size, 2^n */
+    ngx_uint_t                          nstreams;
+    ngx_rtmp_live_stream_t            **streams;    /* open addressing index */
     ngx_flag_t                          live;
     ngx_flag_t                          meta;
     ngx_msec_t                          sync;
@@ -72,11 +119,22 @@ typedef struct {
     ngx_flag_t                          play_restart;
     ngx_flag_t                          idle_streams;
     ngx_msec_t                          buflen;
+    size_t                              queue_high;
+    size_t                              queue_low;
+    ngx_int_t                           gop_cache;
+    size_t                              gop_cache_size;
+    ngx_msec_t                          gop_cache_duration;
     ngx_pool_t                         *pool;
     ngx_rtmp_live_stream_t             *free_streams;
+    ngx_uint_t                          nfree_streams;
+    ngx_rtmp_live_frame_t              *free_frames;
 } ngx_rtmp_live_app_conf_t;
 
 
+ngx_rtmp_live_stream_t *ngx_rtmp_live_find_stream(
+    ngx_rtmp_live_app_conf_t *lacf, u_char *name, size_t len);
+
+
 extern ngx_module_t  ngx_rtmp_live_module;
 
 
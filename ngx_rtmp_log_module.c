@@ -924,7 +924,9 @@ ngx_rtmp_log_disconnect(ngx_rtmp_session_t *s, ngx_rtmp_header_t *h,
     u_char                     *line, *p;
     size_t                      len;
 
-    if (s->auto_pushed || s->relay) {
+    /* logged by the worker the session is passed to */
+
+    if (s->auto_pushed || s->relay || s->handoff) {
         return NGX_OK;
     }
 
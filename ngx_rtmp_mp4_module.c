@@ -2212,13 +2212,15 @@ ngx_rtmp_mp4_send(ngx_rtmp_session_t *s, ngx_file_t *f, ngx_uint_t *ts)
             in_buf.pos  = fhdr;
             in_buf.last = fhdr + fhdr_size;
 
-            out = ngx_rtmp_append_shared_bufs(cscf, NULL, &in);
+            out = ngx_rtmp_append_shared_bufs(cscf, s->out_chunk_class,
+                                              NULL, &in);
 
             in.buf = &in_buf;
             in_buf.pos  = t->header;
             in_buf.last = t->header + t->header_size;
 
-            ngx_rtmp_append_shared_bufs(cscf, out, &in);
+            ngx_rtmp_append_shared_bufs(cscf, s->out_chunk_class,
+                                        out, &in);
 
             ngx_rtmp_prepare_message(s, &h, NULL, out);
             rc = ngx_rtmp_send_message(s, out, 0);
@@ -2287,7 +2289,8 @@ ngx_rtmp_mp4_send(ngx_rtmp_session_t *s, ngx_file_t *f, ngx_uint_t *ts)
         in_buf.pos  = ngx_rtmp_mp4_buffer;
         in_buf.last = ngx_rtmp_mp4_buffer + cr->size + fhdr_size;
 
-        out = ngx_rtmp_append_shared_bufs(cscf, NULL, &in);
+        out = ngx_rtmp_append_shared_bufs(cscf, s->out_chunk_class,
+                                          NULL, &in);
 
         ngx_rtmp_prepare_message(s, &h, cr->not_first ? &lh : NULL, out);
         rc = ngx_rtmp_send_message(s, out, 0);
@@ -1327,7 +1327,7 @@ ngx_rtmp_notify_disconnect(ngx_rtmp_session_t *s)
     ngx_rtmp_netcall_init_t         ci;
     ngx_url_t                      *url;
 
-    if (s->auto_pushed || s->relay) {
+    if (s->auto_pushed || s->relay || s->handoff) {
         goto next;
     }
 
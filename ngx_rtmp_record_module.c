@@ -122,6 +122,22 @@ static ngx_command_t  ngx_rtmp_record_commands[] = {
       offsetof(ngx_rtmp_record_app_conf_t, max_frames),
       NULL },
 
+    { ngx_string("record_buffer"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|
+                         NGX_RTMP_REC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_record_app_conf_t, buffer),
+      NULL },
+
+    { ngx_string("record_flush"),
+      NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|
+                         NGX_RTMP_REC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_RTMP_APP_CONF_OFFSET,
+      offsetof(ngx_rtmp_record_app_conf_t, flush),
+      NULL },
+
     { ngx_string("record_interval"),
       NGX_RTMP_MAIN_CONF|NGX_RTMP_SRV_CONF|NGX_RTMP_APP_CONF|
                          NGX_RTMP_REC_CONF|NGX_CONF_TAKE1,
@@ -191,6 +207,8 @@ ngx_rtmp_record_create_app_conf(ngx_conf_t *cf)
 
     racf->max_size = NGX_CONF_UNSET_SIZE;
     racf->max_frames = NGX_CONF_UNSET_SIZE;
+    racf->buffer = NGX_CONF_UNSET_SIZE;
+    racf->flush = NGX_CONF_UNSET_MSEC;
     racf->interval = NGX_CONF_UNSET_MSEC;
     racf->unique = NGX_CONF_UNSET;
     racf->append = NGX_CONF_UNSET;
@@ -217,6 +235,8 @@ ngx_rtmp_record_merge_app_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_str_value(conf->suffix, prev->suffix, ".flv");
     ngx_conf_merge_size_value(conf->max_size, prev->max_size, 0);
     ngx_conf_merge_size_value(conf->max_frames, prev->max_frames, 0);
+    ngx_conf_merge_size_value(conf->buffer, prev->buffer, 65536);
+    ngx_conf_merge_msec_value(conf->flush, prev->flush, 1000);
     ngx_conf_merge_value(conf->unique, prev->unique, 0);
     ngx_conf_merge_value(conf->append, prev->append, 0);
     ngx_conf_merge_value(conf->lock_file, prev->lock_file, 0);
@@ -226,6 +246,12 @@ ngx_rtmp_record_merge_app_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_bitmask_value(conf->flags, prev->flags, 0);
     ngx_conf_merge_ptr_value(conf->url, prev->url, NULL);
 
+    if (conf->buffer == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"record_buffer\" must not be zero");
+        return NGX_CONF_ERROR;
+    }
+
     if (conf->flags) {
         rracf = ngx_array_push(&conf->rec);
         if (rracf == NULL) {
@@ -264,6 +290,178 @@ ngx_rtmp_record_write_header(ngx_file_t *file)
 }
 
 
+static ngx_int_t
+ngx_rtmp_record_flush(ngx_rtmp_record_rec_ctx_t *rctx)
+{
+    ssize_t                     n;
+    ngx_buf_t                  *b;
+    ngx_chain_t                *cl;
+
+    if (rctx->flush_evt.timer_set) {
+        ngx_del_timer(&rctx->flush_evt);
+    }
+
+    if (rctx->out == NULL) {
+        return NGX_OK;
+    }
+
+    /* one pwritev for all the tags gathered since the last flush */
+
+    n = ngx_write_chain_to_file(&rctx->file, rctx->out, rctx->file.offset,
+                                rctx->pool);
+
+    /* input buffers are released even if the write failed */
+
+    for (cl = rctx->out; cl; cl = cl->next) {
+        if (cl->buf->memory) {
+            ngx_rtmp_free_in_data(cl->buf->start);
+        }
+    }
+
+    rctx->out_last->next = rctx->free;
+    rctx->free = rctx->out;
+    rctx->out = NULL;
+    rctx->out_last = NULL;
+    rctx->pending = 0;
+
+    b = rctx->buffer;
+    b->pos = b->start;
+    b->last = b->start;
+
+    return n == NGX_ERROR ? NGX_ERROR : NGX_OK;
+}
+
+
+static void
+ngx_rtmp_record_flush_handler(ngx_event_t *ev)
+{
+    ngx_rtmp_record_rec_ctx_t  *rctx = ev->data;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_RTMP, ev->log, 0,
+                   "record: %V flush timer", &rctx->conf->id);
+
+    /* ngx_write_chain_to_file() has logged the error */
+
+    (void) ngx_rtmp_record_flush(rctx);
+}
+
+
+static ngx_buf_t *
+ngx_rtmp_record_add_buf(ngx_rtmp_record_rec_ctx_t *rctx)
+{
+    ngx_chain_t                *cl;
+
+    cl = rctx->free;
+
+    if (cl) {
+        rctx->free = cl->next;
+        ngx_memzero(cl->buf, sizeof(ngx_buf_t));
+
+    } else {
+        cl = ngx_alloc_chain_link(rctx->pool);
+        if (cl == NULL) {
+            return NULL;
+        }
+
+        cl->buf = ngx_calloc_buf(rctx->pool);
+        if (cl->buf == NULL) {
+            return NULL;
+        }
+    }
+
+    cl->next = NULL;
+
+    if (rctx->out_last) {
+        rctx->out_last->next = cl;
+
+    } else {
+        rctx->out = cl;
+    }
+
+    rctx->out_last = cl;
+
+    return cl->buf;
+}
+
+
+static ngx_int_t
+ngx_rtmp_record_copy(ngx_rtmp_record_rec_ctx_t *rctx, u_char *data,
+    size_t len)
+{
+    ngx_buf_t                  *b, *ob;
+
+    b = rctx->buffer;
+
+    if ((size_t) (b->end - b->last) < len ||
+        rctx->pending + len > rctx->conf->buffer)
+    {
+        if (ngx_rtmp_record_flush(rctx) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        if ((size_t) (b->end - b->last) < len) {
+            return ngx_write_file(&rctx->file, data, len, rctx->file.offset)
+                   == NGX_ERROR ? NGX_ERROR : NGX_OK;
+        }
+    }
+
+    /* grow the last copied piece if nothing was pinned after it */
+
+    ob = rctx->out_last ? rctx->out_last->buf : NULL;
+
+    if (ob == NULL || !ob->temporary || ob->last != b->last) {
+        ob = ngx_rtmp_record_add_buf(rctx);
+        if (ob == NULL) {
+            return NGX_ERROR;
+        }
+
+        ob->pos = b->last;
+        ob->temporary = 1;
+    }
+
+    b->last = ngx_cpymem(b->last, data, len);
+    ob->last = b->last;
+
+    rctx->pending += len;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_rtmp_record_pin(ngx_rtmp_record_rec_ctx_t *rctx, ngx_buf_t *in)
+{
+    size_t                      len;
+    ngx_buf_t                  *ob;
+
+    len = in->last - in->pos;
+
+    if (rctx->pending && rctx->pending + len > rctx->conf->buffer &&
+        ngx_rtmp_record_flush(rctx) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    ob = ngx_rtmp_record_add_buf(rctx);
+    if (ob == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* input data is refcounted at its buffer start */
+
+    ob->start = in->start;
+    ob->pos = in->pos;
+    ob->last = in->last;
+    ob->memory = 1;
+
+    ngx_rtmp_ref_get(in->start);
+
+    rctx->pending += len;
+
+    return NGX_OK;
+}
+
+
 static ngx_rtmp_record_rec_ctx_t *
 ngx_rtmp_record_get_node_ctx(ngx_rtmp_session_t *s, ngx_uint_t n)
 {
@@ -439,6 +637,9 @@ ngx_rtmp_record_node_open(ngx_rtmp_session_t *s,
     ngx_err_t                   err;
     ngx_str_t                   path;
     ngx_int_t                   mode, create_mode;
+    ngx_buf_t                  *b;
+    ngx_chain_t                *free;
+    ngx_pool_t                 *pool;
     u_char                      buf[8], *p;
     off_t                       file_size;
     uint32_t                    tag_size, mlen, timestamp;
@@ -453,11 +654,27 @@ ngx_rtmp_record_node_open(ngx_rtmp_session_t *s,
     ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
                    "record: %V opening", &rracf->id);
 
+    /* flush timer is not set and nothing is pending while closed */
+
+    b = rctx->buffer;
+    free = rctx->free;
+    pool = rctx->pool;
+
     ngx_memzero(rctx, sizeof(*rctx));
     rctx->conf = rracf;
     rctx->last = *ngx_cached_time;
     rctx->timestamp = ngx_cached_time->sec;
 
+    rctx->buffer = b;
+    rctx->free = free;
+    rctx->pool = pool;
+    b->pos = b->start;
+    b->last = b->start;
+
+    rctx->flush_evt.handler = ngx_rtmp_record_flush_handler;
+    rctx->flush_evt.data = rctx;
+    rctx->flush_evt.log = s->connection->log;
+
     ngx_rtmp_record_make_path(s, rctx, &path);
 
     mode = rracf->append ? NGX_FILE_RDWR : NGX_FILE_WRONLY;
@@ -634,6 +851,13 @@ ngx_rtmp_record_init(ngx_rtmp_session_t *s)
 
         rctx->conf = *rracf;
         rctx->file.fd = NGX_INVALID_FILE;
+        rctx->pool = s->connection->pool;
+
+        rctx->buffer = ngx_create_temp_buf(s->connection->pool,
+                                           (*rracf)->buffer);
+        if (rctx->buffer == NULL) {
+            return NGX_ERROR;
+        }
     }
 
     return NGX_OK;
@@ -798,6 +1022,11 @@ ngx_rtmp_record_node_close(ngx_rtmp_session_t *s,
         return NGX_AGAIN;
     }
 
+    if (ngx_rtmp_record_flush(rctx) != NGX_OK) {
+        ngx_log_error(NGX_LOG_CRIT, s->connection->log, ngx_errno,
+                      "record: %V error flushing buffer", &rracf->id);
+    }
+
     if (rctx->initialized) {
         av = 0;
 
@@ -875,6 +1104,8 @@ ngx_rtmp_record_write_frame(ngx_rtmp_session_t *s,
                             ngx_int_t inc_nframes)
 {
     u_char                      hdr[11], *p, *ph;
+    off_t                       size;
+    ngx_int_t                   rc;
     uint32_t                    timestamp, tag_size;
     ngx_rtmp_record_app_conf_t *rracf;
 
@@ -921,32 +1152,26 @@ ngx_rtmp_record_write_frame(ngx_rtmp_session_t *s,
 
     tag_size = (ph - hdr) + h->mlen;
 
-    if (ngx_write_file(&rctx->file, hdr, ph - hdr, rctx->file.offset)
-        == NGX_ERROR)
-    {
-        ngx_rtmp_record_notify_error(s, rctx);
-
-        ngx_close_file(rctx->file.fd);
+    /*
+     * tag header and size are copied; message bodies are input data
+     * and are pinned until the flush, codec headers are shared chains
+     * written once per file and are copied as well
+     */
 
-        return NGX_ERROR;
+    if (ngx_rtmp_record_copy(rctx, hdr, ph - hdr) != NGX_OK) {
+        goto failed;
     }
 
-    /* write tag body
-     * FIXME: NGINX
-     * ngx_write_chain seems to fit best
-     * but it suffers from uncontrollable
-     * allocations.
-     * we're left with plain writing */
     for(; in; in = in->next) {
         if (in->buf->pos == in->buf->last) {
             continue;
         }
 
-        if (ngx_write_file(&rctx->file, in->buf->pos, in->buf->last
-                           - in->buf->pos, rctx->file.offset)
-            == NGX_ERROR)
-        {
-            return NGX_ERROR;
+        rc = inc_nframes ? ngx_rtmp_record_pin(rctx, in->buf)
+                         : ngx_rtmp_record_copy(rctx, in->buf->pos,
+                                                in->buf->last - in->buf->pos);
+        if (rc != NGX_OK) {
+            goto failed;
         }
     }
 
@@ -959,23 +1184,39 @@ ngx_rtmp_record_write_frame(ngx_rtmp_session_t *s,
     *ph++ = p[1];
     *ph++ = p[0];
 
-    if (ngx_write_file(&rctx->file, hdr, ph - hdr,
-                       rctx->file.offset)
-        == NGX_ERROR)
-    {
-        return NGX_ERROR;
+    if (ngx_rtmp_record_copy(rctx, hdr, ph - hdr) != NGX_OK) {
+        goto failed;
+    }
+
+    /* record_flush 0 writes every tag out as soon as it is complete */
+
+    if (rracf->flush == 0) {
+        if (ngx_rtmp_record_flush(rctx) != NGX_OK) {
+            goto failed;
+        }
+
+    } else if (!rctx->flush_evt.timer_set && rctx->out) {
+        ngx_add_timer(&rctx->flush_evt, rracf->flush);
     }
 
     rctx->nframes += inc_nframes;
 
+    size = rctx->file.offset + rctx->pending;
+
     /* watch max size */
-    if ((rracf->max_size && rctx->file.offset >= (ngx_int_t) rracf->max_size) ||
+    if ((rracf->max_size && size >= (off_t) rracf->max_size) ||
         (rracf->max_frames && rctx->nframes >= rracf->max_frames))
     {
         ngx_rtmp_record_node_close(s, rctx);
     }
 
     return NGX_OK;
+
+failed:
+
+    ngx_rtmp_record_notify_error(s, rctx);
+
+    return NGX_ERROR;
 }
 
 
@@ -1146,17 +1387,18 @@ ngx_rtmp_record_node_av(ngx_rtmp_session_t *s, ngx_rtmp_record_rec_ctx_t *rctx,
     }
 
     if (h->type == NGX_RTMP_MSG_VIDEO) {
-        if (codec_ctx && codec_ctx->video_codec_id == NGX_RTMP_VIDEO_H264 &&
+        if (codec_ctx && ngx_rtmp_is_avc_like(codec_ctx->video_codec_id) &&
             !rctx->avc_header_sent)
         {
             ngx_log_debug1(NGX_LOG_DEBUG_RTMP, s->connection->log, 0,
-                           "record: %V skipping until H264 header", &rracf->id);
+                           "record: %V skipping until video header",
+                           &rracf->id);
             return NGX_OK;
         }
 
         if (ngx_rtmp_get_video_frame_type(in) == NGX_RTMP_VIDEO_KEY_FRAME &&
-            ((codec_ctx && codec_ctx->video_codec_id != NGX_RTMP_VIDEO_H264) ||
-             !ngx_rtmp_is_codec_header(in)))
+            ((codec_ctx && !ngx_rtmp_is_avc_like(codec_ctx->video_codec_id))
+             || !ngx_rtmp_is_video_codec_header(in)))
         {
             rctx->video_key_sent = 1;
         }
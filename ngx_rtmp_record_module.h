@@ -26,6 +26,8 @@ typedef struct {
     ngx_str_t                           path;
     size_t                              max_size;
     size_t                              max_frames;
+    size_t                              buffer;
+    ngx_msec_t                          flush;
     ngx_msec_t                          interval;
     ngx_str_t                           suffix;
     ngx_flag_t                          unique;
@@ -42,6 +44,19 @@ typedef struct {
 typedef struct {
     ngx_rtmp_record_app_conf_t         *conf;
     ngx_file_t                          file;
+
+    /*
+     * tags waiting for the file at file.offset: headers are copied to
+     * the buffer, bodies stay in pinned input buffers until the flush
+     */
+    ngx_buf_t                          *buffer;
+    ngx_chain_t                        *out;
+    ngx_chain_t                        *out_last;
+    ngx_chain_t                        *free;
+    size_t                              pending;
+    ngx_pool_t                         *pool;
+    ngx_event_t                         flush_evt;
+
     ngx_uint_t                          nframes;
     uint32_t                            epoch, time_shift;
     ngx_time_t                          last;
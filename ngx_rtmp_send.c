@@ -11,6 +11,7 @@
 #include "ngx_rtmp_streams.h"
 
 
+/* control messages always fit a single chunk of any size class */
 #define NGX_RTMP_USER_START(s, tp)                                          \
     ngx_rtmp_header_t               __h;                                    \
     ngx_chain_t                    *__l;                                    \
@@ -22,7 +23,7 @@
     memset(&__h, 0, sizeof(__h));                                           \
     __h.type = tp;                                                          \
     __h.csid = 2;                                                           \
-    __l = ngx_rtmp_alloc_shared_buf(__cscf);                                \
+    __l = ngx_rtmp_alloc_shared_buf(__cscf, 0);                             \
     if (__l == NULL) {                                                      \
         return NULL;                                                        \
     }                                                                       \
@@ -370,7 +371,11 @@ ngx_rtmp_send_ping_response(ngx_rtmp_session_t *s, uint32_t timestamp)
 static ngx_chain_t *
 ngx_rtmp_alloc_amf_buf(void *arg)
 {
-    return ngx_rtmp_alloc_shared_buf((ngx_rtmp_core_srv_conf_t *)arg);
+    ngx_rtmp_session_t         *s = arg;
+
+    return ngx_rtmp_alloc_shared_buf(
+            ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module),
+            s->out_chunk_class);
 }
 
 
@@ -383,13 +388,10 @@ ngx_rtmp_append_amf(ngx_rtmp_session_t *s,
                     ngx_rtmp_amf_elt_t *elts, size_t nelts)
 {
     ngx_rtmp_amf_ctx_t          act;
-    ngx_rtmp_core_srv_conf_t   *cscf;
     ngx_int_t                   rc;
 
-    cscf = ngx_rtmp_get_module_srv_conf(s, ngx_rtmp_core_module);
-
     memset(&act, 0, sizeof(act));
-    act.arg = cscf;
+    act.arg = s;
     act.alloc = ngx_rtmp_alloc_amf_buf;
     act.log = s->connection->log;
 
@@ -9,21 +9,26 @@
 #include "ngx_rtmp.h"
 
 
+/* shared bufs hold exactly one outbound chunk; they are pooled
+ * by chunk size class so that sessions sending with different
+ * chunk sizes still share message bufs within their class */
+
 ngx_chain_t *
-ngx_rtmp_alloc_shared_buf(ngx_rtmp_core_srv_conf_t *cscf)
+ngx_rtmp_alloc_shared_buf(ngx_rtmp_core_srv_conf_t *cscf, ngx_uint_t cls)
 {
     u_char                     *p;
     ngx_chain_t                *out;
     ngx_buf_t                  *b;
     size_t                      size;
 
-    if (cscf->free) {
-        out = cscf->free;
-        cscf->free = out->next;
+    if (cscf->free[cls]) {
+        out = cscf->free[cls];
+        cscf->free[cls] = out->next;
 
     } else {
 
-        size = cscf->chunk_size + NGX_RTMP_MAX_CHUNK_HEADER;
+        size = ngx_rtmp_chunk_class_size(cscf, cls)
+               + NGX_RTMP_MAX_CHUNK_HEADER;
 
         p = ngx_pcalloc(cscf->pool, NGX_RTMP_REFCOUNT_BYTES
                 + sizeof(ngx_chain_t)
@@ -42,6 +47,7 @@ ngx_rtmp_alloc_shared_buf(ngx_rtmp_core_srv_conf_t *cscf)
         p += sizeof(ngx_buf_t);
         out->buf->start = p;
         out->buf->end = p + size;
+        out->buf->num = (int) cls;
     }
 
     out->next = NULL;
@@ -56,27 +62,96 @@ ngx_rtmp_alloc_shared_buf(ngx_rtmp_core_srv_conf_t *cscf)
 }
 
 
+ngx_chain_t *
+ngx_rtmp_alloc_shared_link(ngx_rtmp_core_srv_conf_t *cscf)
+{
+    u_char                     *p;
+    ngx_chain_t                *out;
+    ngx_buf_t                  *b;
+
+    if (cscf->free_links) {
+        out = cscf->free_links;
+        cscf->free_links = out->next;
+
+    } else {
+
+        p = ngx_pcalloc(cscf->pool, NGX_RTMP_REFCOUNT_BYTES
+                + sizeof(ngx_chain_t)
+                + sizeof(ngx_buf_t)
+                + NGX_RTMP_MAX_CHUNK_HEADER);
+        if (p == NULL) {
+            return NULL;
+        }
+
+        p += NGX_RTMP_REFCOUNT_BYTES;
+        out = (ngx_chain_t *)p;
+
+        p += sizeof(ngx_chain_t);
+        out->buf = (ngx_buf_t *)p;
+        out->buf->tag = (ngx_buf_tag_t) &ngx_rtmp_core_module;
+    }
+
+    /* link owns a small header area right after its buf;
+     * it can be pointed to borrowed input data later */
+
+    out->next = NULL;
+    b = out->buf;
+    b->start = (u_char *) (b + 1);
+    b->end = b->start + NGX_RTMP_MAX_CHUNK_HEADER;
+    b->pos = b->last = b->start;
+    b->memory = 1;
+
+    ngx_rtmp_ref_set(out, 1);
+
+    return out;
+}
+
+
+void
+ngx_rtmp_free_in_data(void *data)
+{
+    u_char             *p = data;
+
+    if (ngx_rtmp_ref_put(p)) {
+        return;
+    }
+
+    ngx_free(p - NGX_RTMP_REFCOUNT_BYTES);
+}
+
+
 void
 ngx_rtmp_free_shared_chain(ngx_rtmp_core_srv_conf_t *cscf, ngx_chain_t *in)
 {
-    ngx_chain_t        *cl;
+    ngx_chain_t        *cl, *next;
+    ngx_buf_t          *b;
 
     if (ngx_rtmp_ref_put(in)) {
         return;
     }
 
-    for (cl = in; ; cl = cl->next) {
-        if (cl->next == NULL) {
-            cl->next = cscf->free;
-            cscf->free = in;
-            return;
+    for (cl = in; cl; cl = next) {
+        next = cl->next;
+        b = cl->buf;
+
+        if (b->tag != (ngx_buf_tag_t) &ngx_rtmp_core_module) {
+            cl->next = cscf->free[b->num];
+            cscf->free[b->num] = cl;
+            continue;
         }
+
+        if (b->start != (u_char *) (b + 1)) {
+            ngx_rtmp_free_in_data(b->start);
+        }
+
+        cl->next = cscf->free_links;
+        cscf->free_links = cl;
     }
 }
 
 
 ngx_chain_t *
-ngx_rtmp_append_shared_bufs(ngx_rtmp_core_srv_conf_t *cscf,
+ngx_rtmp_append_shared_bufs(ngx_rtmp_core_srv_conf_t *cscf, ngx_uint_t cls,
         ngx_chain_t *head, ngx_chain_t *in)
 {
     ngx_chain_t                    *l, **ll;
@@ -95,7 +170,7 @@ ngx_rtmp_append_shared_bufs(ngx_rtmp_core_srv_conf_t *cscf,
     for ( ;; ) {
 
         if (l == NULL || l->buf->last == l->buf->end) {
-            l = ngx_rtmp_alloc_shared_buf(cscf);
+            l = ngx_rtmp_alloc_shared_buf(cscf, cls);
             if (l == NULL || l->buf == NULL) {
                 break;
             }